@@ -5,6 +5,7 @@
 #include <jni.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/system_properties.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <thread>
@@ -20,7 +21,6 @@
 #include <cmath>
 #include <mutex>
 #include <deque>
-#include <regex>
 #include <numeric>
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -29,6 +29,13 @@
 #define VK_USE_PLATFORM_ANDROID_KHR
 #include <vulkan/vulkan.h>
 #include "compact_enc_det/compact_enc_det.h"
+#include "miu/regex.h"
+#include "miu/literal.h"
+#include "miu/parallel.h"
+#include "miu/matchindex.h"
+#include "miu/linechunks.h"
+#include "miu/intervals.h"
+#include "miu/linevertices.h"
 #include "util/encodings/encodings.h"
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "miu", __VA_ARGS__))
 #define LOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, "miu", __VA_ARGS__))
@@ -38,14 +45,10 @@ void setEngineColorFromInt(float* target, int argb) {
     target[1] = ((argb >> 8) & 0xFF) / 255.0f;
     target[2] = (argb & 0xFF) / 255.0f;
 }
-struct GlyphInfo {
-    float u0, v0, u1, v1;
-    float width, height;
-    float bearingX, bearingY;
-    float advance;
-    bool isColor;
-};
+using miu::GlyphInfo; using miu::Vertex; using miu::ShapedGlyph; using miu::LineVertices; using miu::LineStyleRanges;
 struct MappedFile {
+    static constexpr int kResidentRefreshMs = 1000; // residentBytes() はページを全部調べるので、この間隔より頻繁には調べ直さない
+    mutable size_t residentCache = 0; mutable std::chrono::steady_clock::time_point residentAt;
     int fd = -1;
     size_t size = 0;
     char* ptr = nullptr;
@@ -67,6 +70,18 @@ struct MappedFile {
         size = 0;
     }
     ~MappedFile() { close(); }
+    size_t residentBytes() const {
+        if (!ptr || ptr == MAP_FAILED || size == 0) return 0;
+        auto now = std::chrono::steady_clock::now();
+        if (residentAt != std::chrono::steady_clock::time_point() && now - residentAt < std::chrono::milliseconds(kResidentRefreshMs)) return residentCache;
+        residentAt = now; residentCache = 0;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> vec((size + page - 1) / page);
+        if (mincore(ptr, size, vec.data()) != 0) return 0;
+        size_t resident = 0;
+        for (unsigned char v : vec) if (v & 1) resident++;
+        return residentCache = std::min(size, resident * page);
+    }
 };
 struct Engine;
 struct TextAtlas {
@@ -211,7 +226,8 @@ struct Piece { bool isOriginal; size_t start; size_t len; };
 struct PieceTable {
     const char* origPtr = nullptr; size_t origSize = 0;
     std::string addBuf; std::vector<Piece> pieces;
-    void initEmpty() { origPtr = nullptr; origSize = 0; pieces.clear(); addBuf.clear(); }
+    miu::ChangeLog changes; // 文書の版と直近の変更 (検索結果の索引が差分だけ更新するのに使う)
+    void initEmpty() { origPtr = nullptr; origSize = 0; pieces.clear(); addBuf.clear(); changes.reset(); }
     size_t length() const { size_t s = 0; for (auto& p : pieces) s += p.len; return s; }
     std::string getRange(size_t pos, size_t count) const {
         std::string out; out.reserve(std::min(count, (size_t)4096));
@@ -247,6 +263,7 @@ struct PieceTable {
         } else {
             pieces.insert(pieces.begin() + idx, { false, addStart, s.size() });
         }
+        changes.record(pos, 0, s.size());
     }
     void erase(size_t pos, size_t count) {
         if (count == 0) return;
@@ -264,6 +281,7 @@ struct PieceTable {
             if (pieces[idx].len <= remaining) { remaining -= pieces[idx].len; pieces.erase(pieces.begin() + idx); }
             else { pieces[idx].start += remaining; pieces[idx].len -= remaining; remaining = 0; }
         }
+        if (remaining < count) changes.record(pos, count - remaining, 0);
     }
     char charAt(size_t pos) const {
         size_t cur = 0;
@@ -273,14 +291,68 @@ struct PieceTable {
         }
         return '\0';
     }
+    // pos を含むピース全体を返す。idx/at (ピース番号とその開始位置) は前回の位置から前後にたどる
+    std::string_view pieceAt(size_t pos, size_t& idx, size_t& at) const {
+        if (idx >= pieces.size()) { idx = 0; at = 0; }
+        while (idx > 0 && at > pos) { idx--; at -= pieces[idx].len; }
+        while (idx < pieces.size() && at + pieces[idx].len <= pos) { at += pieces[idx].len; idx++; }
+        if (idx >= pieces.size()) return {};
+        const Piece& p = pieces[idx]; return std::string_view(p.isOriginal ? origPtr + p.start : addBuf.data() + p.start, p.len);
+    }
+    std::string_view spanAt(size_t pos, size_t& idx, size_t& at) const { std::string_view v = pieceAt(pos, idx, at); return v.empty() ? v : v.substr(pos - at); }
+    // miu::LiteralSearcher 用: pos を含むピース全体とその開始位置を返す関数
+    auto pieceReader() const { return [this, idx = (size_t)0, at = (size_t)0](size_t pos, size_t& start) mutable { std::string_view v = pieceAt(pos, idx, at); start = at; return v; }; }
+    // 文書全体をコピーせずにピース単位で読む関数 (miu::Regex の断片入力)
+    miu::RegexSpanFn spanReader() const { return [this, idx = (size_t)0, at = (size_t)0](size_t pos) mutable { return spanAt(pos, idx, at); }; }
+    // 全置換用: 昇順で重ならない範囲をまとめて置き換え、ピース列を 1 回の走査で作り直す。置き換える前のピース列を返し、change に変わった範囲を入れる。
+    // 同じ string を指す置換文字列は追加バッファに 1 度だけ書き、ピースはそれを共有する
+    struct RangeEdit { size_t pos, len; const std::string* text; };
+    std::vector<Piece> replaceRanges(const std::vector<RangeEdit>& edits, miu::TextChange& change) {
+        std::vector<Piece> next; next.reserve(pieces.size() + edits.size() * 2);
+        size_t idx = 0, off = 0, cur = 0; // 元の文書で次に読む位置 (ピース番号とその中の位置)
+        auto emit = [&](const Piece& p) {
+            if (p.len == 0) return;
+            if (!next.empty() && next.back().isOriginal == p.isOriginal && next.back().start + next.back().len == p.start) next.back().len += p.len; else next.push_back(p);
+        };
+        auto advance = [&](size_t to, bool keep) {
+            while (cur < to && idx < pieces.size()) {
+                const Piece& p = pieces[idx]; size_t take = std::min(p.len - off, to - cur);
+                if (keep) emit({ p.isOriginal, p.start + off, take });
+                cur += take; off += take; if (off == p.len) { ++idx; off = 0; }
+            }
+        };
+        const std::string* lastText = nullptr; size_t lastStart = 0, removed = 0, inserted = 0;
+        for (const auto& e : edits) {
+            advance(e.pos, true); advance(e.pos + e.len, false); removed += e.len; inserted += e.text->size();
+            if (e.text != lastText) { lastText = e.text; lastStart = addBuf.size(); addBuf.append(*e.text); }
+            emit({ false, lastStart, e.text->size() });
+        }
+        advance(std::string::npos, true);
+        change = miu::TextChange();
+        if (!edits.empty()) { change.pos = edits.front().pos; change.removed = edits.back().pos + edits.back().len - change.pos; change.inserted = change.removed - removed + inserted; }
+        swapPieces(next, change); return next;
+    }
+    // ピース列を other と入れ替え、変わった範囲を記録する (元に戻すときは change の removed と inserted を逆にして渡す)
+    void swapPieces(std::vector<Piece>& other, const miu::TextChange& change) { pieces.swap(other); changes.record(change.pos, change.removed, change.inserted); }
 };
 struct Cursor {
+    static constexpr float kUnresolvedX = -1.0f; // desiredX をまだ求めていない (resolveCursorX で求める)
     size_t head; size_t anchor; float desiredX;
     size_t start() const { return std::min(head, anchor); }
     size_t end() const { return std::max(head, anchor); }
     bool hasSelection() const { return head != anchor; }
 };
-struct EditOp { enum Type { Insert, Erase } type; size_t pos; std::string text; };
+// 自動ハイライト (カーソルのある単語と同じ語) のキャッシュ。対象の語は文書の版かカーソルが変わったときだけ求め直し、
+// 一致は画面に入る範囲 [from, to) が変わったときだけ索引から取り出す
+struct AutoHighlightCache {
+    uint64_t version = UINT64_MAX; size_t head = 0, anchor = 0, cursorCount = 0; // 対象の語を求めたときの版とカーソル
+    std::string target; bool wholeWord = false;
+    bool valid = false; size_t from = 0, to = 0; std::vector<std::pair<size_t, size_t>> matches;
+};
+// 行番号に使う数字 0-9 のグリフ。アトラスのグリフは 48px で作って描くときに拡大縮小するので、フォントを読み込み直すまで同じものを使える
+struct GutterDigits { bool ready = false; bool has[10] = {}; GlyphInfo info[10] = {}; };
+// Pieces はピース列をまとめて入れ替える編集 (全置換)。pieces はもう一方の側のピース列で、元に戻す・やり直すたびに文書のピース列と交換する
+struct EditOp { enum Type { Insert, Erase, Pieces } type; size_t pos; std::string text; std::shared_ptr<std::vector<Piece>> pieces = nullptr; miu::TextChange change = {}; };
 struct EditBatch { std::vector<EditOp> ops; std::vector<Cursor> beforeCursors; std::vector<Cursor> afterCursors; };
 struct UndoManager {
     std::vector<EditBatch> undoStack; std::vector<EditBatch> redoStack;
@@ -295,11 +367,100 @@ bool isWordChar(char c) {
            (c >= '0' && c <= '9') || c == '_' ||
            (unsigned char)c >= 0x80;
 }
-struct Vertex {
-    float pos[2];
-    float uv[2];
-    float isColor;
-    float color[4];
+// 描画 1 フレームを処理段階ごとに計測する。入れ子の区間は親から差し引いた排他時間で集計する。
+struct FrameProfiler {
+    enum Phase { TextFetch, RegexHighlight, AutoHighlight, Layout, Gutter, Selection, Submit, Frame, PhaseCount };
+    struct Event { int phase; int64_t startUs, durUs; };
+    struct Scope { FrameProfiler& p; Scope(FrameProfiler& fp, Phase ph) : p(fp) { p.push(ph); } ~Scope() { p.pop(); } };
+    static constexpr int kHistory = 120, kMaxDepth = 16;
+    bool showOverlay = false, recording = false;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    double phaseUs[PhaseCount] = {};
+    double history[kHistory][PhaseCount] = {}; int historyCount = 0, historyPos = 0;
+    std::chrono::steady_clock::time_point stackStart[kMaxDepth]; int stackPhase[kMaxDepth] = {}; double stackChildUs[kMaxDepth] = {}; int depth = 0;
+    std::vector<Event> events; size_t maxEvents = 1 << 20;
+    static const char* phaseName(int phase) {
+        static const char* names[] = { "text fetch", "search highlight", "auto highlight", "layout", "gutter", "selection", "submit", "frame" };
+        return (phase >= 0 && phase < PhaseCount) ? names[phase] : "?";
+    }
+    void beginFrame() { depth = 0; std::fill(std::begin(phaseUs), std::end(phaseUs), 0.0); push(Frame); }
+    void endFrame() {
+        while (depth > 0) pop();
+        std::copy(std::begin(phaseUs), std::end(phaseUs), history[historyPos]);
+        historyPos = (historyPos + 1) % kHistory; historyCount = std::min(historyCount + 1, kHistory);
+    }
+    void push(Phase phase) {
+        if (depth >= kMaxDepth) { depth++; return; }
+        stackStart[depth] = std::chrono::steady_clock::now(); stackPhase[depth] = phase; stackChildUs[depth] = 0.0; depth++;
+    }
+    void pop() {
+        if (depth <= 0) return;
+        if (--depth >= kMaxDepth) return;
+        auto now = std::chrono::steady_clock::now();
+        double us = std::chrono::duration<double, std::micro>(now - stackStart[depth]).count();
+        int phase = stackPhase[depth];
+        phaseUs[phase] += (phase == Frame) ? us : us - stackChildUs[depth];
+        if (depth > 0) stackChildUs[depth - 1] += us;
+        if (recording && events.size() < maxEvents) events.push_back({ phase, std::chrono::duration_cast<std::chrono::microseconds>(stackStart[depth] - origin).count(), (int64_t)us });
+    }
+    std::vector<std::string> overlayLines() const {
+        std::vector<std::string> lines; if (historyCount == 0) return lines;
+        double avg[PhaseCount] = {}, frameMax = 0.0;
+        for (int i = 0; i < historyCount; ++i) { for (int p = 0; p < PhaseCount; ++p) avg[p] += history[i][p]; frameMax = std::max(frameMax, history[i][Frame]); }
+        char buf[96];
+        snprintf(buf, sizeof(buf), "frame %6.2f ms avg %6.2f ms max (%d)", avg[Frame] / historyCount / 1000.0, frameMax / 1000.0, historyCount); lines.push_back(buf);
+        for (int p = 0; p < Frame; ++p) { snprintf(buf, sizeof(buf), "%-16s %6.2f ms", phaseName(p), avg[p] / historyCount / 1000.0); lines.push_back(buf); }
+        if (recording) { snprintf(buf, sizeof(buf), "recording %zu events", events.size()); lines.push_back(buf); }
+        return lines;
+    }
+    bool exportChromeTrace(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc); if (!out) return false;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& ev = events[i];
+            out << (i ? ",\n" : "\n") << "{\"name\":\"" << phaseName(ev.phase) << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << ev.startUs << ",\"dur\":" << ev.durUs << "}";
+        }
+        out << "\n]}\n"; return (bool)out;
+    }
+};
+// 主要データ構造の使用バイト数 (容量ベース)。originalMapped は仮想サイズで total には含めない。
+struct MemoryStats {
+    size_t pieceList = 0, addBuffer = 0, originalMapped = 0, originalResident = 0, fileBuffer = 0;
+    size_t lineIndex = 0, undoStack = 0, redoStack = 0, shapeCache = 0, glyphAtlas = 0, fonts = 0, profiler = 0;
+    size_t searchIndex = 0, searchSnapshot = 0, autoHighlight = 0, lineChunks = 0; // 検索の索引 (自動ハイライトの分を含む)、別のスレッドが読む文書の写し、キャッシュ
+    std::vector<std::pair<const char*, size_t>> entries() const {
+        return { { "pieceList", pieceList }, { "addBuffer", addBuffer }, { "originalMapped", originalMapped }, { "originalResident", originalResident },
+                 { "fileBuffer", fileBuffer }, { "lineIndex", lineIndex }, { "undoStack", undoStack }, { "redoStack", redoStack },
+                 { "shapeCache", shapeCache }, { "glyphAtlas", glyphAtlas }, { "fonts", fonts }, { "profiler", profiler },
+                 { "searchIndex", searchIndex }, { "searchSnapshot", searchSnapshot }, { "autoHighlight", autoHighlight }, { "lineChunks", lineChunks } };
+    }
+    size_t total() const { size_t t = 0; for (const auto& e : entries()) t += e.second; return t - originalMapped; }
+    std::string toJson() const {
+        std::string j = "{"; char buf[64];
+        for (const auto& e : entries()) { snprintf(buf, sizeof(buf), "\"%s\":%zu,", e.first, e.second); j += buf; }
+        snprintf(buf, sizeof(buf), "\"total\":%zu}", total()); j += buf; return j;
+    }
+    std::vector<std::string> summaryLines() const {
+        std::vector<std::string> lines; char buf[96];
+        snprintf(buf, sizeof(buf), "memory %10.2f MB", total() / (1024.0 * 1024.0)); lines.push_back(buf);
+        for (const auto& e : entries()) { snprintf(buf, sizeof(buf), "  %-16s %10.2f MB", e.first, e.second / (1024.0 * 1024.0)); lines.push_back(buf); }
+        return lines;
+    }
+};
+// 閾値を超えた操作だけを 1 行 1 JSON で追記する (opt-in)
+struct SlowOpLog {
+    static constexpr int kFlushIntervalMs = 1000; // 書いた行はこの間隔でまとめてファイルへ出す
+    std::ofstream out; bool active = false; double thresholdMs = 50.0; long long lastFlush = 0;
+    bool start(const std::string& path, double threshold) { stop(); out.open(path, std::ios::binary | std::ios::app); if (!out) return false; thresholdMs = threshold; active = true; return true; }
+    void stop() { if (out.is_open()) out.close(); active = false; }
+    void write(const char* op, double ms, size_t docBytes, size_t pieces, size_t lines, size_t cursors) {
+        if (!active || ms < thresholdMs) return;
+        long long unixMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        char buf[320];
+        snprintf(buf, sizeof(buf), "{\"time\":%lld,\"op\":\"%s\",\"ms\":%.3f,\"doc_bytes\":%zu,\"pieces\":%zu,\"lines\":%zu,\"cursors\":%zu}\n", unixMs, op, ms, docBytes, pieces, lines, cursors);
+        out << buf;
+        if (unixMs - lastFlush >= kFlushIntervalMs) { out.flush(); lastFlush = unixMs; }
+    }
 };
 struct PushConstants {
     float screenWidth;
@@ -311,16 +472,10 @@ struct BlurPushConstants {
     float topMargin;
     float screenHeight;
 };
-struct ShapedGlyph {
-    int fontIndex;
-    uint32_t glyphIndex;
-    float xAdvance, yAdvance, xOffset, yOffset;
-    size_t cluster;
-    bool isIME;
-};
 struct LineCache {
     std::vector<ShapedGlyph> glyphs;
     bool isShaped = false;
+    uint64_t gen = 0; // 整形し直すたびに変わる番号 (行の頂点を作り直すかどうかの判定に使う)
 };
 enum MiuEncoding {
     ENC_UTF8_NOBOM = 0,
@@ -356,6 +511,22 @@ struct Engine {
     bool searchMatchCase = false;
     bool searchWholeWord = false;
     bool searchRegex = false;
+    miu::Regex cachedRegex;
+    miu::MatchIndex searchIndex, autoIndex; // 検索語と自動ハイライトの一致の索引
+    AutoHighlightCache autoHighlight;
+    GutterDigits gutterDigits;
+    miu::LineChunkCache<LineVertices> lineChunks; // 見えている行の頂点 (アトラスを作り直したら捨てる)
+    uint64_t shapeGeneration = 0, lastFrameKey = 0;
+    std::atomic<bool> searchProgressed{false}; // 別のスレッドの検索が進んだ (メインループが取り込む)
+    miu::IndexBuilder searchBuilder;        // 検索語を打っている間、別のスレッドで searchIndex を作る
+    std::weak_ptr<const PieceTable> searchSnapshot; // searchBuilder が読んでいる文書の写し (メモリの集計用)
+    size_t searchAnchor = 0;                // 検索語を打ち始めたときのカーソル位置 (ここから後の最初の一致を選ぶ)
+    bool searchRevealPending = false;       // 最初の一致をまだ選んでいない
+    size_t regexStepBudget = 500000000;   // 検索・置換で VM が実行するステップ数の上限
+    int regexTimeLimitMs = 100;           // 次を検索で正規表現を照合する時間の上限 (UI のスレッドを止めない)
+    int bulkRegexTimeLimitMs = 2000;      // すべて置換で文書全体を正規表現で探す時間の上限
+    bool searchTimedOut = false;          // 直前の正規表現の検索が時間の上限で打ち切られた
+    size_t highlightStepBudget = 5000000; // 描画時のハイライト 1 回あたりの上限
     bool isReplaceMode = false;
     std::string newlineStr = "\n";
     float scrollX = 0.0f;
@@ -382,6 +553,7 @@ struct Engine {
     int hScrollPos = 0;
     float lineHeight = 60.0f;
     float charWidth = 24.0f;
+    float monoAdvance = 0.0f; // 先頭のフォントが等幅なら 1 文字の送り幅 (48px 基準)。0 なら等幅でない
     float gutterWidth = 100.0f;
     float currentFontSize = 48.0f;
     bool isDarkMode = false;
@@ -445,6 +617,17 @@ struct Engine {
     MiuEncoding currentEncoding = ENC_UTF8_NOBOM;
     std::string currentCharset = "UTF-8";
     std::string lastTitleStr = "<UNINITIALIZED>";
+    FrameProfiler profiler;
+    SlowOpLog slowLog;
+};
+void noteSlowOp(Engine* engine, const char* op, double ms) {
+    if (engine->slowLog.active && ms >= engine->slowLog.thresholdMs) engine->slowLog.write(op, ms, engine->pt.length(), engine->pt.pieces.size(), engine->lineStarts.size(), engine->cursors.size());
+}
+// スコープの所要時間が閾値を超えたら slowLog に書き出す (入れ子の操作もそれぞれ記録する)
+struct SlowOpScope {
+    Engine* e; const char* op; std::chrono::steady_clock::time_point t0;
+    SlowOpScope(Engine* engine, const char* name) : e(engine), op(name) { if (e->slowLog.active) t0 = std::chrono::steady_clock::now(); }
+    ~SlowOpScope() { if (e->slowLog.active) noteSlowOp(e, op, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count()); }
 };
 bool TextAtlas::loadGlyph(Engine* engine, int fontIndex, uint32_t glyphIndex) {
     uint64_t key = ((uint64_t)fontIndex << 32) | glyphIndex;
@@ -516,9 +699,45 @@ void rebuildLineStarts(Engine* engine);
 void ensureCaretVisible(Engine* engine);
 float getXFromPos(Engine* engine, size_t pos);
 void updateTitleBarIfNeeded(Engine* engine);
+void showMessage(Engine* engine, const char* resName);
 void stopAsyncParsing(Engine* engine);
 void startAsyncLineParsing(Engine* engine, const char* buffer, size_t size);
 void pollAsyncParsing(Engine* engine);
+void pollSearchProgress(Engine* engine);
+static size_t heapBytes(const std::string& s) { return s.capacity() >= sizeof(std::string) ? s.capacity() + 1 : 0; }
+static size_t heapBytes(const std::vector<EditBatch>& stack) {
+    size_t b = stack.capacity() * sizeof(EditBatch);
+    for (const auto& batch : stack) {
+        b += batch.ops.capacity() * sizeof(EditOp) + (batch.beforeCursors.capacity() + batch.afterCursors.capacity()) * sizeof(Cursor);
+        for (const auto& op : batch.ops) { b += heapBytes(op.text); if (op.pieces) b += op.pieces->capacity() * sizeof(Piece); }
+    }
+    return b;
+}
+MemoryStats collectMemoryStats(Engine* engine) {
+    MemoryStats m;
+    m.pieceList = engine->pt.pieces.capacity() * sizeof(Piece);
+    m.addBuffer = heapBytes(engine->pt.addBuf);
+    m.originalMapped = engine->fileMap.size; m.originalResident = engine->fileMap.residentBytes();
+    m.fileBuffer = heapBytes(engine->convertedFileBuffer);
+    m.lineIndex = engine->lineStarts.capacity() * sizeof(size_t);
+    {
+        std::lock_guard<std::mutex> lock(engine->asyncParseMutex);
+        for (const auto& chunk : engine->pendingLineChunks) m.lineIndex += chunk.capacity() * sizeof(size_t);
+    }
+    m.undoStack = heapBytes(engine->undo.undoStack);
+    m.redoStack = heapBytes(engine->undo.redoStack);
+    m.shapeCache = engine->lineCaches.capacity() * sizeof(LineCache);
+    for (const auto& lc : engine->lineCaches) m.shapeCache += lc.glyphs.capacity() * sizeof(ShapedGlyph);
+    // unordered_map はノード (値 + next ポインタ + ハッシュ) とバケット配列で概算する
+    m.glyphAtlas = engine->atlas.pixels.capacity() + engine->atlas.glyphs.size() * (sizeof(std::pair<const uint64_t, GlyphInfo>) + 2 * sizeof(void*)) + engine->atlas.glyphs.bucket_count() * sizeof(void*);
+    for (const auto& f : engine->fallbackFontData) m.fonts += f.capacity();
+    m.profiler = engine->profiler.events.capacity() * sizeof(FrameProfiler::Event);
+    m.searchIndex = engine->searchIndex.bytes() + engine->autoIndex.bytes() + engine->searchBuilder.bytes();
+    if (auto doc = engine->searchSnapshot.lock()) m.searchSnapshot = sizeof(PieceTable) + doc->pieces.capacity() * sizeof(Piece) + heapBytes(doc->addBuf);
+    m.autoHighlight = engine->autoHighlight.matches.capacity() * sizeof(std::pair<size_t, size_t>) + heapBytes(engine->autoHighlight.target);
+    m.lineChunks = engine->lineChunks.bytes([](const LineVertices& lv) { return (lv.bg.capacity() + lv.deco.capacity() + lv.text.capacity()) * sizeof(Vertex); });
+    return m;
+}
 void updateDirtyFlag(Engine* engine) {
     bool wasDirty = engine->isDirty;
     engine->isDirty = !engine->undo.undoStack.empty();
@@ -529,6 +748,7 @@ void updateDirtyFlag(Engine* engine) {
 void performNewDocument(Engine* engine) {
     if (!engine) return;
     stopAsyncParsing(engine);
+    engine->searchBuilder.stop(); // 検索のスレッドが今のファイルの内容を読み終えてから閉じる
     engine->fileMap.close();
     engine->convertedFileBuffer.clear();
     engine->pt.initEmpty();
@@ -563,248 +783,262 @@ std::string UnescapeString(const std::string& s, const std::string& newline) {
         } else out += s[i];
     } return out;
 }
-std::string preprocessRegexQuery(const std::string& query) {
-    std::string processed; processed.reserve(query.size() * 4);
-    for (size_t i = 0; i < query.size(); ++i) {
-        char c = query[i];
-        if (c == '\\' && i + 1 < query.size()) {
-            char next = query[i + 1];
-            if (next == 'n') {
-                bool isPrecededByCR = (i >= 2 && query[i - 2] == '\\' && query[i - 1] == 'r');
-                if (!isPrecededByCR) { processed += "(?:\\r\\n|[\\r\\n])"; i++; continue; }
-            }
-            processed += c; processed += next; i++; continue;
-        } else if (c == '^') {
-            bool inClass = (i > 0 && query[i - 1] == '[');
-            if (!inClass) { processed += "((?:^|(?:\\r\\n|\\r(?!\\n)|[\\n])))"; continue; }
-        } else if (c == '$') {
-            bool inClass = (i > 0 && query[i - 1] == '[');
-            if (!inClass) { processed += "(?=(?:\\r\\n|[\\r\\n]|$))"; continue; }
-        }
-        processed += c;
-    }
-    return processed;
+const miu::Regex& compileSearchRegex(Engine* engine, const std::string& query, bool matchCase) {
+    int flags = miu::Regex::AnyNewline | (matchCase ? 0 : miu::Regex::IgnoreCase);
+    if (engine->cachedRegex.pattern() != query || engine->cachedRegex.flags() != flags) engine->cachedRegex = miu::Regex(query, flags);
+    return engine->cachedRegex;
+}
+// 通常検索の一致として扱うか: 単語単位の指定と、絵文字の途中で切れていないか
+static bool isLiteralMatchOk(const PieceTable& doc, size_t len, bool wholeWord, size_t pos, size_t mLen) {
+    if (wholeWord) { if (pos > 0 && isWordChar(doc.charAt(pos - 1))) return false; if (pos + mLen < len && isWordChar(doc.charAt(pos + mLen))) return false; }
+    // 直後に ZWJ (E2 80 8D)、異体字セレクタ (EF B8 8F)、肌色修飾子 (F0 9F 8F BB-BF) が続くなら絵文字の一部なので一致としない
+    std::string next = doc.getRange(pos + mLen, 4); const unsigned char* b = (const unsigned char*)next.data();
+    if (next.size() >= 3 && ((b[0] == 0xE2 && b[1] == 0x80 && b[2] == 0x8D) || (b[0] == 0xEF && b[1] == 0xB8 && b[2] == 0x8F))) return false;
+    if (next.size() >= 4 && b[0] == 0xF0 && b[1] == 0x9F && b[2] == 0x8F && b[3] >= 0xBB && b[3] <= 0xBF) return false;
+    return true;
+}
+// 並列検索の区切り位置を UTF-8 の文字の先頭に合わせる
+static size_t alignToCharStart(const PieceTable& doc, size_t len, size_t pos) {
+    for (int k = 0; k < 3 && pos < len && ((unsigned char)doc.charAt(pos) & 0xC0) == 0x80; ++k) pos++;
+    return pos;
+}
+size_t alignToCharStart(Engine* engine, size_t pos) { return alignToCharStart(engine->pt, engine->pt.length(), pos); }
+// 一致の次に探し始める位置。空一致の次は 1 文字進めて探す (forEach と同じ規則)
+static size_t nextSearchStart(const PieceTable& doc, size_t len, const miu::SearchHit& h) {
+    if (h.len > 0) return h.pos + h.len;
+    if (h.pos >= len) return len + 1;
+    std::string next = doc.getRange(h.pos, 4); size_t l;
+    miu::decodeUtf8((const unsigned char*)next.data(), next.size(), l); return h.pos + l;
+}
+size_t nextSearchStart(Engine* engine, const miu::SearchHit& h) { return nextSearchStart(engine->pt, engine->pt.length(), h); }
+// 後ろ向きの正規表現検索の窓の始まり: pos 以前で最も近い行頭。窓 1 つ分の中に改行がなければ pos のまま
+static size_t lineStartBefore(const PieceTable& doc, size_t pos) {
+    size_t n = std::min(pos, miu::Regex::kBackwardWindow); std::string s = doc.getRange(pos - n, n);
+    size_t k = s.find_last_of("\r\n");
+    return k != std::string::npos ? pos - n + k + 1 : (n == pos ? 0 : pos);
+}
+// 開始位置が limit より前の一致を、先頭から順に forEach で列挙した場合と同じ順に集める。長い文書は区間に分けて並列に探す。
+// source はスレッドごとに文書を読む関数を作る。予算を使い切ったら false
+bool collectRegexMatches(Engine* engine, const miu::Regex& re, const std::function<miu::RegexSpanFn()>& source, size_t len, size_t limit, std::vector<miu::RegexMatch>& out) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(engine->bulkRegexTimeLimitMs);
+    auto scan = [&](size_t from, size_t to, auto&& emit) {
+        miu::RegexSearchOptions opt; opt.budget = engine->regexStepBudget; opt.startLimit = to; opt.deadline = deadline;
+        return re.forEach(source(), len, from, [&](const miu::RegexMatch& m) { return emit(m); }, opt) == miu::Regex::Found;
+    };
+    auto resume = [&](const miu::RegexMatch& m) { return nextSearchStart(engine, { m.pos, m.len }); };
+    return miu::parallelFindAll(miu::searchPartitions(0, std::min(limit, len + 1), [&](size_t p) { return alignToCharStart(engine, p); }), scan, resume, out);
 }
 size_t findText(Engine* engine, size_t startPos, const std::string& query, bool forward, bool matchCase, bool wholeWord, bool isRegex, size_t* outLen) {
     if (query.empty()) return std::string::npos;
     size_t len = engine->pt.length();
-    std::string actualQuery = query;
-    if (isRegex) actualQuery = preprocessRegexQuery(query);
+    auto align = [&](size_t p) { return alignToCharStart(engine, p); };
     if (isRegex) {
-        std::string fullText = engine->pt.getRange(0, len);
-        try {
-            std::regex_constants::syntax_option_type flags = std::regex_constants::ECMAScript;
-            if (!matchCase) flags |= std::regex_constants::icase;
-            std::regex re(actualQuery, flags);
-            std::smatch m;
-            size_t foundPos = std::string::npos;
-            size_t foundLen = 0;
-            bool startsWithCaret = (!query.empty() && query[0] == '^');
-            bool endsWithDollar = (!query.empty() && query.back() == '$');
-            if (forward) {
-                if (startPos > fullText.size()) startPos = 0;
-                size_t searchStartIdx = startPos;
-                std::regex_constants::match_flag_type searchFlags = std::regex_constants::match_default;
-                if (searchStartIdx > 0) {
-                    searchFlags |= std::regex_constants::match_not_bol;
-                    char prevChar = fullText[searchStartIdx - 1];
-                    if (prevChar == '\n') {
-                        searchStartIdx--;
-                        if (searchStartIdx > 0 && fullText[searchStartIdx - 1] == '\r') {
-                            searchStartIdx--;
-                        }
-                    } else if (prevChar == '\r') {
-                        searchStartIdx--;
-                    }
-                }
-                std::string::const_iterator searchStartIter = fullText.begin() + searchStartIdx;
-                while (std::regex_search(searchStartIter, fullText.cend(), m, re, searchFlags)) {
-                    size_t currentMatchPos = searchStartIdx + m.position();
-                    size_t currentMatchLen = m.length();
-                    size_t anchorLen = 0;
-                    if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                        anchorLen = m.length(1);
-                    }
-                    size_t contentPos = currentMatchPos + anchorLen;
-                    size_t contentLen = currentMatchLen - anchorLen;
-                    bool isValid = false;
-                    if (contentPos >= startPos) isValid = true;
-                    if (isValid && endsWithDollar) {
-                        bool isAtLineEnd = false;
-                        size_t checkPos = contentPos + contentLen;
-                        if (checkPos >= fullText.size()) {
-                            isAtLineEnd = true;
-                        } else {
-                            char c = fullText[checkPos];
-                            if (c == '\r' || c == '\n') {
-                                isAtLineEnd = true;
-                                if (contentLen == 0 && c == '\n' && checkPos > 0 && fullText[checkPos - 1] == '\r') {
-                                    isAtLineEnd = false;
-                                }
-                            }
-                        }
-                        if (!isAtLineEnd) isValid = false;
-                    }
-                    if (isValid) {
-                        foundPos = contentPos;
-                        foundLen = contentLen;
-                        if (startsWithCaret && endsWithDollar && foundLen == 0 && foundPos == fullText.size() && !fullText.empty()) {
-                            bool isAfterNewline = false;
-                            if (foundPos > 0) {
-                                char c = fullText[foundPos - 1];
-                                if (c == '\r' || c == '\n') isAfterNewline = true;
-                            }
-                            if (!isAfterNewline) isValid = false;
-                        }
-                        if (isValid) break;
-                    }
-                    size_t step = currentMatchLen;
-                    if (step == 0) {
-                        bool isBolCaret = (startsWithCaret && !(searchFlags & std::regex_constants::match_not_bol));
-                        if (isBolCaret) step = 0;
-                        else step = 1;
-                    }
-                    if (step == 0 && (searchFlags & std::regex_constants::match_not_bol)) step = 1;
-                    size_t dist = std::distance(searchStartIter, fullText.cend());
-                    if ((size_t)m.position() + step > dist) break;
-                    size_t advance = m.position() + step;
-                    std::advance(searchStartIter, advance);
-                    searchStartIdx += advance;
-                    searchFlags |= std::regex_constants::match_not_bol;
-                }
-                if (foundPos == std::string::npos && startPos > 0) {
-                    if (std::regex_search(fullText.cbegin(), fullText.cend(), m, re)) {
-                        size_t mPos = m.position();
-                        size_t mLen = m.length();
-                        size_t aLen = 0;
-                        if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                            aLen = m.length(1);
-                        }
-                        bool split = false;
-                        if (startsWithCaret && aLen == 1 && mPos < fullText.size() && fullText[mPos] == '\r') {
-                            if (mPos + 1 < fullText.size() && fullText[mPos + 1] == '\n') split = true;
-                        }
-                        if (!split) {
-                            size_t cPos = mPos + aLen;
-                            size_t cLen = mLen - aLen;
-                            bool valid = true;
-                            if (endsWithDollar) {
-                                size_t check = cPos + cLen;
-                                if (check < fullText.size()) {
-                                    char c = fullText[check];
-                                    if (c == '\r' || c == '\n') {
-                                        if (cLen == 0 && c == '\n' && check > 0 && fullText[check - 1] == '\r') {
-                                            valid = false;
-                                        }
-                                    } else {
-                                        valid = false;
-                                    }
-                                }
-                            }
-                            if (startsWithCaret && endsWithDollar && cLen == 0 && cPos == fullText.size() && !fullText.empty()) {
-                                bool isAfterNL = false;
-                                if (cPos > 0) {
-                                    char c = fullText[cPos - 1];
-                                    if (c == '\r' || c == '\n') isAfterNL = true;
-                                }
-                                if (!isAfterNL) valid = false;
-                            }
-                            if (valid) {
-                                foundPos = cPos;
-                                foundLen = cLen;
-                            }
-                        }
-                    }
-                }
-            } else {
-                auto words_begin = std::sregex_iterator(fullText.begin(), fullText.end(), re);
-                auto words_end = std::sregex_iterator();
-                size_t bestPos = std::string::npos;
-                size_t bestLen = 0;
-                size_t limit = (startPos == 0) ? len : startPos;
-                for (auto i = words_begin; i != words_end; ++i) {
-                    size_t mPos = i->position();
-                    size_t mLen = i->length();
-                    size_t aLen = 0;
-                    if (startsWithCaret && i->size() > 1 && (*i)[1].matched) {
-                        aLen = i->length(1);
-                    }
-                    if (startsWithCaret && aLen == 1 && mPos < fullText.size() && fullText[mPos] == '\r') {
-                        if (mPos + 1 < fullText.size() && fullText[mPos + 1] == '\n') continue;
-                    }
-                    size_t contentStart = mPos + aLen;
-                    size_t contentLen = mLen - aLen;
-                    if (endsWithDollar) {
-                        bool isAtEnd = (contentStart + contentLen >= fullText.size());
-                        if (!isAtEnd) {
-                            char c = fullText[contentStart + contentLen];
-                            if (c == '\r' || c == '\n') {
-                                if (contentLen == 0 && c == '\n' && contentStart + contentLen > 0 && fullText[contentStart + contentLen - 1] == '\r') {
-                                    continue;
-                                }
-                            } else {
-                                continue;
-                            }
-                        }
-                    }
-                    if (startsWithCaret && endsWithDollar && contentLen == 0 && contentStart == fullText.size() && !fullText.empty()) {
-                        bool isAfterNL = false;
-                        if (contentStart > 0) {
-                            char c = fullText[contentStart - 1];
-                            if (c == '\r' || c == '\n') isAfterNL = true;
-                        }
-                        if (!isAfterNL) continue;
-                    }
-                    if (contentStart < limit) {
-                        bestPos = contentStart;
-                        bestLen = contentLen;
-                    }
-                }
-                foundPos = bestPos;
-                foundLen = bestLen;
-            }
-            if (foundPos != std::string::npos) {
-                if (outLen) *outLen = foundLen;
-                return foundPos;
-            }
-        } catch (...) { return std::string::npos; }
-        return std::string::npos;
-    }
-    size_t qLen = query.length();
-    if (outLen) *outLen = qLen;
-    auto toLower = [](char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; };
-    size_t cur = startPos;
-    if (forward) { if (cur >= len) cur = 0; } else { if (cur == 0) cur = len; else cur--; }
-    size_t count = 0;
-    while (count < len) {
-        bool match = true;
-        for (size_t i = 0; i < qLen; ++i) {
-            size_t p = cur + i;
-            if (p >= len) { match = false; break; }
-            char c1 = engine->pt.charAt(p); char c2 = query[i];
-            if (!matchCase) { c1 = toLower(c1); c2 = toLower(c2); }
-            if (c1 != c2) { match = false; break; }
-        }
-        if (match && wholeWord) {
-            if (cur > 0 && isWordChar(engine->pt.charAt(cur - 1))) match = false;
-            if (match && (cur + qLen < len) && isWordChar(engine->pt.charAt(cur + qLen))) match = false;
-        }
-        if (match) return cur;
-        if (forward) { cur++; if (cur >= len) cur = 0; } else { if (cur == 0) cur = len - 1; else cur--; }
-        count++;
-    }
-    return std::string::npos;
+        const miu::Regex& re = compileSearchRegex(engine, query, matchCase);
+        if (!re.ok()) return std::string::npos;
+        // ピースを順に読みながら照合し、文書全体のコピーは作らない。長い文書は区間ごとに並列に探す。
+        // 時間の上限を過ぎたら (どこかの区間が打ち切られたら、それより前の一致を見落としたかもしれないので) 見つからなかったことにする
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(engine->regexTimeLimitMs);
+        std::atomic<bool> timedOut{ false };
+        auto firstIn = [&](size_t lo, size_t hi, miu::RegexMatch& m) {
+            miu::RegexSearchOptions opt; opt.budget = engine->regexStepBudget; opt.startLimit = hi; opt.deadline = deadline;
+            miu::Regex::Status st = re.search(engine->pt.spanReader(), len, lo, m, opt);
+            if (st == miu::Regex::BudgetExceeded) timedOut = true;
+            return st == miu::Regex::Found;
+        };
+        miu::RegexMatch m; bool found = false; engine->searchTimedOut = false;
+        if (forward) {
+            if (startPos > len) startPos = 0;
+            found = miu::parallelFindFirst(miu::searchPartitions(startPos, len + 1, align), false, firstIn, m);
+            if (!found && startPos > 0 && !timedOut) found = miu::parallelFindFirst(miu::searchPartitions(0, startPos, align), false, firstIn, m);
+        } else {
+            // カーソルの手前から窓を広げながら探すので、手間は直前の一致までの距離で決まる
+            miu::RegexSearchOptions opt; opt.budget = engine->regexStepBudget; opt.deadline = deadline;
+            miu::Regex::Status st = re.searchBackward(engine->pt.spanReader(), len, (startPos == 0) ? len : startPos, m, [&](size_t p) { return lineStartBefore(engine->pt, p); }, opt);
+            if (st == miu::Regex::BudgetExceeded) timedOut = true;
+            found = st == miu::Regex::Found;
+        }
+        if (timedOut) { engine->searchTimedOut = true; return std::string::npos; }
+        if (!found) return std::string::npos;
+        if (outLen) *outLen = m.len;
+        return m.pos;
+    }
+    auto accept = [&](size_t pos, size_t mLen) { return isLiteralMatchOk(engine->pt, len, wholeWord, pos, mLen); };
+    miu::LiteralSearcher ls(query, matchCase);
+    auto firstIn = [&](size_t lo, size_t hi, miu::SearchHit& h) { auto spans = engine->pt.pieceReader(); h.pos = ls.find(spans, len, lo, hi, accept, &h.len); return h.pos != std::string::npos; };
+    auto lastIn = [&](size_t lo, size_t hi, miu::SearchHit& h) { auto spans = engine->pt.pieceReader(); h.pos = ls.rfind(spans, len, lo, hi, accept, &h.len); return h.pos != std::string::npos; };
+    miu::SearchHit h; bool found = false;
+    if (forward) {
+        size_t cur = startPos >= len ? 0 : startPos;
+        found = miu::parallelFindFirst(miu::searchPartitions(cur, len, align), false, firstIn, h);
+        if (!found && cur > 0) found = miu::parallelFindFirst(miu::searchPartitions(0, cur, align), false, firstIn, h);
+    } else {
+        size_t cur = startPos == 0 ? len : startPos - 1;
+        found = miu::parallelFindFirst(miu::searchPartitions(0, std::min(cur + 1, len), align), true, lastIn, h);
+        if (!found && cur + 1 < len) found = miu::parallelFindFirst(miu::searchPartitions(cur + 1, len, align), true, lastIn, h);
+    }
+    if (!found) return std::string::npos;
+    if (outLen) *outLen = h.len;
+    return h.pos;
+}
+// 文書中の一致をすべて文書順に集める (置換や件数表示用)。正規表現が予算を使い切ったら complete が false になる
+std::vector<miu::SearchHit> findAll(Engine* engine, const std::string& query, bool matchCase, bool wholeWord, bool isRegex, bool* complete = nullptr) {
+    std::vector<miu::SearchHit> hits; if (complete) *complete = true;
+    if (query.empty()) return hits;
+    size_t len = engine->pt.length();
+    if (isRegex) {
+        const miu::Regex& re = compileSearchRegex(engine, query, matchCase);
+        std::vector<miu::RegexMatch> all;
+        bool ok = re.ok() && collectRegexMatches(engine, re, [&] { return engine->pt.spanReader(); }, len, len + 1, all);
+        engine->searchTimedOut = re.ok() && !ok;
+        if (complete) *complete = ok;
+        for (const auto& m : all) hits.push_back({ m.pos, m.len });
+        return hits;
+    }
+    miu::LiteralSearcher ls(query, matchCase);
+    auto scan = [&](size_t from, size_t to, auto&& emit) {
+        auto spans = engine->pt.pieceReader();
+        for (size_t p = from; ; ) {
+            miu::SearchHit h; h.pos = ls.find(spans, len, p, to, [&](size_t pos, size_t mLen) { return isLiteralMatchOk(engine->pt, len, wholeWord, pos, mLen); }, &h.len);
+            if (h.pos == std::string::npos || !emit(h)) return true;
+            p = h.pos + h.len;
+        }
+    };
+    miu::parallelFindAll(miu::searchPartitions(0, len, [&](size_t p) { return alignToCharStart(engine, p); }), scan, [](const miu::SearchHit& h) { return h.pos + h.len; }, hits);
+    return hits;
+}
+// 索引のキー: 検索語と検索条件
+static std::string matchIndexKey(const std::string& query, bool matchCase, bool wholeWord, bool isRegex) {
+    std::string key = query; key += '\0'; key += (char)('0' + (matchCase ? 1 : 0) + (wholeWord ? 2 : 0) + (isRegex ? 4 : 0)); return key;
+}
+static std::string searchIndexKey(Engine* engine) { return matchIndexKey(engine->searchQuery, engine->searchMatchCase, engine->searchWholeWord, engine->searchRegex); }
+// 索引を作るときの探し方 (MatchIndex::ScanFn)。doc と検索条件の写しだけを使うので、別のスレッドで文書の写しに対しても使える。
+// re が null なら通常検索。cancel が立つと正規表現の照合を途中でやめる
+static miu::MatchIndex::ScanFn matchIndexScan(const PieceTable& doc, size_t len, const miu::Regex* re, const std::string& query, bool matchCase, bool wholeWord, size_t budget, const std::atomic<bool>* cancel = nullptr) {
+    if (re) return [&doc, len, re, budget, cancel](size_t from, size_t limit, std::vector<miu::SearchHit>& hits, size_t& reach) {
+        miu::RegexSearchOptions opt; opt.budget = budget; opt.startLimit = limit; opt.reach = &reach; opt.cancel = cancel;
+        return re->forEach(doc.spanReader(), len, from, [&](const miu::RegexMatch& m) { hits.push_back({ m.pos, m.len }); return true; }, opt) == miu::Regex::Found;
+    };
+    // 一致の判定は一致の前後の 1 文字と、直後の絵文字の修飾 (4 バイト) まで読む
+    return [&doc, len, ls = miu::LiteralSearcher(query, matchCase), wholeWord](size_t from, size_t limit, std::vector<miu::SearchHit>& hits, size_t& reach) {
+        auto spans = doc.pieceReader(); size_t to = std::min(limit, len);
+        for (size_t p = from; p < to; ) {
+            miu::SearchHit h; h.pos = ls.find(spans, len, p, to, [&](size_t pos, size_t mLen) { return isLiteralMatchOk(doc, len, wholeWord, pos, mLen); }, &h.len);
+            if (h.pos == std::string::npos) break;
+            hits.push_back(h); p = h.pos + h.len;
+        }
+        reach = to + ls.maxLength() + 4;
+        return true;
+    };
+}
+// 検索条件の一致の索引を文書の最新の版に合わせて返す。前の版からの編集が少なければ、その周りのチャンクだけを探し直す。
+// 索引を使えない (検索語が空、正規表現が正しくない、予算切れ、一致が多すぎる) ときは nullptr
+const miu::MatchIndex* matchIndex(Engine* engine, miu::MatchIndex& idx, const std::string& query, bool matchCase, bool wholeWord, bool isRegex) {
+    if (query.empty()) return nullptr;
+    std::string key = matchIndexKey(query, matchCase, wholeWord, isRegex);
+    if (idx.key() != key) idx.reset(key);
+    if (idx.current(engine->pt.changes)) return idx.complete() ? &idx : nullptr;
+    const miu::Regex* re = isRegex ? &compileSearchRegex(engine, query, matchCase) : nullptr;
+    if (re && !re->ok()) return nullptr;
+    const PieceTable& doc = engine->pt; size_t len = doc.length();
+    auto align = [&](size_t p) { return alignToCharStart(doc, len, p); };
+    auto resume = [&](const miu::SearchHit& h) { return nextSearchStart(doc, len, h); };
+    return idx.update(doc.changes, len, align, matchIndexScan(doc, len, re, query, matchCase, wholeWord, engine->regexStepBudget), resume) ? &idx : nullptr;
+}
+// 検索語の索引を別のスレッドで作り始める。文書は今の版の写し (ピースの表と追加バッファ。元のファイルの内容は共有する) を読む
+void startSearchBuild(Engine* engine) {
+    std::shared_ptr<const miu::Regex> re;
+    if (engine->searchRegex) { const miu::Regex& r = compileSearchRegex(engine, engine->searchQuery, engine->searchMatchCase); if (!r.ok()) { engine->searchBuilder.stop(); return; } re = std::make_shared<miu::Regex>(r); }
+    auto doc = std::make_shared<PieceTable>(engine->pt); engine->searchSnapshot = doc;
+    std::string key = searchIndexKey(engine), query = engine->searchQuery;
+    bool matchCase = engine->searchMatchCase, wholeWord = engine->searchWholeWord; size_t anchor = engine->searchAnchor, budget = engine->regexStepBudget; uint64_t version = engine->pt.changes.version();
+    engine->searchBuilder.start(key, version, [=](miu::MatchIndex& out, const std::atomic<bool>& cancel, const miu::MatchIndex::ProgressFn& progress) {
+        size_t len = doc->length();
+        auto align = [&](size_t p) { return alignToCharStart(*doc, len, p); };
+        auto resume = [&](const miu::SearchHit& h) { return nextSearchStart(*doc, len, h); };
+        out.reset(key);
+        out.rebuild(version, len, anchor, align, matchIndexScan(*doc, len, re.get(), query, matchCase, wholeWord, budget, &cancel), resume, cancel, progress);
+    }, [engine] { engine->searchProgressed = true; });
+}
+// 描画と件数の表示に使う検索語の索引。編集に追いつくだけなら差分を探し直して返す。検索語や条件が変わって作り直しが要るときは、
+// 別のスレッドで作り始めて nullptr を返す (できあがったらメインループの pollSearchProgress が受け取る)
+const miu::MatchIndex* searchMatchIndex(Engine* engine) {
+    if (engine->searchQuery.empty()) return nullptr;
+    std::string key = searchIndexKey(engine);
+    if (engine->searchIndex.key() == key && engine->searchIndex.updatable(engine->pt.changes)) return matchIndex(engine, engine->searchIndex, engine->searchQuery, engine->searchMatchCase, engine->searchWholeWord, engine->searchRegex);
+    if (!engine->searchBuilder.pending(key)) startSearchBuild(engine);
+    return nullptr;
+}
+// 次を検索・すべて置換などのコマンド用: できあがっていた索引は受け取り、差分を探し直すだけで使えるときだけ返す。
+// 索引を一から作るのは別のスレッドに任せたままにし (文書全体を UI のスレッドで探さない)、呼び出し側はカーソルから探す
+const miu::MatchIndex* searchMatchIndexNow(Engine* engine) {
+    engine->searchBuilder.take(engine->searchIndex); engine->searchRevealPending = false;
+    return searchMatchIndex(engine);
+}
+// 別のスレッドの検索の進み具合を取り込む。できあがった索引を受け取り、最初の一致をまだ選んでいなければ選ぶ
+void applySearchProgress(Engine* engine) {
+    miu::IndexBuilder::Progress p = engine->searchBuilder.progress();
+    engine->searchBuilder.take(engine->searchIndex);
+    if (!engine->searchRevealPending || engine->searchQuery.empty()) return;
+    std::string key = searchIndexKey(engine);
+    miu::MatchIndex& idx = engine->searchIndex; miu::SearchHit h; bool found = false;
+    if (idx.key() == key && idx.current(engine->pt.changes)) {
+        engine->searchRevealPending = false;
+        if (idx.complete() && idx.count() > 0) { size_t i = idx.lowerBound(engine->searchAnchor); h = idx.at(i < idx.count() ? i : 0); found = true; }
+    }
+    else if (p.key == key && p.version == engine->pt.changes.version() && p.hasFirst) { engine->searchRevealPending = false; h = p.first; found = true; }
+    if (!found) return;
+    engine->cursors.clear();
+    engine->cursors.push_back({ h.pos + h.len, h.pos, getXFromPos(engine, h.pos + h.len) });
+    ensureCaretVisible(engine);
+}
+// メインループから毎フレーム呼ぶ
+void pollSearchProgress(Engine* engine) { if (engine->searchProgressed.exchange(false)) applySearchProgress(engine); }
+// 検索語か検索条件が変わった: 前の検索を取り消して別のスレッドで探し始め、カーソルから後の最初の一致が見つかったら選ぶ
+void searchQueryChanged(Engine* engine) {
+    engine->searchBuilder.stop(); engine->searchTimedOut = false;
+    engine->searchAnchor = engine->cursors.empty() ? 0 : engine->cursors.back().start(); engine->searchRevealPending = !engine->searchQuery.empty();
+    if (searchMatchIndex(engine)) applySearchProgress(engine); // 同じ条件の索引が使えるなら、その場で選ぶ
+}
+// 検索語の一致の総数と、選択範囲がそのうち何番目の一致か (1 から。一致を選んでいなければ 0)。件数が分からなければ false。
+// 別のスレッドで探している途中なら、それまでの件数を返して partial を true にする
+bool searchMatchStatus(Engine* engine, size_t& current, size_t& total, bool& partial) {
+    partial = false;
+    const miu::MatchIndex* idx = searchMatchIndex(engine);
+    if (!idx) {
+        if (!engine->searchBuilder.pending(searchIndexKey(engine))) return false;
+        total = engine->searchBuilder.progress().found; current = 0; partial = true; return true;
+    }
+    total = idx->count(); current = 0;
+    if (engine->cursors.size() == 1) {
+        const Cursor& c = engine->cursors.back(); size_t i = idx->lowerBound(c.start());
+        if (i < total) { miu::SearchHit h = idx->at(i); if (h.pos == c.start() && h.pos + h.len == c.end()) current = i + 1; }
+    }
+    return true;
 }
 void findNextCommand(Engine* engine, bool forward) {
     if (engine->searchQuery.empty()) return;
+    SlowOpScope so(engine, "find");
     size_t currentCursorPos = forward ? (engine->cursors.empty() ? 0 : engine->cursors.back().end()) : (engine->cursors.empty() ? 0 : engine->cursors.back().start());
+    // 索引があれば、カーソルの次 (前) の一致を二分探索で選ぶ。末尾 (先頭) まで行ったら反対側へ回り込む
+    if (const miu::MatchIndex* idx = searchMatchIndexNow(engine)) {
+        size_t n = idx->count();
+        if (n == 0) return;
+        size_t i = idx->lowerBound(currentCursorPos);
+        if (forward) { if (i < n && idx->at(i).len == 0 && idx->at(i).pos == currentCursorPos) i++; if (i >= n) i = 0; }
+        else i = i == 0 ? n - 1 : i - 1;
+        miu::SearchHit h = idx->at(i);
+        engine->cursors.clear();
+        engine->cursors.push_back({ h.pos + h.len, h.pos, getXFromPos(engine, h.pos + h.len) });
+        ensureCaretVisible(engine);
+        return;
+    }
     size_t matchLen = 0;
     size_t pos = findText(engine, currentCursorPos, engine->searchQuery, forward, engine->searchMatchCase, engine->searchWholeWord, engine->searchRegex, &matchLen);
     if (pos != std::string::npos) {
         engine->cursors.clear();
         engine->cursors.push_back({ pos + matchLen, pos, getXFromPos(engine, pos + matchLen) });
         ensureCaretVisible(engine);
-    }
+    } else if (engine->searchTimedOut) showMessage(engine, "msg_search_too_slow");
 }
 void replaceNextCommand(Engine* engine) {
     if (engine->cursors.empty() || engine->searchQuery.empty()) return;
@@ -834,146 +1068,39 @@ void replaceNextCommand(Engine* engine) {
 }
 void replaceAllCommand(Engine* engine) {
     if (engine->searchQuery.empty()) return;
-    struct Match { size_t start; size_t len; std::string replacementText; };
-    std::vector<Match> matches;
+    SlowOpScope so(engine, "replaceAll");
     size_t docLen = engine->pt.length();
+    // 一致の位置は検索の索引から取り出す (索引を使えなければ文書全体を探す)
+    std::vector<miu::SearchHit> hits;
+    if (const miu::MatchIndex* idx = searchMatchIndexNow(engine)) { hits.reserve(idx->count()); for (size_t i = 0; i < idx->count(); ++i) hits.push_back(idx->at(i)); }
+    else { bool complete = true; hits = findAll(engine, engine->searchQuery, engine->searchMatchCase, engine->searchWholeWord, engine->searchRegex, &complete); if (!complete) { LOGE("replaceAll: regex search stopped"); if (engine->searchTimedOut) showMessage(engine, "msg_search_too_slow"); return; } }
+    // 置換文字列は全一致で 1 つを共有し、$1 などを展開するときだけ一致ごとに作る
+    std::string fixedText = UnescapeString(engine->replaceQuery, engine->newlineStr); std::vector<std::string> formatted;
     if (engine->searchRegex) {
-        std::string actualQuery = preprocessRegexQuery(engine->searchQuery);
-        try {
-            std::regex_constants::syntax_option_type rxFlags = std::regex_constants::ECMAScript;
-            if (!engine->searchMatchCase) rxFlags |= std::regex_constants::icase;
-            std::regex re(actualQuery, rxFlags);
-            std::string fullText = engine->pt.getRange(0, docLen);
-            std::string rawFmt = UnescapeString(engine->replaceQuery, engine->newlineStr);
-            std::string fmt;
-            for (size_t i = 0; i < rawFmt.size(); ++i) {
-                if (rawFmt[i] == '$') {
-                    fmt += '$';
-                    if (i + 1 < rawFmt.size()) {
-                        if (isdigit((unsigned char)rawFmt[i + 1])) {
-                            i++;
-                            std::string numStr;
-                            while (i < rawFmt.size() && isdigit((unsigned char)rawFmt[i])) {
-                                numStr += rawFmt[i];
-                                i++;
-                            }
-                            i--;
-                            int grp = std::stoi(numStr);
-                            if (grp > 0) grp++;
-                            fmt += std::to_string(grp);
-                        } else {
-                            fmt += rawFmt[i + 1];
-                            i++;
-                        }
-                    }
-                } else {
-                    fmt += rawFmt[i];
-                }
-            }
-            bool startsWithCaret = (!engine->searchQuery.empty() && engine->searchQuery[0] == '^');
-            bool endsWithDollar = (!engine->searchQuery.empty() && engine->searchQuery.back() == '$');
-            auto searchStart = fullText.cbegin();
-            std::smatch m;
-            size_t currentOffset = 0;
-            std::regex_constants::match_flag_type flags = std::regex_constants::match_default;
-            while (std::regex_search(searchStart, fullText.cend(), m, re, flags)) {
-                size_t matchPos = currentOffset + m.position();
-                size_t matchLen = m.length();
-                size_t anchorLen = 0;
-                if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                    anchorLen = m.length(1);
-                }
-                size_t contentPos = matchPos + anchorLen;
-                size_t contentLen = matchLen - anchorLen;
-                bool shouldHighlight = true;
-                if (endsWithDollar) {
-                    bool isAtLineEnd = false;
-                    if (contentPos + contentLen >= fullText.size()) {
-                        isAtLineEnd = true;
-                    } else {
-                        char c = fullText[contentPos + contentLen];
-                        if (c == '\r' || c == '\n') {
-                            isAtLineEnd = true;
-                            if (contentLen == 0 && c == '\n' && contentPos + contentLen > 0 && fullText[contentPos + contentLen - 1] == '\r') {
-                                isAtLineEnd = false;
-                            }
-                        }
-                    }
-                    if (!isAtLineEnd) shouldHighlight = false;
-                    if (shouldHighlight && contentPos > 0 && contentPos < fullText.size()) {
-                        if (fullText[contentPos] == '\n' && fullText[contentPos - 1] == '\r') {
-                            shouldHighlight = false;
-                        }
-                    }
-                }
-                if (shouldHighlight && startsWithCaret && endsWithDollar && contentLen == 0) {
-                    size_t globalPos = contentPos;
-                    if (globalPos == fullText.size() && !fullText.empty()) {
-                        bool isAfterNewline = false;
-                        if (globalPos > 0) {
-                            char c = fullText[globalPos - 1];
-                            if (c == '\r' || c == '\n') isAfterNewline = true;
-                        }
-                        if (!isAfterNewline) shouldHighlight = false;
-                    }
-                }
-                if (shouldHighlight && !matches.empty()) {
-                    const auto& last = matches.back();
-                    if (last.start == contentPos && last.len == 0 && contentLen == 0) {
-                        shouldHighlight = false;
-                    }
-                }
-                if (shouldHighlight) {
-                    std::string rText = m.format(fmt);
-                    matches.push_back({ contentPos, contentLen, rText });
-                }
-                size_t step = matchLen;
-                if (step == 0) {
-                    bool isBolCaret = (startsWithCaret && !(flags & std::regex_constants::match_not_bol));
-                    if (isBolCaret) step = 0;
-                    else step = 1;
-                }
-                if (step == 0 && (flags & std::regex_constants::match_not_bol)) step = 1;
-                size_t relativeAdvance = m.position() + step;
-                size_t remaining = std::distance(searchStart, fullText.cend());
-                if (relativeAdvance > remaining) break;
-                std::advance(searchStart, relativeAdvance);
-                currentOffset += relativeAdvance;
-                flags |= std::regex_constants::match_not_bol;
+        const miu::Regex& re = compileSearchRegex(engine, engine->searchQuery, engine->searchMatchCase);
+        if (!re.ok()) return;
+        if (fixedText.find('$') != std::string::npos) {
+            // 一致の位置から照合し直してグループの範囲を得る。文書全体はコピーせず、ピースを順に読む
+            auto spans = engine->pt.spanReader();
+            miu::RegexSearchOptions opt; opt.budget = engine->regexStepBudget; opt.anchored = true;
+            formatted.reserve(hits.size());
+            for (const auto& h : hits) {
+                miu::RegexMatch m;
+                if (re.search(spans, docLen, h.pos, m, opt) != miu::Regex::Found || m.pos != h.pos) { m = miu::RegexMatch(); m.pos = h.pos; m.len = h.len; }
+                formatted.push_back(re.format(m, spans, docLen, fixedText));
             }
-        } catch (...) { return; }
-    } else {
-        size_t currentPos = 0;
-        while (true) {
-            size_t matchLen = 0;
-            size_t pos = findText(engine, currentPos, engine->searchQuery, true, engine->searchMatchCase, engine->searchWholeWord, false, &matchLen);
-            if (pos == std::string::npos || pos < currentPos) break;
-            std::string rText = UnescapeString(engine->replaceQuery, engine->newlineStr);
-            matches.push_back({ pos, matchLen, rText });
-            currentPos = pos + matchLen;
-            if (currentPos > docLen) break;
-        }
-    }
-    if (matches.empty()) return;
+        }
+    }
+    std::vector<PieceTable::RangeEdit> edits; edits.reserve(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) if (hits[i].pos + hits[i].len <= docLen) edits.push_back({ hits[i].pos, hits[i].len, formatted.empty() ? &fixedText : &formatted[i] });
+    if (edits.empty()) return;
+    // 新しいピース列は 1 回の走査で作る。元のピース列は取っておき、元に戻すときはピース列を入れ替えるだけにする
     EditBatch batch;
     batch.beforeCursors = engine->cursors;
-    for (auto it = matches.rbegin(); it != matches.rend(); ++it) {
-        size_t start = it->start;
-        size_t len = it->len;
-        if (start + len > engine->pt.length()) continue;
-        std::string deleted = engine->pt.getRange(start, len);
-        engine->pt.erase(start, len);
-        batch.ops.push_back({ EditOp::Erase, start, deleted });
-        engine->pt.insert(start, it->replacementText);
-        batch.ops.push_back({ EditOp::Insert, start, it->replacementText });
-    }
-    size_t finalMatchIdx = matches.size() - 1;
-    long long offsetBeforeFinal = 0;
-    for (size_t i = 0; i < finalMatchIdx; ++i) {
-        offsetBeforeFinal += (long long)matches[i].replacementText.size() - (long long)matches[i].len;
-    }
-    size_t lastReplaceStart = (size_t)((long long)matches.back().start + offsetBeforeFinal);
-    size_t lastReplaceEnd = lastReplaceStart + matches.back().replacementText.size();
+    EditOp op{ EditOp::Pieces, 0, std::string() };
+    op.pieces = std::make_shared<std::vector<Piece>>(engine->pt.replaceRanges(edits, op.change)); op.pos = op.change.pos;
+    size_t lastReplaceEnd = op.change.pos + op.change.inserted, lastReplaceStart = lastReplaceEnd - edits.back().text->size();
+    batch.ops.push_back(std::move(op));
     engine->cursors.clear();
     engine->cursors.push_back({ lastReplaceEnd, lastReplaceStart, getXFromPos(engine, lastReplaceEnd) });
     batch.afterCursors = engine->cursors;
@@ -1086,7 +1213,9 @@ static std::string ConvertToUtf8(JNIEnv* env, const char* data, size_t len, cons
 }
 bool openDocumentFromFile(Engine* engine, const std::string& path, JNIEnv* env) {
     if (!engine) return false;
+    SlowOpScope so(engine, "open");
     stopAsyncParsing(engine);
+    engine->searchBuilder.stop(); // 検索のスレッドが今のファイルの内容を読み終えてから閉じる
     engine->fileMap.close();
     engine->convertedFileBuffer.clear();
     engine->pt.initEmpty();
@@ -1125,6 +1254,7 @@ bool openDocumentFromFile(Engine* engine, const std::string& path, JNIEnv* env)
             engine->pt.origSize = engine->convertedFileBuffer.size();
             engine->pt.pieces.push_back({ true, 0, engine->pt.origSize });
         }
+        engine->pt.changes.reset(); // ピースを直接入れ替えたので、検索の索引は作り直させる
         engine->newlineStr = "\n";
         const char* checkPtr = engine->pt.origPtr;
         size_t checkLen = std::min(engine->pt.origSize, (size_t)4096);
@@ -1337,6 +1467,7 @@ void pollAsyncParsing(Engine* engine) {
     }
 }
 void rebuildLineStarts(Engine* engine) {
+    SlowOpScope so(engine, "rebuildLineStarts");
     stopAsyncParsing(engine);
     engine->lineStarts.clear();
     engine->lineStarts.push_back(0);
@@ -1389,7 +1520,7 @@ void ensureLineShaped(Engine* engine, int lineIdx) {
     LineCache& cache = engine->lineCaches[lineIdx];
     if (cache.isShaped) return;
     cache.glyphs.clear();
-    cache.isShaped = true;
+    cache.isShaped = true; cache.gen = ++engine->shapeGeneration;
     size_t start = engine->lineStarts[lineIdx];
     size_t end = (lineIdx + 1 < engine->lineStarts.size()) ? engine->lineStarts[lineIdx + 1] : engine->pt.length();
     size_t textEnd = end;
@@ -1482,9 +1613,39 @@ void ensureLineShaped(Engine* engine, int lineIdx) {
     }
     hb_buffer_destroy(hb_buf);
 }
+// 先頭のフォントが等幅で、行が表示できる ASCII とタブだけなら、送り幅の和で x 座標が決まる (整形しなくてよい)
+static bool isAsciiMonospaceLine(Engine* engine, const std::string& text) {
+    if (engine->monoAdvance <= 0.0f) return false;
+    for (unsigned char c : text) if ((c < 0x20 && c != '\t') || c >= 0x7F) return false;
+    return true;
+}
+// ASCII の文字 c を x (48px 基準) に置いたあとの x。タブは ensureLineShaped と同じく半角 4 文字分のタブストップまで進む
+static float asciiAdvance(Engine* engine, float x, char c) {
+    if (c != '\t') return x + engine->monoAdvance;
+    const float tabWidthUnscaled = 24.0f * 4.0f;
+    float adv = std::floor(x / tabWidthUnscaled + 1.0f) * tabWidthUnscaled - x;
+    if (adv < 1.0f) adv += tabWidthUnscaled;
+    return x + adv;
+}
+static float asciiLineX(Engine* engine, const std::string& text, size_t bytes) {
+    float x = 0.0f;
+    for (size_t i = 0; i < bytes && i < text.size(); ++i) x = asciiAdvance(engine, x, text[i]);
+    return x;
+}
+// 行 lineIdx の改行を除いた文字列。IME で入力中の行なら false (入力中の文字列を含めて整形する必要がある)
+static bool plainLineText(Engine* engine, int lineIdx, std::string& text) {
+    size_t start = engine->lineStarts[lineIdx], end = (lineIdx + 1 < engine->lineStarts.size()) ? engine->lineStarts[lineIdx + 1] : engine->pt.length();
+    if (end > start && engine->pt.charAt(end - 1) == '\n') end--;
+    if (end > start && engine->pt.charAt(end - 1) == '\r') end--;
+    if (!engine->imeComp.empty() && !engine->cursors.empty() && engine->cursors.back().head >= start && engine->cursors.back().head <= end) return false;
+    text = engine->pt.getRange(start, end - start);
+    return true;
+}
 float getXFromPos(Engine* engine, size_t pos) {
     int lineIdx = getLineIdx(engine, pos);
     if (lineIdx < 0 || lineIdx >= engine->lineStarts.size()) return engine->gutterWidth;
+    std::string text;
+    if (engine->monoAdvance > 0.0f && plainLineText(engine, lineIdx, text) && isAsciiMonospaceLine(engine, text)) return engine->gutterWidth + asciiLineX(engine, text, pos - engine->lineStarts[lineIdx]) * (engine->currentFontSize / 48.0f);
     ensureLineShaped(engine, lineIdx);
     float x = engine->gutterWidth;
     float scale = engine->currentFontSize / 48.0f;
@@ -1507,6 +1668,13 @@ size_t getDocPosFromPoint(Engine* engine, float touchX, float touchY) {
     if (lineIdx < 0) return 0;
     if (lineIdx >= engine->lineStarts.size()) return engine->pt.length();
     size_t start = engine->lineStarts[lineIdx];
+    std::string text;
+    if (engine->monoAdvance > 0.0f && plainLineText(engine, lineIdx, text) && isAsciiMonospaceLine(engine, text)) {
+        // 文字の幅の半分より左ならその文字の前
+        float scale = engine->currentFontSize / 48.0f, x0 = engine->gutterWidth - engine->scrollX, x = 0.0f;
+        for (size_t i = 0; i < text.size(); ++i) { float next = asciiAdvance(engine, x, text[i]); if (touchX < x0 + (x + next) * 0.5f * scale) return start + i; x = next; }
+        return start + text.size();
+    }
     ensureLineShaped(engine, lineIdx);
     float currentX = engine->gutterWidth - engine->scrollX;
     float scale = engine->currentFontSize / 48.0f;
@@ -1729,12 +1897,14 @@ void insertNewlineWithAutoIndent(Engine* engine) {
 }
 void performUndo(Engine* engine) {
     if (engine->undo.undoStack.empty()) return;
+    SlowOpScope so(engine, "undo");
     EditBatch b = engine->undo.undoStack.back();
     engine->undo.undoStack.pop_back();
     engine->undo.redoStack.push_back(b);
     for (int i = (int)b.ops.size() - 1; i >= 0; --i) {
         const auto& o = b.ops[i];
-        if (o.type == EditOp::Insert) engine->pt.erase(o.pos, o.text.size());
+        if (o.type == EditOp::Pieces) engine->pt.swapPieces(*o.pieces, { o.change.pos, o.change.inserted, o.change.removed });
+        else if (o.type == EditOp::Insert) engine->pt.erase(o.pos, o.text.size());
         else engine->pt.insert(o.pos, o.text);
     }
     engine->cursors = b.beforeCursors;
@@ -1744,11 +1914,13 @@ void performUndo(Engine* engine) {
 }
 void performRedo(Engine* engine) {
     if (engine->undo.redoStack.empty()) return;
+    SlowOpScope so(engine, "redo");
     EditBatch b = engine->undo.redoStack.back();
     engine->undo.redoStack.pop_back();
     engine->undo.undoStack.push_back(b);
     for (const auto& o : b.ops) {
-        if (o.type == EditOp::Insert) engine->pt.insert(o.pos, o.text);
+        if (o.type == EditOp::Pieces) engine->pt.swapPieces(*o.pieces, o.change);
+        else if (o.type == EditOp::Insert) engine->pt.insert(o.pos, o.text);
         else engine->pt.erase(o.pos, o.text.size());
     }
     engine->cursors = b.afterCursors;
@@ -2129,6 +2301,7 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdMarkSaved(JNIEnv* env, j
 JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSetSearchOptions(JNIEnv* env, jobject thiz, jstring query, jstring replace, jboolean matchCase, jboolean wholeWord, jboolean regex) {
     if (!g_engine) return;
     std::lock_guard<std::mutex> lock(g_imeMutex);
+    std::string key = searchIndexKey(g_engine);
     if (query) {
         const char* q = env->GetStringUTFChars(query, nullptr);
         g_engine->searchQuery = q ? q : "";
@@ -2142,12 +2315,22 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSetSearchOptions(JNIEnv*
     g_engine->searchMatchCase = matchCase;
     g_engine->searchWholeWord = wholeWord;
     g_engine->searchRegex = regex;
+    if (searchIndexKey(g_engine) != key) searchQueryChanged(g_engine);
 }
 JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdFindNext(JNIEnv* env, jobject thiz, jboolean forward) {
     if (!g_engine) return;
     std::lock_guard<std::mutex> lock(g_imeMutex);
     findNextCommand(g_engine, forward);
 }
+// 検索ツールバーに出す「何番目 / 全件数」。件数が分からなければ空文字列
+JNIEXPORT jstring JNICALL Java_jp_hack_miu_MainActivity_cmdGetSearchStatus(JNIEnv* env, jobject thiz) {
+    if (!g_engine) return env->NewStringUTF("");
+    std::lock_guard<std::mutex> lock(g_imeMutex);
+    size_t current = 0, total = 0; bool partial = false;
+    if (g_engine->searchQuery.empty() || !searchMatchStatus(g_engine, current, total, partial)) return env->NewStringUTF("");
+    std::string s = partial ? std::to_string(total) + "…" : current ? std::to_string(current) + " / " + std::to_string(total) : std::to_string(total);
+    return env->NewStringUTF(s.c_str());
+}
 JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdReplaceNext(JNIEnv* env, jobject thiz) {
     if (!g_engine) return;
     std::lock_guard<std::mutex> lock(g_imeMutex);
@@ -2288,6 +2471,7 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdPaste(JNIEnv* env, jobje
 JNIEXPORT jbyteArray JNICALL Java_jp_hack_miu_MainActivity_cmdGetSaveData(JNIEnv* env, jobject thiz) {
     if (!g_engine) return nullptr;
     std::lock_guard<std::mutex> lock(g_imeMutex);
+    SlowOpScope so(g_engine, "save");
     std::string utf8Text = g_engine->pt.getRange(0, g_engine->pt.length());
     jbyteArray utf8Array = env->NewByteArray(utf8Text.size());
     env->SetByteArrayRegion(utf8Array, 0, utf8Text.size(), (const jbyte*)utf8Text.data());
@@ -2476,6 +2660,7 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdMoveCursor(JNIEnv* env,
                 if (!keepAnchor) c.anchor = c.head;
                 c.desiredX = getXFromPos(g_engine, c.head);
             } else {
+                resolveCursorX(g_engine, c);
                 int lineIdx = getLineIdx(g_engine, c.head);
                 int targetLineIdx = (direction == 2) ? (lineIdx - 1) : (lineIdx + 1);
                 if (targetLineIdx >= 0 && targetLineIdx < (int)g_engine->lineStarts.size()) {
@@ -2545,6 +2730,31 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdMoveHomeEnd(JNIEnv* env,
     }
     ensureCaretVisible(g_engine);
 }
+// カーソルのある単語 (カーソルが単語の直後ならその単語) の範囲
+static void wordAtCaret(Engine* engine, size_t pos, size_t& s, size_t& e) {
+    size_t targetPos = pos;
+    if (targetPos > 0) {
+        char currChar = targetPos < engine->pt.length() ? engine->pt.charAt(targetPos) : '\0';
+        char prevChar = engine->pt.charAt(targetPos - 1);
+        if (!isWordChar(currChar) && isWordChar(prevChar)) { targetPos--; }
+    }
+    getWordBoundaries(engine, targetPos, s, e);
+}
+static void resolveCursorX(Engine* engine, Cursor& c) { if (c.desiredX < 0.0f) c.desiredX = getXFromPos(engine, c.head); }
+// 文書の [from, to] に掛かるカーソルの添字を out に入れる。重ならずに文書順に並んでいれば二分探索で範囲の先頭を探し、そうでなければ位置の比較だけで選ぶ。
+// 文書順が 1 か所で折り返している (すべての一致を選んで主カーソルを末尾に置いた) ときは、その前後の 2 つの並びをそれぞれ探す
+static void visibleCursorIndices(Engine* engine, size_t from, size_t to, std::vector<size_t>& out) {
+    const auto& cs = engine->cursors; out.clear();
+    size_t n = cs.size(), wrap = 0; bool ordered = true;
+    for (size_t i = 1; i < n && ordered; ++i) if (cs[i - 1].end() > cs[i].start()) { if (wrap) ordered = false; else wrap = i; }
+    if (ordered && wrap) ordered = cs[n - 1].end() <= cs[0].start();
+    if (!ordered) { for (size_t i = 0; i < n; ++i) if (cs[i].start() <= to && cs[i].end() >= from) out.push_back(i); return; }
+    auto scan = [&](size_t lo, size_t hi) {
+        size_t i = std::partition_point(cs.begin() + lo, cs.begin() + hi, [&](const Cursor& c) { return c.end() < from; }) - cs.begin();
+        for (; i < hi && cs[i].start() <= to; ++i) out.push_back(i);
+    };
+    if (wrap) { scan(0, wrap); scan(wrap, n); } else scan(0, n);
+}
 JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSelectNextOccurrence(JNIEnv* env, jobject thiz) {
     if (!g_engine || g_engine->cursors.empty()) return;
     std::lock_guard<std::mutex> lock(g_imeMutex);
@@ -2554,14 +2764,8 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSelectNextOccurrence(JNI
 
     if (!c.hasSelection()) {
         // 選択範囲がない場合は、現在の単語を選択する（1回目のCtrl+D）
-        size_t targetPos = c.head;
-        if (targetPos > 0) {
-            char currChar = targetPos < g_engine->pt.length() ? g_engine->pt.charAt(targetPos) : '\0';
-            char prevChar = g_engine->pt.charAt(targetPos - 1);
-            if (!isWordChar(currChar) && isWordChar(prevChar)) { targetPos--; }
-        }
         size_t s, e;
-        getWordBoundaries(g_engine, targetPos, s, e);
+        wordAtCaret(g_engine, c.head, s, e);
         if (s != e) {
             g_engine->cursors.clear();
             g_engine->cursors.push_back({e, s, getXFromPos(g_engine, e)});
@@ -2590,6 +2794,27 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSelectNextOccurrence(JNI
         ensureCaretVisible(g_engine);
     }
 }
+// 選択範囲 (なければカーソルのある単語を単語単位で) と同じ文字列をすべて選ぶ。一致は findAll で 1 回に求めて文書順のままカーソルにし、
+// desiredX は上下移動で使うときに resolveCursorX で求める
+JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdSelectAllOccurrences(JNIEnv* env, jobject thiz) {
+    if (!g_engine || g_engine->cursors.empty()) return;
+    std::lock_guard<std::mutex> lock(g_imeMutex);
+    Cursor c = g_engine->cursors.back();
+    size_t s = c.start(), e = c.end();
+    if (!c.hasSelection()) { wordAtCaret(g_engine, c.head, s, e); if (s == e) return; }
+    std::vector<miu::SearchHit> hits = findAll(g_engine, g_engine->pt.getRange(s, e - s), true, !c.hasSelection(), false);
+    if (hits.empty()) return;
+    std::vector<Cursor> next; next.reserve(hits.size());
+    size_t primary = hits.size() - 1;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (hits[i].pos == s) primary = i;
+        next.push_back({hits[i].pos + hits[i].len, hits[i].pos, Cursor::kUnresolvedX});
+    }
+    // 元の選択を主カーソル (末尾) にし、ほかはその後ろから文書を一周する順に並べる
+    std::rotate(next.begin(), next.begin() + primary + 1, next.end());
+    g_engine->cursors.swap(next);
+    ensureCaretVisible(g_engine);
+}
 JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdClearSelectionAndMultiCursor(JNIEnv* env, jobject thiz) {
     if (!g_engine || g_engine->cursors.empty()) return;
     std::lock_guard<std::mutex> lock(g_imeMutex);
@@ -2615,6 +2840,7 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdPageMove(JNIEnv* env, jo
     if (linesPerPage < 1) linesPerPage = 1;
     size_t len = g_engine->pt.length();
     for (auto& c : g_engine->cursors) {
+        resolveCursorX(g_engine, c);
         int lineIdx = getLineIdx(g_engine, c.head);
         int targetLineIdx = isUp ? (lineIdx - linesPerPage) : (lineIdx + linesPerPage);
         if (targetLineIdx >= 0 && targetLineIdx < (int)g_engine->lineStarts.size()) {
@@ -2729,6 +2955,17 @@ JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdZoom(JNIEnv* env, jobjec
         ensureCaretVisible(g_engine);
     }
 }
+JNIEXPORT void JNICALL Java_jp_hack_miu_MainActivity_cmdToggleProfiler(JNIEnv* env, jobject thiz, jboolean exportTrace) {
+    if (!g_engine) return;
+    std::lock_guard<std::mutex> lock(g_imeMutex);
+    FrameProfiler& prof = g_engine->profiler;
+    if (exportTrace) {
+        const char* dir = g_engine->app->activity->externalDataPath ? g_engine->app->activity->externalDataPath : g_engine->app->activity->internalDataPath;
+        std::string path = std::string(dir ? dir : ".") + "/miu_frame_trace.json";
+        if (prof.exportChromeTrace(path)) LOGI("frame trace: %s (%zu events)", path.c_str(), prof.events.size()); else LOGE("frame trace export failed: %s", path.c_str());
+        LOGI("memory: %s", collectMemoryStats(g_engine).toJson().c_str());
+    } else { prof.showOverlay = !prof.showOverlay; prof.recording = prof.showOverlay; }
+}
 JNIEXPORT jstring JNICALL Java_jp_hack_miu_MainActivity_cmdGetTextBeforeCursor(JNIEnv* env, jobject thiz, jint length) {
     if (!g_engine || g_engine->cursors.empty()) return env->NewStringUTF("");
     std::lock_guard<std::mutex> lock(g_imeMutex);
@@ -3286,7 +3523,7 @@ bool initVulkan(Engine* engine) {
     createBuffer(engine, bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, engine->vertexBuffer, engine->vertexBufferMemory);
     createBuffer(engine, engine->atlas.width * engine->atlas.height * 4, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, engine->atlasStagingBuffer, engine->atlasStagingMemory);
     if (FT_Init_FreeType(&engine->ftLibrary)) return false;
-    engine->atlas.init();
+    engine->atlas.init(); engine->gutterDigits = GutterDigits(); engine->lineChunks.clear(); engine->lastFrameKey = 0;
     const char* fontPaths[] = {
             "/system/fonts/Roboto-Regular.ttf",
             "/system/fonts/NotoSansCJK-Regular.ttc",
@@ -3318,6 +3555,12 @@ bool initVulkan(Engine* engine) {
             if (face != nullptr) { engine->fallbackHbFonts.push_back(hb_ft_font_create(face, nullptr)); engine->fallbackFontScales.push_back(emScale); }
         } else engine->fallbackFontData.pop_back();
     }
+    // 先頭のフォントが等幅なら、ASCII だけの行の x 座標は整形せずに計算できる (getXFromPos と getDocPosFromPoint)
+    engine->monoAdvance = 0.0f;
+    if (!engine->fallbackFaces.empty() && FT_IS_FIXED_WIDTH(engine->fallbackFaces[0])) {
+        hb_codepoint_t gid = 0;
+        if (hb_font_get_nominal_glyph(engine->fallbackHbFonts[0], ' ', &gid)) engine->monoAdvance = (hb_font_get_glyph_h_advance(engine->fallbackHbFonts[0], gid) / 64.0f) * engine->fallbackFontScales[0];
+    }
     if (!createTextTexture(engine)) return false;
     if (!createDescriptors(engine)) return false;
     if (!createPipelineLayout(engine)) return false;
@@ -3341,9 +3584,67 @@ std::string GetResString(Engine* engine, const char* resName) {
     if (needDetach) vm->DetachCurrentThread();
     return result;
 }
+// 行番号の数字の字形をアトラスから引く (フォントを読み込み直してから最初の 1 回だけグリフを読み込む)
+static const GutterDigits& gutterDigits(Engine* engine) {
+    GutterDigits& gd = engine->gutterDigits;
+    if (gd.ready || engine->fallbackFaces.empty()) return gd;
+    for (int d = 0; d < 10; ++d) {
+        uint32_t cp = '0' + d; int fontIdx = getFontIndexForChar(engine, cp, 0); uint32_t glyphIdx = FT_Get_Char_Index(engine->fallbackFaces[fontIdx], cp); uint64_t key = ((uint64_t)fontIdx << 32) | glyphIdx;
+        if (engine->atlas.glyphs.count(key) == 0) engine->atlas.loadGlyph(engine, fontIdx, glyphIdx);
+        auto it = engine->atlas.glyphs.find(key); gd.has[d] = it != engine->atlas.glyphs.end(); if (gd.has[d]) gd.info[d] = it->second;
+    }
+    gd.ready = true; return gd;
+}
+// 自動ハイライトの対象の語と、[visStart, visEnd) にかかる一致を最新にする。文書もカーソルも画面の範囲も変わっていなければ何もしない
+const AutoHighlightCache& updateAutoHighlight(Engine* engine, size_t visStart, size_t visEnd) {
+    AutoHighlightCache& ah = engine->autoHighlight;
+    uint64_t ver = engine->pt.changes.version();
+    size_t head = engine->cursors.empty() ? 0 : engine->cursors.back().head, anchor = engine->cursors.empty() ? 0 : engine->cursors.back().anchor;
+    if (ah.version != ver || ah.head != head || ah.anchor != anchor || ah.cursorCount != engine->cursors.size()) {
+        auto [target, wholeWord] = getHighlightTarget(engine);
+        if (ah.version != ver || ah.target != target || ah.wholeWord != wholeWord) ah.valid = false;
+        ah.version = ver; ah.head = head; ah.anchor = anchor; ah.cursorCount = engine->cursors.size(); ah.target = std::move(target); ah.wholeWord = wholeWord;
+    }
+    if (ah.target.empty() || ah.target == engine->searchQuery) { ah.matches.clear(); ah.valid = false; return ah; }
+    if (ah.valid && ah.from == visStart && ah.to == visEnd) return ah;
+    FrameProfiler::Scope ps(engine->profiler, FrameProfiler::AutoHighlight);
+    ah.matches.clear(); ah.valid = true; ah.from = visStart; ah.to = visEnd;
+    if (const miu::MatchIndex* idx = matchIndex(engine, engine->autoIndex, ah.target, true, ah.wholeWord, false)) idx->forEachOverlapping(visStart, visEnd, [&](const miu::SearchHit& h) { ah.matches.push_back({ h.pos, h.pos + h.len }); });
+    else {
+        size_t currentSearchPos = visStart;
+        while (currentSearchPos <= visEnd) {
+            size_t matchLen = 0; size_t found = findText(engine, currentSearchPos, ah.target, true, true, ah.wholeWord, false, &matchLen);
+            if (found == std::string::npos || found < currentSearchPos || found > visEnd) break;
+            ah.matches.push_back({found, found + matchLen});
+            if (matchLen == 0) currentSearchPos = found + 1; else currentSearchPos = found + matchLen;
+        }
+    }
+    return ah;
+}
+// 行 lineIdx の頂点を out に作る (座標は LineVertices の原点から)。組み立ては miu::buildLineVertices で、ここでは字形をアトラスから引き、行末の改行の記号を決める
+static void buildLineVertices(Engine* engine, int lineIdx, size_t lineStart, size_t lineEnd, const LineStyleRanges& ranges, LineVertices& out) {
+    miu::LineVertexStyle st = { engine->currentFontSize / 48.0f, engine->lineHeight, engine->charWidth, 1.0f / engine->atlas.width, 1.0f / engine->atlas.height, {}, {}, {} };
+    std::copy(engine->textColor, engine->textColor + 4, st.text); std::copy(engine->selColor, engine->selColor + 4, st.sel); std::copy(engine->autoHlColor, engine->autoHlColor + 4, st.autoHl);
+    miu::LineEnding ending;
+    if (lineEnd > lineStart) {
+        char lastChar = engine->pt.charAt(lineEnd - 1);
+        if (lastChar == '\n' || lastChar == '\r') {
+            size_t newlinePos = lineEnd - 1; uint64_t nlKey = 0xFFFFFFFFFFFFFFFD; bool skipDraw = false;
+            if (lastChar == '\n') { if (newlinePos > lineStart && engine->pt.charAt(newlinePos - 1) == '\r') { newlinePos--; nlKey = 0xFFFFFFFFFFFFFFFF; } else nlKey = 0xFFFFFFFFFFFFFFFD; }
+            else if (lastChar == '\r') { if (lineEnd < engine->pt.length() && engine->pt.charAt(lineEnd) == '\n') skipDraw = true; else nlKey = 0xFFFFFFFFFFFFFFFE; }
+            if (!skipDraw) { auto it = engine->atlas.glyphs.find(nlKey); ending = { true, newlinePos, it != engine->atlas.glyphs.end() ? &it->second : nullptr }; }
+        }
+    }
+    size_t nextLineStart = lineIdx + 1 < engine->lineStarts.size() ? engine->lineStarts[lineIdx + 1] : SIZE_MAX;
+    miu::buildLineVertices(engine->lineCaches[lineIdx].glyphs, lineStart, nextLineStart, ending, ranges, st, [&](int fontIndex, uint32_t glyphIndex) -> const GlyphInfo* {
+        uint64_t key = ((uint64_t)fontIndex << 32) | glyphIndex;
+        if (engine->atlas.glyphs.count(key) == 0) engine->atlas.loadGlyph(engine, fontIndex, glyphIndex);
+        auto it = engine->atlas.glyphs.find(key); return it != engine->atlas.glyphs.end() ? &it->second : nullptr;
+    }, out);
+}
 void updateTextVertices(Engine* engine) {
-    float scale = engine->currentFontSize / 48.0f; float baselineOffset = engine->lineHeight * 0.8f; engine->maxLineWidth = engine->gutterWidth;
-    std::vector<Vertex> bgVertices; std::vector<Vertex> lineVertices; std::vector<Vertex> charVertices; std::vector<Vertex> cursorVertices;
+    float scale = engine->currentFontSize / 48.0f; float baselineOffset = engine->lineHeight * 0.8f;
+    std::vector<Vertex> cursorVertices;
     float whiteU = 1.0f / engine->atlas.width; float whiteV = 1.0f / engine->atlas.height;
     auto addRect = [&](std::vector<Vertex>& verts, float rx, float ry, float rw, float rh, float r, float g, float b, float a) {
         verts.push_back({{rx, ry}, {whiteU, whiteV}, 0.0f, {r, g, b, a}}); verts.push_back({{rx, ry + rh}, {whiteU, whiteV}, 0.0f, {r, g, b, a}});
@@ -3352,174 +3653,103 @@ void updateTextVertices(Engine* engine) {
     };
     float textR = engine->textColor[0], textG = engine->textColor[1], textB = engine->textColor[2], textA = engine->textColor[3];
     float cursorWidth = std::max(2.0f, 4.0f * scale);
+    float winH = 5000.0f; float winW = 1080.0f;
+    if (engine->app->window != nullptr) { winH = (float)ANativeWindow_getHeight(engine->app->window); winW = (float)ANativeWindow_getWidth(engine->app->window); }
+    // 画面に入る行の範囲。一致は文書全体の索引からこの範囲の分だけ取り出す
+    int lineCount = (int)engine->lineStarts.size(); size_t docLen = engine->pt.length();
+    float firstY = (engine->scrollY - engine->topMargin - baselineOffset - engine->lineHeight) / engine->lineHeight, lastY = (engine->scrollY - engine->topMargin - baselineOffset + winH + engine->lineHeight) / engine->lineHeight;
+    int firstVisLine = std::clamp((int)std::floor(firstY), 0, lineCount), endVisLine = std::clamp((int)std::ceil(lastY) + 1, firstVisLine, lineCount);
+    size_t visStart = firstVisLine < lineCount ? engine->lineStarts[firstVisLine] : docLen, visEnd = endVisLine < lineCount ? engine->lineStarts[endVisLine] : docLen;
     std::vector<std::pair<size_t, size_t>> searchMatches;
     if (!engine->searchQuery.empty()) {
-        size_t docLen = engine->pt.length();
-        if (engine->searchRegex) {
-            std::string fullText = engine->pt.getRange(0, docLen); std::string actualQuery = preprocessRegexQuery(engine->searchQuery);
-            try {
-                std::regex_constants::syntax_option_type rxFlags = std::regex_constants::ECMAScript; if (!engine->searchMatchCase) rxFlags |= std::regex_constants::icase;
-                std::regex re(actualQuery, rxFlags); bool startsWithCaret = (!engine->searchQuery.empty() && engine->searchQuery[0] == '^'); bool endsWithDollar = (!engine->searchQuery.empty() && engine->searchQuery.back() == '$');
-                auto searchStart = fullText.cbegin(); std::smatch m; size_t currentOffset = 0; std::regex_constants::match_flag_type flags = std::regex_constants::match_default;
-                while (std::regex_search(searchStart, fullText.cend(), m, re, flags)) {
-                    size_t matchPos = currentOffset + m.position(); size_t matchLen = m.length(); size_t anchorLen = 0;
-                    if (startsWithCaret && m.size() > 1 && m[1].matched) anchorLen = m.length(1);
-                    size_t contentPos = matchPos + anchorLen; size_t contentLen = matchLen - anchorLen; bool shouldHighlight = true;
-                    if (endsWithDollar) {
-                        bool isAtLineEnd = false;
-                        if (contentPos + contentLen >= fullText.size()) isAtLineEnd = true;
-                        else {
-                            char c = fullText[contentPos + contentLen];
-                            if (c == '\r' || c == '\n') { isAtLineEnd = true; if (contentLen == 0 && c == '\n' && contentPos + contentLen > 0 && fullText[contentPos + contentLen - 1] == '\r') isAtLineEnd = false; }
-                        }
-                        if (!isAtLineEnd) shouldHighlight = false;
-                        if (shouldHighlight && contentPos > 0 && contentPos < fullText.size()) { if (fullText[contentPos] == '\n' && fullText[contentPos - 1] == '\r') shouldHighlight = false; }
-                    }
-                    if (shouldHighlight && startsWithCaret && endsWithDollar && contentLen == 0) {
-                        size_t globalPos = contentPos;
-                        if (globalPos == fullText.size() && !fullText.empty()) { bool isAfterNewline = false; if (globalPos > 0) { char c = fullText[globalPos - 1]; if (c == '\r' || c == '\n') isAfterNewline = true; } if (!isAfterNewline) shouldHighlight = false; }
-                    }
-                    if (shouldHighlight && !searchMatches.empty()) { const auto& last = searchMatches.back(); if (last.first == contentPos && (last.second - last.first) == 0 && contentLen == 0) shouldHighlight = false; }
-                    if (shouldHighlight) searchMatches.push_back({ contentPos, contentPos + contentLen });
-                    size_t step = matchLen;
-                    if (step == 0) { bool isBolCaret = (startsWithCaret && !(flags & std::regex_constants::match_not_bol)); if (isBolCaret) step = 0; else step = 1; }
-                    if (step == 0 && (flags & std::regex_constants::match_not_bol)) step = 1;
-                    size_t relativeAdvance = m.position() + step; size_t remaining = std::distance(searchStart, fullText.cend());
-                    if (relativeAdvance > remaining) break;
-                    std::advance(searchStart, relativeAdvance); currentOffset += relativeAdvance; flags |= std::regex_constants::match_not_bol;
-                }
-            } catch (...) {}
+        FrameProfiler::Scope ps(engine->profiler, FrameProfiler::RegexHighlight);
+        if (const miu::MatchIndex* idx = searchMatchIndex(engine)) idx->forEachOverlapping(visStart, visEnd, [&](const miu::SearchHit& h) { searchMatches.push_back({ h.pos, h.pos + h.len }); });
+        else if (engine->searchRegex) {
+            // 索引を使えないときは表示範囲だけを探す。前後の 1 バイトを文脈として渡し、行頭/行末と単語境界を文書全体と同じに判定する
+            std::string visibleText;
+            { FrameProfiler::Scope fs(engine->profiler, FrameProfiler::TextFetch); visibleText = engine->pt.getRange(visStart, visEnd - visStart); }
+            const miu::Regex& re = compileSearchRegex(engine, engine->searchQuery, engine->searchMatchCase);
+            miu::RegexSearchOptions opt; opt.budget = engine->highlightStepBudget;
+            opt.before = visStart > 0 ? (unsigned char)engine->pt.charAt(visStart - 1) : -1;
+            opt.after = visEnd < docLen ? (unsigned char)engine->pt.charAt(visEnd) : -1;
+            re.forEach(visibleText.data(), visibleText.size(), 0, [&](const miu::RegexMatch& m) { searchMatches.push_back({ visStart + m.pos, visStart + m.pos + m.len }); return true; }, opt);
         } else {
-            size_t currentSearchPos = 0;
-            while (currentSearchPos <= docLen) {
+            size_t currentSearchPos = visStart;
+            while (currentSearchPos <= visEnd) {
                 size_t matchLen = 0; size_t found = findText(engine, currentSearchPos, engine->searchQuery, true, engine->searchMatchCase, engine->searchWholeWord, false, &matchLen);
-                if (found == std::string::npos || found < currentSearchPos) break;
+                if (found == std::string::npos || found < currentSearchPos || found > visEnd) break;
                 searchMatches.push_back({found, found + matchLen});
                 if (matchLen == 0) currentSearchPos = found + 1; else currentSearchPos = found + matchLen;
             }
         }
     }
-    std::vector<std::pair<size_t, size_t>> autoMatches; auto [autoStr, isWholeWord] = getHighlightTarget(engine);
-    if (!autoStr.empty() && autoStr != engine->searchQuery) {
-        size_t currentSearchPos = 0; size_t docLen = engine->pt.length();
-        while (currentSearchPos <= docLen) {
-            size_t matchLen = 0; size_t found = findText(engine, currentSearchPos, autoStr, true, true, isWholeWord, false, &matchLen);
-            if (found == std::string::npos || found < currentSearchPos) break;
-            autoMatches.push_back({found, found + matchLen});
-            if (matchLen == 0) currentSearchPos = found + 1; else currentSearchPos = found + matchLen;
-        }
+    const std::vector<std::pair<size_t, size_t>>& autoMatches = updateAutoHighlight(engine, visStart, visEnd).matches;
+    // 見えている範囲に掛かるカーソルだけを先に選んでおく (カーソルがいくつあっても 1 行ごとに全部は見ない)
+    std::vector<size_t> visCursors; visibleCursorIndices(engine, visStart, visEnd, visCursors);
+    std::vector<std::pair<size_t, size_t>> selRanges;
+    for (size_t ci : visCursors) { const auto& cur = engine->cursors[ci]; if (cur.hasSelection()) selRanges.push_back({ cur.start(), cur.end() }); }
+    // 前のフレームと描くものが同じ (スクロール・文書・カーソル・一致・色が同じ) なら頂点バッファをそのまま使う
+    uint64_t style = miu::Hasher().add(scale).add(engine->charWidth).add(engine->lineHeight).add(whiteU).add(whiteV).add(engine->textColor).add(engine->selColor).add(engine->autoHlColor).add(engine->caretColor)
+        .add(engine->gutterBgColor).add(engine->gutterTextColor).add(engine->isDarkMode).value();
+    {
+        miu::Hasher fk; fk.add(style).add(engine->scrollX).add(engine->scrollY).add(winW).add(winH).add(engine->topMargin).add(engine->bottomInset).add(engine->gutterWidth)
+            .add(engine->pt.changes.version()).add(engine->lineStarts.size()).add(engine->shapeGeneration).add(engine->profiler.showOverlay).add(std::string_view(engine->imeComp));
+        for (size_t ci : visCursors) fk.add(engine->cursors[ci].head).add(engine->cursors[ci].anchor);
+        for (const auto& m : searchMatches) fk.add(m.first).add(m.second); fk.add('|'); for (const auto& m : autoMatches) fk.add(m.first).add(m.second);
+        bool same = engine->vertexCount > 0 && !engine->profiler.showOverlay && fk.value() == engine->lastFrameKey;
+        engine->lastFrameKey = fk.value();
+        if (same) return;
     }
-    float winH = 5000.0f; float winW = 1080.0f;
-    if (engine->app->window != nullptr) { winH = (float)ANativeWindow_getHeight(engine->app->window); winW = (float)ANativeWindow_getWidth(engine->app->window); }
-    for (int lineIdx = 0; lineIdx < engine->lineStarts.size(); ++lineIdx) {
+    engine->maxLineWidth = engine->gutterWidth;
+    engine->profiler.push(FrameProfiler::Layout);
+    LineStyleRanges ranges; ranges.sel.assign(selRanges); ranges.search.assign(searchMatches); ranges.autoHl.assign(autoMatches);
+    for (const auto& m : searchMatches) if (m.first == m.second) ranges.emptyMatches.push_back(m.first);
+    std::sort(ranges.emptyMatches.begin(), ranges.emptyMatches.end());
+    std::vector<size_t> heads; for (size_t ci : visCursors) heads.push_back(engine->cursors[ci].head);
+    std::sort(heads.begin(), heads.end()); auto headIt = heads.begin();
+    // 行の頂点は行ごとに持っておき、その行の字形・選択・一致・色が変わったときだけ作り直す。
+    // 行の頂点は行の左端 (行番号の右) とベースラインを原点にしているので、最後に頂点バッファへ書き込むときに行の位置へずらす
+    engine->lineChunks.retain(firstVisLine, endVisLine);
+    float originX = engine->gutterWidth - engine->scrollX;
+    struct PlacedLine { const LineVertices* lv; float dy; }; // lineChunks の中身 (unordered_map なので、ほかの行を足しても動かない)
+    std::vector<PlacedLine> placed; placed.reserve(endVisLine - firstVisLine);
+    for (int lineIdx = firstVisLine; lineIdx < endVisLine; ++lineIdx) {
         float lineY = engine->topMargin + baselineOffset - engine->scrollY + lineIdx * engine->lineHeight;
         if (lineY < -engine->lineHeight || lineY > winH + engine->lineHeight) continue;
         if (lineIdx >= engine->lineCaches.size()) break;
         ensureLineShaped(engine, lineIdx);
-        float x = engine->gutterWidth - engine->scrollX; size_t lineStart = engine->lineStarts[lineIdx]; size_t lineEnd = (lineIdx + 1 < engine->lineStarts.size()) ? engine->lineStarts[lineIdx + 1] : engine->pt.length();
-        for (const auto& match : searchMatches) {
-            if (match.first == match.second) {
-                if (match.first >= lineStart && (lineIdx + 1 >= engine->lineStarts.size() || match.first < engine->lineStarts[lineIdx + 1])) {
-                    float drawX = engine->gutterWidth;
-                    if (match.first > lineStart) { float s = engine->currentFontSize / 48.0f; for (const auto &sg: engine->lineCaches[lineIdx].glyphs) { if (sg.cluster >= match.first) break; drawX += sg.xAdvance * s; } }
-                    drawX -= engine->scrollX; float bgY = lineY - engine->lineHeight * 0.8f;
-                    addRect(bgVertices, drawX, bgY, engine->charWidth, engine->lineHeight, 1.0f, 1.0f, 0.0f, 0.4f);
-                }
-            }
-        }
-        for (const auto& sg : engine->lineCaches[lineIdx].glyphs) {
-            uint64_t key = ((uint64_t)sg.fontIndex << 32) | sg.glyphIndex;
-            if (engine->atlas.glyphs.count(key) == 0) engine->atlas.loadGlyph(engine, sg.fontIndex, sg.glyphIndex);
-
-            bool isSelected = false;
-            // 【変更】全てのカーソルをループして選択状態を判定
-            for (const auto& cur : engine->cursors) {
-                if (cur.hasSelection() && sg.cluster >= cur.start() && sg.cluster < cur.end()) {
-                    isSelected = true; break;
-                }
-            }
-
-            bool isSearchResult = false;
-            for (const auto& match : searchMatches) { if (match.first < match.second && sg.cluster >= match.first && sg.cluster < match.second) { isSearchResult = true; break; } }
-            bool isAutoHlResult = false;
-            for (const auto& match : autoMatches) { if (match.first < match.second && sg.cluster >= match.first && sg.cluster < match.second) { isAutoHlResult = true; break; } }
-
-            if (sg.isIME) {
-                float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, sg.xAdvance * scale, engine->lineHeight, 0.2f, 0.6f, 1.0f, 0.3f);
-                float underY = lineY + engine->lineHeight * 0.1f; addRect(lineVertices, x, underY, sg.xAdvance * scale, 2.0f, textR, textG, textB, 1.0f);
-            } else if (isSelected) {
-                float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, sg.xAdvance * scale, engine->lineHeight, engine->selColor[0], engine->selColor[1], engine->selColor[2], engine->selColor[3]);
-            } else if (isSearchResult) {
-                float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, sg.xAdvance * scale, engine->lineHeight, 1.0f, 1.0f, 0.0f, 0.4f);
-            } else if (isAutoHlResult) {
-                float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, sg.xAdvance * scale, engine->lineHeight, engine->autoHlColor[0], engine->autoHlColor[1], engine->autoHlColor[2], engine->autoHlColor[3]);
-            }
-
-            if (engine->atlas.glyphs.count(key) > 0) {
-                GlyphInfo& info = engine->atlas.glyphs[key]; float isColorFlag = info.isColor ? 1.0f : 0.0f;
-                float xpos = x + sg.xOffset * scale + info.bearingX * scale; float ypos = lineY - sg.yOffset * scale - info.bearingY * scale; float w = info.width * scale; float h = info.height * scale;
-                charVertices.push_back({{xpos, ypos}, {info.u0, info.v0}, isColorFlag, {textR, textG, textB, textA}}); charVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, isColorFlag, {textR, textG, textB, textA}});
-                charVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, isColorFlag, {textR, textG, textB, textA}}); charVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, isColorFlag, {textR, textG, textB, textA}});
-                charVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, isColorFlag, {textR, textG, textB, textA}}); charVertices.push_back({{xpos + w, ypos + h}, {info.u1, info.v1}, isColorFlag, {textR, textG, textB, textA}});
-            }
-            x += sg.xAdvance * scale; float absoluteX = x + engine->scrollX; if (absoluteX > engine->maxLineWidth) engine->maxLineWidth = absoluteX;
-        }
-        if (lineEnd > lineStart) {
-            char lastChar = engine->pt.charAt(lineEnd - 1);
-            if (lastChar == '\n' || lastChar == '\r') {
-                size_t newlinePos = lineEnd - 1; uint64_t nlKey = 0xFFFFFFFFFFFFFFFD; bool skipDraw = false;
-                if (lastChar == '\n') { if (newlinePos > lineStart && engine->pt.charAt(newlinePos - 1) == '\r') { newlinePos--; nlKey = 0xFFFFFFFFFFFFFFFF; } else nlKey = 0xFFFFFFFFFFFFFFFD; }
-                else if (lastChar == '\r') { if (lineEnd < engine->pt.length() && engine->pt.charAt(lineEnd) == '\n') skipDraw = true; else nlKey = 0xFFFFFFFFFFFFFFFE; }
-                if (!skipDraw) {
-                    bool isNewlineSelected = false;
-                    // 【変更】全てのカーソルをループして改行の選択状態を判定
-                    for (const auto& cur : engine->cursors) {
-                        if (cur.hasSelection() && newlinePos >= cur.start() && newlinePos < cur.end()) {
-                            isNewlineSelected = true; break;
-                        }
-                    }
-                    bool isNewlineMatched = false; for (const auto& match : searchMatches) { if (match.first < match.second && match.first <= newlinePos && match.second > newlinePos) { isNewlineMatched = true; break; } }
-                    bool isNewlineAutoMatched = false; for (const auto& match : autoMatches) { if (match.first < match.second && match.first <= newlinePos && match.second > newlinePos) { isNewlineAutoMatched = true; break; } }
-                    if (isNewlineSelected) { float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, engine->charWidth, engine->lineHeight, engine->selColor[0], engine->selColor[1], engine->selColor[2], engine->selColor[3]); }
-                    else if (isNewlineMatched) { float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, engine->charWidth, engine->lineHeight, 1.0f, 1.0f, 0.0f, 0.4f); }
-                    else if (isNewlineAutoMatched) { float bgY = lineY - engine->lineHeight * 0.8f; addRect(bgVertices, x, bgY, engine->charWidth, engine->lineHeight, engine->autoHlColor[0], engine->autoHlColor[1], engine->autoHlColor[2], engine->autoHlColor[3]); }
-                    if (engine->atlas.glyphs.count(nlKey) > 0) {
-                        GlyphInfo& info = engine->atlas.glyphs[nlKey]; float nlR = engine->textColor[0], nlG = engine->textColor[1], nlB = engine->textColor[2], nlA = engine->textColor[3] * 0.3f;
-                        float targetSize = engine->charWidth * 1.0f; float iconScale = targetSize / info.width; float w = info.width * iconScale, h = info.height * iconScale;
-                        float xpos = x + (engine->charWidth - w) * 0.5f; float rowCenterY = engine->topMargin - engine->scrollY + lineIdx * engine->lineHeight + engine->lineHeight * 0.5f; float ypos = rowCenterY - h * 0.5f;
-                        charVertices.push_back({{xpos, ypos}, {info.u0, info.v0}, 0.0f, {nlR, nlG, nlB, nlA}}); charVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {nlR, nlG, nlB, nlA}});
-                        charVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {nlR, nlG, nlB, nlA}}); charVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {nlR, nlG, nlB, nlA}});
-                        charVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {nlR, nlG, nlB, nlA}}); charVertices.push_back({{xpos + w, ypos + h}, {info.u1, info.v1}, 0.0f, {nlR, nlG, nlB, nlA}});
-                    }
-                }
-            }
-        }
-        for (const auto& c : engine->cursors) {
-            size_t vPos = c.head;
-            if (vPos >= lineStart && (lineIdx + 1 >= engine->lineStarts.size() || vPos < engine->lineStarts[lineIdx + 1])) {
-                float cx = getXFromPos(engine, vPos); float curY = lineY - engine->lineHeight * 0.8f;
-                addRect(cursorVertices, cx - engine->scrollX, curY, cursorWidth, engine->lineHeight, engine->caretColor[0], engine->caretColor[1], engine->caretColor[2], engine->caretColor[3]);
-            }
+        size_t lineStart = engine->lineStarts[lineIdx]; size_t lineEnd = (lineIdx + 1 < engine->lineStarts.size()) ? engine->lineStarts[lineIdx + 1] : engine->pt.length();
+        // 行末の改行記号は行の終わりと次の行の頭の文字で決まる
+        miu::Hasher sig; sig.add(style).add(engine->lineCaches[lineIdx].gen).add(lineStart).add(lineEnd);
+        for (size_t p = lineEnd > lineStart + 2 ? lineEnd - 2 : lineStart; p <= lineEnd && p < docLen; ++p) sig.add(engine->pt.charAt(p));
+        for (const miu::Intervals* set : { &ranges.sel, &ranges.search, &ranges.autoHl }) { sig.add('|'); set->forEachIn(lineStart, lineEnd, [&](size_t a, size_t b) { sig.add(a).add(b); }); }
+        for (auto it = std::lower_bound(ranges.emptyMatches.begin(), ranges.emptyMatches.end(), lineStart); it != ranges.emptyMatches.end() && *it <= lineEnd; ++it) sig.add(*it);
+        const LineVertices& lv = engine->lineChunks.get(lineIdx, sig.value(), [&](LineVertices& out) { buildLineVertices(engine, lineIdx, lineStart, lineEnd, ranges, out); });
+        placed.push_back({ &lv, lineY });
+        if (lv.width > 0.0f) engine->maxLineWidth = std::max(engine->maxLineWidth, engine->gutterWidth + lv.width);
+        FrameProfiler::Scope cs(engine->profiler, FrameProfiler::Selection);
+        size_t nextLineStart = lineIdx + 1 < engine->lineStarts.size() ? engine->lineStarts[lineIdx + 1] : SIZE_MAX;
+        for (headIt = std::lower_bound(headIt, heads.end(), lineStart); headIt != heads.end() && *headIt < nextLineStart; ++headIt) {
+            float cx = getXFromPos(engine, *headIt); float curY = lineY - engine->lineHeight * 0.8f;
+            addRect(cursorVertices, cx - engine->scrollX, curY, cursorWidth, engine->lineHeight, engine->caretColor[0], engine->caretColor[1], engine->caretColor[2], engine->caretColor[3]);
         }
     }
+    engine->profiler.pop();
+    engine->profiler.push(FrameProfiler::Gutter);
     std::vector<Vertex> gutterBgVertices; std::vector<Vertex> gutterTextVertices;
     addRect(gutterBgVertices, 0.0f, 0.0f, engine->gutterWidth, winH, engine->gutterBgColor[0], engine->gutterBgColor[1], engine->gutterBgColor[2], engine->gutterBgColor[3]);
     float gutterTextR = engine->gutterTextColor[0], gutterTextG = engine->gutterTextColor[1], gutterTextB = engine->gutterTextColor[2];
-    for (int i = 0; i < engine->lineStarts.size(); ++i) {
+    const GutterDigits& gd = gutterDigits(engine);
+    for (int i = firstVisLine; i < endVisLine; ++i) {
         float lineTop = engine->topMargin - engine->scrollY + i * engine->lineHeight;
         if (lineTop + engine->lineHeight < 0.0f || lineTop > winH) continue;
         std::string lineNumStr = std::to_string(i + 1); float numWidth = 0.0f;
-        for(char c : lineNumStr) {
-            uint32_t cp = c; int fontIdx = getFontIndexForChar(engine, cp, 0); uint32_t glyphIdx = FT_Get_Char_Index(engine->fallbackFaces[fontIdx], cp); uint64_t key = ((uint64_t)fontIdx << 32) | glyphIdx;
-            if (engine->atlas.glyphs.count(key) == 0 && !engine->fallbackFaces.empty()) engine->atlas.loadGlyph(engine, fontIdx, glyphIdx);
-            if (engine->atlas.glyphs.count(key) > 0) numWidth += engine->atlas.glyphs[key].advance * scale; else numWidth += engine->charWidth;
-        }
+        for (char c : lineNumStr) numWidth += gd.has[c - '0'] ? gd.info[c - '0'].advance * scale : engine->charWidth;
         float rightMargin = engine->charWidth * 0.5f; float numX = engine->gutterWidth - rightMargin - numWidth; if (numX < rightMargin * 0.5f) numX = rightMargin * 0.5f;
         float lineY = lineTop + baselineOffset;
-        for(char c : lineNumStr) {
-            uint32_t cp = c; int fontIdx = getFontIndexForChar(engine, cp, 0); uint32_t glyphIdx = FT_Get_Char_Index(engine->fallbackFaces[fontIdx], cp); uint64_t key = ((uint64_t)fontIdx << 32) | glyphIdx;
-            if (engine->atlas.glyphs.count(key) > 0) {
-                GlyphInfo& info = engine->atlas.glyphs[key]; float xpos = numX + info.bearingX * scale; float ypos = lineY - info.bearingY * scale; float w = info.width * scale; float h = info.height * scale;
+        for (char c : lineNumStr) {
+            if (gd.has[c - '0']) {
+                const GlyphInfo& info = gd.info[c - '0']; float xpos = numX + info.bearingX * scale; float ypos = lineY - info.bearingY * scale; float w = info.width * scale; float h = info.height * scale;
                 gutterTextVertices.push_back({{xpos, ypos}, {info.u0, info.v0}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}}); gutterTextVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}});
                 gutterTextVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}}); gutterTextVertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}});
                 gutterTextVertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}}); gutterTextVertices.push_back({{xpos + w, ypos + h}, {info.u1, info.v1}, 0.0f, {gutterTextR, gutterTextG, gutterTextB, 1.0f}});
@@ -3527,9 +3757,10 @@ void updateTextVertices(Engine* engine) {
             } else numX += engine->charWidth;
         }
     }
-    std::vector<Vertex> vertices;
-    vertices.insert(vertices.end(), bgVertices.begin(), bgVertices.end()); vertices.insert(vertices.end(), lineVertices.begin(), lineVertices.end());
-    vertices.insert(vertices.end(), charVertices.begin(), charVertices.end()); vertices.insert(vertices.end(), cursorVertices.begin(), cursorVertices.end());
+    engine->profiler.pop();
+    FrameProfiler::Scope ss(engine->profiler, FrameProfiler::Submit);
+    // 行の文字より上に重ねるもの (カーソル・行番号・スクロールバー・計測の表示)
+    std::vector<Vertex> vertices(std::move(cursorVertices));
     vertices.insert(vertices.end(), gutterBgVertices.begin(), gutterBgVertices.end()); vertices.insert(vertices.end(), gutterTextVertices.begin(), gutterTextVertices.end());
     float visibleH = winH - engine->bottomInset; float contentH = engine->lineStarts.size() * engine->lineHeight + engine->topMargin + engine->lineHeight;
     float maxScrollY = std::max(0.0f, contentH - visibleH); float maxScrollX = std::max(0.0f, engine->maxLineWidth - winW + engine->charWidth * 2.0f);
@@ -3544,11 +3775,42 @@ void updateTextVertices(Engine* engine) {
         float barWidth = std::max(minBarLen, displayAreaW * viewportRatio); float scrollRatio = engine->scrollX / maxScrollX; float barX = engine->gutterWidth + scrollRatio * (displayAreaW - barWidth);
         addRect(vertices, barX, visibleH - sbThickness - 4.0f, barWidth, sbThickness, sbR, sbG, sbB, sbA);
     }
-    engine->vertexCount = static_cast<uint32_t>(vertices.size());
+    if (engine->profiler.showOverlay) {
+        std::vector<std::string> lines = engine->profiler.overlayLines();
+        for (const auto& l : collectMemoryStats(engine).summaryLines()) lines.push_back(l);
+        float olh = engine->lineHeight * 0.6f, oScale = scale * 0.6f, ow = engine->charWidth * 0.6f * 40.0f, ox = winW - ow - sbThickness - 12.0f, oy = engine->topMargin + 8.0f;
+        if (!lines.empty()) addRect(vertices, ox, oy, ow, olh * lines.size() + 16.0f, 0.0f, 0.0f, 0.0f, 0.6f);
+        for (size_t k = 0; k < lines.size(); ++k) {
+            float tx = ox + 8.0f, baseY = oy + 8.0f + olh * (k + 1) - olh * 0.2f;
+            for (char c : lines[k]) {
+                uint32_t cp = (unsigned char)c; int fontIdx = getFontIndexForChar(engine, cp, 0); uint32_t glyphIdx = FT_Get_Char_Index(engine->fallbackFaces[fontIdx], cp); uint64_t key = ((uint64_t)fontIdx << 32) | glyphIdx;
+                if (engine->atlas.glyphs.count(key) == 0 && !engine->fallbackFaces.empty()) engine->atlas.loadGlyph(engine, fontIdx, glyphIdx);
+                if (engine->atlas.glyphs.count(key) == 0) { tx += engine->charWidth * 0.6f; continue; }
+                GlyphInfo& info = engine->atlas.glyphs[key]; float xpos = tx + info.bearingX * oScale; float ypos = baseY - info.bearingY * oScale; float w = info.width * oScale; float h = info.height * oScale;
+                vertices.push_back({{xpos, ypos}, {info.u0, info.v0}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}}); vertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}});
+                vertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}}); vertices.push_back({{xpos + w, ypos}, {info.u1, info.v0}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}});
+                vertices.push_back({{xpos, ypos + h}, {info.u0, info.v1}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}}); vertices.push_back({{xpos + w, ypos + h}, {info.u1, info.v1}, 0.0f, {1.0f, 1.0f, 1.0f, 1.0f}});
+                tx += info.advance * oScale;
+            }
+        }
+    }
+    size_t lineVertexCount = 0;
+    for (const auto& pl : placed) lineVertexCount += pl.lv->bg.size() + pl.lv->deco.size() + pl.lv->text.size();
+    engine->vertexCount = static_cast<uint32_t>(std::min<size_t>(lineVertexCount + vertices.size(), 1000000));
     if (engine->vertexCount == 0) return;
-    if (engine->vertexCount > 1000000) engine->vertexCount = 1000000;
     void* data; vkMapMemory(engine->device, engine->vertexBufferMemory, 0, sizeof(Vertex) * engine->vertexCount, 0, &data);
-    memcpy(data, vertices.data(), sizeof(Vertex) * engine->vertexCount); vkUnmapMemory(engine->device, engine->vertexBufferMemory);
+    // 行の頂点は、全部の行の背景・下線・文字の順に、行の位置へずらしながら頂点バッファへ直接書く (1 フレームに 1 回だけ写す)
+    Vertex* dst = static_cast<Vertex*>(data); Vertex* dstEnd = dst + engine->vertexCount;
+    auto put = [&](const std::vector<Vertex>& src, float dy) {
+        size_t n = std::min(src.size(), (size_t)(dstEnd - dst));
+        for (size_t k = 0; k < n; ++k) { Vertex v = src[k]; v.pos[0] += originX; v.pos[1] += dy; dst[k] = v; }
+        dst += n;
+    };
+    for (const auto& pl : placed) put(pl.lv->bg, pl.dy);
+    for (const auto& pl : placed) put(pl.lv->deco, pl.dy);
+    for (const auto& pl : placed) put(pl.lv->text, pl.dy);
+    memcpy(dst, vertices.data(), sizeof(Vertex) * std::min(vertices.size(), (size_t)(dstEnd - dst)));
+    vkUnmapMemory(engine->device, engine->vertexBufferMemory);
 }
 void renderFrame(Engine* engine) {
     if (engine->device == VK_NULL_HANDLE || !engine->isWindowReady) return;
@@ -3556,6 +3818,7 @@ void renderFrame(Engine* engine) {
     uint32_t imageIndex;
     VkResult result = vkAcquireNextImageKHR(engine->device, engine->swapchain, UINT64_MAX, engine->imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
     if (result == VK_ERROR_OUT_OF_DATE_KHR) { recreateSwapchain(engine); return; } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) return;
+    engine->profiler.beginFrame();
     vkResetFences(engine->device, 1, &engine->inFlightFence);
     vkResetCommandBuffer(engine->commandBuffers[imageIndex], 0);
     VkCommandBufferBeginInfo beginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
@@ -3563,6 +3826,7 @@ void renderFrame(Engine* engine) {
     {
         std::lock_guard<std::mutex> lock(g_imeMutex);
         updateTextVertices(engine);
+        engine->profiler.push(FrameProfiler::Submit);
         if (engine->atlas.isDirty) {
             vkDeviceWaitIdle(engine->device); uint32_t dy = engine->atlas.dirtyMinY; uint32_t dh = engine->atlas.dirtyMaxY - engine->atlas.dirtyMinY; uint32_t dw = engine->atlas.width;
             if (dh > 0) {
@@ -3626,6 +3890,8 @@ void renderFrame(Engine* engine) {
     VkPresentInfoKHR present = {VK_STRUCTURE_TYPE_PRESENT_INFO_KHR};
     present.waitSemaphoreCount = 1; present.pWaitSemaphores = sigSem; present.swapchainCount = 1; present.pSwapchains = &engine->swapchain; present.pImageIndices = &imageIndex;
     VkResult presentResult = vkQueuePresentKHR(engine->graphicsQueue, &present);
+    engine->profiler.endFrame();
+    noteSlowOp(engine, "frame", engine->profiler.phaseUs[FrameProfiler::Frame] / 1000.0);
     if (presentResult == VK_ERROR_OUT_OF_DATE_KHR) { recreateSwapchain(engine); }
 }
 void checkKeyboardVisibility(Engine* engine) {
@@ -3804,9 +4070,23 @@ void updateTitleBarIfNeeded(Engine* engine) {
         env->DeleteLocalRef(clazz); if (needDetach) vm->DetachCurrentThread();
     }
 }
+// strings.xml の resName の文言をトーストで出す
+void showMessage(Engine* engine, const char* resName) {
+    JNIEnv* env = nullptr; JavaVM* vm = engine->app->activity->vm; bool needDetach = false;
+    if (vm->GetEnv((void**)&env, JNI_VERSION_1_6) == JNI_EDETACHED) { if (vm->AttachCurrentThread(&env, nullptr) != 0) return; needDetach = true; }
+    jclass clazz = env->GetObjectClass(engine->app->activity->clazz); jmethodID mid = env->GetMethodID(clazz, "showMessage", "(Ljava/lang/String;)V");
+    if (mid) { jstring jName = env->NewStringUTF(resName); env->CallVoidMethod(engine->app->activity->clazz, mid, jName); env->DeleteLocalRef(jName); }
+    env->DeleteLocalRef(clazz); if (needDetach) vm->DetachCurrentThread();
+}
 void android_main(struct android_app* app) {
     Engine engine = {}; engine.app = app; app->userData = &engine; app->onAppCmd = onAppCmd; app->onInputEvent = handleInput; g_engine = &engine;
     engine.pt.initEmpty(); rebuildLineStarts(&engine); engine.cursors.push_back({0, 0, 0.0f});
+    // adb shell setprop debug.miu.slow_ms 50 で遅い操作のログ (miu_slow_ops.jsonl) を有効にする
+    char slowMs[PROP_VALUE_MAX] = {};
+    if (__system_property_get("debug.miu.slow_ms", slowMs) > 0 && atof(slowMs) > 0.0 && app->activity->internalDataPath) {
+        std::string slowPath = std::string(app->activity->internalDataPath) + "/miu_slow_ops.jsonl";
+        if (engine.slowLog.start(slowPath, atof(slowMs))) LOGI("slow op log: %s (>= %s ms)", slowPath.c_str(), slowMs);
+    }
     while (true) {
         int events; struct android_poll_source* source; int timeout = engine.isWindowReady ? 0 : -1;
         while (ALooper_pollOnce(timeout, nullptr, &events, (void**)&source) >= 0) { if (source != nullptr) source->process(app, source); if (app->destroyRequested != 0) { cleanupVulkan(&engine); return; } timeout = engine.isWindowReady ? 0 : -1; }
@@ -3837,6 +4117,7 @@ void android_main(struct android_app* app) {
                     else if (ev.type == ImeEvent::Delete) backspaceAtCursors(&engine);
                     else if (ev.type == ImeEvent::DeleteForward) deleteForwardAtCursors(&engine);
                 }
+                pollSearchProgress(&engine);
             }
             renderFrame(&engine);
         }
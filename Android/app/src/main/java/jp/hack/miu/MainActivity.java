@@ -54,6 +54,7 @@ public class MainActivity extends NativeActivity {
     public native void cmdSetSearchOptions(String query, String replace, boolean matchCase, boolean wholeWord, boolean regex);
     public native void cmdFindNext(boolean forward);
     public native void cmdReplaceNext();
+    public native String cmdGetSearchStatus();
     public native void cmdReplaceAll();
     public native void finishComposingTextNative();
     public native void cmdSetDisplayFileName(String name);
@@ -73,12 +74,14 @@ public class MainActivity extends NativeActivity {
     public native void deleteForwardText();
     public native void cmdMoveHomeEnd(boolean isHome, boolean isCtrl, boolean keepAnchor);
     public native void cmdSelectNextOccurrence();
+    public native void cmdSelectAllOccurrences();
     public native void cmdClearSelectionAndMultiCursor();
     public native void cmdPageMove(boolean isUp, boolean keepAnchor);
     public native void cmdIndentLines(boolean isUnindent);
     public native void cmdZoom(int mode);
     public native String cmdGetTextBeforeCursor(int length);
     public native String cmdGetTextAfterCursor(int length);
+    public native void cmdToggleProfiler(boolean export);
     private ImeBridgeView imeView;
     private PopupWindow toolbarPopup;
     private PopupWindow titleOverlayPopup;
@@ -91,6 +94,7 @@ public class MainActivity extends NativeActivity {
     private LinearLayout searchToolbar;
     private LinearLayout replaceToolbar;
     private SearchEditText searchField;
+    private TextView searchStatusLabel;
     private SearchEditText replaceField;
     private boolean searchMatchCase = false;
     private boolean searchWholeWord = false;
@@ -394,6 +398,11 @@ public class MainActivity extends NativeActivity {
             return false;
         });
         searchToolbar.addView(searchField);
+        searchStatusLabel = new TextView(this);
+        searchStatusLabel.setTextColor(sysTextColor);
+        searchStatusLabel.setTextSize(12.0f);
+        searchStatusLabel.setAlpha(0.6f);
+        searchToolbar.addView(searchStatusLabel);
         searchToolbar.addView(createToolbarButton("<", v -> actionFind(false)));
         searchToolbar.addView(createToolbarButton(">", v -> actionFind(true)));
         replaceToolbar = new LinearLayout(this);
@@ -608,18 +617,31 @@ public class MainActivity extends NativeActivity {
         String q = searchField.getText().toString();
         String r = replaceField.getText().toString();
         cmdSetSearchOptions(q, r, searchMatchCase, searchWholeWord, searchRegex);
+        updateSearchStatus();
+    }
+    // 一致の件数と、選択中の一致が何番目かを検索ツールバーに表示する。別のスレッドで数えている途中 ("N…") なら少し後に読み直す
+    private final Runnable searchStatusPoll = this::updateSearchStatus;
+    private void updateSearchStatus() {
+        if (searchStatusLabel == null) return;
+        String s = cmdGetSearchStatus();
+        searchStatusLabel.setText(s);
+        mainHandler.removeCallbacks(searchStatusPoll);
+        if (s.endsWith("…") && searchToolbar.getVisibility() == View.VISIBLE) mainHandler.postDelayed(searchStatusPoll, 100);
     }
     private void actionFind(boolean forward) {
         updateSearchOptionsToCpp();
         cmdFindNext(forward);
+        updateSearchStatus();
     }
     private void actionReplaceNext() {
         updateSearchOptionsToCpp();
         cmdReplaceNext();
+        updateSearchStatus();
     }
     private void actionReplaceAll() {
         updateSearchOptionsToCpp();
         cmdReplaceAll();
+        updateSearchStatus();
     }
     private void actionCut() {
         String text = cmdCut();
@@ -872,6 +894,7 @@ public class MainActivity extends NativeActivity {
                 if (keyCode == KeyEvent.KEYCODE_F1) { MainActivity.this.showHelpUI(); return true; }
                 boolean isShift = event.isShiftPressed();
                 boolean isCtrl = event.isCtrlPressed() || event.isMetaPressed();
+                if (keyCode == KeyEvent.KEYCODE_F12) { cmdToggleProfiler(isShift); return true; }
                 if (keyCode == KeyEvent.KEYCODE_ESCAPE) {
                     if (searchToolbar != null && searchToolbar.getVisibility() == View.VISIBLE) resetToolbarToMain();
                     else cmdClearSelectionAndMultiCursor();
@@ -890,6 +913,7 @@ public class MainActivity extends NativeActivity {
                 if (keyCode == KeyEvent.KEYCODE_MOVE_END) { cmdMoveHomeEnd(false, isCtrl, isShift); return true; }
                 if (isShift && keyCode == KeyEvent.KEYCODE_INSERT) { actionPaste(); return true; }
                 if (isCtrl) {
+                    if (isShift && keyCode == KeyEvent.KEYCODE_L) { cmdSelectAllOccurrences(); return true; }
                     if (keyCode == KeyEvent.KEYCODE_D) { cmdSelectNextOccurrence(); return true; }
                     if (keyCode == KeyEvent.KEYCODE_F) { openSearchUI(false); return true; }
                     if (keyCode == KeyEvent.KEYCODE_H || keyCode == KeyEvent.KEYCODE_R) { openSearchUI(true); return true; }
@@ -977,6 +1001,7 @@ public class MainActivity extends NativeActivity {
                 if (keyCode == KeyEvent.KEYCODE_F1) { MainActivity.this.showHelpUI(); return true; }
                 boolean isCtrl = event.isCtrlPressed() || event.isMetaPressed();
                 boolean isShift = event.isShiftPressed();
+                if (keyCode == KeyEvent.KEYCODE_F12) { MainActivity.this.cmdToggleProfiler(isShift); return true; }
                 if (keyCode == KeyEvent.KEYCODE_MOVE_HOME) { MainActivity.this.cmdMoveHomeEnd(true, isCtrl, isShift); return true; }
                 if (keyCode == KeyEvent.KEYCODE_MOVE_END) { MainActivity.this.cmdMoveHomeEnd(false, isCtrl, isShift); return true; }
                 if (keyCode == KeyEvent.KEYCODE_PAGE_UP) { MainActivity.this.cmdPageMove(true, isShift); return true; }
@@ -988,6 +1013,7 @@ public class MainActivity extends NativeActivity {
                 }
                 if (isShift && keyCode == KeyEvent.KEYCODE_INSERT) { MainActivity.this.actionPaste(); return true; }
                 if (isCtrl) {
+                    if (isShift && keyCode == KeyEvent.KEYCODE_L) { MainActivity.this.cmdSelectAllOccurrences(); return true; }
                     if (keyCode == KeyEvent.KEYCODE_D) { MainActivity.this.cmdSelectNextOccurrence(); return true; }
                     if (keyCode == KeyEvent.KEYCODE_F) { MainActivity.this.openSearchUI(false); return true; }
                     if (keyCode == KeyEvent.KEYCODE_H || keyCode == KeyEvent.KEYCODE_R) { MainActivity.this.openSearchUI(true); return true; }
@@ -1138,6 +1164,9 @@ public class MainActivity extends NativeActivity {
             if (overlayTitleView != null) overlayTitleView.setText(title);
         });
     }
+    public void showMessage(String resName) {
+        runOnUiThread(() -> Toast.makeText(this, getStringResourceByName(resName), Toast.LENGTH_SHORT).show());
+    }
     @Override
     protected void onDestroy() {
         if (titleOverlayPopup != null && titleOverlayPopup.isShowing()) {
@@ -0,0 +1,490 @@
+#include "EditorCore.h"
+#include "miu/linechunks.h"
+#include "miu/linevertices.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+using Clock = std::chrono::steady_clock;
+struct Rng {
+    uint64_t s;
+    explicit Rng(uint64_t seed) : s(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+    uint64_t next() { s ^= s << 13; s ^= s >> 7; s ^= s << 17; return s; }
+    size_t below(size_t n) { return n ? (size_t)(next() % n) : 0; }
+};
+struct BenchOptions {
+    std::vector<size_t> sizes;
+    std::string filter;
+    uint64_t seed = 1;
+    double minSeconds = 0.2;
+    double maxMemoryRatio = 0.0;
+};
+struct BenchResult {
+    std::string bench;
+    size_t size = 0;
+    size_t ops = 0;
+    double seconds = 0.0;
+    double bytesPerOp = 0.0;
+    size_t pieces = 0;
+    size_t lines = 0;
+    int64_t cacheHits = -1, cacheMisses = -1; // キャッシュを使う処理だけ (負なら出さない)
+    int64_t fastPath = -1;                    // レイアウトを使わずに済んだ回数 (負なら出さない)
+    const char* note = nullptr;               // 数字の読み方の注意 (あれば出す)
+};
+static const BenchOptions* gOpts = nullptr;
+static double secondsSince(Clock::time_point t0) { return std::chrono::duration<double>(Clock::now() - t0).count(); }
+static bool selected(const std::string& name) { return gOpts->filter.empty() || name.find(gOpts->filter) != std::string::npos; }
+static void report(const BenchResult& r) {
+    double nsPerOp = r.ops ? r.seconds * 1e9 / (double)r.ops : 0.0;
+    double mbps = (r.bytesPerOp > 0.0 && r.seconds > 0.0) ? r.bytesPerOp * (double)r.ops / r.seconds / (1024.0 * 1024.0) : 0.0;
+    char cache[64] = "", fast[32] = "";
+    if (r.cacheHits >= 0) snprintf(cache, sizeof(cache), ",\"cache_hits\":%lld,\"cache_misses\":%lld", (long long)r.cacheHits, (long long)r.cacheMisses);
+    if (r.fastPath >= 0) snprintf(fast, sizeof(fast), ",\"fast_path\":%lld", (long long)r.fastPath);
+    std::string note = r.note ? ",\"note\":\"" + EditTrace::escape(r.note) + "\"" : std::string();
+    printf("{\"bench\":\"%s\",\"size\":%zu,\"ops\":%zu,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f,\"pieces\":%zu,\"lines\":%zu%s%s%s}\n",
+           r.bench.c_str(), r.size, r.ops, r.seconds, nsPerOp, mbps, r.pieces, r.lines, cache, fast, note.c_str());
+    fflush(stdout);
+    fprintf(stderr, "  %-36s %12.1f ns/op %10.2f MB/s\n", r.bench.c_str(), nsPerOp, mbps);
+    if (r.note) fprintf(stderr, "    (%s)\n", r.note);
+}
+// 英単語・識別子・日本語を混ぜた行で疑似ソース/ログを作る。
+// 1000 行ごとに "marker"、末尾 1 割の位置に "needle_31337" を 1 つだけ置く。
+static std::string makeCorpus(size_t size, uint64_t seed) {
+    static const char* words[] = { "the", "editor", "piece", "table", "lorem", "ipsum", "return", "size_t", "int", "const",
+        "if", "else", "for", "while", "std::string", "buffer", "cursor", "line", "0x7f", "42", "render", "frame", "ERROR", "INFO",
+        "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E", "\xE3\x83\x86\xE3\x82\xAD\xE3\x82\xB9\xE3\x83\x88" };
+    const size_t nWords = sizeof(words) / sizeof(words[0]);
+    Rng rng(seed);
+    std::string s; s.reserve(size + 128);
+    size_t lineNo = 0, needleAt = size / 10 * 9; bool needlePlaced = false;
+    while (s.size() < size) {
+        size_t indent = rng.below(4);
+        for (size_t i = 0; i < indent; ++i) s += '\t';
+        size_t nw = 3 + rng.below(12);
+        for (size_t i = 0; i < nw; ++i) { if (i) s += ' '; s += words[rng.below(nWords)]; }
+        if (lineNo % 1000 == 999) s += " marker";
+        if (!needlePlaced && s.size() >= needleAt) { s += " needle_31337"; needlePlaced = true; }
+        s += '\n'; lineNo++;
+    }
+    s.resize(size);
+    return s;
+}
+static void resetEditor(Editor& ed, const std::string& corpus) {
+    ed.pt.initFromFile(corpus.data(), corpus.size());
+    ed.undo.clear();
+    ed.cursors.clear(); ed.cursors.push_back({ 0, 0, 0.0f, 0.0f, false });
+    ed.rebuildLineStarts();
+}
+static void fragment(PieceTable& pt, Rng& rng, size_t edits) {
+    for (size_t i = 0; i < edits; ++i) pt.insert(rng.below(pt.length()), "xyz");
+}
+static void benchPieceTable(const std::string& corpus) {
+    const size_t n = corpus.size();
+    Rng rng(gOpts->seed);
+    if (selected("piecetable.insert")) {
+        PieceTable pt; pt.initFromFile(corpus.data(), n);
+        const size_t ops = 20000;
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) pt.insert(rng.below(pt.length()), "abc");
+        report({ "piecetable.insert", n, ops, secondsSince(t0), 0.0, pt.pieces.size(), 0 });
+    }
+    if (selected("piecetable.erase")) {
+        PieceTable pt; pt.initFromFile(corpus.data(), n);
+        const size_t ops = 20000;
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < ops && pt.length() > 3; ++i) pt.erase(rng.below(pt.length() - 3), 3);
+        report({ "piecetable.erase", n, ops, secondsSince(t0), 0.0, pt.pieces.size(), 0 });
+    }
+    PieceTable frag; frag.initFromFile(corpus.data(), n); fragment(frag, rng, 1000);
+    const size_t fragLen = frag.length();
+    if (selected("piecetable.charAt")) {
+        const size_t ops = 200000; volatile char sink = 0;
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) sink = sink + frag.charAt(rng.below(fragLen));
+        report({ "piecetable.charAt", n, ops, secondsSince(t0), 0.0, frag.pieces.size(), 0 });
+    }
+    if (selected("piecetable.getRange")) {
+        const size_t ops = 20000, span = 4096; size_t total = 0;
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) total += frag.getRange(rng.below(fragLen > span ? fragLen - span : 1), span).size();
+        report({ "piecetable.getRange", n, ops, secondsSince(t0), (double)total / (double)ops, frag.pieces.size(), 0 });
+    }
+    if (selected("piecetable.getRange.full")) {
+        auto t0 = Clock::now();
+        std::string all = frag.getRange(0, fragLen);
+        report({ "piecetable.getRange.full", n, 1, secondsSince(t0), (double)all.size(), frag.pieces.size(), 0 });
+    }
+}
+static void benchFind(Editor& ed, const std::string& corpus) {
+    const size_t n = corpus.size();
+    struct FindCase { const char* name; const char* query; bool forward, matchCase, isRegex; };
+    static const FindCase cases[] = {
+        { "editor.findText.literal", "needle_31337", true, true, false },
+        { "editor.findText.literal.icase", "NEEDLE_31337", true, false, false },
+        { "editor.findText.literal.icase.cyrillic", "\xD0\x98\xD0\x93\xD0\x9B\xD0\x90_31337", true, false, false }, // "ИГЛА_31337" (一致なし、全体を走査)
+        { "editor.findText.literal.icase.kelvin", "SKIP_31337", true, false, false }, // S と K は長い s・ケルビン記号にも一致する (一致なし)
+        { "editor.findText.literal.backward", "needle_31337", false, true, false },
+        { "editor.findText.regex", "needle_[0-9]+", true, true, true },
+        { "editor.findText.regex.icase", "NEEDLE_[0-9]+", true, false, true },
+        { "editor.findText.regex.backward", "needle_[0-9]+", false, true, true },
+        { "editor.findText.regex.backward.near", "mark(er)", false, true, true }, // 直前の一致は末尾から 1000 行以内
+        { "editor.findText.regex.nested", "(\\w+ ?)*needle_\\d+", true, true, true },
+    };
+    resetEditor(ed, corpus);
+    for (const auto& fc : cases) {
+        if (!selected(fc.name)) continue;
+        size_t start = fc.forward ? 0 : n, ops = 0, matchLen = 0, found = std::string::npos;
+        auto t0 = Clock::now();
+        do { found = ed.findText(start, fc.query, fc.forward, fc.matchCase, false, fc.isRegex, &matchLen); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+        double scanned = (double)n;
+        if (found != std::string::npos) scanned = fc.forward ? (double)(found + matchLen - start) : (double)(start - found);
+        else fprintf(stderr, "  %s: no match\n", fc.name);
+        report({ fc.name, n, ops, secondsSince(t0), scanned, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+    // 全件の列挙 (置換や件数表示で使う)。文書を区間に分けて並列に探す
+    struct FindAllCase { const char* name; const char* query; bool matchCase, isRegex; };
+    static const FindAllCase allCases[] = {
+        { "editor.findAll.literal", "marker", true, false },
+        { "editor.findAll.literal.icase", "MARKER", false, false },
+        { "editor.findAll.regex", "mark(er)", true, true },
+    };
+    for (const auto& fc : allCases) {
+        if (!selected(fc.name)) continue;
+        size_t ops = 0, hits = 0;
+        auto t0 = Clock::now();
+        do { hits = ed.findAll(fc.query, fc.matchCase, false, fc.isRegex).size(); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+        if (hits == 0) fprintf(stderr, "  %s: no match\n", fc.name);
+        report({ fc.name, n, ops, secondsSince(t0), (double)n, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+    // 1 文字入力するたびに一致の索引を最新の版に追いつかせる (入力中のハイライトと件数表示)。編集の周りのチャンクだけを探し直す
+    static const FindAllCase indexCases[] = {
+        { "editor.matchIndex.edit.literal", "marker", true, false },
+        { "editor.matchIndex.edit.regex", "mark(er)", true, true },
+    };
+    for (const auto& fc : indexCases) {
+        if (!selected(fc.name)) continue;
+        resetEditor(ed, corpus);
+        miu::MatchIndex idx; Rng rng(7);
+        if (!ed.matchIndex(idx, fc.query, fc.matchCase, false, fc.isRegex)) { fprintf(stderr, "  %s: index unavailable\n", fc.name); continue; }
+        size_t ops = 0;
+        auto t0 = Clock::now();
+        do { ed.pt.insert(ed.alignToCharStart(rng.below(ed.pt.length())), "x"); ed.matchIndex(idx, fc.query, fc.matchCase, false, fc.isRegex); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 100000);
+        report({ fc.name, n, ops, secondsSince(t0), (double)n, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+    // 検索語を 1 文字打つたびに UI のスレッドが止まる時間 (探すのは別のスレッド。前の検索を取り消して件数の途中経過を読む)
+    if (selected("editor.searchQueryChanged.regex")) {
+        resetEditor(ed, corpus);
+        static const char* typed[] = { "m", "ma", "mar", "mark", "mark(", "mark(e", "mark(er", "mark(er)" };
+        ed.searchRegex = true; ed.searchMatchCase = true; ed.searchWholeWord = false;
+        size_t ops = 0, current = 0, total = 0; bool partial = false;
+        auto t0 = Clock::now();
+        do { ed.searchQuery = typed[ops % 8]; ed.searchQueryChanged(); ed.searchMatchStatus(current, total, &partial); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 100000);
+        report({ "editor.searchQueryChanged.regex", n, ops, secondsSince(t0), (double)n, ed.pt.pieces.size(), ed.lineStarts.size() });
+        ed.searchBuilder.stop(); ed.searchQuery.clear(); ed.searchRegex = false;
+    }
+    // カーソルのある語の自動ハイライト。idle は同じ画面の描画を繰り返し、scroll は 1 行ずつ下へスクロールする (60 行の画面)
+    for (const char* name : { "editor.autoHighlight.idle", "editor.autoHighlight.scroll" }) {
+        if (!selected(name)) continue;
+        resetEditor(ed, corpus);
+        size_t at = ed.findText(0, "marker", true, true, false, false);
+        if (at == std::string::npos) { fprintf(stderr, "  %s: no match\n", name); continue; }
+        ed.cursors.assign(1, { at + 1, at + 1, 0.0f, 0.0f, false });
+        bool scroll = std::string(name).find("scroll") != std::string::npos;
+        int lines = (int)ed.lineStarts.size(), top = ed.getLineIdx(at);
+        size_t ops = 0, spans = 0;
+        auto t0 = Clock::now();
+        do { int first = scroll ? (top + (int)ops) % std::max(1, lines - 60) : top; spans += ed.updateAutoHighlight(first, std::min(lines, first + 60)).spans.size(); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 1000000);
+        if (spans == 0) fprintf(stderr, "  %s: nothing highlighted\n", name);
+        report({ name, n, ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+    // カーソルを上下に動かす (行の x 座標と位置の変換)。行のレイアウトは 60 行の範囲を行き来するので、2 回目からはキャッシュに当たる。
+    // ascii は等幅フォントとして、ASCII だけの行をレイアウトせずに計算する。どちらも日本語を 'x' に置き換えた ASCII だけの文書で比べ、
+    // fast_path にレイアウトを使わずに済んだ回数を出す。CoreText のない環境ではレイアウトが空なので、比べる相手にならない
+    std::string asciiCorpus = corpus;
+    for (char& c : asciiCorpus) if ((unsigned char)c >= 0x80) c = 'x';
+    for (const char* name : { "editor.layout.cursorMove", "editor.layout.cursorMove.ascii" }) {
+        if (!selected(name)) continue;
+        resetEditor(ed, asciiCorpus);
+        ed.layoutCache.clear(); ed.layoutCache.resetStats();
+        bool savedMono = ed.monospaceFont; ed.monospaceFont = std::string(name).find("ascii") != std::string::npos;
+        int lines = (int)ed.lineStarts.size(), base = lines / 2;
+        size_t ops = 0;
+        auto t0 = Clock::now();
+        do { int li = base + (int)(ops % 120 < 60 ? ops % 60 : 120 - ops % 120); float x = ed.getXFromPos(ed.lineStarts[li] + 3); ed.getPosFromLineAndX(li + 1, x); ops++; }
+        while (secondsSince(t0) < gOpts->minSeconds && ops < 10000000);
+        BenchResult r{ name, n, ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() };
+        r.cacheHits = (int64_t)ed.layoutCache.stats().hits; r.cacheMisses = (int64_t)ed.layoutCache.stats().misses;
+        r.fastPath = (int64_t)(2 * ops) - r.cacheHits - r.cacheMisses; // 1 回に getXFromPos と getPosFromLineAndX で 2 回引く
+#if !defined(__APPLE__)
+        r.note = "no CoreText: layoutFor is a no-op here, so the layout case is not a baseline for the ascii case";
+#endif
+        report(r);
+        ed.monospaceFont = savedMono;
+    }
+    // 選択した語の一致をすべてカーソルにする (x 座標は描画するカーソルの分だけあとで求める)
+    if (selected("editor.selectAllOccurrences")) {
+        resetEditor(ed, corpus);
+        size_t at = ed.findText(0, "marker", true, true, false, false), ops = 0;
+        if (at == std::string::npos) fprintf(stderr, "  editor.selectAllOccurrences: no match\n");
+        else {
+            auto t0 = Clock::now();
+            do { ed.cursors.assign(1, { at + 6, at, 0.0f, 0.0f, false }); ed.selectAllOccurrences(); ops++; }
+            while (secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+            report({ "editor.selectAllOccurrences", n, ops, secondsSince(t0), (double)n, ed.pt.pieces.size(), ed.lineStarts.size() });
+        }
+    }
+    resetEditor(ed, corpus);
+}
+static void benchReplaceAndUndo(Editor& ed, const std::string& corpus) {
+    const size_t n = corpus.size();
+    struct ReplaceCase { const char* name; const char* query; const char* replace; bool isRegex; };
+    static const ReplaceCase cases[] = {
+        { "editor.replaceAll.literal", "marker", "MARKER", false },
+        { "editor.replaceAll.regex", "mark(er)", "MARK$1", true },
+    };
+    for (const auto& rc : cases) {
+        std::string base = rc.name;
+        bool wantReplace = selected(base), wantUndo = selected(base + ".undo"), wantRedo = selected(base + ".redo");
+        if (!wantReplace && !wantUndo && !wantRedo) continue;
+        resetEditor(ed, corpus);
+        ed.searchQuery = rc.query; ed.replaceQuery = rc.replace; ed.searchRegex = rc.isRegex; ed.searchMatchCase = true; ed.searchWholeWord = false;
+        size_t matches = ed.findAll(rc.query, true, false, rc.isRegex).size();
+        auto t0 = Clock::now();
+        ed.replaceAll();
+        double replaceSec = secondsSince(t0);
+        if (wantReplace) report({ base, n, 1, replaceSec, (double)n, ed.pt.pieces.size(), ed.lineStarts.size() });
+        t0 = Clock::now(); ed.performUndo(); double undoSec = secondsSince(t0);
+        if (wantUndo) report({ base + ".undo", n, std::max<size_t>(matches, 1), undoSec, 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+        t0 = Clock::now(); ed.performRedo(); double redoSec = secondsSince(t0);
+        if (wantRedo) report({ base + ".redo", n, std::max<size_t>(matches, 1), redoSec, 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+    if (selected("editor.typing")) {
+        resetEditor(ed, corpus);
+        Rng rng(gOpts->seed);
+        const size_t ops = 20;
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) {
+            size_t p = rng.below(ed.pt.length());
+            ed.cursors.clear(); ed.cursors.push_back({ p, p, 0.0f, 0.0f, false });
+            ed.insertAtCursors("x");
+        }
+        report({ "editor.typing", n, ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+        t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) ed.performUndo();
+        report({ "editor.typing.undo", n, ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+        t0 = Clock::now();
+        for (size_t i = 0; i < ops; ++i) ed.performRedo();
+        report({ "editor.typing.redo", n, ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() });
+    }
+}
+static void benchLineStarts(Editor& ed, const std::string& corpus) {
+    if (!selected("editor.rebuildLineStarts")) return;
+    resetEditor(ed, corpus);
+    Rng rng(gOpts->seed); fragment(ed.pt, rng, 1000);
+    size_t ops = 0;
+    auto t0 = Clock::now();
+    do { ed.rebuildLineStarts(); ops++; } while (secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+    report({ "editor.rebuildLineStarts", corpus.size(), ops, secondsSince(t0), (double)ed.pt.length(), ed.pt.pieces.size(), ed.lineStarts.size() });
+}
+// 行ごとの頂点の保持。頂点は Android の描画と同じ miu::buildLineVertices で行の原点からの座標で作り、行の位置へずらして並べる。
+// 整形とフォントの読み込みは測らない (1 バイト 1 字形として 1 度だけ作り、字形の位置は固定の表から引く)。選択は見えている範囲の中ほどの 10 行。
+// cold は毎フレーム全部の行を作り直す (保持しない場合)、scroll は 1 フレームに 1 行ずつ動かす、idle は何も変わらないフレームで、頂点は作らない
+static void benchLineChunks(Editor& ed, const std::string& corpus) {
+    const int kVisible = 60; const float lh = 20.0f;
+    miu::GlyphInfo atlas[256];
+    for (int b = 0; b < 256; ++b) atlas[b] = { b / 256.0f, 0.0f, (b + 1) / 256.0f, 1.0f / 16.0f, 28.0f, 40.0f, 2.0f, 36.0f, 29.0f, false };
+    miu::LineVertexStyle st = { 16.0f / 48.0f, lh, 8.0f, 0.5f / 4096.0f, 0.5f / 4096.0f, { 0.1f, 0.1f, 0.1f, 1.0f }, { 0.7f, 0.8f, 1.0f, 0.5f }, { 0.85f, 0.85f, 0.85f, 0.5f } };
+    for (const char* name : { "render.lineChunks.cold", "render.lineChunks.scroll", "render.lineChunks.idle" }) {
+        if (!selected(name)) continue;
+        resetEditor(ed, corpus);
+        std::string mode = std::string(name).substr(strlen("render.lineChunks."));
+        int lines = (int)ed.lineStarts.size(), span = std::max(1, lines - kVisible);
+        std::unordered_map<int, std::vector<miu::ShapedGlyph>> shaped;
+        // frame は頂点バッファの代わり (Android と同じく、見えている行を覚えておき、最後に行の位置へずらしながら 1 回だけ書く)
+        miu::LineChunkCache<miu::LineVertices> chunks; std::vector<miu::Vertex> frame(1000000); std::vector<std::pair<const miu::LineVertices*, float>> placed; uint64_t lastKey = 0;
+        size_t ops = 0;
+        auto t0 = Clock::now();
+        do {
+            int first = mode == "scroll" ? (int)(ops % span) : span / 2, end = std::min(lines, first + kVisible);
+            uint64_t key = miu::Hasher().add(first).add(ed.pt.length()).value();
+            ops++;
+            if (mode == "idle" && key == lastKey) continue;
+            lastKey = key;
+            if (mode == "cold") chunks.clear();
+            size_t selFrom = ed.lineStarts[std::min(lines - 1, first + 25)], selTo = ed.lineStarts[std::min(lines - 1, first + 35)] + 3;
+            miu::LineStyleRanges ranges; ranges.sel.assign({ { selFrom, selTo } });
+            chunks.retain(first, end); placed.clear();
+            for (int li = first; li < end; ++li) {
+                size_t ls = ed.lineStarts[li], le = li + 1 < lines ? ed.lineStarts[li + 1] : ed.pt.length();
+                uint64_t sig = miu::Hasher().add(ls).add(le).add(std::min(std::max(selFrom, ls), le)).add(std::min(std::max(selTo, ls), le)).value();
+                const miu::LineVertices& lv = chunks.get(li, sig, [&](miu::LineVertices& out) {
+                    auto& glyphs = shaped[li];
+                    if (glyphs.empty()) for (size_t p = ls; p < le && corpus[p] != '\n'; ++p) glyphs.push_back({ 0, (unsigned char)corpus[p], 29.0f, 0.0f, 0.0f, 0.0f, p, false });
+                    miu::LineEnding ending; if (le > ls && corpus[le - 1] == '\n') ending = { true, le - 1, &atlas['\n'] };
+                    miu::buildLineVertices(glyphs, ls, le, ending, ranges, st, [&](int, uint32_t g) { return &atlas[g & 0xFF]; }, out);
+                });
+                placed.push_back({ &lv, (li - first + 1) * lh });
+            }
+            miu::Vertex* dst = frame.data(); miu::Vertex* dstEnd = dst + frame.size();
+            for (auto part : { &miu::LineVertices::bg, &miu::LineVertices::deco, &miu::LineVertices::text })
+                for (const auto& pl : placed) {
+                    const std::vector<miu::Vertex>& src = pl.first->*part; size_t n = std::min(src.size(), (size_t)(dstEnd - dst));
+                    for (size_t k = 0; k < n; ++k) { miu::Vertex v = src[k]; v.pos[0] += 40.0f; v.pos[1] += pl.second; dst[k] = v; }
+                    dst += n;
+                }
+        } while (secondsSince(t0) < gOpts->minSeconds && ops < 1000000);
+        BenchResult r{ name, corpus.size(), ops, secondsSince(t0), 0.0, ed.pt.pieces.size(), ed.lineStarts.size() };
+        r.cacheHits = (int64_t)chunks.stats().reused; r.cacheMisses = (int64_t)chunks.stats().built;
+        report(r);
+    }
+}
+// フォルダ内検索: 文書を 64 個のファイルに分けて一時フォルダに書き、全体を探す (ファイルはページキャッシュに載った状態)
+static void benchFindInFiles(Editor& ed, const std::string& corpus) {
+    struct FolderCase { const char* name; const char* query; bool isRegex; };
+    static const FolderCase cases[] = {
+        { "folder.find.literal", "needle_31337", false },
+        { "folder.find.regex", "needle_[0-9]+", true },
+    };
+    bool any = false; for (const auto& fc : cases) any = any || selected(fc.name);
+    if (!any) return;
+    namespace fs = std::filesystem;
+    std::error_code ec; fs::path dir = fs::temp_directory_path(ec) / ("miu_bench_" + std::to_string(corpus.size()));
+    fs::remove_all(dir, ec); fs::create_directories(dir / "sub", ec);
+    const size_t files = 64, per = (corpus.size() + files - 1) / files;
+    for (size_t i = 0; i < files; ++i) {
+        std::ofstream f(dir / (i % 2 ? "sub" : "") / ("file" + std::to_string(i) + ".txt"), std::ios::binary);
+        if (i * per < corpus.size()) f.write(corpus.data() + i * per, (std::streamsize)std::min(per, corpus.size() - i * per));
+    }
+    for (const auto& fc : cases) {
+        if (!selected(fc.name)) continue;
+        ed.searchQuery = fc.query; ed.searchRegex = fc.isRegex; ed.searchMatchCase = true; ed.searchWholeWord = false;
+        size_t ops = 0, matches = 0;
+        auto t0 = Clock::now();
+        do {
+            ed.startFolderSearch(fs::path(dir).string());
+            while (ed.folderSearch.busy()) std::this_thread::sleep_for(std::chrono::microseconds(200));
+            ed.applyFolderSearchProgress(); matches = ed.folderMatches.size(); ops++;
+        } while (secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+        if (matches == 0) fprintf(stderr, "  %s: no match\n", fc.name);
+        report({ fc.name, corpus.size(), ops, secondsSince(t0), (double)ed.folderSearch.progress().bytes, 0, 0 });
+    }
+    fs::remove_all(dir, ec);
+}
+static void benchEncoding(const std::string& corpus) {
+    const size_t n = corpus.size();
+    std::string latin1 = corpus.substr(0, std::min(n, (size_t)(1 << 20)));
+    Rng rng(gOpts->seed);
+    for (auto& c : latin1) if ((unsigned char)c >= 0x80 || rng.below(32) == 0) c = (char)(0xC0 + rng.below(0x3F));
+    struct EncCase { const char* name; const char* buf; size_t len; };
+    const EncCase cases[] = {
+        { "encoding.DetectEncodingEx.utf8", corpus.data(), n },
+        { "encoding.DetectEncodingEx.latin1", latin1.data(), latin1.size() },
+    };
+    for (const auto& ec : cases) {
+        if (!selected(ec.name)) continue;
+        size_t ops = 0; volatile int sink = 0;
+        auto t0 = Clock::now();
+        do { sink = sink + (int)DetectEncodingEx(ec.buf, ec.len).type; ops++; } while (secondsSince(t0) < gOpts->minSeconds && ops < 100000);
+        report({ ec.name, n, ops, secondsSince(t0), 0.0, 0, 0 });
+    }
+}
+// 優先度の高い枝が文末まで生き残る式 (a*b|a など) で、一致を全部列挙する手間が文書の長さに比例するかを確かめる。
+// 'a' だけの行を長さ n/8 と n で列挙し、どちらも n に比例する VM のステップ数の予算に収まらなければ失敗扱い
+static bool benchRegexEnumerate(const std::string& corpus) {
+    struct EnumerateCase { const char* name; const char* pattern; };
+    static const EnumerateCase cases[] = {
+        { "regex.enumerate.linear.star", "a*b|a" },
+        { "regex.enumerate.linear.group", "(a|b)*c|a" },
+        { "regex.enumerate.linear.word", "\\w*x|\\w" },
+        { "regex.enumerate.linear.class", "[a-z]+\\d|a" },
+    };
+    static constexpr size_t kStepsPerByte = 64;
+    const size_t n = std::min(corpus.size(), (size_t)1 << 17);
+    bool ok = true;
+    for (const auto& ec : cases) {
+        if (!selected(ec.name) || n < 8) continue;
+        miu::Regex re(ec.pattern);
+        for (size_t len : { n / 8, n }) {
+            std::string text(len, 'a'); size_t matches = 0, ops = 0; miu::Regex::Status st;
+            miu::RegexSearchOptions opt; opt.budget = kStepsPerByte * len;
+            auto t0 = Clock::now();
+            do { matches = 0; st = re.forEach(text.data(), len, 0, [&](const miu::RegexMatch&) { matches++; return true; }, opt); ops++; }
+            while (st == miu::Regex::Found && secondsSince(t0) < gOpts->minSeconds && ops < 1000);
+            report({ ec.name, len, ops, secondsSince(t0), (double)len, 0, 0 });
+            if (st != miu::Regex::Found || matches != len) { fprintf(stderr, "regex enumerate regression: %s over %zu bytes did not finish in %zu steps/byte (%zu matches)\n", ec.pattern, len, kStepsPerByte, matches); ok = false; }
+        }
+    }
+    return ok;
+}
+// 編集後のメモリ内訳を出力する。--max-memory-ratio 指定時はコーパスサイズ比で超過したら失敗扱い
+static bool benchMemory(Editor& ed, const std::string& corpus) {
+    if (!selected("memory.after_edits")) return true;
+    resetEditor(ed, corpus);
+    Rng rng(gOpts->seed); fragment(ed.pt, rng, 1000);
+    ed.searchQuery = "marker"; ed.replaceQuery = "MARKER"; ed.searchMatchCase = true; ed.searchWholeWord = false; ed.searchRegex = false;
+    ed.replaceAll();
+    for (size_t i = 0; i < 100; ++i) { size_t p = rng.below(ed.pt.length()); ed.cursors.clear(); ed.cursors.push_back({ p, p, 0.0f, 0.0f, false }); ed.insertAtCursors("x"); }
+    MemoryStats m = ed.memoryStats();
+    double ratio = corpus.empty() ? 0.0 : (double)m.total() / (double)corpus.size();
+    printf("{\"bench\":\"memory.after_edits\",\"size\":%zu,\"ratio\":%.3f,\"memory\":%s}\n", corpus.size(), ratio, m.toJson().c_str());
+    fflush(stdout);
+    fprintf(stderr, "  %-36s %12.2f MB %10.3f x corpus\n", "memory.after_edits", m.total() / (1024.0 * 1024.0), ratio);
+    if (gOpts->maxMemoryRatio > 0.0 && ratio > gOpts->maxMemoryRatio) { fprintf(stderr, "memory regression: %.3f > %.3f\n", ratio, gOpts->maxMemoryRatio); return false; }
+    return true;
+}
+static size_t parseSize(const std::string& s) {
+    char* end = nullptr; double v = strtod(s.c_str(), &end);
+    switch (end && *end ? toupper((unsigned char)*end) : 0) {
+        case 'K': v *= 1024.0; break;
+        case 'M': v *= 1024.0 * 1024.0; break;
+        case 'G': v *= 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+    return (size_t)v;
+}
+static void usage() {
+    fprintf(stderr, "usage: miu_bench [--sizes 1M,16M,64M] [--filter name] [--seed N] [--min-seconds S] [--max-memory-ratio R]\n"
+                    "  results are written to stdout as one JSON object per line\n"
+                    "  --max-memory-ratio fails (exit 1) when memory.after_edits exceeds R x corpus size\n"
+                    "  regex.enumerate.linear fails (exit 1) when enumerating matches is not linear in the text length\n");
+}
+int main(int argc, char** argv) {
+    BenchOptions opts;
+    std::string sizes = "1M,16M,64M";
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string { if (i + 1 >= argc) { usage(); exit(2); } return argv[++i]; };
+        if (a == "--sizes") sizes = value();
+        else if (a == "--filter") opts.filter = value();
+        else if (a == "--seed") opts.seed = strtoull(value().c_str(), nullptr, 10);
+        else if (a == "--min-seconds") opts.minSeconds = atof(value().c_str());
+        else if (a == "--max-memory-ratio") opts.maxMemoryRatio = atof(value().c_str());
+        else { usage(); return a == "--help" ? 0 : 2; }
+    }
+    std::stringstream ss(sizes); std::string tok;
+    while (std::getline(ss, tok, ',')) if (!tok.empty()) opts.sizes.push_back(parseSize(tok));
+    gOpts = &opts;
+    printf("{\"suite\":\"miu_bench\",\"schema\":1,\"seed\":%llu,\"compiler\":\"%s\"}\n", (unsigned long long)opts.seed, __VERSION__);
+    bool ok = true;
+    for (size_t size : opts.sizes) {
+        fprintf(stderr, "corpus %zu bytes\n", size);
+        std::string corpus = makeCorpus(size, opts.seed);
+        Editor ed;
+        benchPieceTable(corpus);
+        benchFind(ed, corpus);
+        benchReplaceAndUndo(ed, corpus);
+        benchLineStarts(ed, corpus);
+        benchLineChunks(ed, corpus);
+        benchFindInFiles(ed, corpus);
+        benchEncoding(corpus);
+        ok = benchRegexEnumerate(corpus) && ok;
+        ok = benchMemory(ed, corpus) && ok;
+    }
+    return ok ? 0 : 1;
+}
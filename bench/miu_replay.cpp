@@ -0,0 +1,108 @@
+#include "EditorCore.h"
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+using Clock = std::chrono::steady_clock;
+struct CommandStats { std::vector<double> us; };
+static void usage() {
+    fprintf(stderr, "usage: miu_replay <trace> [--file <path>] [--view WxH] [--dump <path>] [--slow-log <path>] [--slow-ms N]\n"
+                    "  MIU_TRACE=<trace> で記録したトレースを GUI なしで再生し、コマンドごとの遅延を出力する\n"
+                    "  --file  トレース中の open を指定ファイルに置き換える\n"
+                    "  --view  ensureCaretVisible が使うビューサイズ (既定 1200x800)\n"
+                    "  --dump  再生後のドキュメントをファイルに書き出す\n"
+                    "  --slow-log  --slow-ms (既定 50) を超えた操作を JSON 行で追記する\n");
+}
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = (size_t)std::ceil(p / 100.0 * (double)sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+static bool flag(const std::vector<std::string>& f, size_t i) { return i < f.size() && f[i] == "1"; }
+static std::string field(const std::vector<std::string>& f, size_t i) { return i < f.size() ? f[i] : std::string(); }
+static std::vector<Cursor> parseCursors(const std::string& s) {
+    std::vector<Cursor> cs; std::stringstream ss(s); std::string tok;
+    while (std::getline(ss, tok, ';')) {
+        Cursor c{ 0, 0, 0.0f, 0.0f, false }; unsigned long long h = 0, a = 0; int v = 0;
+        if (sscanf(tok.c_str(), "%llu,%llu,%f,%f,%d", &h, &a, &c.desiredX, &c.originalAnchorX, &v) >= 2) { c.head = (size_t)h; c.anchor = (size_t)a; c.isVirtual = v != 0; cs.push_back(c); }
+    }
+    return cs;
+}
+int main(int argc, char** argv) {
+    std::string tracePath, fileOverride, dumpPath, slowPath; float viewW = 1200.0f, viewH = 800.0f; double slowMs = 50.0;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string { if (i + 1 >= argc) { usage(); exit(2); } return argv[++i]; };
+        if (a == "--file") fileOverride = value();
+        else if (a == "--dump") dumpPath = value();
+        else if (a == "--slow-log") slowPath = value();
+        else if (a == "--slow-ms") slowMs = atof(value().c_str());
+        else if (a == "--view") { std::string v = value(); if (sscanf(v.c_str(), "%fx%f", &viewW, &viewH) != 2) { usage(); return 2; } }
+        else if (a == "--help") { usage(); return 0; }
+        else if (tracePath.empty() && a[0] != '-') tracePath = a;
+        else { usage(); return 2; }
+    }
+    if (tracePath.empty()) { usage(); return 2; }
+    std::ifstream in(tracePath, std::ios::binary);
+    if (!in) { fprintf(stderr, "cannot open %s\n", tracePath.c_str()); return 1; }
+    Editor ed;
+    ed.cbGetViewSize = [&](float& w, float& h) { w = viewW; h = viewH; };
+    std::string clip; bool clipRect = false;
+    ed.cbGetClipboard = [&](bool& isRect) { isRect = clipRect; return clip; };
+    if (!slowPath.empty() && !ed.startSlowLog(slowPath, slowMs)) { fprintf(stderr, "cannot open %s\n", slowPath.c_str()); return 1; }
+    ed.newFile();
+    std::map<std::string, CommandStats> stats;
+    std::string line; size_t lineNo = 0, events = 0; double traceMs = 0.0;
+    auto t0 = Clock::now();
+    while (std::getline(in, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> f = EditTrace::parseLine(line);
+        if (f.size() < 2) { fprintf(stderr, "%s:%zu: malformed line\n", tracePath.c_str(), lineNo); return 1; }
+        traceMs = atof(f[0].c_str());
+        const std::string& cmd = f[1];
+        auto start = Clock::now();
+        if (cmd == "open") { if (!ed.openFileFromPath(fileOverride.empty() ? field(f, 2) : fileOverride)) { fprintf(stderr, "%s:%zu: cannot open %s\n", tracePath.c_str(), lineNo, (fileOverride.empty() ? field(f, 2) : fileOverride).c_str()); return 1; } }
+        else if (cmd == "new") ed.newFile();
+        else if (cmd == "cursors") { ed.cursors = parseCursors(field(f, 2)); size_t len = ed.pt.length(); for (auto& c : ed.cursors) { c.head = std::min(c.head, len); c.anchor = std::min(c.anchor, len); } ed.ensureCaretVisible(); }
+        else if (cmd == "search") { ed.searchQuery = field(f, 2); ed.replaceQuery = field(f, 3); ed.searchMatchCase = flag(f, 4); ed.searchWholeWord = flag(f, 5); ed.searchRegex = flag(f, 6); }
+        else if (cmd == "insert") ed.insertAtCursors(field(f, 2));
+        else if (cmd == "insertPadded") ed.insertAtCursorsWithPadding(field(f, 2));
+        else if (cmd == "insertRect") ed.insertRectangularBlock(field(f, 2));
+        else if (cmd == "newline") ed.insertNewlineWithAutoIndent();
+        else if (cmd == "backspace") ed.backspaceAtCursors();
+        else if (cmd == "deleteForward") ed.deleteForwardAtCursors();
+        else if (cmd == "deleteLine") ed.deleteLine();
+        else if (cmd == "moveLines") ed.moveLines(flag(f, 2));
+        else if (cmd == "copyLines") ed.copyLines(flag(f, 2));
+        else if (cmd == "indent") ed.indentLines(flag(f, 2));
+        else if (cmd == "unindent") ed.unindentLines();
+        else if (cmd == "findNext") ed.findNext(flag(f, 2));
+        else if (cmd == "replaceNext") ed.replaceNext();
+        else if (cmd == "replaceAll") ed.replaceAll();
+        else if (cmd == "selectNextOccurrence") ed.selectNextOccurrence();
+        else if (cmd == "selectAllOccurrences") ed.selectAllOccurrences();
+        else if (cmd == "selectAll") ed.selectAll();
+        else if (cmd == "jump") ed.jumpToFileEdge(flag(f, 2), flag(f, 3));
+        else if (cmd == "convertCase") ed.convertSelectedText(flag(f, 2));
+        else if (cmd == "cut") ed.cutToClipboard();
+        else if (cmd == "paste") { clip = field(f, 2); clipRect = flag(f, 3); ed.pasteFromClipboard(); }
+        else if (cmd == "undo") ed.performUndo();
+        else if (cmd == "redo") ed.performRedo();
+        else { fprintf(stderr, "%s:%zu: unknown command %s (skipped)\n", tracePath.c_str(), lineNo, cmd.c_str()); continue; }
+        stats[cmd].us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        events++;
+    }
+    if (!dumpPath.empty()) { std::ofstream out(dumpPath, std::ios::binary); std::string all = ed.pt.getRange(0, ed.pt.length()); out.write(all.data(), all.size()); }
+    double wallMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    printf("{\"suite\":\"miu_replay\",\"schema\":1,\"trace\":\"%s\",\"events\":%zu,\"trace_ms\":%.3f,\"replay_ms\":%.3f,\"doc_bytes\":%zu,\"pieces\":%zu}\n",
+           EditTrace::escape(tracePath).c_str(), events, traceMs, wallMs, ed.pt.length(), ed.pt.pieces.size());
+    fprintf(stderr, "  %-22s %8s %12s %12s %12s %12s\n", "command", "count", "p50 us", "p99 us", "max us", "total ms");
+    for (auto& [cmd, st] : stats) {
+        std::sort(st.us.begin(), st.us.end());
+        double total = std::accumulate(st.us.begin(), st.us.end(), 0.0);
+        double p50 = percentile(st.us, 50.0), p99 = percentile(st.us, 99.0), mx = st.us.back();
+        printf("{\"command\":\"%s\",\"count\":%zu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"total_ms\":%.3f}\n", cmd.c_str(), st.us.size(), p50, p99, mx, total / 1000.0);
+        fprintf(stderr, "  %-22s %8zu %12.1f %12.1f %12.1f %12.3f\n", cmd.c_str(), st.us.size(), p50, p99, mx, total / 1000.0);
+    }
+    return 0;
+}
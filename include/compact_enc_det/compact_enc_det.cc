@@ -21,8 +21,11 @@
 #include <stdio.h>                      // for printf, fprintf, NULL, etc
 #include <stdlib.h>                     // for qsort
 #include <string.h>                     // for memset, memcpy, memcmp, etc
+#include <atomic>
 #include <memory>
 #include <string>                       // for string, operator==, etc
+#include <thread>
+#include <vector>
 
 #include "compact_enc_det/compact_enc_det_hint_code.h"
 #include "util/string_util.h"
@@ -258,7 +261,9 @@ Encoding InternalDetectEncoding(
     const char* meta_charset_hint, const int encoding_hint,
     const Language language_hint,  // User interface lang
     const CompactEncDet::TextCorpusType corpus_type,
-    bool ignore_7bit_mail_encodings, int* bytes_consumed, bool* is_reliable,
+    bool ignore_7bit_mail_encodings,
+    const CompactEncDet::DetectOptions& options,
+    int* bytes_consumed, bool* is_reliable,
     Encoding* second_best_enc);
 
 typedef struct {
@@ -429,6 +434,8 @@ typedef struct {
   char interesting_pairs[NUM_PAIR_SETS][kMaxPairs * 2];   // Two bytes per pair
   int interesting_offsets[NUM_PAIR_SETS][kMaxPairs];      // Src offset of pair
   int interesting_weightshift[NUM_PAIR_SETS][kMaxPairs];  // weightshift of pair
+
+  const CompactEncDet::DetectOptions* options;  // Per-call limits; never NULL
 } DetectEncodingState;
 
 
@@ -1388,6 +1395,8 @@ void InitDetectEncodingState(DetectEncodingState* destatep) {
   destatep->debug_data = NULL;
   destatep->next_detail_entry = 0;
 
+  destatep->options = NULL;           // Filled in by caller
+
   destatep->done = false;
   destatep->reliable = false;
   destatep->hints_derated = false;
@@ -2398,7 +2407,7 @@ void InitialBytesBoost(const uint8* src,
   }
 
   // Usually kill mixed encodings
-  if (!FLAGS_ced_allow_utf8utf8) {
+  if (!destatep->options->allow_utf8utf8) {
     Whack(destatep, F_UTF8UTF8, kBadPairWhack * 8);
   }
   // 2011.11.07 never use UTF8CP1252 -- answer will be UTF8 instead
@@ -3275,7 +3284,7 @@ void CalcReliable(DetectEncodingState* destatep) {
     return;
   }
   if ((destatep->top_prob - destatep->second_top_prob) >=
-      FLAGS_ced_reliable_difference) {
+      destatep->options->reliable_difference) {
     destatep->reliable = true;
     return;
   }
@@ -4296,7 +4305,7 @@ void BoostPrune(const uint8* src, DetectEncodingState* destatep,
     destatep->reliable = true;
   }
   if ((destatep->top_prob - destatep->second_top_prob) >=
-      FLAGS_ced_reliable_difference) {
+      destatep->options->reliable_difference) {
     destatep->reliable = true;
   }
   if (destatep->next_interesting_pair[OtherPair] == 1) {
@@ -4952,6 +4961,7 @@ Encoding Rescan(Encoding enc,
                              language_hint,   // User interface lang
                              corpus_type,
                              ignore_7bit_mail_encodings,
+                             *destatep->options,
                              &mid_bytes_consumed,
                              &mid_is_reliable,
                              &mid_second_best_enc);
@@ -5089,7 +5099,9 @@ Encoding InternalDetectEncoding(
     const char* meta_charset_hint, const int encoding_hint,
     const Language language_hint,  // User interface lang
     const CompactEncDet::TextCorpusType corpus_type,
-    bool ignore_7bit_mail_encodings, int* bytes_consumed, bool* is_reliable,
+    bool ignore_7bit_mail_encodings,
+    const CompactEncDet::DetectOptions& options,
+    int* bytes_consumed, bool* is_reliable,
     Encoding* second_best_enc) {
   *bytes_consumed = 0;
   *is_reliable = false;
@@ -5114,6 +5126,7 @@ Encoding InternalDetectEncoding(
   // Go for the full boat detection
   DetectEncodingState destate;
   InitDetectEncodingState(&destate);
+  destate.options = &options;
 
   std::unique_ptr<DetailEntry[]> scoped_debug_data;
   if (FLAGS_enc_detect_detail) {
@@ -5129,8 +5142,8 @@ Encoding InternalDetectEncoding(
   // scan the rest (up to 256KB) a bit faster by no longer looking for
   // interesting bytes below 0x80. This allows us to skip over runs of
   // 7-bit-ASCII much more quickly.
-  int slow_len = minint(text_length, (FLAGS_enc_detect_slow_max_kb << 10));
-  int fast_len = minint(text_length, (FLAGS_enc_detect_fast_max_kb << 10));
+  int slow_len = minint(text_length, (options.slow_max_kb << 10));
+  int fast_len = minint(text_length, (options.fast_max_kb << 10));
 
   // Initialize pointers.
   // In general, we do not look at last 3 bytes of input in the fast scan
@@ -5290,7 +5303,7 @@ Encoding InternalDetectEncoding(
     // If not clear yet on 7-bit-encodings and more bytes, do more slow
     if (SevenBitActive(&destate) && (src < srclimitfast2)) {
       // Increment limit by another xxxK
-      slow_len += (FLAGS_enc_detect_slow_max_kb << 10);
+      slow_len += (options.slow_max_kb << 10);
       srclimitslow2 = isrc + slow_len - 1;
       if (srclimitslow2 > srclimitfast2) {
         srclimitslow2 = srclimitfast2;
@@ -5397,6 +5410,7 @@ Encoding InternalDetectEncoding(
                              language_hint,
                              corpus_type,
                              ignore_7bit_mail_encodings,
+                             options,
                              bytes_consumed,
                              is_reliable,
                              second_best_enc);
@@ -5534,6 +5548,59 @@ Encoding InternalDetectEncoding(
   return top_enc;
 }
 
+// Final result mapping shared by every public entry point
+static Encoding FinalizeEncoding(Encoding enc, const Language language_hint) {
+#if defined(HTML5_MODE)
+  // Map all the Shift-JIS variants to Shift-JIS when used in Japanese locale.
+  if (language_hint == JAPANESE && IsShiftJisOrVariant(enc)) {
+    enc = JAPANESE_SHIFT_JIS;
+  }
+
+  // 7-bit encodings (except ISO-2022-JP), and some obscure encodings not
+  // supported in WHATWG encoding standard are marked as ASCII to keep the raw
+  // bytes intact.
+  switch (enc) {
+    case ISO_2022_KR:
+    case ISO_2022_CN:
+    case HZ_GB_2312:
+    case UTF7:
+    case UTF16LE:
+    case UTF16BE:
+
+    case CHINESE_EUC_DEC:
+    case CHINESE_CNS:
+    case CHINESE_BIG5_CP950:
+    case JAPANESE_CP932:
+    case MSFT_CP874:
+    case TSCII:
+    case TAMIL_MONO:
+    case TAMIL_BI:
+    case JAGRAN:
+    case BHASKAR:
+    case HTCHANAKYA:
+    case BINARYENC:
+    case UTF8UTF8:
+    case TAM_ELANGO:
+    case TAM_LTTMBARANI:
+    case TAM_SHREE:
+    case TAM_TBOOMIS:
+    case TAM_TMNEWS:
+    case TAM_WEBTAMIL:
+    case KDDI_SHIFT_JIS:
+    case DOCOMO_SHIFT_JIS:
+    case SOFTBANK_SHIFT_JIS:
+    case KDDI_ISO_2022_JP:
+    case SOFTBANK_ISO_2022_JP:
+      enc = ASCII_7BIT;
+      break;
+    default:
+      break;
+  }
+#endif
+
+  return enc;
+}
+
 Encoding CompactEncDet::DetectEncoding(
     const char* text, int text_length, const char* url_hint,
     const char* http_charset_hint, const char* meta_charset_hint,
@@ -5595,6 +5662,15 @@ Encoding CompactEncDet::DetectEncoding(
     return enc;
   }
 
+  CompactEncDet::DetectOptions options;
+  options.url_hint = url_hint;
+  options.http_charset_hint = http_charset_hint;
+  options.meta_charset_hint = meta_charset_hint;
+  options.encoding_hint = encoding_hint;
+  options.language_hint = language_hint;
+  options.corpus_type = corpus_type;
+  options.ignore_7bit_mail_encodings = ignore_7bit_mail_encodings;
+
   Encoding second_best_enc;
   Encoding enc = InternalDetectEncoding(kCEDNone,
                            text,
@@ -5606,6 +5682,7 @@ Encoding CompactEncDet::DetectEncoding(
                            language_hint,   // User interface lang
                            corpus_type,
                            ignore_7bit_mail_encodings,
+                           options,
                            bytes_consumed,
                            is_reliable,
                            &second_best_enc);
@@ -5620,55 +5697,84 @@ Encoding CompactEncDet::DetectEncoding(
     printf("\n");
   }
 
-#if defined(HTML5_MODE)
-  // Map all the Shift-JIS variants to Shift-JIS when used in Japanese locale.
-  if (language_hint == JAPANESE && IsShiftJisOrVariant(enc)) {
-    enc = JAPANESE_SHIFT_JIS;
-  }
+  return FinalizeEncoding(enc, language_hint);
+}
 
-  // 7-bit encodings (except ISO-2022-JP), and some obscure encodings not
-  // supported in WHATWG encoding standard are marked as ASCII to keep the raw
-  // bytes intact.
-  switch (enc) {
-    case ISO_2022_KR:
-    case ISO_2022_CN:
-    case HZ_GB_2312:
-    case UTF7:
-    case UTF16LE:
-    case UTF16BE:
 
-    case CHINESE_EUC_DEC:
-    case CHINESE_CNS:
-    case CHINESE_BIG5_CP950:
-    case JAPANESE_CP932:
-    case MSFT_CP874:
-    case TSCII:
-    case TAMIL_MONO:
-    case TAMIL_BI:
-    case JAGRAN:
-    case BHASKAR:
-    case HTCHANAKYA:
-    case BINARYENC:
-    case UTF8UTF8:
-    case TAM_ELANGO:
-    case TAM_LTTMBARANI:
-    case TAM_SHREE:
-    case TAM_TBOOMIS:
-    case TAM_TMNEWS:
-    case TAM_WEBTAMIL:
-    case KDDI_SHIFT_JIS:
-    case DOCOMO_SHIFT_JIS:
-    case SOFTBANK_SHIFT_JIS:
-    case KDDI_ISO_2022_JP:
-    case SOFTBANK_ISO_2022_JP:
-      enc = ASCII_7BIT;
-      break;
-    default:
-      break;
-  }
-#endif
+CompactEncDet::DetectOptions::DetectOptions()
+    : url_hint(NULL),
+      http_charset_hint(NULL),
+      meta_charset_hint(NULL),
+      encoding_hint(UNKNOWN_ENCODING),
+      language_hint(UNKNOWN_LANGUAGE),
+      corpus_type(WEB_CORPUS),
+      ignore_7bit_mail_encodings(false),
+      slow_max_kb(FLAGS_enc_detect_slow_max_kb),
+      fast_max_kb(FLAGS_enc_detect_fast_max_kb),
+      reliable_difference(FLAGS_ced_reliable_difference),
+      allow_utf8utf8(FLAGS_ced_allow_utf8utf8) {
+}
 
-  return enc;
+// Reentrant version of DetectEncoding. All state lives on the stack or in
+// options; the debug-only echo/counts/dirtsimple paths are not taken.
+Encoding CompactEncDet::DetectEncoding(const char* text, int text_length,
+                                       const DetectOptions& options,
+                                       int* bytes_consumed,
+                                       bool* is_reliable) {
+  Encoding second_best_enc;
+  Encoding enc = InternalDetectEncoding(kCEDNone,
+                           text,
+                           text_length,
+                           options.url_hint,
+                           options.http_charset_hint,
+                           options.meta_charset_hint,
+                           options.encoding_hint,
+                           options.language_hint,
+                           options.corpus_type,
+                           options.ignore_7bit_mail_encodings,
+                           options,
+                           bytes_consumed,
+                           is_reliable,
+                           &second_best_enc);
+  return FinalizeEncoding(enc, options.language_hint);
+}
+
+// Workers pull the next unclaimed request index from a shared counter, so
+// a few large buffers do not leave the other threads idle.
+void CompactEncDet::DetectEncodingBatch(const DetectRequest* requests,
+                                        int count,
+                                        const DetectOptions& options,
+                                        int num_threads,
+                                        DetectResponse* responses) {
+  if (count <= 0) {return;}
+  if (num_threads <= 0) {
+    num_threads = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  num_threads = maxint(1, minint(num_threads, count));
+
+  std::atomic<int> next_request(0);
+  auto worker = [&]() {
+    for (;;) {
+      int i = next_request.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count) {break;}
+      DetectResponse* response = &responses[i];
+      response->encoding = DetectEncoding(requests[i].text,
+                                          requests[i].text_length,
+                                          options,
+                                          &response->bytes_consumed,
+                                          &response->is_reliable);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();                         // The calling thread works too
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
 }
 
 
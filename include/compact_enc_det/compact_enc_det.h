@@ -72,6 +72,61 @@ namespace CompactEncDet {
       const TextCorpusType corpus_type, bool ignore_7bit_mail_encodings,
       int* bytes_consumed, bool* is_reliable);
 
+  // Per-call detection options for the reentrant entry points below.
+  // Default-constructed options carry the same hints as a DetectEncoding()
+  // call with no hints (NULL/UNKNOWN, WEB_CORPUS, 7-bit encodings included)
+  // and snapshot the current values of the process-wide tuning flags
+  // (--enc_detect_slow_max_kb, --enc_detect_fast_max_kb,
+  // --ced_reliable_difference, --ced_allow_utf8utf8), so a default
+  // DetectOptions gives exactly the single-call result.
+  //
+  // The reentrant path never reads those flags, so callers can run many
+  // detections with different limits concurrently without touching globals.
+  // The debug-only flags (--enc_detect_detail, --enc_detect_source,
+  // --counts, --dirtsimple, --ced_echo_input) are not threadsafe and must
+  // stay off while detections run in parallel.
+  struct DetectOptions {
+    DetectOptions();
+
+    const char* url_hint;
+    const char* http_charset_hint;
+    const char* meta_charset_hint;
+    int encoding_hint;
+    Language language_hint;
+    TextCorpusType corpus_type;
+    bool ignore_7bit_mail_encodings;
+
+    int slow_max_kb;           // Kbytes examined for 7-bit-only encodings
+    int fast_max_kb;           // Kbytes examined overall
+    int reliable_difference;   // 30 * bits of 1st - 2nd to be reliable
+    bool allow_utf8utf8;       // Allow the UTF8UTF8 encoding
+  };
+
+  // One buffer to classify and the outputs of classifying it.
+  struct DetectRequest {
+    const char* text;
+    int text_length;
+  };
+  struct DetectResponse {
+    Encoding encoding;
+    int bytes_consumed;
+    bool is_reliable;
+  };
+
+  // Same as DetectEncoding, but takes all hints and limits from options.
+  // Thread safe: may be called concurrently from any number of threads.
+  Encoding DetectEncoding(const char* text, int text_length,
+                          const DetectOptions& options,
+                          int* bytes_consumed, bool* is_reliable);
+
+  // Detect count buffers on up to num_threads worker threads (0 means one
+  // per hardware thread) and return when all are done. responses[i] is the
+  // result for requests[i] and matches a single DetectEncoding call on the
+  // same buffer with the same options.
+  void DetectEncodingBatch(const DetectRequest* requests, int count,
+                           const DetectOptions& options, int num_threads,
+                           DetectResponse* responses);
+
   // Support functions for unit test program
   int BackmapEncodingToRankedEncoding(Encoding enc);
   Encoding TopEncodingOfLangHint(const char* name);
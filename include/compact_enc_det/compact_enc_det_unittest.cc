@@ -19,6 +19,8 @@
 #include <stdio.h>                      // for fprintf, stderr, FILE, etc
 #include <string.h>                     // for strlen, NULL
 #include <string>                       // for string
+#include <thread>                       // for thread
+#include <vector>                       // for vector
 
 
 #include "gtest/gtest.h"
@@ -30,6 +32,8 @@ using std::string;
 
 DECLARE_bool(enc_detect_detail);
 DECLARE_bool(ced_allow_utf8utf8);
+DECLARE_int32(enc_detect_slow_max_kb);
+DECLARE_int32(enc_detect_fast_max_kb);
 DEFINE_int32(trackme, -1, "Track this encoding in --enc_detect_detail output");
 
 static const char kDetailHead[] =
@@ -5126,6 +5130,155 @@ TEST_F(CompactEncDetTest, ShiftJISNoHintTest) {
   EXPECT_EQ(is_reliable, true);
 }
 
+// Every unit test input, with the length the tests above use for it
+struct ParallelInput {
+  const char* text;
+  int text_length;
+};
+
+static std::vector<ParallelInput> AllTestInputs() {
+  const char* strs[] = {
+    kTeststr00, kTeststr03, kTeststr04, kTeststr05, kTeststr06, kTeststr07,
+    kTeststr07v, kTeststr08, kTeststr10, kTeststr11, kTeststr12, kTeststr13,
+    kTeststr14, kTeststr22, kTeststr25, kTeststr26, kTeststr27, kTeststr28,
+    kTeststr29, kTeststr32, kTeststr33, kTeststr35, kTeststr42, kTeststr44,
+    kTeststr46, kTeststr48, kTeststr53, kTeststr54, kTeststr62, kTeststr63,
+    kTeststr52, kTeststr52b, kTeststr99, kTestStrNoUTF8UTF8,
+    kTestShiftJISNoHint,
+  };
+  std::vector<ParallelInput> inputs;
+  for (size_t i = 0; i < arraysize(strs); ++i) {
+    ParallelInput in = {strs[i], static_cast<int>(strlen(strs[i]))};
+    inputs.push_back(in);
+  }
+  // Embedded NUL bytes: use the full array size
+  ParallelInput sized[] = {
+    {kTeststr57, static_cast<int>(sizeof(kTeststr57))},
+    {kTeststr58, static_cast<int>(sizeof(kTeststr58))},
+    {kTeststr59, static_cast<int>(sizeof(kTeststr59))},
+    {kTeststr60, static_cast<int>(sizeof(kTeststr60))},
+    {kTeststr61, static_cast<int>(sizeof(kTeststr61))},
+    {kUTF16LEChomsky, static_cast<int>(sizeof(kUTF16LEChomsky))},
+    {kUTF16LEFltrs, static_cast<int>(sizeof(kUTF16LEFltrs))},
+    {"", 0},
+  };
+  for (size_t i = 0; i < arraysize(sized); ++i) {
+    inputs.push_back(sized[i]);
+  }
+  return inputs;
+}
+
+// Runs every input through the single-call path, then many copies of the
+// inputs through DetectEncodingBatch on several threads, and requires
+// identical answers for each copy.
+static void ExpectBatchMatchesSingleCall(
+    const CompactEncDet::DetectOptions& options) {
+  std::vector<ParallelInput> inputs = AllTestInputs();
+  std::vector<CompactEncDet::DetectResponse> expected(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    expected[i].encoding = CompactEncDet::DetectEncoding(
+        inputs[i].text, inputs[i].text_length,
+        NULL, NULL, NULL, UNKNOWN_ENCODING, UNKNOWN_LANGUAGE,
+        CompactEncDet::WEB_CORPUS, false,
+        &expected[i].bytes_consumed, &expected[i].is_reliable);
+  }
+
+  const int kCopies = 64;
+  std::vector<CompactEncDet::DetectRequest> requests;
+  for (int copy = 0; copy < kCopies; ++copy) {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      CompactEncDet::DetectRequest req = {inputs[i].text,
+                                          inputs[i].text_length};
+      requests.push_back(req);
+    }
+  }
+  std::vector<CompactEncDet::DetectResponse> responses(requests.size());
+  CompactEncDet::DetectEncodingBatch(requests.data(),
+                                     static_cast<int>(requests.size()),
+                                     options, 8, responses.data());
+
+  for (size_t r = 0; r < responses.size(); ++r) {
+    const CompactEncDet::DetectResponse& want = expected[r % inputs.size()];
+    EXPECT_EQ(want.encoding, responses[r].encoding) << "request " << r;
+    EXPECT_EQ(want.bytes_consumed, responses[r].bytes_consumed)
+        << "request " << r;
+    EXPECT_EQ(want.is_reliable, responses[r].is_reliable) << "request " << r;
+  }
+}
+
+TEST_F(CompactEncDetTest, BatchMatchesSingleCall) {
+  CompactEncDet::DetectOptions options;
+  ExpectBatchMatchesSingleCall(options);
+}
+
+TEST_F(CompactEncDetTest, BatchOptionsAreIndependentOfFlags) {
+  // Per-call limits must give the same answer as setting the global flags
+  // for a single call, while the flags themselves stay untouched.
+  VarSetter<int32> slow(&FLAGS_enc_detect_slow_max_kb, 1);
+  VarSetter<int32> fast(&FLAGS_enc_detect_fast_max_kb, 2);
+  VarSetter<bool> utf8utf8(&FLAGS_ced_allow_utf8utf8, true);
+  CompactEncDet::DetectOptions options;
+  EXPECT_EQ(1, options.slow_max_kb);
+  EXPECT_EQ(2, options.fast_max_kb);
+  EXPECT_TRUE(options.allow_utf8utf8);
+  ExpectBatchMatchesSingleCall(options);
+}
+
+TEST_F(CompactEncDetTest, ConcurrentCallsWithDifferentOptions) {
+  // Two thread groups detect the same inputs with different limits at the
+  // same time; each must see only its own options.
+  std::vector<ParallelInput> inputs = AllTestInputs();
+  CompactEncDet::DetectOptions small_options;
+  small_options.slow_max_kb = 1;
+  small_options.fast_max_kb = 1;
+  CompactEncDet::DetectOptions default_options;
+
+  std::vector<CompactEncDet::DetectResponse> small_expected(inputs.size());
+  std::vector<CompactEncDet::DetectResponse> default_expected(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    small_expected[i].encoding = CompactEncDet::DetectEncoding(
+        inputs[i].text, inputs[i].text_length, small_options,
+        &small_expected[i].bytes_consumed, &small_expected[i].is_reliable);
+    default_expected[i].encoding = CompactEncDet::DetectEncoding(
+        inputs[i].text, inputs[i].text_length, default_options,
+        &default_expected[i].bytes_consumed,
+        &default_expected[i].is_reliable);
+  }
+
+  const int kThreads = 8;
+  const int kRounds = 16;
+  std::vector<int> mismatches(kThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.push_back(std::thread([&, t]() {
+      const CompactEncDet::DetectOptions& options =
+          (t & 1) ? small_options : default_options;
+      const std::vector<CompactEncDet::DetectResponse>& expected =
+          (t & 1) ? small_expected : default_expected;
+      for (int round = 0; round < kRounds; ++round) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+          int bytes_consumed;
+          bool is_reliable;
+          Encoding enc = CompactEncDet::DetectEncoding(
+              inputs[i].text, inputs[i].text_length, options,
+              &bytes_consumed, &is_reliable);
+          if (enc != expected[i].encoding ||
+              bytes_consumed != expected[i].bytes_consumed ||
+              is_reliable != expected[i].is_reliable) {
+            ++mismatches[t];
+          }
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  for (int t = 0; t < kThreads; ++t) {
+    EXPECT_EQ(0, mismatches[t]) << "thread " << t;
+  }
+}
+
 #if 0
 CP1252 => UTF8 => UTF8UTF8
 80 => E282AC => C3A2E2809AC2AC
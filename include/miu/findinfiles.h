@@ -0,0 +1,171 @@
+// miu のフォルダ内検索 (ヘッダのみ)。フォルダをたどってファイルを集め、ワーカースレッドで 1 ファイルずつ読み込んで照合し、見つけた一致を順に渡す。
+// ファイルの読み込み (メモリマップと文字コードの判定) と照合の方法は呼び出し側が関数で与える
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "parallel.h"
+
+namespace miu {
+
+// 1 つの一致。pos は UTF-8 にしたファイルの内容での位置。line と column は 0 から数える (column は行頭からのバイト数)。
+// preview は一致を含む行の一部で、一致は preview の previewPos バイト目から始まる
+struct FileMatch { std::string path; size_t pos = 0, len = 0, line = 0, column = 0; std::string preview; size_t previewPos = 0; };
+
+struct FolderSearchOptions {
+    std::vector<std::string> skipDirs{ ".git", ".svn", ".hg", "node_modules" }; // この名前のフォルダには入らない
+    uintmax_t maxFileSize = (uintmax_t)1 << 30;
+    size_t maxMatches = 100000; // これだけ見つけたら打ち切る
+    unsigned threads = 0;       // 0 ならコア数
+};
+
+class FolderSearch {
+public:
+    struct Progress { size_t filesQueued = 0, filesSearched = 0, filesMatched = 0, matches = 0; uint64_t bytes = 0; bool done = false, truncated = false; };
+    // load(path, use): ファイルを開き、UTF-8 にした内容を use に渡す (use から戻ったら閉じてよい)。開けなければ false
+    using LoadFn = std::function<bool(const std::string& path, const std::function<void(std::string_view text)>& use)>;
+    // match(text, emit, cancel): text の一致を文書順に emit(hit) で知らせる。emit が false を返すか cancel が立ったら止める
+    using MatchFn = std::function<void(std::string_view text, const std::function<bool(const SearchHit&)>& emit, const std::atomic<bool>& cancel)>;
+    static constexpr int kNotifyIntervalMs = 50;
+    static constexpr size_t kBinaryProbe = 8192;                 // 先頭のこのバイト数に NUL があればバイナリとみなして飛ばす
+    static constexpr size_t kPreviewBefore = 64, kPreviewMax = 256; // 一致の前に残すバイト数と、preview の最大の長さ
+    FolderSearch() = default;
+    FolderSearch(const FolderSearch&) = delete; FolderSearch& operator=(const FolderSearch&) = delete;
+    ~FolderSearch() { stop(); }
+    // root 以下を探し始める。notify は探しているスレッドから、一致が増えたとき (kNotifyIntervalMs ごと) と終わったときに呼ばれる
+    void start(const std::string& root, LoadFn load, MatchFn match, std::function<void()> notify, const FolderSearchOptions& opt = FolderSearchOptions()) {
+        stop();
+        { std::lock_guard<std::mutex> lk(mu); st = Progress(); results.clear(); queue.clear(); walking = true; active = true; }
+        cancel = false; full = false; matchCount = 0; loadFn = std::move(load); matchFn = std::move(match); notifyFn = std::move(notify); options = opt;
+        lastNotify = std::chrono::steady_clock::now();
+        unsigned n = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+        running = n;
+        walker = std::thread([this, root] { walk(root); });
+        for (unsigned i = 0; i < n; ++i) workers.emplace_back([this] { work(); });
+    }
+    // 探している途中なら取り消し、スレッドが終わるのを待つ
+    void stop() {
+        cancel = true; cv.notify_all();
+        if (walker.joinable()) walker.join();
+        for (auto& t : workers) t.join();
+        workers.clear();
+        std::lock_guard<std::mutex> lk(mu); active = false;
+    }
+    bool busy() const { std::lock_guard<std::mutex> lk(mu); return active && !st.done; }
+    Progress progress() const { std::lock_guard<std::mutex> lk(mu); return st; }
+    // 前回から見つかった一致を out の後ろに移す。同じファイルの一致は続けて並ぶ
+    bool take(std::vector<FileMatch>& out) {
+        std::lock_guard<std::mutex> lk(mu);
+        if (results.empty()) return false;
+        out.insert(out.end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end())); results.clear(); return true;
+    }
+    static std::filesystem::path pathFromUtf8(const std::string& s) {
+#if defined(__cpp_char8_t)
+        return std::filesystem::path(std::u8string(s.begin(), s.end()));
+#else
+        return std::filesystem::u8path(s);
+#endif
+    }
+    static std::string pathToUtf8(const std::filesystem::path& p) { auto s = p.u8string(); return std::string(s.begin(), s.end()); }
+
+private:
+    void walk(const std::string& root) {
+        namespace fs = std::filesystem;
+        auto push = [&](const fs::path& p) { { std::lock_guard<std::mutex> lk(mu); queue.push_back(pathToUtf8(p)); st.filesQueued++; } cv.notify_one(); };
+        std::error_code ec; fs::path top = pathFromUtf8(root);
+        if (fs::is_regular_file(top, ec)) push(top);
+        else {
+            fs::recursive_directory_iterator it(top, fs::directory_options::skip_permission_denied, ec), end;
+            for (; !ec && it != end && !cancel && !full; it.increment(ec)) {
+                std::error_code fe;
+                if (it->is_directory(fe)) {
+                    if (std::find(options.skipDirs.begin(), options.skipDirs.end(), pathToUtf8(it->path().filename())) != options.skipDirs.end()) it.disable_recursion_pending();
+                    continue;
+                }
+                if (!it->is_regular_file(fe) || fe) continue;
+                uintmax_t size = it->file_size(fe);
+                if (!fe && size <= options.maxFileSize) push(it->path());
+            }
+        }
+        { std::lock_guard<std::mutex> lk(mu); walking = false; }
+        cv.notify_all();
+    }
+    void work() {
+        for (;;) {
+            std::string path;
+            {
+                std::unique_lock<std::mutex> lk(mu);
+                cv.wait(lk, [&] { return cancel || full || !queue.empty() || !walking; });
+                if (cancel) return;
+                if (full || queue.empty()) {
+                    // 最後に終わったスレッドが完了を知らせる
+                    if (--running > 0) return;
+                    st.done = true; lk.unlock();
+                    if (notifyFn) notifyFn();
+                    return;
+                }
+                path = std::move(queue.front()); queue.pop_front();
+            }
+            searchFile(path);
+        }
+    }
+    void searchFile(const std::string& path) {
+        std::vector<FileMatch> found; uint64_t bytes = 0;
+        loadFn(path, [&](std::string_view text) {
+            bytes = text.size();
+            if (text.empty() || std::memchr(text.data(), 0, std::min(text.size(), kBinaryProbe))) return;
+            // 行番号は前の一致から改行を数えて進める
+            size_t line = 0, lineStart = 0, counted = 0;
+            matchFn(text, [&](const SearchHit& h) {
+                while (counted < h.pos) {
+                    const char* nl = (const char*)std::memchr(text.data() + counted, '\n', h.pos - counted);
+                    if (!nl) { counted = h.pos; break; }
+                    line++; counted = lineStart = (size_t)(nl - text.data()) + 1;
+                }
+                FileMatch m; m.path = path; m.pos = h.pos; m.line = line; m.column = h.pos - lineStart; m.len = h.len;
+                size_t from = lineStart;
+                if (h.pos - lineStart > kPreviewBefore) { from = h.pos - kPreviewBefore; while (from < h.pos && ((unsigned char)text[from] & 0xC0) == 0x80) from++; }
+                const char* nl = (const char*)std::memchr(text.data() + h.pos, '\n', std::min(text.size() - h.pos, from + kPreviewMax - h.pos));
+                size_t to = nl ? (size_t)(nl - text.data()) : std::min(text.size(), from + kPreviewMax);
+                while (to > h.pos && to < text.size() && ((unsigned char)text[to] & 0xC0) == 0x80) to--;
+                if (to > from && text[to - 1] == '\r') to--;
+                m.preview.assign(text.data() + from, to - from); m.previewPos = h.pos - from;
+                found.push_back(std::move(m));
+                if (matchCount.fetch_add(1) + 1 >= options.maxMatches) { full = true; return false; }
+                return true;
+            }, cancel);
+        });
+        bool notifyNow = false;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            st.filesSearched++; st.bytes += bytes;
+            if (!found.empty()) { st.filesMatched++; st.matches += found.size(); std::move(found.begin(), found.end(), std::back_inserter(results)); }
+            if (full) st.truncated = true;
+            auto now = std::chrono::steady_clock::now();
+            if (!results.empty() && now - lastNotify >= std::chrono::milliseconds(kNotifyIntervalMs)) { lastNotify = now; notifyNow = true; }
+        }
+        if (full) cv.notify_all();
+        if (notifyNow && notifyFn) notifyFn();
+    }
+    mutable std::mutex mu; std::condition_variable cv;
+    std::thread walker; std::vector<std::thread> workers;
+    std::atomic<bool> cancel{ false }, full{ false }; std::atomic<size_t> matchCount{ 0 };
+    LoadFn loadFn; MatchFn matchFn; std::function<void()> notifyFn; FolderSearchOptions options;
+    Progress st; std::deque<std::string> queue; std::vector<FileMatch> results;
+    std::chrono::steady_clock::time_point lastNotify; unsigned running = 0; bool walking = false, active = false;
+};
+
+} // namespace miu
@@ -0,0 +1,55 @@
+// miu の位置の区間の集まり (ヘッダのみ)。選択や一致の [first, second) を並べ替えて重なりをまとめておき、
+// 文字を前から順に見ながらどれかの区間に入るかを調べる (1 文字あたりならして O(1))
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace miu {
+
+class Intervals {
+public:
+    using Span = std::pair<size_t, size_t>;
+    // ranges の順番や重なりは問わない。空の区間は入れない
+    void assign(const std::vector<Span>& ranges) {
+        spans.clear();
+        for (const auto& r : ranges) if (r.first < r.second) spans.push_back(r);
+        std::sort(spans.begin(), spans.end());
+        size_t n = 0;
+        for (const auto& r : spans) {
+            if (n > 0 && r.first <= spans[n - 1].second) spans[n - 1].second = std::max(spans[n - 1].second, r.second);
+            else spans[n++] = r;
+        }
+        spans.resize(n);
+    }
+    // pos より後ろで終わる最初の区間の番号
+    size_t firstEndingAfter(size_t pos) const { return std::partition_point(spans.begin(), spans.end(), [&](const Span& s) { return s.second <= pos; }) - spans.begin(); }
+    // [from, to) に掛かる区間を、その範囲に切り詰めて f(first, second) に渡す
+    template <class F>
+    void forEachIn(size_t from, size_t to, F&& f) const {
+        for (size_t i = firstEndingAfter(from); i < spans.size() && spans[i].first < to; ++i) f(std::max(spans[i].first, from), std::min(spans[i].second, to));
+    }
+    bool empty() const { return spans.empty(); }
+    const std::vector<Span>& items() const { return spans; }
+
+    // 位置を順に調べる。位置が前に戻ったとき (右から左へ書く文字など) は二分探索で探し直す
+    class Sweep {
+    public:
+        explicit Sweep(const Intervals& s, size_t from = 0) : set(&s), i(s.firstEndingAfter(from)), last(from) {}
+        bool contains(size_t pos) {
+            const std::vector<Span>& v = set->spans;
+            if (pos < last) i = set->firstEndingAfter(pos);
+            else while (i < v.size() && v[i].second <= pos) ++i;
+            last = pos;
+            return i < v.size() && v[i].first <= pos;
+        }
+    private:
+        const Intervals* set; size_t i, last;
+    };
+
+private:
+    std::vector<Span> spans;
+};
+
+} // namespace miu
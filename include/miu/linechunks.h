@@ -0,0 +1,58 @@
+// miu の行ごとの描画データのキャッシュ (ヘッダのみ)。行ごとに作った頂点などを、その行の描き方を決める状態をまとめた値 (sig) と一緒に持ち、
+// sig が変わった行だけを作り直す。中身は行の原点からの座標で作っておき、フレームごとに行の位置へずらして並べる
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+
+namespace miu {
+
+// 状態をまとめる 64 ビットのハッシュ (FNV-1a)
+struct Hasher {
+    uint64_t h = 1469598103934665603ull;
+    Hasher& bytes(const void* p, size_t n) { const unsigned char* b = (const unsigned char*)p; for (size_t i = 0; i < n; ++i) { h ^= b[i]; h *= 1099511628211ull; } return *this; }
+    template <class T> Hasher& add(const T& v) { static_assert(std::is_trivially_copyable<T>::value, "add() は値をそのままのバイトで混ぜる"); return bytes(&v, sizeof(v)); }
+    Hasher& add(std::string_view s) { add(s.size()); return bytes(s.data(), s.size()); }
+    uint64_t value() const { return h; }
+};
+
+template <class T>
+class LineChunkCache {
+public:
+    struct Stats { uint64_t built = 0, reused = 0; };
+    // 行 line のデータ。前に作ったときと sig が同じならそれを返し、違えば build(data) で作り直す
+    // (data には前の中身が残っているので、build は最初に消してから作る。確保した領域はそのまま使い回せる)
+    template <class Build>
+    const T& get(int line, uint64_t sig, Build&& build) {
+        auto it = chunks.find(line);
+        if (it != chunks.end() && it->second.sig == sig) { st.reused++; return it->second.data; }
+        st.built++;
+        Chunk& c = it != chunks.end() ? it->second : chunks[line];
+        c.sig = sig; build(c.data);
+        return c.data;
+    }
+    // [first, end) の外の行 (見えなくなった行) を捨てる
+    void retain(int first, int end) {
+        for (auto it = chunks.begin(); it != chunks.end();) it = (it->first < first || it->first >= end) ? chunks.erase(it) : std::next(it);
+    }
+    void clear() { chunks.clear(); }
+    size_t size() const { return chunks.size(); }
+    // 使っているヒープのおおよそのバイト数。dataBytes(data) は 1 行分のデータが別に持つ領域のバイト数
+    template <class F>
+    size_t bytes(F&& dataBytes) const {
+        size_t b = chunks.bucket_count() * sizeof(void*);
+        for (const auto& c : chunks) b += sizeof(typename decltype(chunks)::value_type) + 2 * sizeof(void*) + dataBytes(c.second.data);
+        return b;
+    }
+    const Stats& stats() const { return st; }
+    void resetStats() { st = Stats(); }
+
+private:
+    struct Chunk { uint64_t sig = 0; T data; };
+    std::unordered_map<int, Chunk> chunks; Stats st;
+};
+
+} // namespace miu
@@ -0,0 +1,92 @@
+// miu の 1 行分の頂点の組み立て (ヘッダのみ)。整形済みの字形の並びと、選択・検索・自動ハイライトの区間から、
+// 背景の矩形・下線・文字の四角形の頂点を作る。GPU の API にもフォントのライブラリにも依らない (字形の位置は呼び出し側が引く)
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include "miu/intervals.h"
+
+namespace miu {
+
+// 字形のテクスチャ上の位置 (u, v) と大きさ・原点からのずれ (48px で描いたときの値)
+struct GlyphInfo {
+    float u0, v0, u1, v1;
+    float width, height;
+    float bearingX, bearingY;
+    float advance;
+    bool isColor;
+};
+struct Vertex {
+    float pos[2];
+    float uv[2];
+    float isColor;
+    float color[4];
+};
+struct ShapedGlyph {
+    int fontIndex;
+    uint32_t glyphIndex;
+    float xAdvance, yAdvance, xOffset, yOffset;
+    size_t cluster;
+    bool isIME;
+};
+// 1 行分の頂点。x は行の左端 (行番号の右)、y はベースラインからの位置で持ち、描くときに行の位置へずらす。width は行の文字の幅
+struct LineVertices { std::vector<Vertex> bg, deco, text; float width = 0.0f; };
+// 見えている範囲の選択・検索・自動ハイライトの区間 (並べ替えて重なりをまとめたもの)。emptyMatches は長さ 0 の一致の位置 (昇順)
+struct LineStyleRanges { Intervals sel, search, autoHl; std::vector<size_t> emptyMatches; };
+// 行によらない描き方 (フォントの大きさと色)。whiteU/whiteV はテクスチャの白い画素の位置
+struct LineVertexStyle {
+    float scale, lineHeight, charWidth, whiteU, whiteV;
+    float text[4], sel[4], autoHl[4];
+};
+// 行末の改行の記号。draw が false なら描かない (改行がない、または \r\n の \r で次の行に \n が続く)。glyph は記号の字形 (なければ nullptr)
+struct LineEnding { bool draw = false; size_t pos = 0; const GlyphInfo* glyph = nullptr; };
+
+// 行の頂点を out に作る。glyphs はその行の整形結果 (cluster は文書の位置)、nextLineStart は次の行の先頭 (最後の行なら SIZE_MAX)。
+// glyphFor(fontIndex, glyphIndex) は字形の位置を返す (なければ nullptr)。文字の色分けは、区間の並びを文字と一緒に前へ進めながら決める
+template <class GlyphFor>
+void buildLineVertices(const std::vector<ShapedGlyph>& glyphs, size_t lineStart, size_t nextLineStart, const LineEnding& ending,
+                       const LineStyleRanges& ranges, const LineVertexStyle& st, GlyphFor&& glyphFor, LineVertices& out) {
+    out.bg.clear(); out.deco.clear(); out.text.clear(); out.width = 0.0f;
+    float scale = st.scale, lh = st.lineHeight, bgY = -lh * 0.8f, whiteU = st.whiteU, whiteV = st.whiteV;
+    auto addRect = [&](std::vector<Vertex>& verts, float rx, float ry, float rw, float rh, float r, float g, float b, float a) {
+        verts.push_back({{rx, ry}, {whiteU, whiteV}, 0.0f, {r, g, b, a}}); verts.push_back({{rx, ry + rh}, {whiteU, whiteV}, 0.0f, {r, g, b, a}});
+        verts.push_back({{rx + rw, ry}, {whiteU, whiteV}, 0.0f, {r, g, b, a}}); verts.push_back({{rx + rw, ry}, {whiteU, whiteV}, 0.0f, {r, g, b, a}});
+        verts.push_back({{rx, ry + rh}, {whiteU, whiteV}, 0.0f, {r, g, b, a}}); verts.push_back({{rx + rw, ry + rh}, {whiteU, whiteV}, 0.0f, {r, g, b, a}});
+    };
+    auto addQuad = [&](float xpos, float ypos, float w, float h, const GlyphInfo& info, float isColorFlag, float r, float g, float b, float a) {
+        out.text.push_back({{xpos, ypos}, {info.u0, info.v0}, isColorFlag, {r, g, b, a}}); out.text.push_back({{xpos, ypos + h}, {info.u0, info.v1}, isColorFlag, {r, g, b, a}});
+        out.text.push_back({{xpos + w, ypos}, {info.u1, info.v0}, isColorFlag, {r, g, b, a}}); out.text.push_back({{xpos + w, ypos}, {info.u1, info.v0}, isColorFlag, {r, g, b, a}});
+        out.text.push_back({{xpos, ypos + h}, {info.u0, info.v1}, isColorFlag, {r, g, b, a}}); out.text.push_back({{xpos + w, ypos + h}, {info.u1, info.v1}, isColorFlag, {r, g, b, a}});
+    };
+    const float* text = st.text; const float* sel = st.sel; const float* autoHl = st.autoHl;
+    for (auto it = std::lower_bound(ranges.emptyMatches.begin(), ranges.emptyMatches.end(), lineStart); it != ranges.emptyMatches.end() && *it < nextLineStart; ++it) {
+        float drawX = 0.0f;
+        if (*it > lineStart) { for (const auto& sg : glyphs) { if (sg.cluster >= *it) break; drawX += sg.xAdvance * scale; } }
+        addRect(out.bg, drawX, bgY, st.charWidth, lh, 1.0f, 1.0f, 0.0f, 0.4f);
+    }
+    Intervals::Sweep inSel(ranges.sel, lineStart), inSearch(ranges.search, lineStart), inAuto(ranges.autoHl, lineStart);
+    float x = 0.0f;
+    for (const auto& sg : glyphs) {
+        float adv = sg.xAdvance * scale;
+        if (sg.isIME) { addRect(out.bg, x, bgY, adv, lh, 0.2f, 0.6f, 1.0f, 0.3f); addRect(out.deco, x, lh * 0.1f, adv, 2.0f, text[0], text[1], text[2], 1.0f); }
+        else if (inSel.contains(sg.cluster)) addRect(out.bg, x, bgY, adv, lh, sel[0], sel[1], sel[2], sel[3]);
+        else if (inSearch.contains(sg.cluster)) addRect(out.bg, x, bgY, adv, lh, 1.0f, 1.0f, 0.0f, 0.4f);
+        else if (inAuto.contains(sg.cluster)) addRect(out.bg, x, bgY, adv, lh, autoHl[0], autoHl[1], autoHl[2], autoHl[3]);
+        if (const GlyphInfo* info = glyphFor(sg.fontIndex, sg.glyphIndex))
+            addQuad(x + sg.xOffset * scale + info->bearingX * scale, -sg.yOffset * scale - info->bearingY * scale, info->width * scale, info->height * scale, *info, info->isColor ? 1.0f : 0.0f, text[0], text[1], text[2], text[3]);
+        x += adv;
+    }
+    out.width = x;
+    if (!ending.draw) return;
+    if (inSel.contains(ending.pos)) addRect(out.bg, x, bgY, st.charWidth, lh, sel[0], sel[1], sel[2], sel[3]);
+    else if (inSearch.contains(ending.pos)) addRect(out.bg, x, bgY, st.charWidth, lh, 1.0f, 1.0f, 0.0f, 0.4f);
+    else if (inAuto.contains(ending.pos)) addRect(out.bg, x, bgY, st.charWidth, lh, autoHl[0], autoHl[1], autoHl[2], autoHl[3]);
+    if (const GlyphInfo* info = ending.glyph) {
+        float iconScale = st.charWidth / info->width; float w = info->width * iconScale, h = info->height * iconScale;
+        float rowCenterY = bgY + lh * 0.5f; // 行の上端はベースラインの lineHeight * 0.8 上
+        addQuad(x + (st.charWidth - w) * 0.5f, rowCenterY - h * 0.5f, w, h, *info, 0.0f, text[0], text[1], text[2], text[3] * 0.3f);
+    }
+}
+
+} // namespace miu
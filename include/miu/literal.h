@@ -0,0 +1,279 @@
+// miu の通常 (非正規表現) 検索用の文字列照合 (ヘッダのみ)。
+// 先頭バイトと「珍しい」バイトの 2 点を SIMD (SSE2 / NEON) でまとめて比較して候補を絞り、候補だけを全体照合する。
+// 大文字小文字を区別しない場合は Unicode の単純畳み込み (unicode.h) で比較する。ASCII 英字やキリル文字のように
+// 大文字と小文字で UTF-8 の長さが変わらない部分はビットマスク付きの比較でそのまま SIMD にかけ、長さが変わり得る文字 (K とケルビン記号など) だけを前後に復号して確かめる。
+// 文書はピースのような連続領域の並びとして受け取り、ピースをまたぐ一致は境界付近だけバイト単位で確かめる。
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include "unicode.h"
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define MIU_LITERAL_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define MIU_LITERAL_NEON 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace miu {
+
+// 一般的なテキスト・ソースコード・日本語文書での出現頻度のおおよその順位 (大きいほどよく出る)
+inline int literalByteRank(unsigned char b) {
+    if (b == ' ' || b == '\n' || b == 'e') return 255;
+    if (b == '\t' || b == '\r') return 220;
+    if (b >= 'a' && b <= 'z') return (b == 'q' || b == 'z' || b == 'x' || b == 'j' || b == 'k' || b == 'v') ? 120 : 200;
+    if (b >= 'A' && b <= 'Z') return (b == 'Q' || b == 'Z' || b == 'X' || b == 'J' || b == 'K' || b == 'V') ? 80 : 130;
+    if (b >= '0' && b <= '9') return 160;
+    if (b == '_' || b == '.' || b == ',' || b == '(' || b == ')' || b == ';' || b == '=' || b == '"') return 170;
+    if (b < 0x80) return b < 0x20 ? 40 : 140;
+    if (b <= 0xBF) return 150;               // UTF-8 の継続バイト
+    if (b >= 0xE3 && b <= 0xE9) return 180;  // かな・漢字の先頭バイト
+    return 60;
+}
+
+class LiteralSearcher {
+public:
+    LiteralSearcher(std::string_view needle, bool matchCase) : n(needle.size()) {
+        if (matchCase) { val.assign(needle.begin(), needle.end()); mask.assign(n, 0); runLen = n; minLen = n; maxLen = n; }
+        else buildFolded(needle);
+        // 2 点目は連続部分の先頭以外で最も出現しにくいバイト
+        rare = runLen > 1 ? 1 : 0; int best = 1 << 30;
+        for (size_t k = 1; k < runLen; ++k) {
+            int r = literalByteRank(val[k]); if (mask[k]) r = std::max(r, literalByteRank((unsigned char)(val[k] & ~mask[k])));
+            if (r < best) { best = r; rare = k; }
+        }
+    }
+    size_t size() const { return n; }
+    size_t maxLength() const { return maxLen; } // 一致の長さの最大値 (大文字小文字を区別しないと needle より長くなることがある)
+    // 文書 [0, len) のうち [from, to) に始まる一致を前から探す。accept(pos, len) が false を返した一致は飛ばす。
+    // spanAt(pos, start) は pos を含む連続領域全体を返し、start にその先頭位置を入れる
+    template<class SpanAt, class Accept> size_t find(SpanAt&& spanAt, size_t len, size_t from, size_t to, Accept&& accept, size_t* matchLen = nullptr) const {
+        if (n == 0 || minLen > len) return npos;
+        to = std::min(to, len); if (from >= to) return npos;
+        Cursor<SpanAt> cur{ spanAt, len, 0, {} }; size_t best = npos, bestLen = 0, anchor = npos;
+        auto tryAt = [&](size_t c) {
+            size_t s, l; if (!verify(cur, c, s, l) || s < from || s >= to || (best != npos && s >= best) || !accept(s, l)) return false;
+            best = s; bestLen = l; return true;
+        };
+        size_t aTo = std::min(len - std::min(len, runLen) + 1, to + maxBack);
+        scan(spanAt, len, from + minBack, aTo, true, [&](size_t c) { if (!tryAt(c)) return false; anchor = c; return true; });
+        // 前の部分の長さが揺れる場合は、少し後ろの候補がより前から始まることがある
+        if (anchor != npos && maxBack > minBack) scan(spanAt, len, anchor + 1, std::min(aTo, anchor + 1 + maxBack - minBack), true, [&](size_t c) { tryAt(c); return false; });
+        if (matchLen && best != npos) *matchLen = bestLen;
+        return best;
+    }
+    // [from, to) に始まる一致を後ろから探す
+    template<class SpanAt, class Accept> size_t rfind(SpanAt&& spanAt, size_t len, size_t from, size_t to, Accept&& accept, size_t* matchLen = nullptr) const {
+        if (n == 0 || minLen > len) return npos;
+        to = std::min(to, len); if (from >= to) return npos;
+        Cursor<SpanAt> cur{ spanAt, len, 0, {} }; size_t best = npos, bestLen = 0, anchor = npos;
+        auto tryAt = [&](size_t c) {
+            size_t s, l; if (!verify(cur, c, s, l) || s < from || s >= to || (best != npos && s <= best) || !accept(s, l)) return false;
+            best = s; bestLen = l; return true;
+        };
+        size_t aFrom = from + minBack, aTo = std::min(len - std::min(len, runLen) + 1, to + maxBack);
+        scan(spanAt, len, aFrom, aTo, false, [&](size_t c) { if (!tryAt(c)) return false; anchor = c; return true; });
+        if (anchor != npos && maxBack > minBack) scan(spanAt, len, std::max(aFrom, anchor - std::min(anchor, maxBack - minBack)), anchor, false, [&](size_t c) { tryAt(c); return false; });
+        if (matchLen && best != npos) *matchLen = bestLen;
+        return best;
+    }
+    // 連続した文字列 text の from 以降を探す
+    template<class Accept> size_t find(std::string_view text, size_t from, Accept&& accept, size_t* matchLen = nullptr) const {
+        return find([text](size_t, size_t& start) { start = 0; return text; }, text.size(), from, text.size(), accept, matchLen);
+    }
+    // s 全体がちょうど 1 つの一致になっているか
+    bool matchesWhole(std::string_view s) const { return find(s, 0, [&](size_t pos, size_t l) { return pos == 0 && l == s.size(); }) == 0; }
+    static constexpr size_t npos = (size_t)-1;
+
+private:
+    // val/mask は一致の中で長さが変わらない連続部分 (needle の runStart バイト目から runLen バイト) の各バイト。
+    // (h | mask) == val で大文字小文字の違いを吸収する。ここで候補を絞り、exact でなければコードポイント単位で畳み込んで確かめる
+    size_t n, runLen = 0, rare = 0, minLen = 0, maxLen = 0, minBack = 0, maxBack = 0, backCps = 0; bool exact = true;
+    std::vector<unsigned char> val, mask; std::vector<uint32_t> folded; bool lead[256] = {};
+    void buildFolded(std::string_view needle) {
+        const unsigned char* p = (const unsigned char*)needle.data();
+        struct Cp { size_t off, len, minLen, maxLen; std::vector<std::string> variants; };
+        std::vector<Cp> cps;
+        for (size_t i = 0; i < n; ) {
+            size_t l; uint32_t c = decodeUtf8(p + i, n - i, l); Cp cp{ i, l, l, l, {} };
+            if (c >= 0x110000) { cp.variants.push_back(std::string(1, (char)p[i])); folded.push_back(c); }
+            else { forEachCaseVariant(c, [&](uint32_t v) { std::string e; appendUtf8(e, v); cp.variants.push_back(e); }); folded.push_back(foldCase(c)); }
+            for (const auto& v : cp.variants) { cp.minLen = std::min(cp.minLen, v.size()); cp.maxLen = std::max(cp.maxLen, v.size()); }
+            // ASCII 英字の組 (k と s はケルビン記号・長い s があるので除く) は (h | 0x20) == val だけで正確に判定できる
+            bool asciiPair = cp.variants.size() == 2 && l == 1 && cp.variants[0].size() == 1 && cp.variants[1].size() == 1 && ((cp.variants[0][0] ^ cp.variants[1][0]) == 0x20);
+            if (cp.variants.size() != 1 && !asciiPair) exact = false;
+            minLen += cp.minLen; maxLen += cp.maxLen; cps.push_back(std::move(cp)); i += l;
+        }
+        // 長さの変わらない文字が最も長く続く部分を照合の足場にする
+        size_t bestStart = cps.size(), bestBytes = 0;
+        for (size_t i = 0; i < cps.size(); ) {
+            if (cps[i].minLen != cps[i].maxLen) { ++i; continue; }
+            size_t j = i, bytes = 0; while (j < cps.size() && cps[j].minLen == cps[j].maxLen) bytes += cps[j++].len;
+            if (bytes > bestBytes) { bestBytes = bytes; bestStart = i; }
+            i = j;
+        }
+        if (bestStart == cps.size()) { for (const auto& v : cps[0].variants) lead[(unsigned char)v[0]] = true; return; } // 足場がなければ先頭文字の先頭バイトで絞る
+        for (size_t i = 0; i < bestStart; ++i) { minBack += cps[i].minLen; maxBack += cps[i].maxLen; }
+        backCps = bestStart; runLen = bestBytes;
+        for (size_t i = bestStart; i < cps.size() && cps[i].minLen == cps[i].maxLen; ++i)
+            for (size_t k = 0; k < cps[i].len; ++k) {
+                unsigned char b = p[cps[i].off + k], m = 0; for (const auto& v : cps[i].variants) m |= (unsigned char)(v[k] ^ b);
+                val.push_back((unsigned char)(b | m)); mask.push_back(m);
+            }
+    }
+    // 文書の任意の位置のバイトを読む。直前に読んだ連続領域を覚えておく
+    template<class SpanAt> struct Cursor {
+        SpanAt& spanAt; size_t len, s0 = 0; std::string_view v;
+        const unsigned char* ptr(size_t p, size_t k) {
+            if (p >= len || k > len - p) return nullptr;
+            if (p < s0 || p - s0 >= v.size()) { v = spanAt(p, s0); if (v.empty()) return nullptr; }
+            return p - s0 + k <= v.size() ? (const unsigned char*)v.data() + (p - s0) : nullptr;
+        }
+        int at(size_t p) { const unsigned char* q = ptr(p, 1); return q ? *q : -1; }
+        uint32_t decode(size_t p, size_t& l) {
+            if (const unsigned char* q = ptr(p, std::min<size_t>(4, len - p))) return decodeUtf8(q, std::min<size_t>(4, len - p), l);
+            unsigned char buf[4] = {}; size_t k = 0; for (; k < 4 && p + k < len; ++k) buf[k] = (unsigned char)at(p + k);
+            return decodeUtf8(buf, k, l);
+        }
+    };
+    // 足場の位置 c から一致全体 [s, s + l) を確かめる
+    template<class C> bool verify(C& cur, size_t c, size_t& s, size_t& l) const {
+        if (exact) { s = c; l = n; return true; } // 足場 = needle 全体で、バイト比較が済んでいる
+        s = c;
+        for (size_t i = 0; i < backCps; ++i) {
+            if (s == 0) return false;
+            size_t q = s - 1; while (q > 0 && s - q < 4 && (cur.at(q) & 0xC0) == 0x80) --q;
+            size_t cl; cur.decode(q, cl); s = q + cl == s ? q : s - 1;
+        }
+        size_t p = s;
+        for (uint32_t f : folded) {
+            if (p >= cur.len) return false;
+            size_t cl; uint32_t c2 = cur.decode(p, cl); if ((c2 >= 0x110000 ? c2 : foldCase(c2)) != f) return false;
+            p += cl;
+        }
+        l = p - s; return true;
+    }
+    // [from, to) の足場の候補を前から (forward) または後ろから順に hit に渡し、hit が true を返したら止める
+    template<class SpanAt, class Hit> void scan(SpanAt& spanAt, size_t len, size_t from, size_t to, bool forward, Hit&& hit) const {
+        if (from >= to) return;
+        for (size_t pos = forward ? from : to; forward ? pos < to : pos > from; ) {
+            size_t s0 = 0; std::string_view sp = spanAt(forward ? pos : pos - 1, s0); if (sp.empty()) return;
+            const unsigned char* h = (const unsigned char*)sp.data(); size_t e = s0 + sp.size();
+            size_t lo = std::max(from, s0), hi = std::min(to, e); // この領域で調べる候補 [lo, hi)
+            if (runLen == 0) {
+                if (forward) { for (size_t c = lo; c < hi; ++c) if (lead[h[c - s0]] && hit(c)) return; }
+                else { for (size_t c = hi; c-- > lo; ) if (lead[h[c - s0]] && hit(c)) return; }
+            } else {
+                size_t cross = std::max(lo, e >= runLen ? e - runLen + 1 : 0); // ここから後ろの候補は次の領域にまたがる
+                if (forward) {
+                    if (lo < std::min(hi, cross) && findIn(h, lo - s0, std::min(hi, cross) - 1 - s0, [&](size_t k) { return hit(s0 + k); }) != npos) return;
+                    for (size_t c = cross; c < hi; ++c) if (runAcross(spanAt, len, c) && hit(c)) return;
+                } else {
+                    for (size_t c = hi; c-- > std::max(lo, cross); ) if (runAcross(spanAt, len, c) && hit(c)) return;
+                    if (lo < std::min(hi, cross) && rfindIn(h, lo - s0, std::min(hi, cross) - 1 - s0, [&](size_t k) { return hit(s0 + k); }) != npos) return;
+                }
+            }
+            pos = forward ? e : s0;
+        }
+    }
+    bool matchAt(const unsigned char* h) const {
+        for (size_t k = 0; k < runLen; ++k) if ((unsigned char)(h[k] | mask[k]) != val[k]) return false;
+        return true;
+    }
+    // h[first..last] (両端を含む) に始まる足場の候補を前から探す。足場の末尾までが h の中にあること
+    template<class Accept> size_t findIn(const unsigned char* h, size_t first, size_t last, Accept&& accept) const {
+        if (runLen == 0 || first > last) return npos;
+        size_t i = first;
+#if defined(MIU_LITERAL_SSE2)
+        const __m128i v0 = _mm_set1_epi8((char)val[0]), m0 = _mm_set1_epi8((char)mask[0]), vr = _mm_set1_epi8((char)val[rare]), mr = _mm_set1_epi8((char)mask[rare]);
+        for (; i <= last && last - i >= 15; i += 16) {
+            __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(h + i)), m0), b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(h + i + rare)), mr);
+            unsigned bits = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, v0), _mm_cmpeq_epi8(b, vr)));
+            while (bits) { size_t c = i + lowestBit(bits); if (matchAt(h + c) && accept(c)) return c; bits &= bits - 1; }
+        }
+#elif defined(MIU_LITERAL_NEON)
+        const uint8x16_t v0 = vdupq_n_u8(val[0]), m0 = vdupq_n_u8(mask[0]), vr = vdupq_n_u8(val[rare]), mr = vdupq_n_u8(mask[rare]);
+        for (; i <= last && last - i >= 15; i += 16) {
+            uint8x16_t eq = vandq_u8(vceqq_u8(vorrq_u8(vld1q_u8(h + i), m0), v0), vceqq_u8(vorrq_u8(vld1q_u8(h + i + rare), mr), vr));
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) & 0x8888888888888888ull; // 1 バイトにつき 4 ビット
+            while (bits) { size_t c = i + lowestBit64(bits) / 4; if (matchAt(h + c) && accept(c)) return c; bits &= bits - 1; }
+        }
+#endif
+        for (; i <= last; ++i) if ((unsigned char)(h[i] | mask[0]) == val[0] && matchAt(h + i) && accept(i)) return i;
+        return npos;
+    }
+    // h[first..last] に始まる足場の候補を後ろから探す
+    template<class Accept> size_t rfindIn(const unsigned char* h, size_t first, size_t last, Accept&& accept) const {
+        if (runLen == 0 || first > last) return npos;
+        size_t end = last + 1; // [first, end) を後ろから 16 個ずつ
+#if defined(MIU_LITERAL_SSE2)
+        const __m128i v0 = _mm_set1_epi8((char)val[0]), m0 = _mm_set1_epi8((char)mask[0]), vr = _mm_set1_epi8((char)val[rare]), mr = _mm_set1_epi8((char)mask[rare]);
+        while (end - first >= 16) {
+            size_t i = end - 16;
+            __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(h + i)), m0), b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(h + i + rare)), mr);
+            unsigned bits = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, v0), _mm_cmpeq_epi8(b, vr)));
+            while (bits) { unsigned k = highestBit(bits); size_t c = i + k; if (matchAt(h + c) && accept(c)) return c; bits &= ~(1u << k); }
+            end = i;
+        }
+#elif defined(MIU_LITERAL_NEON)
+        const uint8x16_t v0 = vdupq_n_u8(val[0]), m0 = vdupq_n_u8(mask[0]), vr = vdupq_n_u8(val[rare]), mr = vdupq_n_u8(mask[rare]);
+        while (end - first >= 16) {
+            size_t i = end - 16;
+            uint8x16_t eq = vandq_u8(vceqq_u8(vorrq_u8(vld1q_u8(h + i), m0), v0), vceqq_u8(vorrq_u8(vld1q_u8(h + i + rare), mr), vr));
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) & 0x8888888888888888ull;
+            while (bits) { unsigned k = highestBit64(bits); size_t c = i + k / 4; if (matchAt(h + c) && accept(c)) return c; bits &= ~(1ull << k); }
+            end = i;
+        }
+#endif
+        while (end > first) { size_t i = --end; if ((unsigned char)(h[i] | mask[0]) == val[0] && matchAt(h + i) && accept(i)) return i; }
+        return npos;
+    }
+    // 領域の境界をまたぐ足場の候補を 1 バイトずつ確かめる
+    template<class SpanAt> bool runAcross(SpanAt&& spanAt, size_t len, size_t c) const {
+        if (c + runLen > len) return false;
+        size_t k = 0;
+        while (k < runLen) {
+            size_t s0 = 0; std::string_view sp = spanAt(c + k, s0); if (sp.empty()) return false;
+            const unsigned char* h = (const unsigned char*)sp.data() + (c + k - s0); size_t avail = sp.size() - (c + k - s0);
+            for (size_t j = 0; j < avail && k < runLen; ++j, ++k) if ((unsigned char)(h[j] | mask[k]) != val[k]) return false;
+        }
+        return true;
+    }
+    static unsigned lowestBit(unsigned v) {
+#if defined(_MSC_VER)
+        unsigned long i; _BitScanForward(&i, v); return (unsigned)i;
+#else
+        return (unsigned)__builtin_ctz(v);
+#endif
+    }
+    static unsigned highestBit(unsigned v) {
+#if defined(_MSC_VER)
+        unsigned long i; _BitScanReverse(&i, v); return (unsigned)i;
+#else
+        return 31u - (unsigned)__builtin_clz(v);
+#endif
+    }
+    static unsigned lowestBit64(uint64_t v) {
+#if defined(_MSC_VER)
+        unsigned long i; _BitScanForward64(&i, v); return (unsigned)i;
+#else
+        return (unsigned)__builtin_ctzll(v);
+#endif
+    }
+    static unsigned highestBit64(uint64_t v) {
+#if defined(_MSC_VER)
+        unsigned long i; _BitScanReverse64(&i, v); return (unsigned)i;
+#else
+        return 63u - (unsigned)__builtin_clzll(v);
+#endif
+    }
+};
+
+} // namespace miu
@@ -0,0 +1,48 @@
+// miu の LRU キャッシュ (ヘッダのみ)。文字列をキーに最近使った capacity 個の値を持ち、あふれたら最も古く使ったものから捨てる。
+// 行のレイアウトのように、作るのは高いが同じ内容なら使い回せるものに使う。値の大きさがキーの長さに比例するときは、
+// キーの合計バイト数の上限 keyByteCap でも古いものから捨てる (長い行がいくつあっても際限なく増えない)
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace miu {
+
+template <class V>
+class LruCache {
+public:
+    struct Stats { uint64_t hits = 0, misses = 0, evictions = 0; };
+    explicit LruCache(size_t capacity, size_t keyByteCap = 0) : cap(capacity ? capacity : 1), byteCap(keyByteCap) {}
+    LruCache(const LruCache&) = delete; LruCache& operator=(const LruCache&) = delete;
+    // key の値があれば最近使ったものにして返す。なければ make() で作って入れる (make は V を返す)
+    template <class Make>
+    V& get(std::string_view key, Make&& make) {
+        auto it = index.find(key);
+        if (it != index.end()) { st.hits++; items.splice(items.begin(), items, it->second); return it->second->second; }
+        st.misses++;
+        // 上限を超える 1 つのキーは、それだけを持つ (返す参照は次に get するまで有効でなければならない)
+        while (!items.empty() && (items.size() >= cap || (byteCap && keyBytes + key.size() > byteCap))) { keyBytes -= items.back().first.capacity(); index.erase(items.back().first); items.pop_back(); st.evictions++; }
+        items.emplace_front(std::string(key), make()); keyBytes += items.front().first.capacity();
+        index.emplace(items.front().first, items.begin());
+        return items.front().second;
+    }
+    void clear() { index.clear(); items.clear(); keyBytes = 0; }
+    size_t size() const { return items.size(); }
+    // 使っているヒープのおおよそのバイト数 (キーの文字列と、リストと索引のノード。値が別に持つ領域は含まない)
+    size_t bytes() const { return keyBytes + items.size() * (sizeof(typename Items::value_type) + 2 * sizeof(void*) + sizeof(typename Index::value_type) + 2 * sizeof(void*)) + index.bucket_count() * sizeof(void*); }
+    size_t capacity() const { return cap; }
+    const Stats& stats() const { return st; }
+    void resetStats() { st = Stats(); }
+
+private:
+    // index のキーは items の中の文字列を指す (list の要素は動かないので消すまで有効)
+    using Items = std::list<std::pair<std::string, V>>;
+    using Index = std::unordered_map<std::string_view, typename Items::iterator>;
+    size_t cap, byteCap; Items items; Index index; Stats st; size_t keyBytes = 0;
+};
+
+} // namespace miu
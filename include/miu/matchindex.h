@@ -0,0 +1,262 @@
+// miu の検索結果の索引 (ヘッダのみ)。検索条件ごとに文書中の一致を区間 (チャンク) に分けて覚えておき、
+// 文書が編集されたら、編集の影響を受けるチャンクだけを探し直して最新の版に追いつく。
+// 次を検索・ハイライト・すべて置換・「N / M 件」の表示は同じ索引を読む。検索語を打っている間は IndexBuilder が別のスレッドで索引を作る。
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "parallel.h"
+
+namespace miu {
+
+// 文書の 1 回の変更: pos から removed バイトを消し、同じ位置に inserted バイトを入れた
+struct TextChange { size_t pos = 0, removed = 0, inserted = 0; };
+
+// 文書の版と直近の変更の記録。変更のたびに版が 1 つ進む。古い記録は捨てる
+class ChangeLog {
+public:
+    static constexpr size_t kMaxChanges = 4096;
+    uint64_t version() const { return ver; }
+    void record(size_t pos, size_t removed, size_t inserted) {
+        if (changes.size() >= kMaxChanges) { changes.erase(changes.begin(), changes.begin() + kMaxChanges / 2); oldest += kMaxChanges / 2; }
+        changes.push_back({ pos, removed, inserted }); ++ver;
+    }
+    // 文書全体が入れ替わった (ファイルを開いたなど)
+    void reset() { oldest = ++ver; changes.clear(); }
+    // 版 v から今の版までの変更を first から count 個。記録が残っていなければ false
+    bool since(uint64_t v, const TextChange*& first, size_t& count) const {
+        if (v < oldest || v > ver) return false;
+        first = changes.data() + (v - oldest); count = (size_t)(ver - v); return true;
+    }
+private:
+    uint64_t ver = 0, oldest = 0; std::vector<TextChange> changes; // changes[i] は版 oldest + i から次の版への変更
+};
+
+// 1 つの検索条件についての一致の索引。一致は重ならず文書順に並ぶ (1 スレッドで先頭から順に探した場合と同じ)。
+// 各チャンクは「どこから探し始めたか」と「判定のためにどこまで読んだか」を覚えておき、その範囲に触れた編集があったときだけ探し直す
+class MatchIndex {
+public:
+    // scan(from, limit, hits, reach): from から探し、開始位置が limit より前の一致を文書順に hits に追加する。
+    // reach には判定のために読んだ範囲の終わり (その位置は含まない。文書の末尾を確かめたら文書の長さ + 1) を入れる。予算切れなら false
+    using ScanFn = std::function<bool(size_t from, size_t limit, std::vector<SearchHit>& hits, size_t& reach)>;
+    using ResumeFn = std::function<size_t(const SearchHit&)>; // その一致の次に探し始める位置
+    using AlignFn = std::function<size_t(size_t)>;            // チャンクの区切りを文字の先頭に合わせる
+    using ProgressFn = std::function<void(size_t found, const SearchHit* first)>; // それまでに見つけた件数と、最初に選ぶ一致 (まだなければ null)
+    static constexpr size_t kChunk = 1 << 17;
+    static constexpr size_t kLookBehind = 4;     // 探し始めの位置より前を読む最大バイト数 (直前の 1 文字)
+    static constexpr size_t kMaxHits = 1 << 22;  // これより多い一致 (空一致を大量に生むパターンなど) は覚えない
+
+    const std::string& key() const { return k; }
+    void reset(const std::string& key) { k = key; chunks.clear(); prefix.clear(); state = Empty; ver = 0; }
+    // 一致をすべて覚えているか (予算切れや件数の上限で作れなかったら false)
+    bool complete() const { return state == Complete; }
+    // 文書の最新の版に追いついているか (追いついていれば update() は何もしない)
+    bool current(const ChangeLog& log) const { return state != Empty && ver == log.version(); }
+    // update() が作り直さずに済むか (最新の版に追いついているか、前の版からの変更の記録が残っている)
+    bool updatable(const ChangeLog& log) const { const TextChange* ch; size_t n; return current(log) || (state == Complete && log.since(ver, ch, n)); }
+    // 文書の最新の版 log.version() に追いつかせる (len はその版の文書の長さ)。戻り値は complete()
+    bool update(const ChangeLog& log, size_t len, const AlignFn& align, const ScanFn& scan, const ResumeFn& resume) {
+        if (state != Empty && ver == log.version()) return complete();
+        const TextChange* ch = nullptr; size_t n = 0;
+        bool incremental = state == Complete && log.since(ver, ch, n);
+        ver = log.version();
+        if (incremental) {
+            for (size_t i = 0; i < n; ++i) apply(ch[i]);
+            split(align);
+            if (!fix(len, scan, resume)) return fail();
+        }
+        else if (!build(len, align, scan, resume)) return fail();
+        return finish();
+    }
+    // 版 version の文書 (長さ len) について 1 つのスレッドで作り直す (別のスレッドで作るとき用。ワーカープールは使わない)。
+    // anchor を含むチャンクから末尾へ、続けて先頭から探し、チャンクを 1 つ探すたびに progress を呼ぶ。最初に選ぶ一致は anchor 以降の最初の一致で、
+    // なければ先頭に戻って最初の一致。cancel が立ったら途中でやめる。戻り値は complete()
+    bool rebuild(uint64_t version, size_t len, size_t anchor, const AlignFn& align, const ScanFn& scan, const ResumeFn& resume, const std::atomic<bool>& cancel, const ProgressFn& progress) {
+        ver = version; partition(len, align);
+        size_t n = chunks.size(), a = (size_t)(std::upper_bound(chunks.begin(), chunks.end(), anchor, [](size_t p, const Chunk& x) { return p < x.start; }) - chunks.begin()) - 1, found = 0;
+        SearchHit first; bool hasFirst = false;
+        for (size_t j = 0; j < n; ++j) {
+            size_t i = (a + j) % n;
+            if (cancel.load() || !scanChunk(i, chunks[i].start, scan) || (found += chunks[i].hits.size()) > kMaxHits) return fail();
+            if (!hasFirst) for (const auto& h : chunks[i].hits) if (j > 0 || h.pos + chunks[i].start >= anchor) { first = h; first.pos += chunks[i].start; hasFirst = true; break; }
+            if (!hasFirst && j + 1 == n && !chunks[a].hits.empty()) { first = chunks[a].hits.front(); first.pos += chunks[a].start; hasFirst = true; }
+            if (progress) progress(found, hasFirst ? &first : nullptr);
+        }
+        if (cancel.load() || !fix(len, scan, resume)) return fail();
+        return finish();
+    }
+    size_t count() const { return prefix.empty() ? 0 : prefix.back(); }
+    // 使っているヒープのバイト数 (容量ベース)
+    size_t bytes() const {
+        size_t b = chunks.capacity() * sizeof(Chunk) + prefix.capacity() * sizeof(size_t) + k.capacity();
+        for (const auto& c : chunks) b += c.hits.capacity() * sizeof(SearchHit);
+        return b;
+    }
+    SearchHit at(size_t i) const {
+        size_t c = (size_t)(std::upper_bound(prefix.begin(), prefix.end(), i) - prefix.begin()) - 1;
+        SearchHit h = chunks[c].hits[i - prefix[c]]; h.pos += chunks[c].start; return h;
+    }
+    // 開始位置が pos 以上の最初の一致の番号 (なければ count())
+    size_t lowerBound(size_t pos) const {
+        if (chunks.empty()) return 0;
+        size_t c = (size_t)(std::upper_bound(chunks.begin(), chunks.end(), pos, [](size_t p, const Chunk& x) { return p < x.start; }) - chunks.begin());
+        if (c == 0) return 0;
+        const Chunk& x = chunks[--c];
+        return prefix[c] + (size_t)(std::lower_bound(x.hits.begin(), x.hits.end(), pos - x.start, [](const SearchHit& h, size_t p) { return h.pos < p; }) - x.hits.begin());
+    }
+    // [lo, hi) と重なる一致 (hi の位置の空一致を含む) を文書順に fn(hit) に渡す
+    template<class Fn> void forEachOverlapping(size_t lo, size_t hi, Fn&& fn) const {
+        size_t i = lowerBound(lo), total = count();
+        if (i > 0) { SearchHit h = at(i - 1); if (h.pos + h.len > lo) i--; }
+        if (i >= total) return;
+        size_t c = (size_t)(std::upper_bound(prefix.begin(), prefix.end(), i) - prefix.begin()) - 1, k = i - prefix[c];
+        for (; c < chunks.size(); ++c, k = 0)
+            for (; k < chunks[c].hits.size(); ++k) {
+                SearchHit h = chunks[c].hits[k]; h.pos += chunks[c].start;
+                if (h.pos > hi || (h.pos == hi && h.len > 0)) return;
+                fn(h);
+            }
+    }
+
+private:
+    // from / reach / hits[].pos は start からの相対位置。hits はこのチャンク [start, start + len) に始まる一致
+    struct Chunk { size_t start = 0, len = 0, from = 0, reach = 0; bool dirty = true; std::vector<SearchHit> hits; };
+    enum State { Empty, Complete, Failed };
+    std::string k; std::vector<Chunk> chunks; std::vector<size_t> prefix; State state = Empty; uint64_t ver = 0; size_t docLen = 0;
+
+    bool fail() { chunks.clear(); prefix.clear(); state = Failed; return false; }
+    bool finish() {
+        prefix.assign(1, 0); for (const auto& c : chunks) prefix.push_back(prefix.back() + c.hits.size());
+        if (count() > kMaxHits) return fail();
+        state = Complete; return true;
+    }
+    // チャンク i を from から探し直す。最後のチャンクは文書の末尾の空一致まで含める
+    bool scanChunk(size_t i, size_t from, const ScanFn& scan) {
+        Chunk& c = chunks[i]; size_t limit = i + 1 < chunks.size() ? c.start + c.len : docLen + 1, reach = from;
+        std::vector<SearchHit> hits;
+        if (from < limit && !scan(from, limit, hits, reach)) return false;
+        for (auto& h : hits) h.pos -= c.start;
+        c.hits = std::move(hits); c.from = from - c.start; c.reach = std::max(reach, from) - c.start; c.dirty = false;
+        return true;
+    }
+    // 長さ len の文書を kChunk ごとのチャンクに区切る (どれも探し直しの印付き)
+    void partition(size_t len, const AlignFn& align) {
+        docLen = len; chunks.clear();
+        std::vector<size_t> b{ 0 };
+        for (size_t p = kChunk; p < len; p += kChunk) { size_t q = align(p); if (q > b.back() && q < len) b.push_back(q); }
+        for (size_t i = 0; i < b.size(); ++i) { Chunk c; c.start = b[i]; c.len = (i + 1 < b.size() ? b[i + 1] : len) - b[i]; chunks.push_back(std::move(c)); }
+    }
+    // チャンクごとに並列に探し、前のチャンクの最後の一致がはみ出していたところだけ続きから探し直す
+    bool build(size_t len, const AlignFn& align, const ScanFn& scan, const ResumeFn& resume) {
+        partition(len, align);
+        std::atomic<size_t> found{ 0 }; std::atomic<bool> failed{ false };
+        WorkerPool::shared().run(chunks.size(), [&](size_t i) {
+            if (failed.load()) return;
+            if (!scanChunk(i, chunks[i].start, scan) || (found += chunks[i].hits.size()) > kMaxHits) failed = true;
+        });
+        return !failed.load() && fix(len, scan, resume);
+    }
+    // 1 つの変更をチャンクに反映する。読んだ範囲に変更が触れたチャンクは探し直しの印を付け、後ろのチャンクはずらす
+    void apply(const TextChange& ch) {
+        size_t a = ch.pos, r = ch.removed, ins = ch.inserted;
+        auto map = [&](size_t p) { return p <= a ? p : (p >= a + r ? p - r : a) + ins; };
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            Chunk& c = chunks[i]; size_t s = c.start, e = s + c.len;
+            if (!c.dirty) {
+                size_t d0 = std::min(s, s + c.from >= kLookBehind ? s + c.from - kLookBehind : 0), d1 = std::max(e, s + c.reach);
+                if (a <= d1 && a + r >= d0) c.dirty = true;
+            }
+            size_t ne = i + 1 == chunks.size() && a == docLen ? e + ins : map(e); // 文書の末尾への挿入は最後のチャンクに入る
+            c.start = map(s); c.len = ne - c.start;
+        }
+        docLen = docLen - r + ins;
+        for (size_t i = 0; i < chunks.size() && chunks.size() > 1; ) {
+            if (chunks[i].len > 0) { ++i; continue; }
+            chunks.erase(chunks.begin() + (ptrdiff_t)i);
+            if (i > 0) chunks[i - 1].dirty = true;
+            if (i < chunks.size()) chunks[i].dirty = true;
+        }
+        chunks[0].start = 0;
+    }
+    // 探し直すチャンクが長くなりすぎていたら分ける
+    void split(const AlignFn& align) {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            if (!chunks[i].dirty || chunks[i].len <= 2 * kChunk) continue;
+            size_t s = chunks[i].start, e = s + chunks[i].len, q = align(s + kChunk);
+            if (q <= s || q >= e) continue;
+            Chunk tail; tail.start = q; tail.len = e - q;
+            chunks[i].len = q - s; chunks.insert(chunks.begin() + (ptrdiff_t)i + 1, std::move(tail));
+        }
+    }
+    // 印の付いたチャンクと、探し始めの位置 (前の一致の続き) が変わったチャンクを前から順に探し直す
+    bool fix(size_t len, const ScanFn& scan, const ResumeFn& resume) {
+        docLen = len; size_t r = 0;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            Chunk& c = chunks[i]; size_t from = std::max(c.start, r);
+            if ((c.dirty || c.start + c.from != from) && !scanChunk(i, from, scan)) return false;
+            if (!c.hits.empty()) { SearchHit h = c.hits.back(); h.pos += c.start; r = resume(h); }
+        }
+        return true;
+    }
+};
+
+// 索引を別のスレッドで作る。新しく作り始めると前の仕事は取り消す。
+// UI のスレッドは progress() で途中の件数と最初の一致を読み、できあがった索引を take() で受け取る
+class IndexBuilder {
+public:
+    struct Progress { std::string key; uint64_t version = 0; size_t found = 0; bool hasFirst = false, done = false; SearchHit first; };
+    // build(out, cancel, progress) は out に索引を作る。cancel が立ったら途中でやめてよい
+    using BuildFn = std::function<void(MatchIndex& out, const std::atomic<bool>& cancel, const MatchIndex::ProgressFn& progress)>;
+    static constexpr int kNotifyIntervalMs = 50;
+    IndexBuilder() = default;
+    IndexBuilder(const IndexBuilder&) = delete; IndexBuilder& operator=(const IndexBuilder&) = delete;
+    ~IndexBuilder() { stop(); }
+    // 版 version の文書について key の索引を作り始める。notify は作っているスレッドから、最初の一致が見つかったとき、
+    // 件数が増えたとき (kNotifyIntervalMs ごと)、できあがったときに呼ばれる
+    void start(const std::string& key, uint64_t version, BuildFn build, std::function<void()> notify) {
+        stop();
+        { std::lock_guard<std::mutex> lk(mu); st = Progress(); st.key = key; st.version = version; result = MatchIndex(); active = true; }
+        cancel = false;
+        worker = std::thread([this, build = std::move(build), notify = std::move(notify)] {
+            auto last = std::chrono::steady_clock::now();
+            MatchIndex idx;
+            build(idx, cancel, [&](size_t found, const SearchHit* first) {
+                bool firstNew;
+                { std::lock_guard<std::mutex> lk(mu); firstNew = first && !st.hasFirst; st.found = found; if (firstNew) { st.hasFirst = true; st.first = *first; } }
+                auto now = std::chrono::steady_clock::now();
+                if (notify && (firstNew || now - last >= std::chrono::milliseconds(kNotifyIntervalMs))) { last = now; notify(); }
+            });
+            if (cancel.load()) return;
+            { std::lock_guard<std::mutex> lk(mu); result = std::move(idx); st.done = true; }
+            if (notify) notify();
+        });
+    }
+    // 作っている途中なら取り消し、スレッドが終わるのを待つ
+    void stop() {
+        cancel = true; if (worker.joinable()) worker.join();
+        std::lock_guard<std::mutex> lk(mu); active = false; result = MatchIndex();
+    }
+    // key の索引を作っているか、できあがって受け取られるのを待っている
+    bool pending(const std::string& key) const { std::lock_guard<std::mutex> lk(mu); return active && st.key == key; }
+    Progress progress() const { std::lock_guard<std::mutex> lk(mu); return active ? st : Progress(); }
+    // できあがって受け取られるのを待っている索引のバイト数 (作っている途中の分は数えない)
+    size_t bytes() const { std::lock_guard<std::mutex> lk(mu); return result.bytes(); }
+    // できあがった索引を out に移す (まだできていなければ false)
+    bool take(MatchIndex& out) {
+        std::lock_guard<std::mutex> lk(mu);
+        if (!active || !st.done) return false;
+        out = std::move(result); result = MatchIndex(); active = false; return true;
+    }
+private:
+    mutable std::mutex mu; std::thread worker; std::atomic<bool> cancel{ false };
+    Progress st; MatchIndex result; bool active = false;
+};
+
+} // namespace miu
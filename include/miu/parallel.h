@@ -0,0 +1,112 @@
+// miu の並列検索 (ヘッダのみ)。文書を区間に分けてワーカースレッドで調べ、結果を文書順につなぐ。
+// 区間の境界をまたぐ一致や、前の区間の最後の一致が次の区間に食い込む場合も、1 スレッドで前から順に探したときと同じ結果になる。
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace miu {
+
+// 固定数のワーカースレッド。run() は呼び出し元のスレッドも処理に加わり、すべての仕事が終わるまで戻らない。
+// 同時に走る run() は 1 つだけで、fn の中から run() を呼んではいけない
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned workers) { for (unsigned i = 0; i < workers; ++i) threads.emplace_back([this] { loop(); }); }
+    ~WorkerPool() { { std::lock_guard<std::mutex> lk(mu); stopping = true; } cv.notify_all(); for (auto& t : threads) t.join(); }
+    WorkerPool(const WorkerPool&) = delete; WorkerPool& operator=(const WorkerPool&) = delete;
+    static WorkerPool& shared() { static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1); return pool; }
+    unsigned concurrency() const { return (unsigned)threads.size() + 1; }
+    // fn(i) を i = 0..count-1 について並列に呼ぶ。i は小さい順に配られる
+    void run(size_t count, const std::function<void(size_t)>& fn) {
+        if (count == 0) return;
+        if (count == 1 || threads.empty()) { for (size_t i = 0; i < count; ++i) fn(i); return; }
+        std::lock_guard<std::mutex> one(runMu);
+        auto job = std::make_shared<Job>(); job->fn = &fn; job->count = count;
+        { std::lock_guard<std::mutex> lk(mu); current = job; ++generation; }
+        cv.notify_all();
+        work(*job);
+        std::unique_lock<std::mutex> lk(mu); doneCv.wait(lk, [&] { return job->done == count; }); current.reset();
+    }
+
+private:
+    struct Job { const std::function<void(size_t)>* fn = nullptr; size_t count = 0; std::atomic<size_t> next{ 0 }; size_t done = 0; };
+    void work(Job& j) {
+        size_t finished = 0;
+        for (size_t i; (i = j.next.fetch_add(1)) < j.count; ) { (*j.fn)(i); ++finished; }
+        if (finished) { std::lock_guard<std::mutex> lk(mu); j.done += finished; if (j.done == j.count) doneCv.notify_all(); }
+    }
+    void loop() {
+        uint64_t seen = 0;
+        for (;;) {
+            std::shared_ptr<Job> job;
+            { std::unique_lock<std::mutex> lk(mu); cv.wait(lk, [&] { return stopping || (current && generation != seen); }); if (stopping) return; seen = generation; job = current; }
+            work(*job);
+        }
+    }
+    std::vector<std::thread> threads; std::mutex mu, runMu; std::condition_variable cv, doneCv;
+    std::shared_ptr<Job> current; uint64_t generation = 0; bool stopping = false;
+};
+
+struct SearchHit { size_t pos = 0, len = 0; };
+
+// 並列にする区間の最小の長さ。これより短い範囲は 1 スレッドで探す
+constexpr size_t kMinSearchPartition = 1 << 20;
+
+// [from, to) を区切る。区切り位置は align(pos) で文字の先頭に合わせる (戻り値は from と to を含む昇順の列)
+template<class Align> std::vector<size_t> searchPartitions(size_t from, size_t to, Align&& align, size_t minPart = kMinSearchPartition) {
+    std::vector<size_t> b{ from };
+    size_t span = to > from ? to - from : 0, parts = std::min<size_t>(span / std::max<size_t>(minPart, 1), (size_t)WorkerPool::shared().concurrency() * 4);
+    for (size_t i = 1; i < parts; ++i) { size_t p = align(from + span / parts * i); if (p > b.back() && p < to) b.push_back(p); }
+    if (to > from) b.push_back(to);
+    return b;
+}
+
+// 区間ごとに最初 (backward なら最後) の一致を探し、範囲全体で最初 (最後) の一致を out に入れる。
+// findIn(lo, hi, hit) は [lo, hi) に始まる一致を探して hit に入れ、見つかれば true を返す。答えの出た区間より遠い区間は調べない
+template<class Hit, class FindIn> bool parallelFindFirst(const std::vector<size_t>& bounds, bool backward, FindIn&& findIn, Hit& out) {
+    if (bounds.size() < 2) return false;
+    size_t parts = bounds.size() - 1; std::vector<Hit> hits(parts); std::atomic<size_t> best{ parts }; // best は探す順で数えた区間番号
+    WorkerPool::shared().run(parts, [&](size_t k) {
+        if (k > best.load()) return;
+        size_t i = backward ? parts - 1 - k : k;
+        if (!findIn(bounds[i], bounds[i + 1], hits[i])) return;
+        size_t cur = best.load(); while (k < cur && !best.compare_exchange_weak(cur, k)) {}
+    });
+    if (best.load() == parts) return false;
+    out = std::move(hits[backward ? parts - 1 - best.load() : best.load()]); return true;
+}
+
+// 1 スレッドで前から順に列挙した場合と同じ一致の列を、区間ごとに並列に集めて out に追加する。
+// scan(from, limit, emit) は from から順に探し、開始位置が limit より前の一致ごとに emit(hit) を呼ぶ (emit が false を返したら止める)。
+// scan が false を返したら (予算切れなど) 全体も false を返す。resume(hit) はその一致の次に探し始める位置
+template<class Hit, class Scan, class Resume> bool parallelFindAll(const std::vector<size_t>& bounds, Scan&& scan, Resume&& resume, std::vector<Hit>& out) {
+    if (bounds.size() < 2) return true;
+    size_t parts = bounds.size() - 1; std::vector<std::vector<Hit>> hits(parts); std::vector<char> ok(parts, 1);
+    WorkerPool::shared().run(parts, [&](size_t i) { ok[i] = scan(bounds[i], bounds[i + 1], [&](const Hit& h) { hits[i].push_back(h); return true; }) ? 1 : 0; });
+    if (std::find(ok.begin(), ok.end(), 0) != ok.end()) return false;
+    size_t base = out.size();
+    for (size_t i = 0; i < parts; ++i) {
+        std::vector<Hit>& h = hits[i];
+        size_t r = out.size() > base ? resume(out.back()) : bounds[0];
+        if (r <= bounds[i]) { out.insert(out.end(), std::make_move_iterator(h.begin()), std::make_move_iterator(h.end())); continue; }
+        // 前の一致がこの区間に食い込んでいる: その続きから探し直し、区間の結果と同じ一致に出会ったら残りは区間の結果を使う
+        size_t sync = h.size();
+        bool good = scan(r, bounds[i + 1], [&](const Hit& x) {
+            auto it = std::lower_bound(h.begin(), h.end(), x.pos, [](const Hit& a, size_t p) { return a.pos < p; });
+            if (it != h.end() && it->pos == x.pos && it->len == x.len) { sync = (size_t)(it - h.begin()); return false; }
+            out.push_back(x); return true;
+        });
+        if (!good) return false;
+        out.insert(out.end(), std::make_move_iterator(h.begin() + (ptrdiff_t)sync), std::make_move_iterator(h.end()));
+    }
+    return true;
+}
+
+} // namespace miu
@@ -0,0 +1,692 @@
+// miu の検索・ハイライト用正規表現エンジン (ヘッダのみ)。
+// パターンを Thompson NFA にコンパイルし、遅延構築の DFA と Pike VM で実行するため、どんなパターンでも入力長に対して線形時間で終わる。
+// 構文は ECMAScript のうち正規言語で表せるもの。後方参照と先読み/後読みは使えない (末尾の (?=...) だけは扱える)。
+// ^ と $ は常に複数行モードで、\r\n / \r / \n を行末とみなす (\r と \n の間には一致しない)。
+// 入力は UTF-8 としてコードポイント単位で照合し、位置と長さはバイト単位で返す。
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include "unicode.h"
+
+namespace miu {
+
+inline bool isRegexWordByte(int b) { return (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || (b >= '0' && b <= '9') || b == '_'; }
+
+struct RegexMatch {
+    static constexpr size_t npos = (size_t)-1;
+    size_t pos = npos, len = 0;
+    std::vector<size_t> caps; // グループ i の開始/終了が caps[2i], caps[2i+1] (未一致は npos)
+    bool matched(int g) const { return 2 * (size_t)g + 1 < caps.size() && caps[2 * g] != npos && caps[2 * g + 1] != npos; }
+    size_t start(int g) const { return caps[2 * g]; }
+    size_t end(int g) const { return caps[2 * g + 1]; }
+};
+// before/after は text の直前/直後のバイト (-1 ならそこが文書の先頭/末尾)。budget は VM の実行ステップ数の上限 (0 は無制限)。
+// 文書を連続したバイト列の断片として渡すための関数。pos (< 文書長) から始まる、空でない連続領域を返す。
+using RegexSpanFn = std::function<std::string_view(size_t pos)>;
+struct RegexSearchOptions {
+    size_t budget = 0;
+    int before = -1, after = -1;
+    bool anchored = false;  // start の位置から始まる一致だけを探す
+    bool fullMatch = false; // 一致の終わりが text の末尾であることを要求する
+    size_t startLimit = (size_t)-1; // これより前に始まる一致だけを探す (文書を区間に分けて並列に探すときの区間の終わり)
+    size_t* reach = nullptr;        // 指定すると、結果を決めるために読んだ範囲の終わり (文書の末尾を確かめたら len + 1) の最大値を書き込む
+    const std::atomic<bool>* cancel = nullptr; // 別のスレッドがこれを立てたら、予算切れと同じく BudgetExceeded で打ち切る
+    // この時刻を過ぎたら予算切れと同じく打ち切る (既定値なら期限なし)。ステップ数は DFA の状態を作る手間を正確には表さないので、
+    // UI のスレッドで探すときはこちらで待ち時間を抑える
+    std::chrono::steady_clock::time_point deadline{};
+};
+
+class Regex {
+public:
+    enum Flags { None = 0, IgnoreCase = 1, AnyNewline = 2 }; // AnyNewline: パターン中の \n を \r\n / \r / \n のいずれにも一致させる
+    enum Status { Found, NotFound, BudgetExceeded, Invalid };
+    static constexpr size_t kMaxInsts = 1 << 16;
+
+    Regex() = default;
+    explicit Regex(std::string_view pattern, int flags = None) { compile(pattern, flags); }
+    bool ok() const { return err.empty() && !prog.empty(); }
+    const std::string& error() const { return err; }
+    int groupCount() const { return ngroups; }
+    const std::string& pattern() const { return src; }
+    int flags() const { return flg; }
+
+    // text[start..len) から最も左の一致 (同じ位置なら ECMAScript と同じ優先順位) を探す
+    Status search(const char* text, size_t len, size_t start, RegexMatch& m, const RegexSearchOptions& o = RegexSearchOptions()) const {
+        return search(contiguous(text, len), len, start, m, o);
+    }
+    Status search(std::string_view text, size_t start, RegexMatch& m, const RegexSearchOptions& o = RegexSearchOptions()) const { return search(text.data(), text.size(), start, m, o); }
+    // 断片に分かれた文書 (ピーステーブルなど) を、全体をコピーせずに先頭から順に読みながら探す
+    Status search(const RegexSpanFn& src, size_t len, size_t start, RegexMatch& m, const RegexSearchOptions& o = RegexSearchOptions()) const {
+        if (!ok()) return Invalid;
+        Vm vm(*this, src, len); Status st = vm.run(start, m, o);
+        if (o.reach) *o.reach = std::max(*o.reach, vm.reach);
+        return st;
+    }
+    // 一致を順に列挙する (空一致の後は 1 文字進める)。fn が false を返すか予算を使い切ると止まる。
+    // 最後まで列挙できたら Found、途中で打ち切られたら BudgetExceeded を返す。
+    template<class Fn> Status forEach(const char* text, size_t len, size_t start, Fn&& fn, const RegexSearchOptions& o = RegexSearchOptions()) const {
+        return forEach(contiguous(text, len), len, start, std::forward<Fn>(fn), o);
+    }
+    template<class Fn> Status forEach(const RegexSpanFn& src, size_t len, size_t start, Fn&& fn, const RegexSearchOptions& o = RegexSearchOptions()) const {
+        if (!ok()) return Invalid;
+        Vm vm(*this, src, len); RegexMatch m; size_t pos = start; RegexSearchOptions opt = o; size_t used = 0;
+        vm.memoDead = prog.size() <= Vm::kDeadMaxInsts;
+        auto done = [&](Status st) { if (o.reach) *o.reach = std::max(*o.reach, vm.reach); return st; };
+        while (pos <= len) {
+            if (o.budget) { if (used >= o.budget) return done(BudgetExceeded); opt.budget = o.budget - used; }
+            vm.deadFloor = pos; Status st = vm.run(pos, m, opt); used += vm.steps;
+            if (st != Found) return done(st == NotFound ? Found : st);
+            if (!fn((const RegexMatch&)m)) return done(Found);
+            if (m.len > 0) pos = m.pos + m.len;
+            else { if (m.pos >= len) break; size_t l; vm.r.decode(m.pos, l); pos = m.pos + l; vm.touch(pos); }
+        }
+        return done(Found);
+    }
+    // limit より前に始まる最後の一致を探す。limit の手前の窓を前向きに列挙し、見つからなければ窓を倍に広げるので、
+    // 手間は文書の先頭からの位置ではなく、直前の一致までの距離に比例する。windowStart(pos) は窓の始まりを pos 以前の行頭などに合わせる。
+    // 結果は窓の始まりから forEach で列挙したときの最後の一致 (行をまたがない一致なら、行頭から列挙しても文書の先頭から列挙しても同じ)
+    static constexpr size_t kBackwardWindow = 1 << 16;
+    template<class WindowStart> Status searchBackward(const RegexSpanFn& src, size_t len, size_t limit, RegexMatch& m, WindowStart&& windowStart, const RegexSearchOptions& o = RegexSearchOptions()) const {
+        if (!ok()) return Invalid;
+        limit = std::min(limit, len + 1);
+        RegexSearchOptions opt = o; opt.startLimit = std::min(o.startLimit, limit);
+        for (size_t window = kBackwardWindow; ; window *= 2) {
+            size_t from = limit > window ? std::min(windowStart(limit - window), limit - window) : 0; bool found = false;
+            Status st = forEach(src, len, from, [&](const RegexMatch& x) { m = x; found = true; return true; }, opt);
+            if (st != Found) return st;
+            if (found) return Found;
+            if (from == 0) return NotFound;
+        }
+    }
+    // 置換文字列の展開: $& $1..$99 $` $' $$
+    std::string format(const RegexMatch& m, const char* text, size_t len, std::string_view fmt) const { return format(m, contiguous(text, len), len, fmt); }
+    // 断片に分かれた文書から、展開に使う範囲 (一致やグループ。$` $' のときだけ一致の前後) だけを読む
+    std::string format(const RegexMatch& m, const RegexSpanFn& src, size_t len, std::string_view fmt) const {
+        std::string out;
+        auto append = [&](size_t from, size_t to) { while (from < to) { std::string_view s = src(from); size_t k = std::min(s.size(), to - from); out.append(s.data(), k); from += k; } };
+        for (size_t i = 0; i < fmt.size(); ++i) {
+            char c = fmt[i];
+            if (c != '$' || i + 1 >= fmt.size()) { out += c; continue; }
+            char n = fmt[i + 1];
+            if (n == '$') { out += '$'; i++; }
+            else if (n == '&') { append(m.pos, m.pos + m.len); i++; }
+            else if (n == '`') { append(0, m.pos); i++; }
+            else if (n == '\'') { append(m.pos + m.len, len); i++; }
+            else if (n >= '0' && n <= '9') {
+                int g = n - '0'; size_t used = 1;
+                if (i + 2 < fmt.size() && fmt[i + 2] >= '0' && fmt[i + 2] <= '9' && g * 10 + (fmt[i + 2] - '0') <= ngroups) { g = g * 10 + (fmt[i + 2] - '0'); used = 2; }
+                if (g == 0 || g > ngroups) { out += c; continue; }
+                if (m.matched(g)) append(m.start(g), m.end(g));
+                i += used;
+            }
+            else out += c;
+        }
+        return out;
+    }
+
+private:
+    enum Op : uint8_t { OpChar, OpCharFold, OpAny, OpClass, OpSplit, OpJmp, OpSave, OpAssert, OpMatch };
+    enum AssertKind { Bol, Eol, WordB, NotWordB };
+    struct Inst { Op op; uint32_t x, y; };
+    struct CharClass {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges; bool negated = false; uint64_t ascii[2] = { 0, 0 };
+        void add(uint32_t lo, uint32_t hi) { ranges.push_back({ lo, hi }); }
+        void finish(bool icase = false) {
+            normalize();
+            if (icase) { addCaseVariants(); addCaseVariants(); normalize(); } // 2 回目で K → k → K (ケルビン記号) のような間接の対応も入る
+            for (uint32_t c = 0; c < 128; ++c) if (containsRaw(c)) ascii[c >> 6] |= 1ull << (c & 63);
+        }
+        void normalize() {
+            std::sort(ranges.begin(), ranges.end()); std::vector<std::pair<uint32_t, uint32_t>> merged;
+            for (const auto& r : ranges) { if (!merged.empty() && r.first <= merged.back().second + 1) merged.back().second = std::max(merged.back().second, r.second); else merged.push_back(r); }
+            ranges.swap(merged);
+        }
+        // 大文字小文字を区別しないときは、含まれる文字と同じ形に畳み込まれる文字をクラスに加えておく
+        void addCaseVariants() {
+            size_t n; const CaseFoldRange* t = caseFoldRanges(n); std::vector<std::pair<uint32_t, uint32_t>> extra;
+            for (size_t i = 0; i < n; ++i) {
+                const CaseFoldRange& e = t[i]; uint32_t tlo = (uint32_t)((int32_t)e.lo + e.delta), thi = (uint32_t)((int32_t)e.hi + e.delta);
+                for (const auto& r : ranges) {
+                    // 畳み込み元 → 畳み込み先
+                    for (uint32_t c = std::max(r.first, e.lo), last = std::min(r.second, e.hi); c <= last; ++c) {
+                        if (e.stride == 1) { extra.push_back({ (uint32_t)((int32_t)c + e.delta), (uint32_t)((int32_t)last + e.delta) }); break; }
+                        if ((c - e.lo) % e.stride == 0) extra.push_back({ (uint32_t)((int32_t)c + e.delta), (uint32_t)((int32_t)c + e.delta) });
+                    }
+                    // 畳み込み先 → 畳み込み元
+                    for (uint32_t c = std::max(r.first, tlo), last = std::min(r.second, thi); c <= last; ++c) {
+                        if (e.stride == 1) { extra.push_back({ (uint32_t)((int32_t)c - e.delta), (uint32_t)((int32_t)last - e.delta) }); break; }
+                        if ((c - tlo) % e.stride == 0) extra.push_back({ (uint32_t)((int32_t)c - e.delta), (uint32_t)((int32_t)c - e.delta) });
+                    }
+                }
+            }
+            ranges.insert(ranges.end(), extra.begin(), extra.end()); normalize();
+        }
+        bool containsRaw(uint32_t c) const {
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(c, (uint32_t)0xFFFFFFFF));
+            return it != ranges.begin() && (it - 1)->second >= c;
+        }
+        bool contains(uint32_t c) const { return c < 128 ? ((ascii[c >> 6] >> (c & 63)) & 1) != 0 : containsRaw(c); }
+        bool matches(uint32_t c) const { return contains(c) != negated; }
+    };
+    struct Node {
+        enum Type { Empty, Lit, Any, Cls, Cat, Alt, Rep, Group, Assert, Newline } type = Empty;
+        uint32_t cp = 0; int cls = -1, min = 0, max = 0, cap = -1; bool greedy = true; std::vector<int> kids;
+    };
+
+    std::string src, err; int flg = 0, ngroups = 0;
+    std::vector<Inst> prog; std::vector<CharClass> classes; std::vector<Node> nodes;
+    bool firstBytes[256] = {}; bool usePrefilter = false; int singleFirstByte = -1;
+
+    // ---- パーサ ----
+    struct Parser {
+        Regex& re; std::string_view s; size_t i = 0;
+        bool eof() const { return i >= s.size(); }
+        bool fail(const char* msg) { if (re.err.empty()) re.err = msg; return false; }
+        int node(Node::Type t) { re.nodes.push_back(Node()); re.nodes.back().type = t; return (int)re.nodes.size() - 1; }
+        uint32_t nextCp() { size_t l; uint32_t c = decodeUtf8((const unsigned char*)s.data() + i, s.size() - i, l); i += l; return c; }
+        int parseAlt(int depth) {
+            if (depth > 200) { fail("pattern nests too deeply"); return -1; }
+            int first = parseCat(depth); if (first < 0) return -1;
+            if (eof() || s[i] != '|') return first;
+            int alt = node(Node::Alt); re.nodes[alt].kids.push_back(first);
+            while (!eof() && s[i] == '|') { i++; int k = parseCat(depth); if (k < 0) return -1; re.nodes[alt].kids.push_back(k); }
+            return alt;
+        }
+        int parseCat(int depth) {
+            int cat = node(Node::Cat);
+            while (!eof() && s[i] != '|' && s[i] != ')') {
+                int a = parseRepeat(depth); if (a < 0) return -1;
+                re.nodes[cat].kids.push_back(a);
+            }
+            return cat;
+        }
+        bool parseInt(int& v) { size_t b = i; v = 0; while (!eof() && s[i] >= '0' && s[i] <= '9') { v = std::min(v * 10 + (s[i] - '0'), 100000); i++; } return i > b; }
+        int parseRepeat(int depth) {
+            int a = parseAtom(depth); if (a < 0) return -1;
+            while (!eof()) {
+                int mn, mx; size_t save = i;
+                if (s[i] == '*') { mn = 0; mx = -1; i++; }
+                else if (s[i] == '+') { mn = 1; mx = -1; i++; }
+                else if (s[i] == '?') { mn = 0; mx = 1; i++; }
+                else if (s[i] == '{') {
+                    i++; if (!parseInt(mn)) { i = save; break; }
+                    mx = mn;
+                    if (!eof() && s[i] == ',') { i++; if (!parseInt(mx)) mx = -1; }
+                    if (eof() || s[i] != '}') { i = save; break; }
+                    i++;
+                    if (mx != -1 && mx < mn) { fail("numbers out of order in {} quantifier"); return -1; }
+                    if (mn > 1000 || mx > 1000) { fail("repetition count too large"); return -1; }
+                }
+                else break;
+                Node::Type t = re.nodes[a].type;
+                if (t == Node::Assert || t == Node::Rep) { fail("nothing to repeat"); return -1; }
+                int r = node(Node::Rep); re.nodes[r].min = mn; re.nodes[r].max = mx; re.nodes[r].kids.push_back(a);
+                if (!eof() && s[i] == '?') { re.nodes[r].greedy = false; i++; }
+                a = r;
+            }
+            return a;
+        }
+        int parseAtom(int depth) {
+            char c = s[i];
+            if (c == '(') {
+                i++; int cap = -1;
+                if (s.substr(i, 2) == "?:") i += 2;
+                else if (s.substr(i, 2) == "?=" || s.substr(i, 2) == "?!" || s.substr(i, 3) == "?<=" || s.substr(i, 3) == "?<!") {
+                    if (s.substr(i, 2) != "?=") { fail("lookaround is not supported"); return -1; }
+                    i += 2; int body = parseAlt(depth + 1); if (body < 0) return -1;
+                    if (eof() || s[i] != ')') { fail("missing )"); return -1; }
+                    i++;
+                    if (!eof() && s[i] != ')') { fail("lookahead is only supported at the end of the pattern"); return -1; }
+                    int g = node(Node::Group); re.nodes[g].cap = -2; re.nodes[g].kids.push_back(body); return g; // -2: 末尾の先読み
+                }
+                else if (s.substr(i, 2) == "?<") { size_t e = s.find('>', i); if (e == std::string_view::npos) { fail("invalid group name"); return -1; } i = e + 1; cap = ++re.ngroups; }
+                else if (!eof() && s[i] == '?') { fail("invalid group"); return -1; }
+                else cap = ++re.ngroups;
+                int body = parseAlt(depth + 1); if (body < 0) return -1;
+                if (eof() || s[i] != ')') { fail("missing )"); return -1; }
+                i++;
+                if (cap < 0) return body;
+                int g = node(Node::Group); re.nodes[g].cap = cap; re.nodes[g].kids.push_back(body); return g;
+            }
+            if (c == ')') { fail("unmatched )"); return -1; }
+            if (c == '*' || c == '+' || c == '?') { fail("nothing to repeat"); return -1; }
+            if (c == '[') { i++; return parseClass(); }
+            if (c == '.') { i++; return node(Node::Any); }
+            if (c == '^') { i++; int n = node(Node::Assert); re.nodes[n].cp = Bol; return n; }
+            if (c == '$') { i++; int n = node(Node::Assert); re.nodes[n].cp = Eol; return n; }
+            if (c == '\\') return parseEscape(false, nullptr);
+            int n = node(Node::Lit); re.nodes[n].cp = nextCp(); return n;
+        }
+        bool hexDigits(size_t count, uint32_t& v) {
+            v = 0;
+            for (size_t k = 0; k < count; ++k) {
+                if (eof()) return false;
+                char h = s[i];
+                int d = (h >= '0' && h <= '9') ? h - '0' : (h >= 'a' && h <= 'f') ? h - 'a' + 10 : (h >= 'A' && h <= 'F') ? h - 'A' + 10 : -1;
+                if (d < 0) return false;
+                v = v * 16 + d; i++;
+            }
+            return true;
+        }
+        static void addShorthand(CharClass& cc, char k) {
+            switch (k) {
+                case 'd': cc.add('0', '9'); break;
+                case 'w': cc.add('a', 'z'); cc.add('A', 'Z'); cc.add('0', '9'); cc.add('_', '_'); break;
+                case 's': cc.add('\t', '\r'); cc.add(' ', ' '); cc.add(0xA0, 0xA0); cc.add(0x1680, 0x1680); cc.add(0x2000, 0x200A);
+                          cc.add(0x2028, 0x2029); cc.add(0x202F, 0x202F); cc.add(0x205F, 0x205F); cc.add(0x3000, 0x3000); cc.add(0xFEFF, 0xFEFF); break;
+            }
+        }
+        static void addNegated(CharClass& cc, const CharClass& pos) {
+            uint32_t next = 0;
+            for (const auto& r : pos.ranges) { if (r.first > next) cc.add(next, r.first - 1); next = r.second + 1; }
+            if (next <= 0x1100FF) cc.add(next, 0x1100FF);
+        }
+        // クラス内では単一文字を out に返す (-1 ならクラス略記を cc に追加した)
+        int parseEscape(bool inClass, CharClass* cc) {
+            i++; if (eof()) { fail("trailing backslash"); return -1; }
+            char k = s[i++]; uint32_t v = 0;
+            switch (k) {
+                case 'd': case 'w': case 's': case 'D': case 'W': case 'S': {
+                    CharClass tmp; addShorthand(tmp, (char)(k | 0x20)); tmp.finish();
+                    CharClass& target = inClass ? *cc : (re.classes.emplace_back(), re.classes.back());
+                    if (k >= 'a') for (const auto& r : tmp.ranges) target.add(r.first, r.second); else addNegated(target, tmp);
+                    if (inClass) return -2;
+                    re.classes.back().finish((re.flg & IgnoreCase) != 0); int n = node(Node::Cls); re.nodes[n].cls = (int)re.classes.size() - 1; return n;
+                }
+                case 'b': if (inClass) { v = 8; break; } { int n = node(Node::Assert); re.nodes[n].cp = WordB; return n; }
+                case 'B': if (inClass) { fail("invalid escape in class"); return -1; } { int n = node(Node::Assert); re.nodes[n].cp = NotWordB; return n; }
+                case 'n': if (!inClass && (re.flg & AnyNewline)) return node(Node::Newline); v = '\n'; break;
+                case 'r': v = '\r'; break; case 't': v = '\t'; break; case 'f': v = '\f'; break; case 'v': v = '\v'; break;
+                case '0': v = 0; break;
+                case 'x': if (!hexDigits(2, v)) { fail("invalid \\x escape"); return -1; } break;
+                case 'u':
+                    if (!eof() && s[i] == '{') { i++; size_t b = i; while (!eof() && s[i] != '}') i++; if (eof() || i == b || i - b > 6) { fail("invalid \\u escape"); return -1; } std::string_view h = s.substr(b, i - b); i = b; if (!hexDigits(h.size(), v) || v > 0x10FFFF) { fail("invalid \\u escape"); return -1; } i++; }
+                    else if (!hexDigits(4, v)) { fail("invalid \\u escape"); return -1; }
+                    break;
+                case 'c': if (!eof() && ((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z'))) { v = (uint32_t)(s[i++] & 0x1F); break; } fail("invalid \\c escape"); return -1;
+                default:
+                    if (k >= '1' && k <= '9') { fail("backreferences are not supported"); return -1; }
+                    if ((k >= 'a' && k <= 'z') || (k >= 'A' && k <= 'Z')) { fail("unknown escape"); return -1; }
+                    i--; v = nextCp(); break;
+            }
+            if (inClass) return (int)v;
+            int n = node(Node::Lit); re.nodes[n].cp = v; return n;
+        }
+        int parseClass() {
+            re.classes.emplace_back(); size_t ci = re.classes.size() - 1; CharClass cc;
+            if (!eof() && s[i] == '^') { cc.negated = true; i++; }
+            while (!eof() && s[i] != ']') {
+                int lo;
+                if (s[i] == '\\') { lo = parseEscape(true, &cc); if (lo == -1) return -1; if (lo == -2) continue; }
+                else lo = (int)nextCp();
+                if (i + 1 < s.size() && s[i] == '-' && s[i + 1] != ']') {
+                    i++; int hi;
+                    if (s[i] == '\\') { hi = parseEscape(true, &cc); if (hi == -1) return -1; if (hi == -2) { cc.add(lo, lo); cc.add('-', '-'); continue; } }
+                    else hi = (int)nextCp();
+                    if (hi < lo) { fail("range out of order in character class"); return -1; }
+                    cc.add((uint32_t)lo, (uint32_t)hi);
+                }
+                else cc.add((uint32_t)lo, (uint32_t)lo);
+            }
+            if (eof()) { fail("missing ]"); return -1; }
+            i++; cc.finish((re.flg & IgnoreCase) != 0); re.classes[ci] = std::move(cc);
+            int n = node(Node::Cls); re.nodes[n].cls = (int)ci; return n;
+        }
+    };
+
+    // ---- コンパイラ ----
+    bool emit(Op op, uint32_t x = 0, uint32_t y = 0) { if (prog.size() >= kMaxInsts) { if (err.empty()) err = "pattern is too large"; return false; } prog.push_back({ op, x, y }); return true; }
+    bool compileNode(int id) {
+        const Node n = nodes[id];
+        switch (n.type) {
+            case Node::Empty: return true;
+            case Node::Lit: { int variants = 0; if (flg & IgnoreCase) forEachCaseVariant(n.cp, [&](uint32_t) { variants++; }); return variants > 1 ? emit(OpCharFold, foldCase(n.cp)) : emit(OpChar, n.cp); }
+            case Node::Any: return emit(OpAny);
+            case Node::Cls: return emit(OpClass, (uint32_t)n.cls);
+            case Node::Assert: return emit(OpAssert, n.cp);
+            case Node::Newline: {
+                // (?:\r\n|\r|\n)
+                size_t s1 = prog.size(); if (!emit(OpSplit)) return false; prog[s1].x = (uint32_t)prog.size();
+                if (!emit(OpChar, '\r')) return false;
+                size_t s2 = prog.size(); if (!emit(OpSplit)) return false;
+                prog[s2].x = (uint32_t)prog.size(); if (!emit(OpChar, '\n')) return false; prog[s2].y = (uint32_t)prog.size();
+                size_t j = prog.size(); if (!emit(OpJmp)) return false; prog[s1].y = (uint32_t)prog.size();
+                if (!emit(OpChar, '\n')) return false;
+                prog[j].x = (uint32_t)prog.size(); return true;
+            }
+            case Node::Cat: for (int k : n.kids) if (!compileNode(k)) return false; return true;
+            case Node::Group:
+                if (n.cap == -2) return compileNode(n.kids[0]);
+                return emit(OpSave, 2 * n.cap) && compileNode(n.kids[0]) && emit(OpSave, 2 * n.cap + 1);
+            case Node::Alt: {
+                std::vector<size_t> jumps;
+                for (size_t k = 0; k < n.kids.size(); ++k) {
+                    size_t sp = prog.size();
+                    if (k + 1 < n.kids.size()) { if (!emit(OpSplit)) return false; prog[sp].x = (uint32_t)prog.size(); }
+                    if (!compileNode(n.kids[k])) return false;
+                    if (k + 1 < n.kids.size()) { jumps.push_back(prog.size()); if (!emit(OpJmp)) return false; prog[sp].y = (uint32_t)prog.size(); }
+                }
+                for (size_t j : jumps) prog[j].x = (uint32_t)prog.size();
+                return true;
+            }
+            case Node::Rep: {
+                for (int k = 0; k < n.min; ++k) if (!compileNode(n.kids[0])) return false;
+                if (n.max == -1) {
+                    size_t sp = prog.size(); if (!emit(OpSplit)) return false;
+                    size_t body = prog.size(); if (!compileNode(n.kids[0]) || !emit(OpJmp, (uint32_t)sp)) return false;
+                    size_t out = prog.size();
+                    prog[sp].x = (uint32_t)(n.greedy ? body : out); prog[sp].y = (uint32_t)(n.greedy ? out : body);
+                    return true;
+                }
+                std::vector<size_t> splits;
+                for (int k = n.min; k < n.max; ++k) {
+                    splits.push_back(prog.size()); if (!emit(OpSplit)) return false;
+                    prog[splits.back()].x = (uint32_t)prog.size();
+                    if (!compileNode(n.kids[0])) return false;
+                }
+                for (size_t sp : splits) { uint32_t body = prog[sp].x, out = (uint32_t)prog.size(); prog[sp].x = n.greedy ? body : out; prog[sp].y = n.greedy ? out : body; }
+                return true;
+            }
+        }
+        return false;
+    }
+    void compile(std::string_view pattern, int flags) {
+        src.assign(pattern.data(), pattern.size()); flg = flags; err.clear(); prog.clear(); classes.clear(); nodes.clear(); ngroups = 0;
+        Parser p{ *this, pattern };
+        int root = p.parseAlt(0);
+        if (root >= 0 && !p.eof()) p.fail(pattern[p.i] == ')' ? "unmatched )" : "syntax error");
+        if (!err.empty() || root < 0) { if (err.empty()) err = "syntax error"; prog.clear(); return; }
+        // 末尾の (?=...) は一致の終わりを記録してから本体を続ける
+        int lookahead = -1;
+        if (nodes[root].type == Node::Cat && !nodes[root].kids.empty()) { int last = nodes[root].kids.back(); if (nodes[last].type == Node::Group && nodes[last].cap == -2) { lookahead = last; nodes[root].kids.pop_back(); } }
+        for (size_t k = 0; k < nodes.size(); ++k) if (nodes[k].type == Node::Group && nodes[k].cap == -2 && (int)k != lookahead) { err = "lookahead is only supported at the end of the pattern"; return; }
+        if (!emit(OpSave, 0) || !compileNode(root) || !emit(OpSave, 1) || (lookahead >= 0 && !compileNode(lookahead)) || !emit(OpMatch)) { prog.clear(); return; }
+        nodes.clear(); nodes.shrink_to_fit();
+        computePrefilter();
+    }
+    // 一致の先頭になり得るバイトを集めて、スレッドが空の区間を読み飛ばす
+    void computePrefilter() {
+        std::fill(std::begin(firstBytes), std::end(firstBytes), false); usePrefilter = false; singleFirstByte = -1;
+        std::vector<uint32_t> stack{ 0 }; std::vector<bool> seen(prog.size(), false);
+        auto addCp = [&](uint32_t c) { std::string u; appendUtf8(u, c); firstBytes[(unsigned char)u[0]] = true; };
+        while (!stack.empty()) {
+            uint32_t pc = stack.back(); stack.pop_back();
+            if (seen[pc]) continue;
+            seen[pc] = true;
+            const Inst& in = prog[pc];
+            switch (in.op) {
+                case OpJmp: stack.push_back(in.x); break;
+                case OpSplit: stack.push_back(in.x); stack.push_back(in.y); break;
+                case OpSave: case OpAssert: stack.push_back(pc + 1); break;
+                case OpMatch: return;
+                case OpChar: if (in.x >= 0x110000) firstBytes[(in.x - 0x110000) & 0xFF] = true; else addCp(in.x); break;
+                case OpCharFold: forEachCaseVariant(in.x, addCp); break;
+                case OpAny: case OpClass: return;
+            }
+        }
+        int count = 0; for (int b = 0; b < 256; ++b) if (firstBytes[b]) { count++; singleFirstByte = b; }
+        if (count != 1) singleFirstByte = -1;
+        usePrefilter = count > 0 && count < 256;
+    }
+
+    // ---- 実行 ----
+    // まず遅延構築の DFA で「一致が終わる位置があるか」と「直前にスレッドが空になった位置」を調べ、
+    // 一致があればその位置から Pike VM を走らせて、優先順位どおりの一致とグループ位置を求める。
+    // どちらも文書を前から 1 度だけ読み、断片の境界をまたいで持ち越すのは直前の 1 バイトと 1 文字 (最大 4 バイト) だけ。
+    static RegexSpanFn contiguous(const char* text, size_t len) { return [text, len](size_t p) { return std::string_view(text + p, len - p); }; }
+    static int byteClass(int b) { return b < 0 ? 0 : b == '\n' ? 1 : b == '\r' ? 2 : isRegexWordByte(b) ? 3 : 4; }
+    static bool assertOk(uint32_t kind, int prev, int cur) {
+        switch (kind) {
+            case Bol: return prev == 0 || prev == 1 || (prev == 2 && cur != 1);
+            case Eol: return cur == 0 || cur == 2 || (cur == 1 && prev != 2);
+            case WordB: return (prev == 3) != (cur == 3);
+            case NotWordB: return (prev == 3) == (cur == 3);
+        }
+        return false;
+    }
+    bool accepts(const Inst& in, uint32_t c) const {
+        switch (in.op) {
+            case OpChar: return c == in.x;
+            case OpCharFold: return foldCase(c) == in.x;
+            case OpAny: return c != '\n' && c != '\r';
+            case OpClass: return classes[in.x].matches(c);
+            default: return false;
+        }
+    }
+    // 断片を順に読むリーダー。現在の断片と直前の断片だけを覚えておく
+    struct Reader {
+        const RegexSpanFn& src; size_t len;
+        const unsigned char* cur = nullptr; size_t lo = 0, hi = 0;
+        const unsigned char* prev = nullptr; size_t plo = 0, phi = 0;
+        Reader(const RegexSpanFn& s, size_t n) : src(s), len(n) {}
+        void load(size_t p) { prev = cur; plo = lo; phi = hi; std::string_view v = src(p); cur = (const unsigned char*)v.data(); lo = p; hi = p + v.size(); }
+        int at(size_t p) {
+            if (p >= len) return -1;
+            if (p >= lo && p < hi) return cur[p - lo];
+            if (p >= plo && p < phi) return prev[p - plo];
+            load(p); return cur[0];
+        }
+        uint32_t decode(size_t p, size_t& l) {
+            if (!(p >= lo && p < hi)) load(p);
+            if (p + 4 <= hi || hi >= len) return decodeUtf8(cur + (p - lo), hi - p, l);
+            unsigned char b[4]; size_t n = std::min((size_t)4, len - p);
+            for (size_t k = 0; k < n; ++k) b[k] = (unsigned char)at(p + k);
+            return decodeUtf8(b, n, l);
+        }
+    };
+    struct Vm {
+        const Regex& re; Reader r; size_t ncap; size_t steps = 0, reach = 0; // reach: 読んだ範囲の終わり (末尾の確認は len + 1)
+        static constexpr size_t kClockSteps = 4096; // 期限があるとき、このステップ数ごとに時刻を確かめる
+        size_t nextClock = 0;
+        // 予算・取り消し・期限のどれかで打ち切るか
+        bool stopped(const RegexSearchOptions& o) {
+            if ((o.budget && steps > o.budget) || (o.cancel && o.cancel->load(std::memory_order_relaxed))) return true;
+            if (o.deadline == std::chrono::steady_clock::time_point() || steps < nextClock) return false;
+            nextClock = steps + kClockSteps; return std::chrono::steady_clock::now() >= o.deadline;
+        }
+        struct List { std::vector<uint32_t> dense, sparse; std::vector<size_t> caps; size_t n = 0; };
+        List lists[2]; std::vector<size_t> work; struct Frame { uint32_t pc; int32_t slot; size_t old; }; std::vector<Frame> stack;
+        static constexpr int kUnknown = -1, kMatch = -2; static constexpr size_t kMaxStates = 2048;
+        struct DState { std::vector<uint32_t> kernel; int prev; bool inject; int trans[128]; int endMatch[5]; std::vector<std::pair<uint32_t, int>> wide; };
+        std::vector<DState> dstates; std::unordered_map<std::string, int> dindex; std::vector<uint32_t> mark, dset, dstack, next; uint32_t gen = 0;
+        // forEach で列挙するあいだ、一致に届かないと分かった (命令, 位置) を覚えておく。最後の一致より後ろの位置のスレッドは優先度で
+        // 切られずに全部たどられて消えたので、次の一致を探すときもそこからは一致に届かない。これがないと a*b|a のように優先度の高い枝が
+        // 文末まで生き残る式で、一致ごとに文末まで読み直して O(n^2) になる。位置 p は p % (行数) の行に置き、先に入っている
+        // 位置のほうが前 (まだ使う) ならそちらを残す
+        static constexpr size_t kDeadMaxBytes = 4 << 20, kDeadMaxInsts = 256;
+        bool memoDead = false; size_t deadFloor = 0, deadWords = 0;
+        std::vector<uint64_t> deadBits; std::vector<size_t> deadPos; std::vector<std::pair<size_t, size_t>> pendingRows; std::vector<uint32_t> pendingPcs;
+        bool dead(uint32_t pc, size_t p) const {
+            if (deadPos.empty()) return false;
+            size_t row = p % deadPos.size(); return deadPos[row] == p && (deadBits[row * deadWords + pc / 64] >> (pc % 64) & 1);
+        }
+        void commitDead() {
+            if (pendingRows.empty()) return;
+            if (deadPos.empty()) { deadWords = (re.prog.size() + 63) / 64; deadPos.assign(std::min(kDeadMaxBytes / (8 * (deadWords + 1)), r.len + 1), RegexMatch::npos); deadBits.assign(deadPos.size() * deadWords, 0); }
+            for (size_t k = 0; k < pendingRows.size(); ++k) {
+                size_t p = pendingRows[k].first, row = p % deadPos.size(), end = k + 1 < pendingRows.size() ? pendingRows[k + 1].second : pendingPcs.size();
+                if (deadPos[row] != p) {
+                    if (deadPos[row] != RegexMatch::npos && deadPos[row] >= deadFloor && deadPos[row] < p) continue;
+                    deadPos[row] = p; std::fill(deadBits.begin() + row * deadWords, deadBits.begin() + (row + 1) * deadWords, 0);
+                }
+                for (size_t j = pendingRows[k].second; j < end; ++j) deadBits[row * deadWords + pendingPcs[j] / 64] |= (uint64_t)1 << (pendingPcs[j] % 64);
+            }
+        }
+        Vm(const Regex& re_, const RegexSpanFn& src, size_t len) : re(re_), r(src, len), ncap(2 * (size_t)(re_.ngroups + 1)) {
+            for (auto& l : lists) { l.dense.resize(re.prog.size()); l.sparse.resize(re.prog.size()); l.caps.resize(re.prog.size() * ncap); }
+            work.resize(ncap); mark.assign(re.prog.size(), 0);
+        }
+        void touch(size_t end) { if (end > reach) reach = end; }
+        int before(size_t p, const RegexSearchOptions& o) { return p > 0 ? r.at(p - 1) : o.before; }
+        int here(size_t p, const RegexSearchOptions& o) { return p < r.len ? r.at(p) : o.after; }
+        // 一致の先頭になり得るバイトまで断片ごとに読み飛ばす
+        size_t skipTo(size_t p) {
+            while (p < r.len) {
+                if (!(p >= r.lo && p < r.hi)) r.load(p);
+                const unsigned char* b = r.cur + (p - r.lo); size_t n = r.hi - p;
+                if (re.singleFirstByte >= 0) { const void* f = memchr(b, re.singleFirstByte, n); if (f) return p + (size_t)((const unsigned char*)f - b); }
+                else { for (size_t k = 0; k < n; ++k) if (re.firstBytes[b[k]]) return p + k; }
+                p = r.hi;
+            }
+            return r.len;
+        }
+        // ---- DFA ----
+        // inject: この位置から始まる一致も探すか (startLimit を過ぎたら false の状態に切り替える)
+        int intern(const std::vector<uint32_t>& kernel, int prev, bool inject = true) {
+            std::string key(1, (char)(prev | (inject ? 0 : 8))); key.append((const char*)kernel.data(), kernel.size() * sizeof(uint32_t));
+            auto it = dindex.find(key); if (it != dindex.end()) return it->second;
+            dstates.emplace_back(); DState& d = dstates.back(); d.kernel = kernel; d.prev = prev; d.inject = inject;
+            std::fill(std::begin(d.trans), std::end(d.trans), kUnknown); std::fill(std::begin(d.endMatch), std::end(d.endMatch), kUnknown);
+            int id = (int)dstates.size() - 1; dindex.emplace(std::move(key), id); return id;
+        }
+        // kernel と開始位置 (pc 0、inject のときだけ) からの ε 閉包。到達した文字消費命令を dset に集め、Match に届けば true
+        bool closure(int si, int cur) {
+            if (++gen == 0) { std::fill(mark.begin(), mark.end(), 0); gen = 1; }
+            const DState& d = dstates[si]; dset.clear(); dstack.assign(d.kernel.begin(), d.kernel.end()); if (d.inject) dstack.push_back(0);
+            bool found = false;
+            while (!dstack.empty()) {
+                uint32_t pc = dstack.back(); dstack.pop_back();
+                if (mark[pc] == gen) continue;
+                mark[pc] = gen; steps++;
+                const Inst& in = re.prog[pc];
+                switch (in.op) {
+                    case OpJmp: dstack.push_back(in.x); break;
+                    case OpSplit: dstack.push_back(in.y); dstack.push_back(in.x); break;
+                    case OpSave: dstack.push_back(pc + 1); break;
+                    case OpAssert: if (assertOk(in.x, d.prev, cur)) dstack.push_back(pc + 1); break;
+                    case OpMatch: found = true; break;
+                    default: dset.push_back(pc); break;
+                }
+            }
+            return found;
+        }
+        int transition(int si, uint32_t c, unsigned char firstByte) {
+            if (closure(si, byteClass(firstByte))) { cache(si, c, kMatch); return kMatch; }
+            next.clear();
+            for (uint32_t pc : dset) if (re.accepts(re.prog[pc], c)) next.push_back(pc + 1);
+            std::sort(next.begin(), next.end()); next.erase(std::unique(next.begin(), next.end()), next.end());
+            int prev = c < 0x80 ? byteClass((int)c) : 4; bool inject = dstates[si].inject;
+            if (dstates.size() >= kMaxStates) { dstates.clear(); dindex.clear(); return intern(next, prev, inject); }
+            int ni = intern(next, prev, inject); cache(si, c, ni); return ni;
+        }
+        void cache(int si, uint32_t c, int v) { if (c < 0x80) dstates[si].trans[c] = v; else dstates[si].wide.push_back({ c, v }); }
+        Status scan(size_t start, const RegexSearchOptions& o, size_t& from) {
+            static const std::vector<uint32_t> none;
+            const size_t len = r.len;
+            const size_t limit = o.startLimit;
+            if (start >= limit) return NotFound;
+            int s = intern(none, byteClass(before(start, o))); from = start;
+            for (size_t p = start; ; ) {
+                if (p >= limit && dstates[s].inject) { if (dstates[s].kernel.empty()) return NotFound; std::vector<uint32_t> k = dstates[s].kernel; s = intern(k, dstates[s].prev, false); }
+                if (dstates[s].kernel.empty() && dstates[s].inject) {
+                    if (re.usePrefilter) { size_t q = skipTo(p); touch(q + 1); if (q >= len || q >= limit) return NotFound; if (q != p) { p = q; s = intern(none, byteClass(r.at(p - 1))); } }
+                    from = p;
+                }
+                if (dstates[s].kernel.empty() && !dstates[s].inject) return NotFound;
+                if (p >= len) {
+                    touch(len + 1); int cur = byteClass(o.after); int em = dstates[s].endMatch[cur];
+                    if (em == kUnknown) { em = closure(s, cur) ? 1 : 0; dstates[s].endMatch[cur] = em; }
+                    return em ? Found : NotFound;
+                }
+                if (stopped(o)) return BudgetExceeded;
+                // 現在の断片内の ASCII はキャッシュ済みの遷移だけで進める
+                if (p >= r.lo && p < r.hi) {
+                    const unsigned char* b = r.cur + (p - r.lo); const unsigned char* e = r.cur + (r.hi - r.lo); const unsigned char* q = b;
+                    if (o.budget && (size_t)(e - b) > o.budget - steps) e = b + (o.budget - steps);
+                    if (p < limit && (size_t)(e - b) > limit - p) e = b + (limit - p);
+                    if (o.deadline != std::chrono::steady_clock::time_point() && (size_t)(e - b) > kClockSteps) e = b + kClockSteps;
+                    while (q < e && *q < 0x80) {
+                        int n = dstates[s].trans[*q];
+                        if (n == kMatch) return Found;
+                        if (n == kUnknown || dstates[n].kernel.empty()) break;
+                        s = n; q++;
+                    }
+                    touch(p + (size_t)(q - b) + 1);
+                    if (q != b) { steps += (size_t)(q - b); p += (size_t)(q - b); continue; }
+                }
+                steps++;
+                size_t l = 1; int b = r.at(p); int n;
+                if (b < 0x80) { n = dstates[s].trans[b]; if (n == kUnknown) n = transition(s, (uint32_t)b, (unsigned char)b); }
+                else {
+                    uint32_t c = r.decode(p, l); n = kUnknown;
+                    for (const auto& w : dstates[s].wide) if (w.first == c) { n = w.second; break; }
+                    if (n == kUnknown) n = transition(s, c, (unsigned char)b);
+                }
+                touch(p + l);
+                if (n == kMatch) return Found;
+                s = n; p += l;
+            }
+        }
+        // ---- Pike VM ----
+        static bool has(const List& l, uint32_t pc) { uint32_t d = l.sparse[pc]; return d < l.n && l.dense[d] == pc; }
+        void add(List& l, uint32_t pc0, const size_t* caps, size_t p, const RegexSearchOptions& o) {
+            std::copy(caps, caps + ncap, work.begin());
+            int prev = byteClass(before(p, o)), cur = byteClass(here(p, o));
+            stack.clear(); stack.push_back({ pc0, -1, 0 });
+            while (!stack.empty()) {
+                Frame f = stack.back(); stack.pop_back();
+                if (f.slot >= 0) { work[f.slot] = f.old; continue; }
+                uint32_t pc = f.pc;
+                for (;;) {
+                    if (has(l, pc) || (memoDead && dead(pc, p))) break;
+                    l.sparse[pc] = (uint32_t)l.n; l.dense[l.n++] = pc; steps++;
+                    const Inst& in = re.prog[pc];
+                    if (in.op == OpJmp) { pc = in.x; continue; }
+                    if (in.op == OpSplit) { stack.push_back({ in.y, -1, 0 }); pc = in.x; continue; }
+                    if (in.op == OpSave) { if (in.x < ncap) { stack.push_back({ 0, (int32_t)in.x, work[in.x] }); work[in.x] = p; } pc++; continue; }
+                    if (in.op == OpAssert) { if (!assertOk(in.x, prev, cur)) break; pc++; continue; }
+                    std::copy(work.begin(), work.end(), l.caps.begin() + (size_t)l.sparse[pc] * ncap);
+                    break;
+                }
+            }
+        }
+        Status run(size_t start, RegexMatch& m, const RegexSearchOptions& o) {
+            steps = 0; nextClock = 0; bool matched = false; m.caps.assign(ncap, RegexMatch::npos);
+            const size_t len = r.len;
+            if (!o.anchored && !o.fullMatch) { size_t from; Status st = scan(start, o, from); if (st != Found) return st; start = from; }
+            std::vector<size_t> empty(ncap, RegexMatch::npos);
+            List* cl = &lists[0]; List* nl = &lists[1]; cl->n = 0; pendingRows.clear(); pendingPcs.clear();
+            for (size_t p = start; p <= len; ) {
+                if (stopped(o)) return BudgetExceeded;
+                if (!matched && (!o.anchored || p == start) && p < o.startLimit) {
+                    if (cl->n == 0 && re.usePrefilter && !o.anchored) { p = skipTo(p); touch(p + 1); if (p >= len || p >= o.startLimit) break; }
+                    add(*cl, 0, empty.data(), p, o);
+                }
+                touch(p + 1);
+                if (cl->n == 0) break;
+                size_t l = 0; uint32_t c = p < len ? r.decode(p, l) : 0xFFFFFFFF; touch(p + l);
+                nl->n = 0; bool hit = false;
+                for (size_t i = 0; i < cl->n; ++i) {
+                    uint32_t pc = cl->dense[i]; const Inst& in = re.prog[pc]; const size_t* caps = cl->caps.data() + i * ncap;
+                    if (in.op == OpMatch) {
+                        if (o.fullMatch && p != len) continue;
+                        matched = hit = true; std::copy(caps, caps + ncap, m.caps.begin()); break;
+                    }
+                    if (c != 0xFFFFFFFF && re.accepts(in, c)) add(*nl, pc + 1, caps, p + l, o);
+                }
+                // 一致の後ろの位置のスレッドは、このあと一致しなければ全部行き止まり
+                if (memoDead && matched) {
+                    if (hit) { pendingRows.clear(); pendingPcs.clear(); }
+                    else { pendingRows.push_back({ p, pendingPcs.size() }); pendingPcs.insert(pendingPcs.end(), cl->dense.begin(), cl->dense.begin() + cl->n); }
+                }
+                std::swap(cl, nl);
+                if (p >= len) break;
+                p += l;
+            }
+            if (!matched) return NotFound;
+            if (memoDead) commitDead();
+            m.pos = m.caps[0]; m.len = m.caps[1] - m.caps[0];
+            return Found;
+        }
+    };
+};
+
+} // namespace miu
@@ -55,6 +55,7 @@
 - (void)jumpToLine:(NSInteger)lineNumber;
 - (void)getSmartWordRangeAtPos:(size_t)pos outStart:(size_t*)outStart outEnd:(size_t*)outEnd;
 - (void)showMenuForCurrentSelection;
+- (void)invalidateEditor;
 @end
 @implementation iOSEditorView {
     CGPoint _lastPanTranslation;
@@ -123,7 +124,7 @@
 - (void)hideHelpIfNeeded {
     if (self.editor && self.editor->showHelpPopup) {
         self.editor->showHelpPopup = false;
-        [self setNeedsDisplay];
+        [self invalidateEditor];
     }
 }
 - (void)hardwareKeyboardStateChanged:(NSNotification *)note {
@@ -208,6 +209,12 @@
 - (UIView *)textInputView {
     return self;
 }
+// 前回描いたときから変わった所だけを描き直す (全体が変わったときは全体)。エディタの座標は topRenderMargin だけ下にずれる
+- (void)invalidateEditor {
+    std::vector<DirtyRect> rects;
+    if (!self.editor || self.editor->collectDamage(self.bounds.size.width, self.bounds.size.height - self.topRenderMargin, rects)) { [self setNeedsDisplay]; return; }
+    for (const auto& d : rects) [self setNeedsDisplayInRect:CGRectMake(d.x, d.y + self.topRenderMargin, d.w, d.h)];
+}
 - (void)drawRect:(CGRect)rect {
     if (!self.editor) return;
     CGContextRef ctx = UIGraphicsGetCurrentContext();
@@ -217,7 +224,7 @@
 - (void)touchesBegan:(NSSet<UITouch *> *)touches withEvent:(UIEvent *)event {
     if (self.editor && self.editor->showHelpPopup) {
         self.editor->showHelpPopup = false;
-        [self setNeedsDisplay];
+        [self invalidateEditor];
     }
     [self stopMomentumScroll];
     UITouch *touch = [touches anyObject];
@@ -274,7 +281,7 @@
         int li = self.editor->getLineIdx(newHead);
         c.desiredX = self.editor->getXInLine(li, newHead);
         [self.inputDelegate selectionDidChange:self];
-        [self setNeedsDisplay];
+        [self invalidateEditor];
     }
 }
 - (void)touchesEnded:(NSSet<UITouch *> *)touches withEvent:(UIEvent *)event {
@@ -299,7 +306,7 @@
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
     self.editor->ensureCaretVisible();
-    [self setNeedsDisplay];
+    [self invalidateEditor];
     [self becomeFirstResponder];
     dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.1 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
         [self showMenuForCurrentSelection];
@@ -376,7 +383,7 @@
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
     self.editor->ensureCaretVisible();
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)handleTripleTapAtPoint:(CGPoint)p {
     if (!self.editor) return;
@@ -393,7 +400,7 @@
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
     self.editor->ensureCaretVisible();
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (BOOL)gestureRecognizer:(UIGestureRecognizer *)gestureRecognizer shouldReceiveTouch:(UITouch *)touch {
     return YES;
@@ -437,7 +444,7 @@
     self.editor->ensureCaretVisible();
     self.editor->zoomPopupText = std::to_string((int)newFontSize) + " px";
     self.editor->zoomPopupEndTime = std::chrono::steady_clock::now() + std::chrono::seconds(1);
-    [self setNeedsDisplay];
+    [self invalidateEditor];
     [self setNeedsLayout];
     [self.inputDelegate selectionDidChange:self];
 }
@@ -481,7 +488,7 @@
         }
         [self applyScrollDeltaX:dx deltaY:dy];
         [gesture setTranslation:CGPointZero inView:self];
-        [self setNeedsDisplay];
+        [self invalidateEditor];
     } else if (gesture.state == UIGestureRecognizerStateEnded || gesture.state == UIGestureRecognizerStateCancelled) {
         _scrollVelocity = [gesture velocityInView:self];
         if (fabs(_scrollVelocity.x) < 10.0 && fabs(_scrollVelocity.y) < 10.0) {
@@ -521,7 +528,7 @@
     if (self.editor->hScrollPos == 0 || self.editor->hScrollPos == maxH) {
         _scrollVelocity.x = 0;
     }
-    [self setNeedsDisplay];
+    [self invalidateEditor];
     [self.inputDelegate selectionDidChange:self];
     [self checkCaretVisibilityAndDismissKeyboardIfNeeded];
     if (self.editor) {
@@ -572,7 +579,7 @@
     [self.inputDelegate textWillChange:self];
     self.editor->imeComp = markedText ? [markedText UTF8String] : "";
     [self.inputDelegate textDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)unmarkText {
     if (!self.editor) return;
@@ -582,7 +589,7 @@
         self.editor->imeComp = "";
     }
     [self.inputDelegate textDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)insertText:(NSString *)text {
     [self hideHelpIfNeeded];
@@ -596,7 +603,7 @@
         self.editor->insertAtCursors([text UTF8String]);
     }
     [self.inputDelegate textDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)deleteBackward {
     [self hideHelpIfNeeded];
@@ -607,7 +614,7 @@
     self.editor->backspaceAtCursors();
     [self.inputDelegate textDidChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
     [self setNeedsLayout];
 }
 - (UITextRange *)selectedTextRange {
@@ -628,7 +635,7 @@
     c.originalAnchorX = c.desiredX;
     c.isVirtual = false;
     self.editor->cursors.push_back(c);
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (UITextRange *)markedTextRange {
     if (self.editor && !self.editor->imeComp.empty() && !self.editor->cursors.empty()) {
@@ -668,7 +675,7 @@
     self.editor->cursors.push_back(c);
     self.editor->insertAtCursors([text UTF8String]);
     [self.inputDelegate textDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (UITextPosition *)beginningOfDocument { return [iOSTextPosition positionWithIndex:0]; }
 - (UITextPosition *)endOfDocument { return [iOSTextPosition positionWithIndex:(self.editor ? self.editor->pt.length() : 0)]; }
@@ -722,7 +729,13 @@
     if (start > end) std::swap(start, end);
     int startLine = self.editor->getLineIdx(start);
     int endLine = self.editor->getLineIdx(end);
-    for (int line = startLine; line <= endLine; line++) {
+    // 選択の両端の行と、見えている行だけ矩形を作る (大きな選択でも画面の分で済む)
+    int visFirst = std::max(startLine + 1, self.editor->vScrollPos - 1);
+    int visLast = std::min(endLine - 1, self.editor->vScrollPos + (int)(self.bounds.size.height / self.editor->lineHeight) + 1);
+    std::vector<int> lines{ startLine };
+    for (int line = visFirst; line <= visLast; line++) lines.push_back(line);
+    if (endLine != startLine) lines.push_back(endLine);
+    for (int line : lines) {
         size_t lineStartIdx = self.editor->lineStarts[line];
         size_t nextLineStartIdx = (line + 1 < self.editor->lineStarts.size())
                                   ? self.editor->lineStarts[line + 1]
@@ -846,6 +859,7 @@
         [UIKeyCommand keyCommandWithInput:@"j" modifierFlags:UIKeyModifierCommand action:@selector(cmdGoToLine:)],
         [UIKeyCommand keyCommandWithInput:@"g" modifierFlags:UIKeyModifierCommand action:@selector(cmdGoToLine:)],
         [UIKeyCommand keyCommandWithInput:@"d" modifierFlags:UIKeyModifierCommand action:@selector(selectWordOrNextOccurrence:)],
+        [UIKeyCommand keyCommandWithInput:@"l" modifierFlags:UIKeyModifierCommand | UIKeyModifierShift action:@selector(selectAllOccurrences:)],
         [UIKeyCommand keyCommandWithInput:@"+" modifierFlags:UIKeyModifierCommand action:@selector(zoomIn:)],
         [UIKeyCommand keyCommandWithInput:@"=" modifierFlags:UIKeyModifierCommand action:@selector(zoomIn:)],
         [UIKeyCommand keyCommandWithInput:@"-" modifierFlags:UIKeyModifierCommand action:@selector(zoomOut:)],
@@ -925,7 +939,7 @@
     c.isVirtual = false;
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)moveCursorTo:(size_t)newPos keepSelection:(BOOL)keep updateX:(BOOL)updateX {
     [self hideHelpIfNeeded];
@@ -946,7 +960,7 @@
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
     self.editor->ensureCaretVisible();
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)moveLeft:(id)sender { [self doMoveLeft:NO]; }
 - (void)moveLeftAndSelect:(id)sender { [self doMoveLeft:YES]; }
@@ -965,6 +979,7 @@
 - (void)moveUp:(id)sender { [self doMoveUp:NO]; }
 - (void)moveUpAndSelect:(id)sender { [self doMoveUp:YES]; }
 - (void)doMoveUp:(BOOL)keep {
+    self.editor->resolveCursorX(self.editor->cursors.back());
     Cursor c = self.editor->cursors.back();
     int li = self.editor->getLineIdx(c.head);
     size_t newPos = (li > 0) ? self.editor->getPosFromLineAndX(li - 1, c.desiredX) : 0;
@@ -973,6 +988,7 @@
 - (void)moveDown:(id)sender { [self doMoveDown:NO]; }
 - (void)moveDownAndSelect:(id)sender { [self doMoveDown:YES]; }
 - (void)doMoveDown:(BOOL)keep {
+    self.editor->resolveCursorX(self.editor->cursors.back());
     Cursor c = self.editor->cursors.back();
     int li = self.editor->getLineIdx(c.head);
     size_t newPos = (li + 1 < self.editor->lineStarts.size()) ? self.editor->getPosFromLineAndX(li + 1, c.desiredX) : self.editor->pt.length();
@@ -1004,7 +1020,15 @@
     self.editor->selectNextOccurrence();
     [self.inputDelegate selectionWillChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
+}
+- (void)selectAllOccurrences:(id)sender {
+    [self hideHelpIfNeeded];
+    if (!self.editor) return;
+    self.editor->selectAllOccurrences();
+    [self.inputDelegate selectionWillChange:self];
+    [self.inputDelegate selectionDidChange:self];
+    [self invalidateEditor];
 }
 - (void)openDocument:(id)sender {
     [self hideHelpIfNeeded];
@@ -1036,7 +1060,7 @@
     self.editor->cutToClipboard();
     [self.inputDelegate textDidChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)paste:(id)sender {
     if (!self.editor) return;
@@ -1046,7 +1070,7 @@
     self.editor->pasteFromClipboard();
     [self.inputDelegate textDidChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)handleUndo:(id)sender {
     if (!self.editor) return;
@@ -1057,7 +1081,7 @@
     self.editor->ensureCaretVisible();
     [self.inputDelegate textDidChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)handleRedo:(id)sender {
     if (!self.editor) return;
@@ -1068,7 +1092,7 @@
     self.editor->ensureCaretVisible();
     [self.inputDelegate textDidChange:self];
     [self.inputDelegate selectionDidChange:self];
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (void)zoomIn:(id)sender {
     [self hideHelpIfNeeded];
@@ -1089,7 +1113,7 @@
     if (!self.editor) return;
     [self hideEditMenuIfNeeded];
     self.editor->showHelpPopup = !self.editor->showHelpPopup;
-    [self setNeedsDisplay];
+    [self invalidateEditor];
 }
 - (UIView *)inputAccessoryView {
     if (@available(iOS 14.0, *)) {
@@ -1236,7 +1260,7 @@
     self.editor->cursors.push_back(c);
     [self.inputDelegate selectionDidChange:self];
     self.editor->ensureCaretVisible();
-    [self setNeedsDisplay];
+    [self invalidateEditor];
     [self setNeedsLayout];
 }
 #pragma mark - UIEditMenuInteractionDelegate
@@ -1483,12 +1507,23 @@
     _editorEngine->cbNeedsDisplay = [weakSelf]() {
         __strong typeof(self) strongSelf = weakSelf;
         if (strongSelf) {
-            [strongSelf.editorView setNeedsDisplay];
+            [strongSelf.editorView invalidateEditor];
             if (strongSelf->_editorEngine && strongSelf->_editorEngine->cbUpdateTitleBar) {
                 strongSelf->_editorEngine->cbUpdateTitleBar();
             }
         }
     };
+    // 検索のスレッドから呼ばれるので、メインスレッドで進み具合を取り込む
+    _editorEngine->cbSearchProgress = [weakSelf]() {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            __strong typeof(self) strongSelf = weakSelf;
+            if (!strongSelf || !strongSelf->_editorEngine) return;
+            [strongSelf.editorView.inputDelegate selectionWillChange:strongSelf.editorView];
+            strongSelf->_editorEngine->applySearchProgress();
+            [strongSelf.editorView.inputDelegate selectionDidChange:strongSelf.editorView];
+            [strongSelf.editorView setNeedsDisplay];
+        });
+    };
     _editorEngine->cbGetViewSize = [weakSelf](float& w, float& h) {
         __strong typeof(self) strongSelf = weakSelf;
         if (strongSelf) {
@@ -2031,16 +2066,19 @@
     if (!_editorEngine) return;
     _editorEngine->searchMatchCase = !sender.selected;
     [self updateOptionButtonVisual:sender isSelected:_editorEngine->searchMatchCase];
+    [self searchConditionsChanged];
 }
 - (void)toggleWholeWord:(UIButton *)sender {
     if (!_editorEngine) return;
     _editorEngine->searchWholeWord = !sender.selected;
     [self updateOptionButtonVisual:sender isSelected:_editorEngine->searchWholeWord];
+    [self searchConditionsChanged];
 }
 - (void)toggleRegex:(UIButton *)sender {
     if (!_editorEngine) return;
     _editorEngine->searchRegex = !sender.selected;
     [self updateOptionButtonVisual:sender isSelected:_editorEngine->searchRegex];
+    [self searchConditionsChanged];
 }
 - (void)prepareSearchQuery {
     if (!_editorEngine || _editorEngine->cursors.empty()) return;
@@ -2209,8 +2247,22 @@
 - (void)searchTextChanged:(UITextField *)sender {
     if (!_editorEngine) return;
     _editorEngine->searchQuery = sender.text ? sender.text.UTF8String : "";
+    [self searchConditionsChanged];
+}
+// 検索語か検索条件が変わった: 別のスレッドで探し始める (最初の一致は見つかり次第選ばれる)
+- (void)searchConditionsChanged {
+    [self.editorView.inputDelegate selectionWillChange:self.editorView];
+    _editorEngine->searchQueryChanged();
+    [self.editorView.inputDelegate selectionDidChange:self.editorView];
     [self.editorView setNeedsDisplay];
 }
+// 正規表現の検索が時間の上限で打ち切られたら知らせる (見つからなかったのと区別する)
+- (void)reportSearchTimeout {
+    if (!_editorEngine || !_editorEngine->searchTimedOut) return;
+    UIAlertController *alert = [UIAlertController alertControllerWithTitle:NSLocalizedString(@"Too slow", nil) message:nil preferredStyle:UIAlertControllerStyleAlert];
+    [alert addAction:[UIAlertAction actionWithTitle:NSLocalizedString(@"OK", nil) style:UIAlertActionStyleDefault handler:nil]];
+    [self presentViewController:alert animated:YES completion:nil];
+}
 - (void)doFindNext {
     if (!_editorEngine || self.searchField.text.length == 0) return;
     [self.editorView.inputDelegate selectionWillChange:self.editorView];
@@ -2218,6 +2270,7 @@
     _editorEngine->findNext(true);
     [self.editorView.inputDelegate selectionDidChange:self.editorView];
     [self.editorView setNeedsDisplay];
+    [self reportSearchTimeout];
 }
 - (void)doFindPrev {
     if (!_editorEngine || self.searchField.text.length == 0) return;
@@ -2226,6 +2279,7 @@
     _editorEngine->findNext(false);
     [self.editorView.inputDelegate selectionDidChange:self.editorView];
     [self.editorView setNeedsDisplay];
+    [self reportSearchTimeout];
 }
 - (void)doReplace {
     if (!_editorEngine || self.searchField.text.length == 0) return;
@@ -2248,5 +2302,6 @@
     [self.editorView.inputDelegate textDidChange:self.editorView];
     [self.editorView.inputDelegate selectionDidChange:self.editorView];
     [self.editorView setNeedsDisplay];
+    [self reportSearchTimeout];
 }
 @end
@@ -79,6 +79,46 @@ static std::string Utf8ToLocal(const std::string& utf8, CFStringEncoding encodin
     if (usedBufLen > 0) return std::string(buf.data(), usedBufLen);
     return "";
 }
+#else
+static void AppendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) out += (char)cp;
+    else if (cp < 0x800) { out += (char)(0xC0 | (cp >> 6)); out += (char)(0x80 | (cp & 0x3F)); }
+    else if (cp < 0x10000) { out += (char)(0xE0 | (cp >> 12)); out += (char)(0x80 | ((cp >> 6) & 0x3F)); out += (char)(0x80 | (cp & 0x3F)); }
+    else { out += (char)(0xF0 | (cp >> 18)); out += (char)(0x80 | ((cp >> 12) & 0x3F)); out += (char)(0x80 | ((cp >> 6) & 0x3F)); out += (char)(0x80 | (cp & 0x3F)); }
+}
+std::string WToUTF8(const std::wstring& w) {
+    std::string out; out.reserve(w.size());
+    for (size_t i = 0; i < w.size(); ++i) {
+        uint32_t cp = (uint32_t)w[i];
+        if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp <= 0xDBFF && i + 1 < w.size()) { cp = 0x10000 + ((cp - 0xD800) << 10) + ((uint32_t)w[i + 1] - 0xDC00); i++; }
+        AppendUtf8(out, cp);
+    }
+    return out;
+}
+std::wstring UTF8ToW(const std::string& s) {
+    std::wstring out; out.reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = s[i]; uint32_t cp = c; int n = 0;
+        if (c >= 0xF0) { cp = c & 0x07; n = 3; } else if (c >= 0xE0) { cp = c & 0x0F; n = 2; } else if (c >= 0xC0) { cp = c & 0x1F; n = 1; }
+        i++;
+        for (int k = 0; k < n && i < s.size(); ++k, ++i) cp = (cp << 6) | (s[i] & 0x3F);
+        if (sizeof(wchar_t) == 2 && cp >= 0x10000) { cp -= 0x10000; out.push_back((wchar_t)(0xD800 + (cp >> 10))); out.push_back((wchar_t)(0xDC00 + (cp & 0x3FF))); }
+        else out.push_back((wchar_t)cp);
+    }
+    return out;
+}
+std::string Utf16ToUtf8(const char* data, size_t len, bool isBigEndian) {
+    if (len < 2) return "";
+    std::string out; out.reserve(len);
+    const unsigned char* b = (const unsigned char*)data;
+    auto unit = [&](size_t i) -> uint32_t { return isBigEndian ? ((uint32_t)b[i] << 8) | b[i + 1] : ((uint32_t)b[i + 1] << 8) | b[i]; };
+    for (size_t i = 2; i + 1 < len; i += 2) {
+        uint32_t cp = unit(i);
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 3 < len) { uint32_t lo = unit(i + 2); if (lo >= 0xDC00 && lo <= 0xDFFF) { cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00); i += 2; } }
+        AppendUtf8(out, cp);
+    }
+    return out;
+}
 #endif
 const std::wstring APP_TITLE = L"miu";
 bool MappedFile::open(const char* path) {
@@ -88,6 +128,143 @@ bool MappedFile::open(const char* path) {
     ptr = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0); return (ptr != MAP_FAILED);
 }
 void MappedFile::close() { if (ptr && ptr != MAP_FAILED) munmap(ptr, size); if (fd != -1) ::close(fd); ptr = nullptr; fd = -1; }
+size_t MappedFile::residentBytes() const {
+    if (!ptr || ptr == MAP_FAILED || size == 0) return 0;
+    auto now = std::chrono::steady_clock::now();
+    if (residentAt != std::chrono::steady_clock::time_point() && now - residentAt < std::chrono::milliseconds(kResidentRefreshMs)) return residentCache;
+    residentAt = now; residentCache = 0;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), pages = (size + page - 1) / page, resident = 0;
+    std::vector<unsigned char> vec(pages);
+#if defined(__APPLE__)
+    if (mincore(ptr, size, (char*)vec.data()) != 0) return 0;
+#else
+    if (mincore(ptr, size, vec.data()) != 0) return 0;
+#endif
+    for (unsigned char v : vec) if (v & 1) resident++;
+    return residentCache = std::min(size, resident * page);
+}
+static size_t HeapBytes(const std::string& s) { return s.capacity() >= sizeof(std::string) ? s.capacity() + 1 : 0; }
+static size_t HeapBytes(const std::vector<EditBatch>& stack) {
+    size_t b = stack.capacity() * sizeof(EditBatch);
+    for (const auto& batch : stack) {
+        b += batch.ops.capacity() * sizeof(EditOp) + (batch.beforeCursors.capacity() + batch.afterCursors.capacity()) * sizeof(Cursor);
+        for (const auto& op : batch.ops) { b += HeapBytes(op.text); if (op.pieces) b += op.pieces->capacity() * sizeof(Piece); }
+    }
+    return b;
+}
+std::vector<std::pair<const char*, size_t>> MemoryStats::entries() const {
+    return { { "pieceList", pieceList }, { "addBuffer", addBuffer }, { "originalMapped", originalMapped }, { "originalResident", originalResident },
+             { "fileBuffer", fileBuffer }, { "lineIndex", lineIndex }, { "undoStack", undoStack }, { "redoStack", redoStack }, { "profiler", profiler },
+             { "searchIndex", searchIndex }, { "searchSnapshot", searchSnapshot }, { "autoHighlight", autoHighlight }, { "layoutCache", layoutCache }, { "gutterCache", gutterCache } };
+}
+size_t MemoryStats::total() const { size_t t = 0; for (const auto& e : entries()) t += e.second; return t - originalMapped; }
+std::string MemoryStats::toJson() const {
+    std::string j = "{"; char buf[64];
+    for (const auto& e : entries()) { snprintf(buf, sizeof(buf), "\"%s\":%zu,", e.first, e.second); j += buf; }
+    snprintf(buf, sizeof(buf), "\"total\":%zu}", total()); j += buf; return j;
+}
+std::vector<std::string> MemoryStats::summaryLines() const {
+    std::vector<std::string> lines; char buf[96];
+    snprintf(buf, sizeof(buf), "memory %10.2f MB", total() / (1024.0 * 1024.0)); lines.push_back(buf);
+    for (const auto& e : entries()) { snprintf(buf, sizeof(buf), "  %-16s %10.2f MB", e.first, e.second / (1024.0 * 1024.0)); lines.push_back(buf); }
+    return lines;
+}
+bool EditTrace::start(const std::string& path) {
+    stop(); out.open(path, std::ios::binary | std::ios::trunc); if (!out) return false;
+    out << "#miutrace\t1\n"; active = true; t0 = std::chrono::steady_clock::now(); lastFlushMs = 0.0; lastCursors.clear(); lastSearch.clear(); return true;
+}
+void EditTrace::stop() { if (out.is_open()) out.close(); active = false; }
+std::string EditTrace::escape(std::string_view s) {
+    std::string r; r.reserve(s.size());
+    for (char c : s) { if (c == '\\') r += "\\\\"; else if (c == '\t') r += "\\t"; else if (c == '\n') r += "\\n"; else if (c == '\r') r += "\\r"; else r += c; }
+    return r;
+}
+void EditTrace::write(const char* cmd, std::initializer_list<std::string_view> args) {
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    char ts[32]; snprintf(ts, sizeof(ts), "%.3f", ms);
+    out << ts << '\t' << cmd; for (auto a : args) out << '\t' << escape(a); out << '\n';
+    if (ms - lastFlushMs >= kFlushIntervalMs) { out.flush(); lastFlushMs = ms; }
+}
+std::vector<std::string> EditTrace::parseLine(const std::string& line) {
+    std::vector<std::string> f(1);
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (c == '\t') { f.emplace_back(); continue; }
+        if (c == '\\' && i + 1 < line.size()) { char n = line[++i]; c = (n == 't') ? '\t' : (n == 'n') ? '\n' : (n == 'r') ? '\r' : n; }
+        f.back() += c;
+    }
+    return f;
+}
+// トップレベルのコマンドだけを記録する (内部で呼ばれる他のコマンドは記録しない)
+struct TraceScope {
+    Editor* e; bool top;
+    template<class... A> TraceScope(Editor* ed, const char* cmd, const A&... args) : e(ed), top(ed->trace.depth++ == 0) {
+        if (top && e->trace.active) { e->traceSync(); e->trace.write(cmd, { std::string_view(args)... }); }
+    }
+    ~TraceScope() { e->trace.depth--; }
+};
+bool SlowOpLog::start(const std::string& path, double threshold) {
+    stop(); out.open(path, std::ios::binary | std::ios::app); if (!out) return false;
+    thresholdMs = threshold; active = true; return true;
+}
+void SlowOpLog::stop() { if (out.is_open()) out.close(); active = false; }
+void SlowOpLog::write(const char* op, double ms, size_t docBytes, size_t pieces, size_t lines, size_t cursors) {
+    if (!active || ms < thresholdMs) return;
+    long long unixMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    char buf[320];
+    snprintf(buf, sizeof(buf), "{\"time\":%lld,\"op\":\"%s\",\"ms\":%.3f,\"doc_bytes\":%zu,\"pieces\":%zu,\"lines\":%zu,\"cursors\":%zu}\n", unixMs, op, ms, docBytes, pieces, lines, cursors);
+    out << buf;
+    if (unixMs - lastFlush >= kFlushIntervalMs) { out.flush(); lastFlush = unixMs; }
+}
+// スコープの所要時間が閾値を超えたら slowLog に書き出す (入れ子の操作もそれぞれ記録する)
+struct SlowOpScope {
+    Editor* e; const char* op; std::chrono::steady_clock::time_point t0;
+    SlowOpScope(Editor* ed, const char* name) : e(ed), op(name) { if (e->slowLog.active) t0 = std::chrono::steady_clock::now(); }
+    ~SlowOpScope() { if (e->slowLog.active) e->noteSlowOp(op, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count()); }
+};
+const char* FrameProfiler::phaseName(int phase) {
+    static const char* names[] = { "text fetch", "search highlight", "auto highlight", "layout", "gutter", "selection", "submit", "frame" };
+    return (phase >= 0 && phase < PhaseCount) ? names[phase] : "?";
+}
+void FrameProfiler::beginFrame() { depth = 0; std::fill(std::begin(phaseUs), std::end(phaseUs), 0.0); push(Frame); }
+void FrameProfiler::endFrame() {
+    while (depth > 0) pop();
+    std::copy(std::begin(phaseUs), std::end(phaseUs), history[historyPos]);
+    historyPos = (historyPos + 1) % kHistory; historyCount = std::min(historyCount + 1, kHistory);
+}
+void FrameProfiler::push(Phase phase) {
+    if (depth >= kMaxDepth) { depth++; return; }
+    stackStart[depth] = std::chrono::steady_clock::now(); stackPhase[depth] = phase; stackChildUs[depth] = 0.0; depth++;
+}
+void FrameProfiler::pop() {
+    if (depth <= 0) return;
+    if (--depth >= kMaxDepth) return;
+    auto now = std::chrono::steady_clock::now();
+    double us = std::chrono::duration<double, std::micro>(now - stackStart[depth]).count();
+    int phase = stackPhase[depth];
+    phaseUs[phase] += (phase == Frame) ? us : us - stackChildUs[depth];
+    if (depth > 0) stackChildUs[depth - 1] += us;
+    if (recording && events.size() < maxEvents) events.push_back({ phase, std::chrono::duration_cast<std::chrono::microseconds>(stackStart[depth] - origin).count(), (int64_t)us });
+}
+std::vector<std::string> FrameProfiler::overlayLines() const {
+    std::vector<std::string> lines; if (historyCount == 0) return lines;
+    double avg[PhaseCount] = {}, frameMax = 0.0;
+    for (int i = 0; i < historyCount; ++i) { for (int p = 0; p < PhaseCount; ++p) avg[p] += history[i][p]; frameMax = std::max(frameMax, history[i][Frame]); }
+    char buf[96];
+    snprintf(buf, sizeof(buf), "frame %6.2f ms avg %6.2f ms max (%d)", avg[Frame] / historyCount / 1000.0, frameMax / 1000.0, historyCount); lines.push_back(buf);
+    for (int p = 0; p < Frame; ++p) { snprintf(buf, sizeof(buf), "%-16s %6.2f ms", phaseName(p), avg[p] / historyCount / 1000.0); lines.push_back(buf); }
+    if (recording) { snprintf(buf, sizeof(buf), "recording %zu events", events.size()); lines.push_back(buf); }
+    return lines;
+}
+bool FrameProfiler::exportChromeTrace(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc); if (!out) return false;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Event& ev = events[i];
+        out << (i ? ",\n" : "\n") << "{\"name\":\"" << phaseName(ev.phase) << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << ev.startUs << ",\"dur\":" << ev.durUs << "}";
+    }
+    out << "\n]}\n"; return (bool)out;
+}
 bool IsValidUtf8(const char* buf, size_t len) {
     if (len == 0) return true;
     size_t check_len = (len > 4096) ? 4096 : len;
@@ -114,7 +291,7 @@ bool IsValidUtf8(const char* buf, size_t len) {
     }
     return true;
 }
-static DetectResult DetectEncodingEx(const char* buf, size_t len) {
+DetectResult DetectEncodingEx(const char* buf, size_t len) {
 #if defined(__APPLE__)
     DetectResult res = { ENC_UTF8_NOBOM, kCFStringEncodingUTF8 };
 #else
@@ -181,6 +358,7 @@ void Editor::detectNewlineStyle(const char* buf, size_t len) {
     newlineStr = "\n";
 }
 void Editor::insertAtCursorsWithPadding(const std::string& text) {
+    TraceScope ts(this, "insertPadded", text);
     if (cursors.empty()) return;
     EditBatch batch; batch.beforeCursors = cursors;
     auto sortedIndices = std::vector<size_t>(cursors.size());
@@ -217,6 +395,7 @@ void Editor::insertAtCursorsWithPadding(const std::string& text) {
     batch.afterCursors = cursors; undo.push(batch); rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag();
 }
 void Editor::insertNewlineWithAutoIndent() {
+    TraceScope ts(this, "newline");
     if (cursors.empty()) return;
     EditBatch batch;
     batch.beforeCursors = cursors;
@@ -275,6 +454,7 @@ void Editor::insertNewlineWithAutoIndent() {
     updateDirtyFlag();
 }
 void Editor::insertRectangularBlock(const std::string& text) {
+    TraceScope ts(this, "insertRect", text);
     if (cursors.empty()) return;
     std::vector<std::string> lines; std::stringstream ss(text); std::string line;
     while (std::getline(ss, line)) { if (!line.empty() && line.back() == '\r') line.pop_back(); lines.push_back(line); }
@@ -282,6 +462,7 @@ void Editor::insertRectangularBlock(const std::string& text) {
     EditBatch batch; batch.beforeCursors = cursors;
     auto sortedCursors = cursors;
     std::sort(sortedCursors.begin(), sortedCursors.end(), [](const Cursor& a, const Cursor& b) { return a.start() < b.start(); });
+    resolveCursorX(sortedCursors[0]);
     size_t basePos = sortedCursors[0].head; float baseX = sortedCursors[0].desiredX; int startLineIdx = getLineIdx(basePos);
     int requiredTotalLines = startLineIdx + (int)lines.size();
     if (requiredTotalLines > (int)lineStarts.size()) {
@@ -325,6 +506,7 @@ std::vector<int> Editor::getUniqueLineIndices() {
     std::sort(lines.begin(), lines.end()); lines.erase(std::unique(lines.begin(), lines.end()), lines.end()); return lines;
 }
 void Editor::deleteLine() {
+    TraceScope ts(this, "deleteLine");
     std::vector<int> lines = getUniqueLineIndices(); if (lines.empty()) return;
     EditBatch batch; batch.beforeCursors = cursors;
     for (int i = (int)lines.size() - 1; i >= 0; --i) {
@@ -347,6 +529,7 @@ void Editor::deleteLine() {
     batch.afterCursors = cursors; undo.push(batch); rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag();
 }
 void Editor::moveLines(bool up) {
+    TraceScope ts(this, "moveLines", up ? "1" : "0");
     std::vector<int> lines = getUniqueLineIndices(); if (lines.empty()) return;
     if (up && lines.front() == 0) return; if (!up && lines.back() >= (int)lineStarts.size() - 1) return;
     EditBatch batch; batch.beforeCursors = cursors;
@@ -446,6 +629,7 @@ void Editor::moveLines(bool up) {
     batch.afterCursors = cursors; undo.push(batch); ensureCaretVisible(); updateDirtyFlag();
 }
 void Editor::copyLines(bool up) {
+    TraceScope ts(this, "copyLines", up ? "1" : "0");
     std::vector<int> lines = getUniqueLineIndices(); if (lines.empty()) return;
     size_t len = pt.length(); if (len > 0 && pt.charAt(len-1) != '\n') { pt.insert(len, "\n"); rebuildLineStarts(); }
     EditBatch batch; batch.beforeCursors = cursors;
@@ -483,6 +667,7 @@ void Editor::copyLines(bool up) {
     batch.afterCursors = cursors; undo.push(batch); ensureCaretVisible(); updateDirtyFlag();
 }
 void Editor::indentLines(bool forceLineIndent) {
+    TraceScope ts(this, "indent", forceLineIndent ? "1" : "0");
     bool hasSelection = false;
     for (const auto& c : cursors) if (c.hasSelection()) hasSelection = true;
     if (!hasSelection && !forceLineIndent) {
@@ -524,6 +709,7 @@ void Editor::indentLines(bool forceLineIndent) {
     updateDirtyFlag();
 }
 void Editor::unindentLines() {
+    TraceScope ts(this, "unindent");
     std::vector<int> lines = getUniqueLineIndices();
     if (lines.empty()) return;
     EditBatch batch;
@@ -566,6 +752,8 @@ void Editor::updateGutterWidth() {
 void Editor::updateMaxLineWidth() {
 #if defined(__APPLE__)
     if (!fontRef) return;
+#else
+    return;
 #endif
     maxLineWidth = 0.0f;
     for (int i = 0; i < (int)lineStarts.size(); ++i) {
@@ -590,6 +778,67 @@ std::pair<std::string, bool> Editor::getHighlightTarget() {
     if (end > start) return { pt.getRange(start, end - start), true };
     return { "", true };
 }
+// 一致 [pos, pos + len) のうち [lineFrom, lineTo) 行にかかる部分を行ごとの範囲にして out に足す。空一致は 1 文字分の幅にする
+void Editor::matchSpans(size_t pos, size_t len, int lineFrom, int lineTo, std::vector<LineSpan>& out) {
+    if (len == 0) {
+        int li = getLineIdx(pos);
+        if (li >= lineFrom && li < lineTo) { float x = getXInLine(li, pos); out.push_back({ li, x, x + charWidth }); }
+        return;
+    }
+    while (len > 0) {
+        int li = getLineIdx(pos);
+        if (li >= lineTo) break;
+        size_t lineEndPos = (li + 1 < (int)lineStarts.size()) ? lineStarts[li + 1] : pt.length();
+        size_t lineVisualEnd = lineEndPos;
+        if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\n') lineVisualEnd--;
+        if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\r') lineVisualEnd--;
+        size_t lenInLine = std::min(len, lineVisualEnd > pos ? lineVisualEnd - pos : 0);
+        if (lenInLine == 0 && pos < lineEndPos) lenInLine = std::min(len, lineEndPos - pos);
+        if (li >= lineFrom) {
+            float x1 = getXInLine(li, pos), x2 = getXInLine(li, pos + lenInLine);
+            if (x2 <= x1) x2 = x1 + charWidth;
+            out.push_back({ li, x1, x2 });
+        }
+        size_t consumed = std::min(len, lineEndPos - pos);
+        if (consumed == 0) break;
+        pos += consumed; len -= consumed;
+    }
+}
+// 自動ハイライトの対象の語と、[firstLine, endLine) 行の塗る範囲を最新にする。文書もカーソルも表示範囲も変わっていなければ何もしない
+const AutoHighlightCache& Editor::updateAutoHighlight(int firstLine, int endLine) {
+    AutoHighlightCache& ah = autoHighlight;
+    uint64_t ver = pt.changes.version();
+    size_t head = cursors.empty() ? 0 : cursors.back().head, anchor = cursors.empty() ? 0 : cursors.back().anchor;
+    if (ah.version != ver || ah.head != head || ah.anchor != anchor || ah.cursorCount != cursors.size()) {
+        auto [target, wholeWord] = getHighlightTarget();
+        // 同じ語の中でカーソルが動いただけなら塗る範囲はそのまま使える
+        if (ah.version != ver || ah.target != target || ah.wholeWord != wholeWord) { ah.spans.clear(); ah.first = ah.end = 0; }
+        ah.version = ver; ah.head = head; ah.anchor = anchor; ah.cursorCount = cursors.size(); ah.target = std::move(target); ah.wholeWord = wholeWord;
+    }
+    if (ah.target.empty() || ah.target == searchQuery) return ah;
+    if (ah.charWidth != charWidth || ah.ime != imeComp || firstLine >= ah.end || endLine <= ah.first) { ah.spans.clear(); ah.first = ah.end = firstLine; ah.charWidth = charWidth; ah.ime = imeComp; }
+    if (firstLine == ah.first && endLine == ah.end) return ah;
+    const miu::MatchIndex* idx = matchIndex(autoIndex, ah.target, true, ah.wholeWord, false);
+    auto scan = [&](int a, int b, std::vector<LineSpan>& out) {
+        if (a >= b) return;
+        size_t from = lineStarts[a], to = b < (int)lineStarts.size() ? lineStarts[b] : pt.length();
+        if (idx) { idx->forEachOverlapping(from, to, [&](const miu::SearchHit& m) { if (m.len > 0) matchSpans(m.pos, m.len, a, b, out); }); return; }
+        // 索引を使えないときだけその範囲の文字列を探す
+        std::string text; { FrameProfiler::Scope fs(profiler, FrameProfiler::TextFetch); text = pt.getRange(from, to - from); }
+        for (size_t p = 0; (p = text.find(ah.target, p)) != std::string::npos; ++p) {
+            size_t docPos = from + p, qLen = ah.target.size();
+            if (ah.wholeWord && ((docPos > 0 && isWordChar(pt.charAt(docPos - 1))) || (docPos + qLen < pt.length() && isWordChar(pt.charAt(docPos + qLen))))) continue;
+            matchSpans(docPos, qLen, a, b, out);
+        }
+    };
+    // 前から見えていた行の範囲はそのまま残し、上下に新しく見えた行だけを求める
+    std::vector<LineSpan> spans;
+    scan(firstLine, ah.first, spans);
+    for (const auto& sp : ah.spans) if (sp.line >= firstLine && sp.line < endLine) spans.push_back(sp);
+    scan(std::max(ah.end, firstLine), endLine, spans);
+    ah.spans.swap(spans); ah.first = firstLine; ah.end = endLine;
+    return ah;
+}
 std::string Editor::UnescapeString(const std::string& s, const std::string& newline) {
     std::string out; out.reserve(s.size());
     for (size_t i = 0; i < s.size(); ++i) {
@@ -598,286 +847,328 @@ std::string Editor::UnescapeString(const std::string& s, const std::string& newl
         } else out += s[i];
     } return out;
 }
-std::string Editor::preprocessRegexQuery(const std::string& query) {
-    std::string processed;
-    processed.reserve(query.size() * 4);
-    for (size_t i = 0; i < query.size(); ++i) {
-        char c = query[i];
-        if (c == '\\') {
-            if (i + 1 < query.size()) {
-                char next = query[i + 1];
-                if (next == 'n') {
-                    bool isPrecededByCR = (i >= 2 && query[i - 2] == '\\' && query[i - 1] == 'r');
-                    if (!isPrecededByCR) {
-                        processed += "(?:\\r\\n|[\\r\\n])";
-                        i++; continue;
-                    }
-                }
-                processed += c; processed += next; i++; continue;
-            }
-        }
-        else if (c == '^') {
-            bool inClass = false;
-            if (i > 0 && query[i - 1] == '[') inClass = true;
-            if (!inClass) {
-                processed += "((?:^|(?:\\r\\n|\\r(?!\\n)|[\\n])))";
-                continue;
-            }
-        }
-        else if (c == '$') {
-            bool inClass = false;
-            if (i > 0 && query[i - 1] == '[') inClass = true;
-            if (!inClass) {
-                processed += "(?=(?:\\r\\n|[\\r\\n]|$))";
-                continue;
-            }
-        }
-        processed += c;
-    }
-    return processed;
+const miu::Regex& Editor::compileSearchRegex(const std::string& query, bool matchCase) {
+    int flags = miu::Regex::AnyNewline | (matchCase ? 0 : miu::Regex::IgnoreCase);
+    if (cachedRegex.pattern() != query || cachedRegex.flags() != flags) cachedRegex = miu::Regex(query, flags);
+    return cachedRegex;
+}
+// 通常検索の一致として扱うか: 単語単位の指定と、絵文字の途中で切れていないか
+// before は一致の直前の 1 バイト (文書の先頭なら 0)、next は直後の最大 4 バイト
+static bool isLiteralMatchOk(bool wholeWord, char before, std::string_view next) {
+    if (wholeWord) { if (before && Editor::isWordChar(before)) return false; if (!next.empty() && Editor::isWordChar(next[0])) return false; }
+    // 直後に ZWJ (E2 80 8D)、異体字セレクタ (EF B8 8F)、肌色修飾子 (F0 9F 8F BB-BF) が続くなら絵文字の一部なので一致としない
+    const unsigned char* b = (const unsigned char*)next.data();
+    if (next.size() >= 3 && ((b[0] == 0xE2 && b[1] == 0x80 && b[2] == 0x8D) || (b[0] == 0xEF && b[1] == 0xB8 && b[2] == 0x8F))) return false;
+    if (next.size() >= 4 && b[0] == 0xF0 && b[1] == 0x9F && b[2] == 0x8F && b[3] >= 0xBB && b[3] <= 0xBF) return false;
+    return true;
+}
+static bool isLiteralMatchOk(const PieceTable& doc, bool wholeWord, size_t pos, size_t mLen) {
+    return isLiteralMatchOk(wholeWord, (wholeWord && pos > 0) ? doc.charAt(pos - 1) : 0, doc.getRange(pos + mLen, 4));
+}
+// 並列検索の区切り位置を UTF-8 の文字の先頭に合わせる
+static size_t alignToCharStart(const PieceTable& doc, size_t len, size_t pos) {
+    for (int k = 0; k < 3 && pos < len && ((unsigned char)doc.charAt(pos) & 0xC0) == 0x80; ++k) pos++;
+    return pos;
+}
+size_t Editor::alignToCharStart(size_t pos) { return ::alignToCharStart(pt, pt.length(), pos); }
+// 一致の次に探し始める位置。空一致の次は 1 文字進めて探す (forEach と同じ規則)
+static size_t nextSearchStart(const PieceTable& doc, size_t len, const miu::SearchHit& h) {
+    if (h.len > 0) return h.pos + h.len;
+    if (h.pos >= len) return len + 1;
+    std::string next = doc.getRange(h.pos, 4); size_t l;
+    miu::decodeUtf8((const unsigned char*)next.data(), next.size(), l); return h.pos + l;
+}
+size_t Editor::nextSearchStart(const miu::SearchHit& h) { return ::nextSearchStart(pt, pt.length(), h); }
+// 後ろ向きの正規表現検索の窓の始まり: pos 以前で最も近い行頭。窓 1 つ分の中に改行がなければ pos のまま
+static size_t lineStartBefore(const PieceTable& doc, size_t pos) {
+    size_t n = std::min(pos, miu::Regex::kBackwardWindow); std::string s = doc.getRange(pos - n, n);
+    size_t k = s.find_last_of("\r\n");
+    return k != std::string::npos ? pos - n + k + 1 : (n == pos ? 0 : pos);
+}
+// 開始位置が limit より前の一致を、先頭から順に forEach で列挙した場合と同じ順に集める。長い文書は区間に分けて並列に探す。
+// source はスレッドごとに文書を読む関数を作る。予算を使い切ったら false
+bool Editor::collectRegexMatches(const miu::Regex& re, const std::function<miu::RegexSpanFn()>& source, size_t len, size_t limit, std::vector<miu::RegexMatch>& out) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(bulkRegexTimeLimitMs);
+    auto scan = [&](size_t from, size_t to, auto&& emit) {
+        miu::RegexSearchOptions opt; opt.budget = regexStepBudget; opt.startLimit = to; opt.deadline = deadline;
+        return re.forEach(source(), len, from, [&](const miu::RegexMatch& m) { return emit(m); }, opt) == miu::Regex::Found;
+    };
+    auto resume = [&](const miu::RegexMatch& m) { return nextSearchStart({ m.pos, m.len }); };
+    return miu::parallelFindAll(miu::searchPartitions(0, std::min(limit, len + 1), [&](size_t p) { return alignToCharStart(p); }), scan, resume, out);
 }
 size_t Editor::findText(size_t startPos, const std::string& query, bool forward, bool matchCase, bool wholeWord, bool isRegex, size_t* outLen) {
     if (query.empty()) return std::string::npos;
     size_t len = pt.length();
-    std::string actualQuery = query;
-    if (isRegex) actualQuery = preprocessRegexQuery(query);
+    auto align = [&](size_t p) { return alignToCharStart(p); };
     if (isRegex) {
-        std::string fullText = pt.getRange(0, len);
-        try {
-            std::regex_constants::syntax_option_type flags = std::regex_constants::ECMAScript;
-            if (!matchCase) flags |= std::regex_constants::icase;
-            std::regex re(actualQuery, flags);
-            std::smatch m;
-            size_t foundPos = std::string::npos;
-            size_t foundLen = 0;
-            bool startsWithCaret = (!query.empty() && query[0] == '^');
-            bool endsWithDollar = (!query.empty() && query.back() == '$');
-            if (forward) {
-                if (startPos > fullText.size()) startPos = 0;
-                size_t searchStartIdx = startPos;
-                std::regex_constants::match_flag_type searchFlags = std::regex_constants::match_default;
-                if (searchStartIdx > 0) {
-                    searchFlags |= std::regex_constants::match_not_bol;
-                    char prevChar = fullText[searchStartIdx - 1];
-                    if (prevChar == '\n') {
-                        searchStartIdx--;
-                        if (searchStartIdx > 0 && fullText[searchStartIdx - 1] == '\r') {
-                            searchStartIdx--;
-                        }
-                    }
-                    else if (prevChar == '\r') {
-                        searchStartIdx--;
-                    }
-                }
-                std::string::const_iterator searchStartIter = fullText.begin() + searchStartIdx;
-                while (std::regex_search(searchStartIter, fullText.cend(), m, re, searchFlags)) {
-                    size_t currentMatchPos = searchStartIdx + m.position();
-                    size_t currentMatchLen = m.length();
-                    size_t anchorLen = 0;
-                    if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                        anchorLen = m.length(1);
-                    }
-                    size_t contentPos = currentMatchPos + anchorLen;
-                    size_t contentLen = currentMatchLen - anchorLen;
-                    bool isValid = false;
-                    if (contentPos >= startPos) isValid = true;
-                    if (isValid && endsWithDollar) {
-                        bool isAtLineEnd = false;
-                        size_t checkPos = contentPos + contentLen;
-                        if (checkPos >= fullText.size()) {
-                            isAtLineEnd = true;
-                        } else {
-                            char c = fullText[checkPos];
-                            if (c == '\r' || c == '\n') {
-                                isAtLineEnd = true;
-                                if (contentLen == 0 && c == '\n' && checkPos > 0 && fullText[checkPos - 1] == '\r') {
-                                    isAtLineEnd = false;
-                                }
-                            }
-                        }
-                        if (!isAtLineEnd) isValid = false;
-                    }
-                    if (isValid) {
-                        foundPos = contentPos;
-                        foundLen = contentLen;
-                        if (startsWithCaret && endsWithDollar && foundLen == 0 && foundPos == fullText.size() && !fullText.empty()) {
-                            bool isAfterNewline = false;
-                            if (foundPos > 0) {
-                                char c = fullText[foundPos - 1];
-                                if (c == '\r' || c == '\n') isAfterNewline = true;
-                            }
-                            if (!isAfterNewline) isValid = false;
-                        }
-                        if (isValid) break;
-                    }
-                    size_t step = currentMatchLen;
-                    if (step == 0) {
-                        bool isBolCaret = (startsWithCaret && !(searchFlags & std::regex_constants::match_not_bol));
-                        if (isBolCaret) step = 0;
-                        else step = 1;
-                    }
-                    if (step == 0 && (searchFlags & std::regex_constants::match_not_bol)) step = 1;
-                    
-                    size_t dist = std::distance(searchStartIter, fullText.cend());
-                    if ((size_t)m.position() + step > dist) break;
-                    size_t advance = m.position() + step;
-                    std::advance(searchStartIter, advance);
-                    searchStartIdx += advance;
-                    searchFlags |= std::regex_constants::match_not_bol;
-                }
-                if (foundPos == std::string::npos && startPos > 0) {
-                    if (std::regex_search(fullText.cbegin(), fullText.cend(), m, re)) {
-                        size_t mPos = m.position();
-                        size_t mLen = m.length();
-                        size_t aLen = 0;
-                        if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                            aLen = m.length(1);
-                        }
-                        bool split = false;
-                        if (startsWithCaret && aLen == 1 && mPos < fullText.size() && fullText[mPos] == '\r') {
-                            if (mPos + 1 < fullText.size() && fullText[mPos + 1] == '\n') split = true;
-                        }
-                        if (!split) {
-                            size_t cPos = mPos + aLen;
-                            size_t cLen = mLen - aLen;
-                            bool valid = true;
-                            if (endsWithDollar) {
-                                size_t check = cPos + cLen;
-                                if (check < fullText.size()) {
-                                    char c = fullText[check];
-                                    if (c == '\r' || c == '\n') {
-                                        if (cLen == 0 && c == '\n' && check > 0 && fullText[check - 1] == '\r') valid = false;
-                                    } else {
-                                        valid = false;
-                                    }
-                                }
-                            }
-                            if (startsWithCaret && endsWithDollar && cLen == 0 && cPos == fullText.size() && !fullText.empty()) {
-                                bool isAfterNL = false;
-                                if (cPos > 0) {
-                                    char c = fullText[cPos - 1];
-                                    if (c == '\r' || c == '\n') isAfterNL = true;
-                                }
-                                if (!isAfterNL) valid = false;
-                            }
-                            if (valid) {
-                                foundPos = cPos;
-                                foundLen = cLen;
-                            }
-                        }
-                    }
-                }
-            }
-            else {
-                auto words_begin = std::sregex_iterator(fullText.begin(), fullText.end(), re);
-                auto words_end = std::sregex_iterator();
-                size_t bestPos = std::string::npos;
-                size_t bestLen = 0;
-                size_t limit = (startPos == 0) ? len : startPos;
-                for (auto i = words_begin; i != words_end; ++i) {
-                    size_t mPos = i->position();
-                    size_t mLen = i->length();
-                    size_t aLen = 0;
-                    if (startsWithCaret && i->size() > 1 && (*i)[1].matched) {
-                        aLen = i->length(1);
-                    }
-                    if (startsWithCaret && aLen == 1 && mPos < fullText.size() && fullText[mPos] == '\r') {
-                        if (mPos + 1 < fullText.size() && fullText[mPos + 1] == '\n') continue;
-                    }
-                    size_t contentStart = mPos + aLen;
-                    size_t contentLen = mLen - aLen;
-                    if (endsWithDollar) {
-                        bool isAtEnd = (contentStart + contentLen >= fullText.size());
-                        if (!isAtEnd) {
-                            char c = fullText[contentStart + contentLen];
-                            if (c != '\r' && c != '\n') continue;
-                            if (contentLen == 0 && c == '\n' && contentStart + contentLen > 0 && fullText[contentStart + contentLen - 1] == '\r') continue;
-                        }
-                    }
-                    if (startsWithCaret && endsWithDollar && contentLen == 0 && contentStart == fullText.size() && !fullText.empty()) {
-                        bool isAfterNL = false;
-                        if (contentStart > 0) {
-                            char c = fullText[contentStart - 1];
-                            if (c == '\r' || c == '\n') isAfterNL = true;
-                        }
-                        if (!isAfterNL) continue;
-                    }
-                    if (contentStart < limit) {
-                        bestPos = contentStart;
-                        bestLen = contentLen;
-                    }
-                }
-                if (bestPos != std::string::npos) {
-                    foundPos = bestPos;
-                    foundLen = bestLen;
-                }
-            }
-            if (foundPos != std::string::npos) {
-                if (outLen) *outLen = foundLen;
-                return foundPos;
-            }
+        const miu::Regex& re = compileSearchRegex(query, matchCase);
+        if (!re.ok()) return std::string::npos;
+        // ピースを順に読みながら照合し、文書全体のコピーは作らない。長い文書は区間ごとに並列に探す。
+        // 時間の上限を過ぎたら (どこかの区間が打ち切られたら、それより前の一致を見落としたかもしれないので) 見つからなかったことにする
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(regexTimeLimitMs);
+        std::atomic<bool> timedOut{ false };
+        auto firstIn = [&](size_t lo, size_t hi, miu::RegexMatch& m) {
+            miu::RegexSearchOptions opt; opt.budget = regexStepBudget; opt.startLimit = hi; opt.deadline = deadline;
+            miu::Regex::Status st = re.search(pt.spanReader(), len, lo, m, opt);
+            if (st == miu::Regex::BudgetExceeded) timedOut = true;
+            return st == miu::Regex::Found;
+        };
+        miu::RegexMatch m; bool found = false; searchTimedOut = false;
+        if (forward) {
+            if (startPos > len) startPos = 0;
+            found = miu::parallelFindFirst(miu::searchPartitions(startPos, len + 1, align), false, firstIn, m);
+            if (!found && startPos > 0 && !timedOut) found = miu::parallelFindFirst(miu::searchPartitions(0, startPos, align), false, firstIn, m);
         }
-        catch (...) { return std::string::npos; }
-        return std::string::npos;
-    }
-    size_t qLen = query.length();
-    if (outLen) *outLen = qLen;
-    auto toLower = [](char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; };
-    size_t cur = startPos;
-    if (forward) { if (cur >= len) cur = 0; }
-    else { if (cur == 0) cur = len; else cur--; }
-    size_t count = 0;
-    while (count < len) {
-        bool match = true;
-        for (size_t i = 0; i < qLen; ++i) {
-            size_t p = cur + i;
-            if (p >= len) { match = false; break; }
-            char c1 = pt.charAt(p); char c2 = query[i];
-            if (!matchCase) { c1 = toLower(c1); c2 = toLower(c2); }
-            if (c1 != c2) { match = false; break; }
+        else {
+            // カーソルの手前から窓を広げながら探すので、手間は直前の一致までの距離で決まる
+            miu::RegexSearchOptions opt; opt.budget = regexStepBudget; opt.deadline = deadline;
+            miu::Regex::Status st = re.searchBackward(pt.spanReader(), len, (startPos == 0) ? len : startPos, m, [&](size_t p) { return lineStartBefore(pt, p); }, opt);
+            if (st == miu::Regex::BudgetExceeded) timedOut = true;
+            found = st == miu::Regex::Found;
         }
-        if (match && wholeWord) {
-            if (cur > 0 && isWordChar(pt.charAt(cur - 1))) match = false;
-            if (match && (cur + qLen < len) && isWordChar(pt.charAt(cur + qLen))) match = false;
+        if (timedOut) { searchTimedOut = true; return std::string::npos; }
+        if (!found) return std::string::npos;
+        if (outLen) *outLen = m.len;
+        return m.pos;
+    }
+    auto accept = [&](size_t pos, size_t mLen) { return isLiteralMatchOk(pt, wholeWord, pos, mLen); };
+    miu::LiteralSearcher ls(query, matchCase);
+    auto firstIn = [&](size_t lo, size_t hi, miu::SearchHit& h) { auto spans = pt.pieceReader(); h.pos = ls.find(spans, len, lo, hi, accept, &h.len); return h.pos != std::string::npos; };
+    auto lastIn = [&](size_t lo, size_t hi, miu::SearchHit& h) { auto spans = pt.pieceReader(); h.pos = ls.rfind(spans, len, lo, hi, accept, &h.len); return h.pos != std::string::npos; };
+    miu::SearchHit h; bool found = false;
+    if (forward) {
+        size_t cur = startPos >= len ? 0 : startPos;
+        found = miu::parallelFindFirst(miu::searchPartitions(cur, len, align), false, firstIn, h);
+        if (!found && cur > 0) found = miu::parallelFindFirst(miu::searchPartitions(0, cur, align), false, firstIn, h);
+    }
+    else {
+        size_t cur = startPos == 0 ? len : startPos - 1;
+        found = miu::parallelFindFirst(miu::searchPartitions(0, std::min(cur + 1, len), align), true, lastIn, h);
+        if (!found && cur + 1 < len) found = miu::parallelFindFirst(miu::searchPartitions(cur + 1, len, align), true, lastIn, h);
+    }
+    if (!found) return std::string::npos;
+    if (outLen) *outLen = h.len;
+    return h.pos;
+}
+// 文書中の一致をすべて文書順に集める (置換や件数表示用)。正規表現が予算を使い切ったら complete が false になる
+std::vector<miu::SearchHit> Editor::findAll(const std::string& query, bool matchCase, bool wholeWord, bool isRegex, bool* complete) {
+    std::vector<miu::SearchHit> hits; if (complete) *complete = true;
+    if (query.empty()) return hits;
+    size_t len = pt.length();
+    if (isRegex) {
+        const miu::Regex& re = compileSearchRegex(query, matchCase);
+        std::vector<miu::RegexMatch> all;
+        bool ok = re.ok() && collectRegexMatches(re, [&] { return pt.spanReader(); }, len, len + 1, all);
+        if (complete) *complete = ok;
+        searchTimedOut = re.ok() && !ok;
+        for (const auto& m : all) hits.push_back({ m.pos, m.len });
+        return hits;
+    }
+    miu::LiteralSearcher ls(query, matchCase);
+    auto scan = [&](size_t from, size_t to, auto&& emit) {
+        auto spans = pt.pieceReader();
+        for (size_t p = from; ; ) {
+            miu::SearchHit h; h.pos = ls.find(spans, len, p, to, [&](size_t pos, size_t mLen) { return isLiteralMatchOk(pt, wholeWord, pos, mLen); }, &h.len);
+            if (h.pos == std::string::npos || !emit(h)) return true;
+            p = h.pos + h.len;
         }
-        if (match) {
-            size_t nextPos = cur + qLen;
-            if (nextPos < len) {
-                unsigned char b1 = (unsigned char)pt.charAt(nextPos);
-                if (b1 == 0xE2 && nextPos + 2 < len) {
-                    unsigned char b2 = (unsigned char)pt.charAt(nextPos + 1);
-                    unsigned char b3 = (unsigned char)pt.charAt(nextPos + 2);
-                    if (b2 == 0x80 && b3 == 0x8D) match = false;
-                }
-                else if (b1 == 0xEF && nextPos + 2 < len) {
-                    unsigned char b2 = (unsigned char)pt.charAt(nextPos + 1);
-                    unsigned char b3 = (unsigned char)pt.charAt(nextPos + 2);
-                    if (b2 == 0xB8 && b3 == 0x8F) match = false;
-                }
-                else if (b1 == 0xF0 && nextPos + 3 < len) {
-                    unsigned char b2 = (unsigned char)pt.charAt(nextPos + 1);
-                    unsigned char b3 = (unsigned char)pt.charAt(nextPos + 2);
-                    unsigned char b4 = (unsigned char)pt.charAt(nextPos + 3);
-                    if (b2 == 0x9F && b3 == 0x8F && (b4 >= 0xBB && b4 <= 0xBF)) match = false;
-                }
-            }
+    };
+    miu::parallelFindAll(miu::searchPartitions(0, len, [&](size_t p) { return alignToCharStart(p); }), scan, [](const miu::SearchHit& h) { return h.pos + h.len; }, hits);
+    return hits;
+}
+// 索引のキー: 検索語と検索条件
+static std::string matchIndexKey(const std::string& query, bool matchCase, bool wholeWord, bool isRegex) {
+    std::string key = query; key += '\0'; key += (char)('0' + (matchCase ? 1 : 0) + (wholeWord ? 2 : 0) + (isRegex ? 4 : 0)); return key;
+}
+// 索引を作るときの探し方 (MatchIndex::ScanFn)。doc と検索条件の写しだけを使うので、別のスレッドで文書の写しに対しても使える。
+// re が null なら通常検索。cancel が立つと正規表現の照合を途中でやめる
+static miu::MatchIndex::ScanFn matchIndexScan(const PieceTable& doc, size_t len, const miu::Regex* re, const std::string& query, bool matchCase, bool wholeWord, size_t budget, const std::atomic<bool>* cancel = nullptr) {
+    if (re) return [&doc, len, re, budget, cancel](size_t from, size_t limit, std::vector<miu::SearchHit>& hits, size_t& reach) {
+        miu::RegexSearchOptions opt; opt.budget = budget; opt.startLimit = limit; opt.reach = &reach; opt.cancel = cancel;
+        return re->forEach(doc.spanReader(), len, from, [&](const miu::RegexMatch& m) { hits.push_back({ m.pos, m.len }); return true; }, opt) == miu::Regex::Found;
+    };
+    // 一致の判定は一致の前後の 1 文字と、直後の絵文字の修飾 (4 バイト) まで読む
+    return [&doc, len, ls = miu::LiteralSearcher(query, matchCase), wholeWord](size_t from, size_t limit, std::vector<miu::SearchHit>& hits, size_t& reach) {
+        auto spans = doc.pieceReader(); size_t to = std::min(limit, len);
+        for (size_t p = from; p < to; ) {
+            miu::SearchHit h; h.pos = ls.find(spans, len, p, to, [&](size_t pos, size_t mLen) { return isLiteralMatchOk(doc, wholeWord, pos, mLen); }, &h.len);
+            if (h.pos == std::string::npos) break;
+            hits.push_back(h); p = h.pos + h.len;
         }
-        if (match) return cur;
-        if (forward) { cur++; if (cur >= len) cur = 0; }
-        else { if (cur == 0) cur = len - 1; else cur--; }
-        count++;
+        reach = to + ls.maxLength() + 4;
+        return true;
+    };
+}
+// 検索条件の一致の索引を文書の最新の版に合わせて返す。前の版からの編集が少なければ、その周りのチャンクだけを探し直す。
+// 索引を使えない (検索語が空、正規表現が正しくない、予算切れ、一致が多すぎる) ときは nullptr
+const miu::MatchIndex* Editor::matchIndex(miu::MatchIndex& idx, const std::string& query, bool matchCase, bool wholeWord, bool isRegex) {
+    if (query.empty()) return nullptr;
+    std::string key = matchIndexKey(query, matchCase, wholeWord, isRegex);
+    if (idx.key() != key) idx.reset(key);
+    if (idx.current(pt.changes)) return idx.complete() ? &idx : nullptr;
+    const miu::Regex* re = isRegex ? &compileSearchRegex(query, matchCase) : nullptr;
+    if (re && !re->ok()) return nullptr;
+    size_t len = pt.length();
+    auto align = [&](size_t p) { return ::alignToCharStart(pt, len, p); };
+    auto resume = [&](const miu::SearchHit& h) { return ::nextSearchStart(pt, len, h); };
+    return idx.update(pt.changes, len, align, matchIndexScan(pt, len, re, query, matchCase, wholeWord, regexStepBudget), resume) ? &idx : nullptr;
+}
+// 描画と件数の表示に使う検索語の索引。編集に追いつくだけなら差分を探し直して返す。検索語や条件が変わって作り直しが要るときは、
+// 別のスレッドで作り始めて nullptr を返す (進み具合は cbSearchProgress で知らせる)
+const miu::MatchIndex* Editor::searchMatchIndex() {
+    if (searchQuery.empty()) return nullptr;
+    std::string key = matchIndexKey(searchQuery, searchMatchCase, searchWholeWord, searchRegex);
+    if (searchIndex.key() == key && searchIndex.updatable(pt.changes)) return matchIndex(searchIndex, searchQuery, searchMatchCase, searchWholeWord, searchRegex);
+    if (!searchBuilder.pending(key)) startSearchBuild();
+    return nullptr;
+}
+// 次を検索・すべて置換などのコマンド用: できあがっていた索引は受け取り、差分を探し直すだけで使えるときだけ返す。
+// 索引を一から作るのは別のスレッドに任せたままにし (文書全体を UI のスレッドで探さない)、呼び出し側はカーソルから探す
+const miu::MatchIndex* Editor::searchMatchIndexNow() {
+    searchBuilder.take(searchIndex); searchRevealPending = false;
+    return searchMatchIndex();
+}
+// 検索語の索引を別のスレッドで作り始める。文書は今の版の写し (ピースの表と追加バッファ。元のファイルの内容は共有する) を読む
+void Editor::startSearchBuild() {
+    std::shared_ptr<const miu::Regex> re;
+    if (searchRegex) { const miu::Regex& r = compileSearchRegex(searchQuery, searchMatchCase); if (!r.ok()) { searchBuilder.stop(); return; } re = std::make_shared<miu::Regex>(r); }
+    auto doc = std::make_shared<PieceTable>(pt); searchSnapshot = doc;
+    std::string key = matchIndexKey(searchQuery, searchMatchCase, searchWholeWord, searchRegex), query = searchQuery;
+    bool matchCase = searchMatchCase, wholeWord = searchWholeWord; size_t anchor = searchAnchor, budget = regexStepBudget; uint64_t version = pt.changes.version();
+    searchBuilder.start(key, version, [=](miu::MatchIndex& out, const std::atomic<bool>& cancel, const miu::MatchIndex::ProgressFn& progress) {
+        size_t len = doc->length();
+        auto align = [&](size_t p) { return ::alignToCharStart(*doc, len, p); };
+        auto resume = [&](const miu::SearchHit& h) { return ::nextSearchStart(*doc, len, h); };
+        out.reset(key);
+        out.rebuild(version, len, anchor, align, matchIndexScan(*doc, len, re.get(), query, matchCase, wholeWord, budget, &cancel), resume, cancel, progress);
+    }, cbSearchProgress);
+}
+// 検索パネルの検索語か検索条件が変わった: 前の検索を取り消して別のスレッドで探し始め、カーソルから後の最初の一致が見つかったら選ぶ
+void Editor::searchQueryChanged() {
+    searchBuilder.stop(); searchTimedOut = false;
+    searchAnchor = cursors.empty() ? 0 : cursors.back().start(); searchRevealPending = !searchQuery.empty();
+    if (searchMatchIndex()) applySearchProgress(); // 同じ条件の索引が使えるなら、その場で選ぶ
+}
+// 別のスレッドの検索の進み具合を取り込む (UI のスレッドで呼ぶ)。できあがった索引を受け取り、最初の一致をまだ選んでいなければ選ぶ。
+// 表示し直すことがあれば true
+bool Editor::applySearchProgress() {
+    miu::IndexBuilder::Progress p = searchBuilder.progress();
+    bool changed = searchBuilder.take(searchIndex) || p.found > 0;
+    if (!searchRevealPending || searchQuery.empty()) return changed;
+    std::string key = matchIndexKey(searchQuery, searchMatchCase, searchWholeWord, searchRegex);
+    miu::SearchHit h; bool found = false;
+    if (searchIndex.key() == key && searchIndex.current(pt.changes)) {
+        searchRevealPending = false;
+        if (searchIndex.complete() && searchIndex.count() > 0) { size_t i = searchIndex.lowerBound(searchAnchor); h = searchIndex.at(i < searchIndex.count() ? i : 0); found = true; }
+    }
+    else if (p.key == key && p.version == pt.changes.version() && p.hasFirst) { searchRevealPending = false; h = p.first; found = true; }
+    if (!found) return changed;
+    size_t matchEnd = h.pos + h.len;
+    cursors.clear();
+    cursors.push_back({ matchEnd, h.pos, getXFromPos(matchEnd), getXFromPos(h.pos), false });
+    ensureCaretVisible();
+    updateTitleBar();
+    return true;
+}
+// 検索語の一致の総数と、選択範囲がそのうち何番目の一致か (1 から。一致を選んでいなければ 0)。件数が分からなければ false。
+// partial を渡すと、別のスレッドで探している途中ならそれまでの件数を返して *partial を true にする
+bool Editor::searchMatchStatus(size_t& current, size_t& total, bool* partial) {
+    if (partial) *partial = false;
+    const miu::MatchIndex* idx = searchMatchIndex();
+    if (!idx) {
+        if (!partial || !searchBuilder.pending(matchIndexKey(searchQuery, searchMatchCase, searchWholeWord, searchRegex))) return false;
+        total = searchBuilder.progress().found; current = 0; *partial = true; return true;
     }
-    return std::string::npos;
+    total = idx->count(); current = 0;
+    if (cursors.size() == 1) {
+        const Cursor& c = cursors.back(); size_t i = idx->lowerBound(c.start());
+        if (i < total) { miu::SearchHit h = idx->at(i); if (h.pos == c.start() && h.pos + h.len == c.end()) current = i + 1; }
+    }
+    return true;
+}
+// ファイルをメモリマップし、文字コードを判定して UTF-8 にした内容を use に渡す (開くときと同じ変換。UTF-8 ならコピーしない)
+static bool withUtf8FileContent(const std::string& path, const std::function<void(std::string_view)>& use) {
+    MappedFile f; if (!f.open(path.c_str())) return false;
+    DetectResult enc = DetectEncodingEx(f.ptr, f.size);
+    const char* ptr = f.ptr; size_t sz = f.size; std::string converted;
+    if (enc.type == ENC_UTF16LE || enc.type == ENC_UTF16BE) converted = Utf16ToUtf8(ptr, sz, enc.type == ENC_UTF16BE);
+    else if (enc.type == ENC_UTF8_BOM) { ptr += 3; sz -= 3; }
+#if defined(__APPLE__)
+    else if (enc.type == ENC_LOCAL) converted = LocalToUtf8(ptr, sz, enc.codePage);
+#endif
+    if (!converted.empty()) use(converted); else use(std::string_view(ptr, sz));
+    return true;
+}
+// フォルダ内検索の照合 (FolderSearch::MatchFn)。検索条件の写しだけを使い、ワーカースレッドから同時に呼ばれる。
+// 通常検索は kFolderSearchSlice ごとに区切って探し、取り消されたら長いファイルの途中でもやめる
+static constexpr size_t kFolderSearchSlice = 1 << 20;
+static miu::FolderSearch::MatchFn folderSearchMatcher(std::shared_ptr<const miu::Regex> re, const std::string& query, bool matchCase, bool wholeWord, size_t budget) {
+    if (re) return [re, budget](std::string_view text, const std::function<bool(const miu::SearchHit&)>& emit, const std::atomic<bool>& cancel) {
+        miu::RegexSearchOptions opt; opt.budget = budget; opt.cancel = &cancel;
+        re->forEach(text.data(), text.size(), 0, [&](const miu::RegexMatch& m) { return emit({ m.pos, m.len }); }, opt);
+    };
+    return [ls = std::make_shared<const miu::LiteralSearcher>(query, matchCase), wholeWord](std::string_view text, const std::function<bool(const miu::SearchHit&)>& emit, const std::atomic<bool>& cancel) {
+        auto spans = [text](size_t, size_t& start) { start = 0; return text; };
+        auto accept = [&](size_t pos, size_t mLen) { return isLiteralMatchOk(wholeWord, pos > 0 ? text[pos - 1] : 0, text.substr(std::min(text.size(), pos + mLen), 4)); };
+        for (size_t p = 0; p < text.size() && !cancel.load(std::memory_order_relaxed); ) {
+            size_t to = std::min(text.size(), p + kFolderSearchSlice);
+            miu::SearchHit h; h.pos = ls->find(spans, text.size(), p, to, accept, &h.len);
+            if (h.pos == std::string::npos) { p = to; continue; }
+            if (!emit(h)) return;
+            p = h.pos + std::max<size_t>(h.len, 1);
+        }
+    };
+}
+// root 以下のファイルを今の検索条件で探し始める。前の結果は消し、見つかった一致は cbFolderSearchProgress のたびに取り込む
+bool Editor::startFolderSearch(const std::string& root) {
+    folderSearch.stop(); folderMatches.clear();
+    if (searchQuery.empty()) return false;
+    std::shared_ptr<const miu::Regex> re;
+    if (searchRegex) { const miu::Regex& r = compileSearchRegex(searchQuery, searchMatchCase); if (!r.ok()) return false; re = std::make_shared<miu::Regex>(r); }
+    folderSearch.start(root, withUtf8FileContent, folderSearchMatcher(re, searchQuery, searchMatchCase, searchWholeWord, regexStepBudget), cbFolderSearchProgress);
+    return true;
+}
+void Editor::stopFolderSearch() { folderSearch.stop(); }
+// 見つかった一致を folderMatches に取り込む (UI のスレッドで呼ぶ)。増えたら true
+bool Editor::applyFolderSearchProgress() { return folderSearch.take(folderMatches); }
+// フォルダ内検索の index 番目の一致を選ぶ。別のファイルなら開く (開いたあとに編集したファイルでは位置がずれることがある)
+bool Editor::openFolderMatch(size_t index) {
+    if (index >= folderMatches.size()) return false;
+    std::string path = folderMatches[index].path; size_t pos = folderMatches[index].pos, mLen = folderMatches[index].len;
+    if (WToUTF8(currentFilePath) != path && (!checkUnsavedChanges() || !openFileFromPath(path))) return false;
+    size_t len = pt.length(), start = std::min(pos, len), end = std::min(pos + mLen, len);
+    cursors.clear(); cursors.push_back({ end, start, getXFromPos(end), getXFromPos(start), false });
+    ensureCaretVisible();
+    if (cbNeedsDisplay) cbNeedsDisplay();
+    return true;
 }
 void Editor::findNext(bool forward) {
+    TraceScope ts(this, "findNext", forward ? "1" : "0"); SlowOpScope so(this, "find");
     if (searchQuery.empty()) return;
     size_t currentCursorPos = forward ? (cursors.empty() ? 0 : cursors.back().end()) : (cursors.empty() ? 0 : cursors.back().start());
+    // 索引があれば、カーソルの次 (前) の一致を二分探索で選ぶ。末尾 (先頭) まで行ったら反対側へ回り込む
+    if (const miu::MatchIndex* idx = searchMatchIndexNow()) {
+        size_t n = idx->count();
+        if (n == 0) { if (cbBeep) cbBeep(); return; }
+        size_t i = idx->lowerBound(currentCursorPos);
+        if (forward) { if (i < n && idx->at(i).len == 0 && idx->at(i).pos == currentCursorPos) i++; if (i >= n) i = 0; }
+        else i = i == 0 ? n - 1 : i - 1;
+        miu::SearchHit h = idx->at(i); size_t matchEnd = h.pos + h.len;
+        cursors.clear();
+        cursors.push_back({ matchEnd, h.pos, getXFromPos(matchEnd), getXFromPos(h.pos), false });
+        ensureCaretVisible();
+        updateTitleBar();
+        if (cbNeedsDisplay) cbNeedsDisplay();
+        return;
+    }
     size_t searchStart = currentCursorPos;
     bool hasWrapped = false;
     while (true) {
         size_t matchLen = 0;
         size_t pos = findText(searchStart, searchQuery, forward, searchMatchCase, searchWholeWord, searchRegex, &matchLen);
         if (pos == std::string::npos) {
+            // 時間の上限で打ち切ったら、回り込んで探し直さずにやめる (検索パネルに打ち切ったことを表示する)
+            if (searchTimedOut) { if (cbBeep) cbBeep(); if (cbNeedsDisplay) cbNeedsDisplay(); return; }
             if (forward && !hasWrapped) {
                 searchStart = 0;
                 hasWrapped = true;
@@ -915,6 +1206,7 @@ void Editor::findNext(bool forward) {
     }
 }
 void Editor::replaceNext() {
+    TraceScope ts(this, "replaceNext");
     if (cursors.empty() || searchQuery.empty()) return;
     Cursor& c = cursors.back();
     if (!c.hasSelection()) { findNext(true); return; }
@@ -924,70 +1216,21 @@ void Editor::replaceNext() {
     bool match = false;
     std::string replacement = replaceQuery;
     if (searchRegex) {
-        try {
-            std::string actualQuery = preprocessRegexQuery(searchQuery);
-            std::regex_constants::syntax_option_type flags = std::regex_constants::ECMAScript;
-            if (!searchMatchCase) flags |= std::regex_constants::icase;
-            std::regex re(actualQuery, flags);
-            std::smatch m;
-            std::string rawFmt = UnescapeString(replaceQuery, newlineStr);
-            std::string fmt;
-            for (size_t i = 0; i < rawFmt.size(); ++i) {
-                if (rawFmt[i] == '$') {
-                    fmt += '$';
-                    if (i + 1 < rawFmt.size()) {
-                        if (isdigit((unsigned char)rawFmt[i + 1])) {
-                            i++;
-                            std::string numStr;
-                            while (i < rawFmt.size() && isdigit((unsigned char)rawFmt[i])) {
-                                numStr += rawFmt[i];
-                                i++;
-                            }
-                            i--;
-                            int grp = std::stoi(numStr);
-                            if (grp > 0) grp++;
-                            fmt += std::to_string(grp);
-                        } else {
-                            fmt += rawFmt[i + 1];
-                            i++;
-                        }
-                    }
-                } else {
-                    fmt += rawFmt[i];
-                }
-            }
-            if (std::regex_match(selText, m, re)) {
+        const miu::Regex& re = compileSearchRegex(searchQuery, searchMatchCase);
+        if (re.ok()) {
+            // 末尾の先読みが選択範囲の後ろを見られるよう、少し先まで取り出して start から始まる一致を調べる
+            std::string text = pt.getRange(start, std::min(pt.length() - start, len + 4096));
+            miu::RegexSearchOptions opt; opt.budget = regexStepBudget; opt.anchored = true;
+            opt.before = start > 0 ? (unsigned char)pt.charAt(start - 1) : -1;
+            opt.after = start + text.size() < pt.length() ? (unsigned char)pt.charAt(start + text.size()) : -1;
+            miu::RegexMatch m;
+            if (re.search(text, 0, m, opt) == miu::Regex::Found && m.pos == 0 && m.len == len) {
                 match = true;
-            }
-            else if (start > 0) {
-                int backStep = 0;
-                if (pt.charAt(start - 1) == '\n') {
-                    backStep = 1;
-                    if (start > 1 && pt.charAt(start - 2) == '\r') backStep = 2;
-                }
-                else if (pt.charAt(start - 1) == '\r') {
-                    backStep = 1;
-                }
-                if (backStep > 0) {
-                    std::string extendedText = pt.getRange(start - backStep, len + backStep);
-                    if (std::regex_match(extendedText, m, re)) {
-                        match = true;
-                    }
-                }
-            }
-            if (match) {
-                replacement = m.format(fmt);
-            }
-        } catch (...) {}
-    } else {
-        if (len == searchQuery.length()) {
-            match = true;
-            for (size_t i = 0; i < len; ++i) {
-                char c1 = selText[i]; char c2 = searchQuery[i];
-                if (!searchMatchCase) { c1 = (c1 >= 'A' && c1 <= 'Z') ? c1 + ('a' - 'A') : c1; c2 = (c2 >= 'A' && c2 <= 'Z') ? c2 + ('a' - 'A') : c2; }
-                if (c1 != c2) { match = false; break; }
+                replacement = re.format(m, text.data(), text.size(), UnescapeString(replaceQuery, newlineStr));
             }
         }
+    } else {
+        match = miu::LiteralSearcher(searchQuery, searchMatchCase).matchesWhole(selText);
         if (match) replacement = replaceQuery;
     }
     if (match) {
@@ -1009,155 +1252,41 @@ void Editor::replaceNext() {
     }
 }
 void Editor::replaceAll() {
+    TraceScope ts(this, "replaceAll"); SlowOpScope so(this, "replaceAll");
     if (searchQuery.empty()) return;
-    struct Match { size_t start; size_t len; std::string replacementText; };
-    std::vector<Match> matches;
     size_t docLen = pt.length();
+    // 一致の位置は検索の索引から取り出す (索引を使えなければ文書全体を探す)
+    std::vector<miu::SearchHit> hits;
+    if (const miu::MatchIndex* idx = searchMatchIndexNow()) { hits.reserve(idx->count()); for (size_t i = 0; i < idx->count(); ++i) hits.push_back(idx->at(i)); }
+    else { bool complete = true; hits = findAll(searchQuery, searchMatchCase, searchWholeWord, searchRegex, &complete); if (!complete) { if (cbBeep) cbBeep(); return; } }
+    // 置換文字列は全一致で 1 つを共有し、$1 などを展開するときだけ一致ごとに作る
+    std::string fixedText = replaceQuery; std::vector<std::string> formatted;
     if (searchRegex) {
-        std::string fullText = pt.getRange(0, docLen);
-        std::string actualQuery = preprocessRegexQuery(searchQuery);
-        std::string rawFmt = UnescapeString(replaceQuery, newlineStr);
-        std::string fmt;
-        for (size_t i = 0; i < rawFmt.size(); ++i) {
-            if (rawFmt[i] == '$') {
-                fmt += '$';
-                if (i + 1 < rawFmt.size()) {
-                    if (isdigit((unsigned char)rawFmt[i + 1])) {
-                        i++;
-                        std::string numStr;
-                        while (i < rawFmt.size() && isdigit((unsigned char)rawFmt[i])) {
-                            numStr += rawFmt[i];
-                            i++;
-                        }
-                        i--;
-                        int grp = std::stoi(numStr);
-                        if (grp > 0) grp++;
-                        fmt += std::to_string(grp);
-                    } else {
-                        fmt += rawFmt[i + 1];
-                        i++;
-                    }
-                }
-            } else {
-                fmt += rawFmt[i];
-            }
-        }
-        try {
-            bool startsWithCaret = (!searchQuery.empty() && searchQuery[0] == '^');
-            bool endsWithDollar = (!searchQuery.empty() && searchQuery.back() == '$');
-            auto searchStart = fullText.cbegin();
-            std::smatch m;
-            size_t currentOffset = 0;
-            std::regex_constants::match_flag_type flags = std::regex_constants::match_default;
-            std::regex_constants::syntax_option_type reFlags = std::regex_constants::ECMAScript;
-            if (!searchMatchCase) reFlags |= std::regex_constants::icase;
-            std::regex cachedRegex(actualQuery, reFlags);
-            while (std::regex_search(searchStart, fullText.cend(), m, cachedRegex, flags)) {
-                size_t matchPos = currentOffset + m.position();
-                size_t matchLen = m.length();
-                size_t anchorLen = 0;
-                if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                    anchorLen = m.length(1);
-                }
-                size_t contentPos = matchPos + anchorLen;
-                size_t contentLen = matchLen - anchorLen;
-                
-                if (endsWithDollar) {
-                    if (contentLen > 0) {
-                        if (fullText[contentPos + contentLen - 1] == '\n') {
-                            contentLen--;
-                            if (contentLen > 0 && fullText[contentPos + contentLen - 1] == '\r') contentLen--;
-                        }
-                    }
-                }
-                bool isValid = true;
-                if (endsWithDollar) {
-                    bool isAtLineEnd = false;
-                    size_t checkPos = contentPos + contentLen;
-                    if (checkPos >= fullText.size()) {
-                        isAtLineEnd = true;
-                    } else {
-                        char c = fullText[checkPos];
-                        if (c == '\r' || c == '\n') {
-                            isAtLineEnd = true;
-                            if (contentLen == 0 && c == '\n' && checkPos > 0 && fullText[checkPos - 1] == '\r') {
-                                isAtLineEnd = false;
-                            }
-                        }
-                    }
-                    if (!isAtLineEnd) isValid = false;
-                }
-                if (isValid && startsWithCaret && endsWithDollar && contentLen == 0 && contentPos == fullText.size() && !fullText.empty()) {
-                    bool isAfterNewline = false;
-                    if (contentPos > 0) {
-                        char c = fullText[contentPos - 1];
-                        if (c == '\r' || c == '\n') isAfterNewline = true;
-                    }
-                    if (!isAfterNewline) isValid = false;
-                }
-                if (isValid && !matches.empty()) {
-                    const auto& last = matches.back();
-                    if (last.start == contentPos && last.len == 0 && contentLen == 0) {
-                        isValid = false;
-                    }
-                }
-                if (isValid) {
-                    std::string rText = m.format(fmt);
-                    matches.push_back({ contentPos, contentLen, rText });
-                }
-                size_t step = matchLen;
-                if (step == 0) {
-                    bool isBolCaret = (startsWithCaret && !(flags & std::regex_constants::match_not_bol));
-                    if (isBolCaret) step = 0;
-                    else step = 1;
-                }
-                if (step == 0 && (flags & std::regex_constants::match_not_bol)) step = 1;
-                size_t relativeAdvance = m.position() + step;
-                size_t remaining = std::distance(searchStart, fullText.cend());
-                if (relativeAdvance > remaining) break;
-                std::advance(searchStart, relativeAdvance);
-                currentOffset += relativeAdvance;
-                flags |= std::regex_constants::match_not_bol;
-            }
-            if (startsWithCaret && fullText.empty()) {
-                bool alreadyMatched = !matches.empty();
-                if (!alreadyMatched) {
-                    matches.push_back({ 0, 0, fmt });
-                }
+        const miu::Regex& re = compileSearchRegex(searchQuery, searchMatchCase);
+        if (!re.ok()) { if (cbBeep) cbBeep(); return; }
+        fixedText = UnescapeString(replaceQuery, newlineStr);
+        if (fixedText.find('$') != std::string::npos) {
+            // 一致の位置から照合し直してグループの範囲を得る。文書全体はコピーせず、ピースを順に読む
+            auto spans = pt.spanReader();
+            miu::RegexSearchOptions opt; opt.budget = regexStepBudget; opt.anchored = true;
+            formatted.reserve(hits.size());
+            for (const auto& h : hits) {
+                miu::RegexMatch m;
+                if (re.search(spans, docLen, h.pos, m, opt) != miu::Regex::Found || m.pos != h.pos) { m = miu::RegexMatch(); m.pos = h.pos; m.len = h.len; }
+                formatted.push_back(re.format(m, spans, docLen, fixedText));
             }
         }
-        catch (...) { return; }
-    } else {
-        size_t currentPos = 0;
-        while (true) {
-            size_t matchLen = 0;
-            size_t pos = findText(currentPos, searchQuery, true, searchMatchCase, searchWholeWord, false, &matchLen);
-            if (pos == std::string::npos || pos < currentPos) break;
-            matches.push_back({ pos, matchLen, replaceQuery });
-            currentPos = pos + matchLen;
-            if (currentPos > docLen) break;
-        }
     }
-    if (matches.empty()) { if (cbBeep) cbBeep(); return; }
+    std::vector<PieceTable::RangeEdit> edits; edits.reserve(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) if (hits[i].pos + hits[i].len <= docLen) edits.push_back({ hits[i].pos, hits[i].len, formatted.empty() ? &fixedText : &formatted[i] });
+    if (edits.empty()) { if (cbBeep) cbBeep(); return; }
+    // 新しいピース列は 1 回の走査で作る。元のピース列は取っておき、元に戻すときはピース列を入れ替えるだけにする
     EditBatch batch;
     batch.beforeCursors = cursors;
-    for (auto it = matches.rbegin(); it != matches.rend(); ++it) {
-        size_t start = it->start;
-        size_t len = it->len;
-        if (start + len > pt.length()) continue;
-        std::string deleted = pt.getRange(start, len);
-        pt.erase(start, len);
-        batch.ops.push_back({ EditOp::Erase, start, deleted });
-        pt.insert(start, it->replacementText);
-        batch.ops.push_back({ EditOp::Insert, start, it->replacementText });
-    }
-    size_t finalMatchIdx = matches.size() - 1;
-    long long offsetBeforeFinal = 0;
-    for (size_t i = 0; i < finalMatchIdx; ++i) {
-        offsetBeforeFinal += (long long)matches[i].replacementText.size() - (long long)matches[i].len;
-    }
-    size_t lastReplaceStart = (size_t)((long long)matches.back().start + offsetBeforeFinal);
-    size_t lastReplaceEnd = lastReplaceStart + matches.back().replacementText.size();
+    EditOp op{ EditOp::Pieces, 0, std::string() };
+    op.pieces = std::make_shared<std::vector<Piece>>(pt.replaceRanges(edits, op.change)); op.pos = op.change.pos;
+    size_t lastReplaceEnd = op.change.pos + op.change.inserted, lastReplaceStart = lastReplaceEnd - edits.back().text->size();
+    batch.ops.push_back(std::move(op));
     cursors.clear();
     cursors.push_back({ lastReplaceEnd, lastReplaceStart, getXFromPos(lastReplaceEnd), getXFromPos(lastReplaceStart), false });
     batch.afterCursors = cursors;
@@ -1166,20 +1295,25 @@ void Editor::replaceAll() {
     ensureCaretVisible();
     updateDirtyFlag();
     if (cbNeedsDisplay) cbNeedsDisplay();
-    if (cbShowReplaceAlert) cbShowReplaceAlert((int)matches.size());
+    if (cbShowReplaceAlert) cbShowReplaceAlert((int)edits.size());
+}
+// カーソルのある単語 (カーソルが単語の直後ならその単語) の範囲
+void Editor::wordAtCaret(size_t pos, size_t& s, size_t& e) {
+    size_t targetPos = pos;
+    if (targetPos > 0) {
+        char currChar = targetPos < pt.length() ? pt.charAt(targetPos) : '\0';
+        char prevChar = pt.charAt(targetPos - 1);
+        if (!isWordChar(currChar) && isWordChar(prevChar)) { targetPos--; }
+    }
+    getWordBoundaries(targetPos, s, e);
 }
 void Editor::selectNextOccurrence() {
+    TraceScope ts(this, "selectNextOccurrence");
     if (cursors.empty()) return;
     Cursor c = cursors.back();
     if (!c.hasSelection()) {
-        size_t targetPos = c.head;
-        if (targetPos > 0) {
-            char currChar = targetPos < pt.length() ? pt.charAt(targetPos) : '\0';
-            char prevChar = pt.charAt(targetPos - 1);
-            if (!isWordChar(currChar) && isWordChar(prevChar)) { targetPos--; }
-        }
         size_t s, e;
-        getWordBoundaries(targetPos, s, e);
+        wordAtCaret(c.head, s, e);
         if (s != e) {
             cursors.clear();
             cursors.push_back({e, s, getXFromPos(e), getXFromPos(s), false});
@@ -1197,6 +1331,141 @@ void Editor::selectNextOccurrence() {
         ensureCaretVisible();
     }
 }
+// 選択範囲 (なければカーソルのある単語を単語単位で) と同じ文字列をすべて選ぶ。一致は findAll で 1 回に求めて文書順のままカーソルにする。
+// x 座標はレイアウトが要るので求めずにおき、描画や上下移動で使うカーソルだけ resolveCursorX で求める
+void Editor::selectAllOccurrences() {
+    TraceScope ts(this, "selectAllOccurrences");
+    if (cursors.empty()) return;
+    Cursor c = cursors.back();
+    size_t s = c.start(), e = c.end();
+    if (!c.hasSelection()) { wordAtCaret(c.head, s, e); if (s == e) return; }
+    std::vector<miu::SearchHit> hits = findAll(pt.getRange(s, e - s), true, !c.hasSelection(), false);
+    if (hits.empty()) return;
+    std::vector<Cursor> next; next.reserve(hits.size());
+    size_t primary = hits.size() - 1;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (hits[i].pos == s) primary = i;
+        next.push_back({ hits[i].pos + hits[i].len, hits[i].pos, Cursor::kUnresolvedX, Cursor::kUnresolvedX, false });
+    }
+    // 元の選択を主カーソル (末尾) にし、ほかはその後ろから文書を一周する順に並べる
+    std::rotate(next.begin(), next.begin() + primary + 1, next.end());
+    cursors.swap(next);
+    ensureCaretVisible();
+}
+void Editor::resolveCursorX(Cursor& c) {
+    if (c.desiredX < 0.0f) c.desiredX = getXFromPos(c.head);
+    if (c.originalAnchorX < 0.0f) c.originalAnchorX = getXFromPos(c.anchor);
+}
+void Editor::visibleCursorIndices(size_t from, size_t to, std::vector<size_t>& out) const {
+    out.clear();
+    // 重ならずに文書順に並んでいれば (矩形選択や次の一致の追加で作ったもの) 二分探索で範囲の先頭を探す。
+    // すべての一致を選んだときは主カーソルを末尾に置くので文書順が 1 か所で折り返している。その前後の 2 つの並びをそれぞれ探す
+    size_t n = cursors.size(), wrap = 0; bool ordered = true;
+    for (size_t i = 1; i < n && ordered; ++i) if (cursors[i - 1].end() > cursors[i].start()) { if (wrap) ordered = false; else wrap = i; }
+    if (ordered && wrap) ordered = cursors[n - 1].end() <= cursors[0].start();
+    if (!ordered) { for (size_t i = 0; i < n; ++i) if (cursors[i].start() <= to && cursors[i].end() >= from) out.push_back(i); return; }
+    auto scan = [&](size_t lo, size_t hi) {
+        size_t i = std::partition_point(cursors.begin() + lo, cursors.begin() + hi, [&](const Cursor& c) { return c.end() < from; }) - cursors.begin();
+        for (; i < hi && cursors[i].start() <= to; ++i) out.push_back(i);
+    };
+    if (wrap) { scan(0, wrap); scan(wrap, n); } else scan(0, n);
+}
+// 高さ h のビューに描く行の範囲 [first, end)。iOS はバウンスで見える上の行も描く
+void Editor::visibleLineRange(float h, int& first, int& end) const {
+    float vh = std::max(0.0f, h - visibleHScrollHeight);
+    int start = vScrollPos; end = std::min((int)lineStarts.size(), start + (int)(vh / lineHeight) + 2);
+#if TARGET_OS_IOS
+    first = std::max(0, start - 15);
+#else
+    first = start;
+#endif
+}
+// 描いたものによらない状態 (スクロール・大きさ・文書の版・検索語など)。marks は空
+RenderSnapshot Editor::renderState(float w, float h) {
+    RenderSnapshot r; r.valid = true; r.w = w; r.h = h; r.vScroll = vScrollPos; r.hScroll = hScrollPos;
+    r.fontSize = currentFontSize; r.gutterWidth = gutterWidth; r.lineCount = lineStarts.size(); r.version = pt.changes.version();
+    r.ime = imeComp; r.search = searchQuery.empty() ? std::string() : searchQuery + (char)('0' + searchMatchCase + 2 * searchWholeWord + 4 * searchRegex);
+    r.overlay = showHelpPopup || profiler.showOverlay || std::chrono::steady_clock::now() < zoomPopupEndTime;
+#if defined(__APPLE__)
+    r.theme = colBackground;
+#endif
+    visibleLineRange(h, r.first, r.end);
+    return r;
+}
+// 今の状態で描いたときの RenderSnapshot。render は描きながら marks を集めるので、これは collectDamage が今の状態と比べるときだけ使う
+RenderSnapshot Editor::renderSnapshot(float w, float h) {
+    RenderSnapshot r = renderState(w, h);
+    if (cursors.empty() || r.first >= r.end) return r;
+    // 見えているカーソルはキャレットの所、選択は行ごとに描く帯 (行末を越える選択は改行の分の 1 文字を足す)、自動ハイライトは一致の所を覚える。
+    // 帯は描画と同じ x の範囲にするので、同じ行の中で選択を伸ばしたり縮めたりしても変わった所が描き直される
+    size_t visFrom = lineStarts[r.first], visTo = (r.end < (int)lineStarts.size()) ? lineStarts[r.end] : pt.length();
+    std::vector<size_t> vis; visibleCursorIndices(visFrom, visTo, vis);
+    auto band = [&](int l, float x1, float x2) { if (x2 > x1) r.marks.push_back({ gutterWidth - (float)hScrollPos + x1, (float)(l - vScrollPos) * lineHeight, x2 - x1, lineHeight }); };
+    for (size_t ci : vis) {
+        auto& c = cursors[ci];
+        int l = getLineIdx(c.head);
+        if (l >= r.first && l < r.end) {
+            float x = getXInLine(l, c.head); if (c.isVirtual && c.desiredX != Cursor::kUnresolvedX) x = std::max(x, c.desiredX);
+            r.marks.push_back({ gutterWidth - (float)hScrollPos + x - 1.0f, (float)(l - vScrollPos) * lineHeight, 4.0f, lineHeight });
+        }
+        if (!c.hasSelection() && cursors.size() == 1) continue;
+        int l1 = std::max(getLineIdx(std::max(c.start(), visFrom)), r.first), l2 = std::min(getLineIdx(std::min(c.end(), visTo)), r.end - 1);
+        if (cursors.size() > 1) { // 矩形選択: どの行もカーソルとアンカーの x の間
+            resolveCursorX(c);
+            float x1 = std::min(c.desiredX, c.originalAnchorX), x2 = std::max(c.desiredX, c.originalAnchorX);
+            if (x2 - x1 >= 0.5f) for (int sl = l1; sl <= l2; ++sl) band(sl, x1, x2);
+            continue;
+        }
+        for (int sl = l1; sl <= l2; ++sl) {
+            size_t lineBegin = lineStarts[sl], lineEnd = (sl + 1 < (int)lineStarts.size() ? lineStarts[sl + 1] : pt.length());
+            size_t selS = std::max(c.start(), lineBegin), selE = std::min(c.end(), lineEnd);
+            float x1 = getXInLine(sl, selS), x2 = getXInLine(sl, selE);
+            if (selE == lineEnd && c.end() >= lineEnd) x2 += charWidth;
+            band(sl, x1, x2);
+        }
+    }
+    const AutoHighlightCache& ah = updateAutoHighlight(r.first, r.end);
+    if (!ah.target.empty() && ah.target != searchQuery)
+        for (const auto& sp : ah.spans) r.marks.push_back({ gutterWidth - (float)hScrollPos + sp.x1, (float)(sp.line - vScrollPos) * lineHeight, std::max(sp.x2 - sp.x1, 1.0f), lineHeight });
+    return r;
+}
+// 前回の render から描き直す必要がある所を out に入れる。全体を描き直すなら true を返す (out は空)。
+// 文書の変更は変わった行 (行数が変わったらそこから下すべて)、カーソルと自動ハイライトは前回と今回で違う所だけ
+bool Editor::collectDamage(float w, float h, std::vector<DirtyRect>& out) {
+    out.clear();
+    RenderSnapshot cur = renderSnapshot(w, h);
+    const RenderSnapshot& old = lastRender;
+    if (!old.valid || old.w != w || old.h != h || old.vScroll != cur.vScroll || old.hScroll != cur.hScroll || old.first != cur.first || old.end != cur.end ||
+        old.fontSize != cur.fontSize || old.gutterWidth != cur.gutterWidth || old.search != cur.search || old.overlay || cur.overlay || old.theme != cur.theme) return true;
+    auto rows = [&](int a, int b) { // [a, b] 行を行番号ごと描き直す
+        a = std::max(a, cur.first); b = std::min(b, cur.end - 1);
+        if (a <= b) out.push_back({ 0.0f, (float)(a - vScrollPos) * lineHeight, w, (float)(b - a + 1) * lineHeight });
+    };
+    if (old.version != cur.version) {
+        const miu::TextChange* ch; size_t n;
+        // 正規表現の一致は離れた行にも及ぶので、検索中は全体を描き直す
+        if (!pt.changes.since(old.version, ch, n) || (searchRegex && !searchQuery.empty())) return true;
+        // 変わった範囲を今の文書の位置で 1 つの区間 [lo, hi] にまとめる
+        size_t lo = SIZE_MAX, hi = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const auto& c = ch[i];
+            if (lo != SIZE_MAX) {
+                if (lo > c.pos) lo = lo >= c.pos + c.removed ? lo - c.removed + c.inserted : c.pos;
+                if (hi > c.pos) hi = hi >= c.pos + c.removed ? hi - c.removed + c.inserted : c.pos;
+            }
+            lo = std::min(lo, c.pos); hi = std::max(hi, c.pos + c.inserted);
+        }
+        hi = std::min(hi, pt.length());
+        rows(getLineIdx(lo), old.lineCount != cur.lineCount ? cur.end - 1 : getLineIdx(hi));
+        if (old.ime != cur.ime) return true;
+    } else if (old.ime != cur.ime && !cursors.empty()) { int l = getLineIdx(cursors.back().head); rows(l, l); }
+    std::vector<DirtyRect> a = old.marks, b = cur.marks;
+    auto byPos = [](const DirtyRect& p, const DirtyRect& q) { return std::tie(p.y, p.x, p.w, p.h) < std::tie(q.y, q.x, q.w, q.h); };
+    std::sort(a.begin(), a.end(), byPos); std::sort(b.begin(), b.end(), byPos);
+    std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out), byPos);
+    if (out.size() > kMaxDirtyRects) { out.clear(); return true; }
+    return false;
+}
 void Editor::updateTitleBar() {
     if (cbUpdateTitleBar) cbUpdateTitleBar();
 }
@@ -1214,6 +1483,7 @@ void Editor::updateFont(float s) {
     currentFontSize = s; lineHeight = std::ceil(s * 1.4f);
     UniChar c = ' '; CGGlyph g; CGSize adv; CTFontGetGlyphsForCharacters(fontRef, &c, &g, 1); CTFontGetAdvancesForGlyphs(fontRef, kCTFontOrientationHorizontal, &g, &adv, 1);
     charWidth = adv.width;
+    monospaceFont = (CTFontGetSymbolicTraits(fontRef) & kCTFontTraitMonoSpace) != 0;
     tabWidth = charWidth * 4.0f;
     if (paragraphStyle) CFRelease(paragraphStyle);
     CGFloat tabInterval = (CGFloat)tabWidth;
@@ -1225,10 +1495,12 @@ void Editor::updateFont(float s) {
     paragraphStyle = CTParagraphStyleCreate(settings, 2);
     CFRelease(emptyTabStops);
 #endif
+    layoutCache.clear(); gutterCache.clear();
     if (oldCharWidth > 0.0f && charWidth > 0.0f) { float ratio = charWidth / oldCharWidth; for (auto& cur : cursors) { cur.desiredX *= ratio; cur.originalAnchorX *= ratio; } }
     updateGutterWidth(); updateMaxLineWidth(); updateScrollBars();
 }
 void Editor::rebuildLineStarts() {
+    SlowOpScope so(this, "rebuildLineStarts");
     lineStarts.clear(); lineStarts.push_back(0); size_t go = 0;
     for (const auto& p : pt.pieces) {
         const char* b = p.isOriginal ? (pt.origPtr + p.start) : (pt.addBuf.data() + p.start);
@@ -1241,6 +1513,80 @@ int Editor::getLineIdx(size_t pos) {
     auto it = std::upper_bound(lineStarts.begin(), lineStarts.end(), pos);
     return std::max(0, (int)std::distance(lineStarts.begin(), it) - 1);
 }
+#if defined(__APPLE__)
+// UTF-8 の文字列 s の先頭 bytes バイトを UTF-16 にしたときの長さ (4 バイトの文字はサロゲートペアで 2)
+static long utf16Units(const std::string& s, size_t bytes) {
+    long n = 0;
+    for (size_t i = 0; i < bytes && i < s.size(); ++i) { unsigned char b = (unsigned char)s[i]; if ((b & 0xC0) != 0x80) n += (b >= 0xF0) ? 2 : 1; }
+    return n;
+}
+// UTF-16 で先頭 units 単位ぶんの文字が、UTF-8 の s で何バイトか
+static size_t utf8BytesForUnits(const std::string& s, long units) {
+    size_t i = 0;
+    while (i < s.size() && units > 0) { unsigned char b = (unsigned char)s[i]; i += b < 0xC0 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4; units -= (b >= 0xF0) ? 2 : 1; }
+    return std::min(i, s.size());
+}
+#endif
+// 改行を除いた行の文字列 text のレイアウト。同じ文字列なら最近使った kLayoutCacheLines 行 (文字列の合計 kLayoutCacheTextBytes まで) の中から使い回す (フォントか色が変わったら捨てる)
+const LineLayout& Editor::layoutFor(const std::string& text) {
+    return layoutCache.get(text, [&] {
+#if defined(__APPLE__)
+        CTLineRef line = nullptr;
+        CFStringRef cf = CFStringCreateWithBytes(NULL, (const UInt8*)text.data(), text.size(), kCFStringEncodingUTF8, false);
+        if (cf) {
+            const void* keys[] = { kCTFontAttributeName, kCTParagraphStyleAttributeName, kCTForegroundColorAttributeName };
+            const void* values[] = { fontRef, paragraphStyle, colText };
+            CFDictionaryRef d = CFDictionaryCreate(NULL, keys, values, colText ? 3 : 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            CFAttributedStringRef as = CFAttributedStringCreate(NULL, cf, d); line = CTLineCreateWithAttributedString(as);
+            CFRelease(as); CFRelease(d); CFRelease(cf);
+        }
+        return LineLayout(line);
+#else
+        return LineLayout();
+#endif
+    });
+}
+const GutterLabel& Editor::gutterLabel(int number) {
+    char buf[16]; int n = snprintf(buf, sizeof(buf), "%d", number);
+    return gutterCache.get(std::string_view(buf, (size_t)n), [&] {
+#if defined(__APPLE__)
+        CTLineRef line = nullptr; float width = 0.0f;
+        CFStringRef cf = CFStringCreateWithBytes(NULL, (const UInt8*)buf, n, kCFStringEncodingUTF8, false);
+        if (cf) {
+            const void* keys[] = { kCTFontAttributeName, kCTForegroundColorAttributeName };
+            const void* values[] = { fontRef, colGutterText };
+            CFDictionaryRef d = CFDictionaryCreate(NULL, keys, values, colGutterText ? 2 : 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            CFAttributedStringRef as = CFAttributedStringCreate(NULL, cf, d); line = CTLineCreateWithAttributedString(as);
+            width = (float)CTLineGetTypographicBounds(line, NULL, NULL, NULL);
+            CFRelease(as); CFRelease(d); CFRelease(cf);
+        }
+        return GutterLabel{ LineLayout(line), width };
+#else
+        return GutterLabel();
+#endif
+    });
+}
+// 等幅フォントで、行が表示できる ASCII とタブだけなら x 座標は桁数から決まる (タブは tabWidth ごとの位置まで進む)
+bool Editor::isAsciiMonospaceLine(const std::string& text) const {
+    if (!monospaceFont || charWidth <= 0.0f) return false;
+    for (unsigned char c : text) if ((c < 0x20 && c != '\t') || c >= 0x7F) return false;
+    return true;
+}
+float Editor::asciiX(const std::string& text, size_t bytes) const {
+    size_t tabCols = std::max<size_t>(1, (size_t)std::lround(tabWidth / charWidth)), col = 0;
+    for (size_t i = 0; i < bytes && i < text.size(); ++i) col = text[i] == '\t' ? (col / tabCols + 1) * tabCols : col + 1;
+    return (float)col * charWidth;
+}
+// tx にいちばん近い文字の境目 (文字の幅の半分より左ならその文字の前)
+size_t Editor::asciiPosForX(const std::string& text, float tx) const {
+    size_t tabCols = std::max<size_t>(1, (size_t)std::lround(tabWidth / charWidth)), col = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        size_t next = text[i] == '\t' ? (col / tabCols + 1) * tabCols : col + 1;
+        if (tx < ((float)col + (float)next) * 0.5f * charWidth) return i;
+        col = next;
+    }
+    return text.size();
+}
 float Editor::getXInLine(int li, size_t pos) {
     if (li < 0 || li >= (int)lineStarts.size()) return 0.0f;
     size_t s = lineStarts[li], e = (li + 1 < (int)lineStarts.size()) ? lineStarts[li + 1] : pt.length();
@@ -1249,17 +1595,12 @@ float Editor::getXInLine(int li, size_t pos) {
     std::string lstr = pt.getRange(s, e - s); size_t rp = std::clamp(pos, s, e) - s;
     if (!imeComp.empty() && !cursors.empty() && getLineIdx(cursors.back().head) == li) { size_t cp = cursors.back().head; if (cp >= s && cp <= e) { lstr.insert(cp - s, imeComp); if (pos >= cp) rp += imeComp.size(); } }
     if (lstr.empty()) return 0.0f;
+    if (isAsciiMonospaceLine(lstr)) return asciiX(lstr, rp);
+    const LineLayout& layout = layoutFor(lstr);
 #if defined(__APPLE__)
-    CFStringRef cf = CFStringCreateWithBytes(NULL, (const UInt8*)lstr.data(), lstr.size(), kCFStringEncodingUTF8, false); if (!cf) return 0.0f;
-    const void* keys[] = { kCTFontAttributeName, kCTParagraphStyleAttributeName };
-    const void* values[] = { fontRef, paragraphStyle };
-    CFDictionaryRef d = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    CFAttributedStringRef as = CFAttributedStringCreate(NULL, cf, d); CTLineRef line = CTLineCreateWithAttributedString(as);
-    CFStringRef sub = CFStringCreateWithBytes(NULL, (const UInt8*)lstr.data(), rp, kCFStringEncodingUTF8, false);
-    CGFloat x = CTLineGetOffsetForStringIndex(line, sub ? CFStringGetLength(sub) : 0, NULL);
-    if (sub) CFRelease(sub); CFRelease(line); CFRelease(as); CFRelease(d); CFRelease(cf); return (float)x;
+    return layout.line ? (float)CTLineGetOffsetForStringIndex(layout.line, utf16Units(lstr, rp), NULL) : 0.0f;
 #else
-    return 0.0f;
+    (void)layout; (void)rp; return 0.0f;
 #endif
 }
 float Editor::getXFromPos(size_t p) { return getXInLine(getLineIdx(p), p); }
@@ -1269,20 +1610,14 @@ size_t Editor::getPosFromLineAndX(int li, float tx) {
     if (e > s && pt.charAt(e-1) == '\n') e--;
     if (e > s && pt.charAt(e-1) == '\r') e--;
     std::string lstr = pt.getRange(s, e - s); if (lstr.empty()) return s;
+    if (isAsciiMonospaceLine(lstr)) return s + asciiPosForX(lstr, tx);
+    const LineLayout& layout = layoutFor(lstr);
 #if defined(__APPLE__)
-    CFStringRef cf = CFStringCreateWithBytes(NULL, (const UInt8*)lstr.data(), lstr.size(), kCFStringEncodingUTF8, false); if (!cf) return s;
-    const void* keys[] = { kCTFontAttributeName, kCTParagraphStyleAttributeName };
-    const void* values[] = { fontRef, paragraphStyle };
-    CFDictionaryRef d = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    CFAttributedStringRef as = CFAttributedStringCreate(NULL, cf, d); CTLineRef line = CTLineCreateWithAttributedString(as);
-    CFIndex ci = CTLineGetStringIndexForPosition(line, CGPointMake(tx, 0));
-    CFIndex bytes = 0; if (ci > 0) {
-        CFStringRef sub = CFStringCreateWithSubstring(NULL, cf, CFRangeMake(0, std::min(ci, CFStringGetLength(cf))));
-        if (sub) { CFStringGetBytes(sub, CFRangeMake(0, CFStringGetLength(sub)), kCFStringEncodingUTF8, 0, false, NULL, 0, &bytes); CFRelease(sub); }
-    }
-    CFRelease(line); CFRelease(as); CFRelease(d); CFRelease(cf); return s + bytes;
+    if (!layout.line) return s;
+    CFIndex ci = CTLineGetStringIndexForPosition(layout.line, CGPointMake(tx, 0));
+    return s + (ci > 0 ? utf8BytesForUnits(lstr, (long)ci) : 0);
 #else
-    return s;
+    (void)layout; (void)tx; return s;
 #endif
 }
 size_t Editor::getDocPosFromPoint(float x, float y) {
@@ -1291,6 +1626,7 @@ size_t Editor::getDocPosFromPoint(float x, float y) {
     return getPosFromLineAndX(li, x - gutterWidth + (float)hScrollPos);
 }
 void Editor::ensureCaretVisible() {
+    if (trace.active && trace.depth == 0) traceSync();
     if (cursors.empty() || !cbGetViewSize) return;
     Cursor& c = cursors.back();
     float viewWidth = 0.0f, viewHeight = 0.0f;
@@ -1307,6 +1643,7 @@ size_t Editor::moveCaretVisual(size_t pos, bool f) {
     else { if (pos == 0) return 0; size_t p = pos-1; while(p>0 && (pt.charAt(p)&0xC0)==0x80) p--; if(p>0 && pt.charAt(p-1)=='\r'&&pt.charAt(p)=='\n') p--; return p; }
 }
 void Editor::insertAtCursors(const std::string& t) {
+    TraceScope ts(this, "insert", t);
     EditBatch b; b.beforeCursors=cursors; auto sorted = cursors;
     std::sort(sorted.begin(), sorted.end(), [](const Cursor& a, const Cursor& b){return a.start()>b.start();});
     for(auto& c:sorted){
@@ -1330,6 +1667,7 @@ void Editor::insertAtCursors(const std::string& t) {
     b.afterCursors=cursors; undo.push(b); rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag();
 }
 void Editor::backspaceAtCursors() {
+    TraceScope ts(this, "backspace");
     if (cursors.empty()) return; EditBatch b; b.beforeCursors = cursors;
     std::vector<size_t> indices(cursors.size()); std::iota(indices.begin(), indices.end(), 0);
     std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return cursors[a].head > cursors[b].head; });
@@ -1357,6 +1695,7 @@ void Editor::backspaceAtCursors() {
     if (cbNeedsDisplay) cbNeedsDisplay();
 }
 void Editor::deleteForwardAtCursors() {
+    TraceScope ts(this, "deleteForward");
     if (cursors.empty()) return; EditBatch b; b.beforeCursors = cursors;
     std::vector<size_t> indices(cursors.size()); std::iota(indices.begin(), indices.end(), 0);
     std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return cursors[a].start() > cursors[b].start(); });
@@ -1373,8 +1712,9 @@ void Editor::deleteForwardAtCursors() {
     }
     if (changed) { b.afterCursors = cursors; undo.push(b); rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag(); }
 }
-void Editor::selectAll() { cursors.clear(); size_t len = pt.length(); cursors.push_back({len, 0, getXFromPos(len), getXFromPos(len), false}); }
+void Editor::selectAll() { TraceScope ts(this, "selectAll"); cursors.clear(); size_t len = pt.length(); cursors.push_back({len, 0, getXFromPos(len), getXFromPos(len), false}); }
 void Editor::jumpToFileEdge(bool start, bool select) {
+    TraceScope ts(this, "jump", start ? "1" : "0", select ? "1" : "0");
     size_t target = start ? 0 : pt.length();
     float targetX = 0.0f;
     if (!start) targetX = getXFromPos(target);
@@ -1399,6 +1739,7 @@ void Editor::jumpToFileEdge(bool start, bool select) {
     if (cbNeedsDisplay) cbNeedsDisplay();
 }
 void Editor::convertSelectedText(bool toUpper) {
+    TraceScope ts(this, "convertCase", toUpper ? "1" : "0");
     if (cursors.empty()) return;
     EditBatch batch;
     batch.beforeCursors = cursors;
@@ -1469,6 +1810,7 @@ void Editor::copyToClipboard() {
     }
 }
 void Editor::cutToClipboard() {
+    TraceScope ts(this, "cut");
     bool hasSelection = false; for (const auto& c : cursors) if (c.hasSelection()) { hasSelection = true; break; }
     copyToClipboard();
     if (!hasSelection) deleteLine(); else insertAtCursors("");
@@ -1478,6 +1820,7 @@ void Editor::pasteFromClipboard() {
     bool isRectMarker = false;
     std::string utf8 = cbGetClipboard(isRectMarker);
     if(utf8.empty()) return;
+    TraceScope ts(this, "paste", utf8, isRectMarker ? "1" : "0");
     if (isRectMarker) {
         if (cursors.size() <= 1) {
             size_t basePos = cursors.empty() ? 0 : cursors[0].head; float baseX = getXFromPos(basePos); int startLine = getLineIdx(basePos);
@@ -1488,14 +1831,15 @@ void Editor::pasteFromClipboard() {
     } else { insertAtCursors(utf8); }
     if (cbNeedsDisplay) cbNeedsDisplay();
 }
-void Editor::performUndo() { if(!undo.undoStack.empty()){ auto b = undo.popUndo(); for(int i=(int)b.ops.size()-1;i>=0;--i){ if(b.ops[i].type==EditOp::Insert) pt.erase(b.ops[i].pos, (int)b.ops[i].text.size()); else pt.insert(b.ops[i].pos, b.ops[i].text); } cursors=b.beforeCursors; rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag(); } }
-void Editor::performRedo() { if(!undo.redoStack.empty()){ auto b = undo.popRedo(); for(const auto& o:b.ops){ if(o.type==EditOp::Insert) pt.insert(o.pos, o.text); else pt.erase(o.pos, (int)o.text.size()); } cursors=b.afterCursors; rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag(); } }
+void Editor::performUndo() { TraceScope ts(this, "undo"); SlowOpScope so(this, "undo"); if(!undo.undoStack.empty()){ auto b = undo.popUndo(); for(int i=(int)b.ops.size()-1;i>=0;--i){ const EditOp& o=b.ops[i]; if(o.type==EditOp::Pieces) pt.swapPieces(*o.pieces, { o.change.pos, o.change.inserted, o.change.removed }); else if(o.type==EditOp::Insert) pt.erase(o.pos, (int)o.text.size()); else pt.insert(o.pos, o.text); } cursors=b.beforeCursors; rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag(); } }
+void Editor::performRedo() { TraceScope ts(this, "redo"); SlowOpScope so(this, "redo"); if(!undo.redoStack.empty()){ auto b = undo.popRedo(); for(const auto& o:b.ops){ if(o.type==EditOp::Pieces) pt.swapPieces(*o.pieces, o.change); else if(o.type==EditOp::Insert) pt.insert(o.pos, o.text); else pt.erase(o.pos, (int)o.text.size()); } cursors=b.afterCursors; rebuildLineStarts(); ensureCaretVisible(); updateDirtyFlag(); } }
 bool Editor::checkUnsavedChanges() {
     if(!isDirty) return true;
     if(cbShowUnsavedAlert) return cbShowUnsavedAlert();
     return true;
 }
 bool Editor::saveFile(const std::wstring& p) {
+    SlowOpScope so(this, "save");
     std::string contentUtf8 = pt.getRange(0, pt.length());
     std::ofstream f(WToUTF8(p), std::ios::binary);
     if(!f) return false;
@@ -1523,6 +1867,8 @@ bool Editor::saveFileAs() {
     return false;
 }
 bool Editor::openFileFromPath(const std::string& p) {
+    TraceScope ts(this, "open", p); SlowOpScope so(this, "open");
+    searchBuilder.stop(); // 検索のスレッドが今のファイルの内容を読み終えてから閉じる
     fileMap.reset(new MappedFile());
     if(fileMap->open(p.c_str())){
         DetectResult encRes = DetectEncodingEx(fileMap->ptr, fileMap->size);
@@ -1562,7 +1908,9 @@ bool Editor::openFile() {
     return false;
 }
 void Editor::newFile() {
+    TraceScope ts(this, "new");
     if(checkUnsavedChanges()){
+        searchBuilder.stop();
         pt.initEmpty();
         currentFilePath.clear();
         this->currentFileBuffer.clear();
@@ -1575,6 +1923,40 @@ void Editor::newFile() {
         updateTitleBar();
     }
 }
+bool Editor::startTrace(const std::string& path) {
+    if (!trace.start(path)) return false;
+    if (!currentFilePath.empty()) trace.write("open", { WToUTF8(currentFilePath) }); else trace.write("new", {});
+    traceSync(); return true;
+}
+void Editor::stopTrace() { trace.stop(); }
+bool Editor::startSlowLog(const std::string& path, double thresholdMs) { return slowLog.start(path, thresholdMs); }
+void Editor::stopSlowLog() { slowLog.stop(); }
+void Editor::noteSlowOp(const char* op, double ms) { if (slowLog.active && ms >= slowLog.thresholdMs) slowLog.write(op, ms, pt.length(), pt.pieces.size(), lineStarts.size(), cursors.size()); }
+MemoryStats Editor::memoryStats() const {
+    MemoryStats m;
+    m.pieceList = pt.pieces.capacity() * sizeof(Piece);
+    m.addBuffer = HeapBytes(pt.addBuf);
+    if (fileMap) { m.originalMapped = fileMap->size; m.originalResident = fileMap->residentBytes(); }
+    m.fileBuffer = HeapBytes(currentFileBuffer);
+    m.lineIndex = lineStarts.capacity() * sizeof(size_t);
+    m.undoStack = HeapBytes(undo.undoStack);
+    m.redoStack = HeapBytes(undo.redoStack);
+    m.profiler = profiler.events.capacity() * sizeof(FrameProfiler::Event);
+    m.searchIndex = searchIndex.bytes() + autoIndex.bytes() + searchBuilder.bytes();
+    if (auto doc = searchSnapshot.lock()) m.searchSnapshot = sizeof(PieceTable) + doc->pieces.capacity() * sizeof(Piece) + HeapBytes(doc->addBuf);
+    m.autoHighlight = autoHighlight.spans.capacity() * sizeof(LineSpan) + HeapBytes(autoHighlight.target) + HeapBytes(autoHighlight.ime);
+    m.layoutCache = layoutCache.bytes(); m.gutterCache = gutterCache.bytes();
+    return m;
+}
+// カーソルと検索条件が前回の記録から変わっていれば書き出す
+void Editor::traceSync() {
+    if (!trace.active) return;
+    std::string cs; char buf[96];
+    for (const auto& c : cursors) { snprintf(buf, sizeof(buf), "%s%zu,%zu,%.2f,%.2f,%d", cs.empty() ? "" : ";", c.head, c.anchor, c.desiredX, c.originalAnchorX, c.isVirtual ? 1 : 0); cs += buf; }
+    if (cs != trace.lastCursors) { trace.lastCursors = cs; trace.write("cursors", { cs }); }
+    std::string ss = searchQuery + '\0' + replaceQuery + (searchMatchCase ? '1' : '0') + (searchWholeWord ? '1' : '0') + (searchRegex ? '1' : '0');
+    if (ss != trace.lastSearch) { trace.lastSearch = ss; trace.write("search", { searchQuery, replaceQuery, searchMatchCase ? "1" : "0", searchWholeWord ? "1" : "0", searchRegex ? "1" : "0" }); }
+}
 bool Editor::isWordChar(char c) { if (isalnum((unsigned char)c) || c == '_') return true; if ((unsigned char)c >= 0x80) return true; return false; }
 void Editor::getWordBoundaries(size_t pos, size_t& start, size_t& end) {
     size_t len = pt.length();
@@ -1611,6 +1993,7 @@ void Editor::initGraphics() {
 }
 void Editor::updateThemeColors() {
 #if defined(__APPLE__)
+    layoutCache.clear(); gutterCache.clear(); // レイアウトは文字の色を含む
     if (colBackground) { CGColorRelease(colBackground); CGColorRelease(colText); CGColorRelease(colGutterBg); CGColorRelease(colGutterText); CGColorRelease(colSel); CGColorRelease(colCaret); }
     if (isDarkMode) {
         colText = CGColorCreateGenericRGB(1.0, 1.0, 1.0, 1.0);
@@ -1641,16 +2024,17 @@ void Editor::updateThemeColors() {
 }
 #if defined(__APPLE__)
 void Editor::render(CGContextRef ctx, float w, float h) {
+    profiler.beginFrame();
     CGContextClearRect(ctx, CGRectMake(0, 0, gutterWidth, h));
     CGContextSetFillColorWithColor(ctx, colBackground);
     CGContextFillRect(ctx, CGRectMake(gutterWidth, 0, w - gutterWidth, h));
     CGContextSetTextMatrix(ctx, CGAffineTransformMakeScale(1.0, -1.0));
     float vw = std::max(0.0f, w - gutterWidth - visibleVScrollWidth);
     float vh = std::max(0.0f, h - visibleHScrollHeight);
-    int start = vScrollPos; int vis = (int)(vh / lineHeight) + 2; int end = std::min((int)lineStarts.size(), start + vis);
-#if TARGET_OS_IOS
-    int renderStart = std::max(0, start - 15);
-#endif
+    int start = vScrollPos, firstLine, end; visibleLineRange(h, firstLine, end);
+    // 描き直す範囲 (クリップ) に掛かる行だけを組む
+    CGRect dirty = CGContextGetClipBoundingBox(ctx);
+    int drawFrom = std::max(firstLine, start + (int)std::floor(CGRectGetMinY(dirty) / lineHeight)), drawTo = std::min(end, start + (int)std::ceil(CGRectGetMaxY(dirty) / lineHeight));
     CGFloat asc = CTFontGetAscent(fontRef);
     CGContextSaveGState(ctx);
 #if TARGET_OS_IOS
@@ -1658,262 +2042,107 @@ void Editor::render(CGContextRef ctx, float w, float h) {
 #else
     CGContextClipToRect(ctx, CGRectMake(gutterWidth, 0, vw, vh));
 #endif
-    auto [autoStr, isWholeWord] = getHighlightTarget();
-    if (!autoStr.empty() && autoStr != searchQuery) {
+    size_t searchRangeStart = lineStarts[firstLine];
+    size_t searchRangeEnd = (end < lineStarts.size()) ? lineStarts[end] : pt.length();
+    // 一致 [pos, pos + len) を行ごとに塗る。空一致は 1 文字分の幅で塗る
+    std::vector<LineSpan> spanBuf;
+    auto fillSpan = [&](const LineSpan& sp) { CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + sp.x1, (float)(sp.line - start) * lineHeight, sp.x2 - sp.x1, lineHeight)); };
+    auto fillMatch = [&](size_t pos, size_t len) { spanBuf.clear(); matchSpans(pos, len, firstLine, end, spanBuf); for (const auto& sp : spanBuf) fillSpan(sp); };
+    // 一致は文書全体の索引から表示範囲の分だけ取り出す。索引を使えないときだけ表示範囲の文字列を探す
+    auto fetchVisibleText = [&] { FrameProfiler::Scope fs(profiler, FrameProfiler::TextFetch); return pt.getRange(searchRangeStart, searchRangeEnd - searchRangeStart); };
+    // カーソル・選択・自動ハイライトを描いた矩形 (collectDamage が次の状態と比べる。renderSnapshot と同じ形で覚える)
+    std::vector<DirtyRect> marks;
+    auto mark = [&](int l, float x, float mw) { marks.push_back({ gutterWidth - (float)hScrollPos + x, (float)(l - start) * lineHeight, mw, lineHeight }); };
+    profiler.push(FrameProfiler::AutoHighlight);
+    const AutoHighlightCache& ah = updateAutoHighlight(firstLine, end);
+    if (!ah.target.empty() && ah.target != searchQuery) {
         CGColorRef autoHlColor = isDarkMode ? CGColorCreateGenericRGB(0.35, 0.35, 0.35, 0.5) : CGColorCreateGenericRGB(0.85, 0.85, 0.85, 0.5);
         CGContextSetFillColorWithColor(ctx, autoHlColor);
-#if TARGET_OS_IOS
-        size_t searchRangeStart = lineStarts[renderStart];
-#else
-        size_t searchRangeStart = lineStarts[start];
-#endif
-        size_t searchRangeEnd = (end < lineStarts.size()) ? lineStarts[end] : pt.length();
-        std::string visibleText = pt.getRange(searchRangeStart, searchRangeEnd - searchRangeStart);
-        size_t searchPos = 0;
-        while ((searchPos = visibleText.find(autoStr, searchPos)) != std::string::npos) {
-            size_t docPos = searchRangeStart + searchPos; bool shouldHighlight = true;
-            if (isWholeWord) {
-                if (docPos > 0 && isWordChar(pt.charAt(docPos - 1))) shouldHighlight = false;
-                if (shouldHighlight && (docPos + autoStr.length() < pt.length()) && isWordChar(pt.charAt(docPos + autoStr.length()))) shouldHighlight = false;
-            }
-            if (shouldHighlight) {
-                size_t currentDrawPos = docPos;
-                size_t remainingLen = autoStr.length();
-                while (remainingLen > 0) {
-                    int li = getLineIdx(currentDrawPos);
-                    size_t lineEndPos = (li + 1 < (int)lineStarts.size()) ? lineStarts[li + 1] : pt.length();
-                    size_t lineVisualEnd = lineEndPos;
-                    if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\n') lineVisualEnd--;
-                    if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\r') lineVisualEnd--;
-                    size_t lenInLine = std::min(remainingLen, lineVisualEnd > currentDrawPos ? lineVisualEnd - currentDrawPos : 0);
-                    if (lenInLine == 0 && remainingLen > 0 && currentDrawPos < lineEndPos) lenInLine = std::min(remainingLen, lineEndPos - currentDrawPos);
-#if TARGET_OS_IOS
-                    if (li >= renderStart && li < end) {
-#else
-                    if (li >= start && li < end) {
-#endif
-                        float y = (float)(li - start) * lineHeight;
-                        float x1 = getXInLine(li, currentDrawPos);
-                        float x2 = getXInLine(li, currentDrawPos + lenInLine);
-                        if (x2 <= x1) x2 = x1 + charWidth;
-                        CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, x2 - x1, lineHeight));
-                    }
-                    size_t consumed = std::min(remainingLen, lineEndPos - currentDrawPos);
-                    if (consumed == 0) break;
-                    currentDrawPos += consumed;
-                    remainingLen -= consumed;
-                }
-            }
-            searchPos += 1;
-        }
+        for (const auto& sp : ah.spans) { fillSpan(sp); mark(sp.line, sp.x1, std::max(sp.x2 - sp.x1, 1.0f)); }
         CGColorRelease(autoHlColor);
     }
+    profiler.pop();
     if (!searchQuery.empty()) {
+        FrameProfiler::Scope ps(profiler, FrameProfiler::RegexHighlight);
         CGColorRef hlColor = isDarkMode ? CGColorCreateGenericRGB(0.4, 0.4, 0.0, 0.6) : CGColorCreateGenericRGB(1.0, 1.0, 0.0, 0.4);
         CGContextSetFillColorWithColor(ctx, hlColor);
-#if TARGET_OS_IOS
-        size_t searchRangeStart = lineStarts[renderStart];
-#else
-        size_t searchRangeStart = lineStarts[start];
-#endif
-        size_t searchRangeEnd = (end < lineStarts.size()) ? lineStarts[end] : pt.length();
-        std::string visibleText = pt.getRange(searchRangeStart, searchRangeEnd - searchRangeStart);
-        if (searchRegex) {
-            try {
-                std::string actualQuery = preprocessRegexQuery(searchQuery);
-                std::regex_constants::syntax_option_type flags = std::regex_constants::ECMAScript;
-                if (!searchMatchCase) flags |= std::regex_constants::icase;
-                std::regex re(actualQuery, flags);
-                bool startsWithCaret = (!searchQuery.empty() && searchQuery[0] == '^');
-                bool endsWithDollar = (!searchQuery.empty() && searchQuery.back() == '$');
-                auto searchStartIter = visibleText.cbegin();
-                std::smatch m;
-                std::regex_constants::match_flag_type matchFlags = std::regex_constants::match_default;
-                size_t lastMatchPos = std::string::npos;
-                while (std::regex_search(searchStartIter, visibleText.cend(), m, re, matchFlags)) {
-                    size_t matchPos = std::distance(visibleText.cbegin(), searchStartIter) + m.position();
-                    size_t matchLen = m.length();
-                    size_t anchorLen = 0;
-                    if (startsWithCaret && m.size() > 1 && m[1].matched) {
-                        anchorLen = m.length(1);
-                    }
-                    size_t contentPos = matchPos + anchorLen;
-                    size_t contentLen = matchLen - anchorLen;
-                    bool shouldHighlight = true;
-                    if (contentPos == lastMatchPos && contentLen == 0) {
-                        shouldHighlight = false;
-                    }
-                    if (endsWithDollar) {
-                        bool isAtLineEnd = false;
-                        if (contentPos + contentLen >= visibleText.size()) {
-                            isAtLineEnd = true;
-                        } else {
-                            char c = visibleText[contentPos + contentLen];
-                            if (c == '\r' || c == '\n') {
-                                isAtLineEnd = true;
-                                if (contentLen == 0 && c == '\n' && contentPos + contentLen > 0 && visibleText[contentPos + contentLen - 1] == '\r') {
-                                    isAtLineEnd = false;
-                                }
-                            }
-                        }
-                        if (!isAtLineEnd) shouldHighlight = false;
-                    }
-                    if (shouldHighlight && startsWithCaret && endsWithDollar && contentLen == 0) {
-                        size_t globalPos = searchRangeStart + contentPos;
-                        if (globalPos == pt.length() && pt.length() > 0) {
-                            bool isAfterNewline = false;
-                            if (globalPos > 0) {
-                                char c = pt.charAt(globalPos - 1);
-                                if (c == '\r' || c == '\n') isAfterNewline = true;
-                            }
-                            if (!isAfterNewline) shouldHighlight = false;
-                        }
-                    }
-                    if (shouldHighlight) {
-                        lastMatchPos = contentPos;
-                        if (contentLen > 0 || (contentLen == 0 && (startsWithCaret || endsWithDollar))) {
-                            size_t currentDrawPos = searchRangeStart + contentPos;
-                            size_t remainingLen = contentLen;
-                            if (remainingLen == 0) {
-                                int li = getLineIdx(currentDrawPos);
-#if TARGET_OS_IOS
-                                if (li >= renderStart && li < end) {
-#else
-                                if (li >= start && li < end) {
-#endif
-                                    float y = (float)(li - start) * lineHeight;
-                                    float x1 = getXInLine(li, currentDrawPos);
-                                    CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, charWidth, lineHeight));
-                                }
-                            } else {
-                                while (remainingLen > 0) {
-                                    int li = getLineIdx(currentDrawPos);
-                                    size_t lineEndPos = (li + 1 < (int)lineStarts.size()) ? lineStarts[li + 1] : pt.length();
-                                    size_t lineVisualEnd = lineEndPos;
-                                    if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\n') lineVisualEnd--;
-                                    if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\r') lineVisualEnd--;
-                                    
-                                    size_t lenInLine = std::min(remainingLen, lineVisualEnd > currentDrawPos ? lineVisualEnd - currentDrawPos : 0);
-                                    if (lenInLine == 0 && remainingLen > 0 && currentDrawPos < lineEndPos) lenInLine = std::min(remainingLen, lineEndPos - currentDrawPos);
-#if TARGET_OS_IOS
-                                    if (li >= renderStart && li < end) {
-#else
-                                    if (li >= start && li < end) {
-#endif
-                                        float y = (float)(li - start) * lineHeight;
-                                        float x1 = getXInLine(li, currentDrawPos);
-                                        float x2 = getXInLine(li, currentDrawPos + lenInLine);
-                                        if (x2 <= x1) x2 = x1 + charWidth;
-                                        CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, x2 - x1, lineHeight));
-                                    }
-                                    size_t consumed = std::min(remainingLen, lineEndPos - currentDrawPos);
-                                    if (consumed == 0) break;
-                                    currentDrawPos += consumed;
-                                    remainingLen -= consumed;
-                                }
-                            }
-                        }
-                    }
-                    size_t step = matchLen;
-                    if (step == 0) {
-                        bool isBolCaret = (startsWithCaret && !(matchFlags & std::regex_constants::match_not_bol));
-                        if (isBolCaret) step = 0;
-                        else step = 1;
-                    }
-                    if (step == 0 && (matchFlags & std::regex_constants::match_not_bol)) step = 1;
-                    size_t advance = m.position() + step;
-                    if (std::distance(searchStartIter, visibleText.cend()) < (ptrdiff_t)advance) break;
-                    std::advance(searchStartIter, advance);
-                    matchFlags |= std::regex_constants::match_not_bol;
-                }
-            } catch (...) {}
+        // 正規表現の空一致は ^ や $ で位置を探すパターンのときだけ塗る
+        bool showEmpty = searchRegex && (searchQuery[0] == '^' || searchQuery.back() == '$');
+        if (const miu::MatchIndex* idx = searchMatchIndex()) idx->forEachOverlapping(searchRangeStart, searchRangeEnd, [&](const miu::SearchHit& m) { if (m.len > 0 || showEmpty) fillMatch(m.pos, m.len); });
+        else if (searchRegex) {
+            const miu::Regex& re = compileSearchRegex(searchQuery, searchMatchCase);
+            std::string visibleText = fetchVisibleText();
+            // 表示範囲の前後の 1 バイトを文脈として渡し、行頭/行末と単語境界を文書全体と同じに判定する
+            miu::RegexSearchOptions opt; opt.budget = highlightStepBudget;
+            opt.before = searchRangeStart > 0 ? (unsigned char)pt.charAt(searchRangeStart - 1) : -1;
+            opt.after = searchRangeEnd < pt.length() ? (unsigned char)pt.charAt(searchRangeEnd) : -1;
+            re.forEach(visibleText.data(), visibleText.size(), 0, [&](const miu::RegexMatch& m) { if (m.len > 0 || showEmpty) fillMatch(searchRangeStart + m.pos, m.len); return true; }, opt);
         } else {
-            std::string q = searchQuery; std::string t = visibleText;
-            if (!searchMatchCase) { std::transform(q.begin(), q.end(), q.begin(), ::tolower); std::transform(t.begin(), t.end(), t.begin(), ::tolower); }
-            size_t offset = 0;
-            while ((offset = t.find(q, offset)) != std::string::npos) {
+            std::string visibleText = fetchVisibleText();
+            miu::LiteralSearcher ls(searchQuery, searchMatchCase);
+            size_t offset = 0, mLen = 0;
+            while ((offset = ls.find(visibleText, offset, [](size_t, size_t) { return true; }, &mLen)) != std::string::npos) {
                 bool match = true;
                 if (searchWholeWord) {
                     if (offset > 0 && isWordChar(visibleText[offset - 1])) match = false;
-                    if (match && (offset + q.length() < visibleText.length()) && isWordChar(visibleText[offset + q.length()])) match = false;
-                }
-                if (match) {
-                    size_t currentDrawPos = searchRangeStart + offset;
-                    size_t remainingLen = q.length();
-                    while (remainingLen > 0) {
-                        int li = getLineIdx(currentDrawPos);
-                        size_t lineEndPos = (li + 1 < (int)lineStarts.size()) ? lineStarts[li + 1] : pt.length();
-                        size_t lineVisualEnd = lineEndPos;
-                        if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\n') lineVisualEnd--;
-                        if (lineVisualEnd > lineStarts[li] && pt.charAt(lineVisualEnd - 1) == '\r') lineVisualEnd--;
-                        
-                        size_t lenInLine = std::min(remainingLen, lineVisualEnd > currentDrawPos ? lineVisualEnd - currentDrawPos : 0);
-                        if (lenInLine == 0 && remainingLen > 0 && currentDrawPos < lineEndPos) lenInLine = std::min(remainingLen, lineEndPos - currentDrawPos);
-#if TARGET_OS_IOS
-                            if (li >= renderStart && li < end) {
-#else
-                            if (li >= start && li < end) {
-#endif
-                            float y = (float)(li - start) * lineHeight;
-                            float x1 = getXInLine(li, currentDrawPos);
-                            float x2 = getXInLine(li, currentDrawPos + lenInLine);
-                            CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, x2 - x1, lineHeight));
-                        }
-                        size_t consumed = std::min(remainingLen, lineEndPos - currentDrawPos);
-                        if (consumed == 0) break;
-                        currentDrawPos += consumed;
-                        remainingLen -= consumed;
-                    }
+                    if (match && (offset + mLen < visibleText.length()) && isWordChar(visibleText[offset + mLen])) match = false;
                 }
+                if (match) fillMatch(searchRangeStart + offset, mLen);
                 offset += 1;
             }
         }
         CGColorRelease(hlColor);
     }
+    profiler.push(FrameProfiler::Selection);
     CGContextSetFillColorWithColor(ctx, colSel);
     bool isRectMode = (cursors.size() > 1);
-    for (const auto& c : cursors) {
+    // 見えている行 [firstLine, end) に掛かるカーソルとその行だけを見る (選択やカーソルがいくつあっても描く量は画面の分だけ)
+    size_t visFrom = lineStarts[firstLine], visTo = (end < (int)lineStarts.size()) ? lineStarts[end] : pt.length();
+    visibleCursorIndices(visFrom, visTo, visibleCursors);
+    for (size_t ci : visibleCursors) {
+        auto& c = cursors[ci];
         if (isRectMode) {
+            int lHead = getLineIdx(c.head), lAnchor = getLineIdx(c.anchor);
+            int startL = std::max(std::min(lHead, lAnchor), firstLine), endL = std::min(std::max(lHead, lAnchor), end - 1);
+            if (endL < startL) continue;
+            resolveCursorX(c); // 見えているカーソルの x だけここで求める
             float visualX1 = std::min(c.desiredX, c.originalAnchorX); float visualX2 = std::max(c.desiredX, c.originalAnchorX);
             if (visualX2 - visualX1 < 0.5f) continue;
-            int lHead = getLineIdx(c.head), lAnchor = getLineIdx(c.anchor);
-            int startL = std::min(lHead, lAnchor), endL = std::max(lHead, lAnchor);
             for (int l = startL; l <= endL; ++l) {
-#if TARGET_OS_IOS
-                if (l < renderStart || l >= end) continue;
-#else
-                if (l < start || l >= end) continue;
-#endif
                 float y = (float)(l - start) * lineHeight; float drawX = gutterWidth - (float)hScrollPos + visualX1; float drawW = visualX2 - visualX1;
-                CGContextFillRect(ctx, CGRectMake(drawX, y, drawW, lineHeight));
+                CGContextFillRect(ctx, CGRectMake(drawX, y, drawW, lineHeight)); mark(l, visualX1, drawW);
             }
         } else {
             if (!c.hasSelection()) continue;
-            size_t pStart = c.start(), pEnd = c.end(); int lStart = getLineIdx(pStart), lEnd = getLineIdx(pEnd);
+            size_t pStart = c.start(), pEnd = c.end();
+            int lStart = std::max(getLineIdx(std::max(pStart, visFrom)), firstLine), lEnd = std::min(getLineIdx(std::min(pEnd, visTo)), end - 1);
             for (int l = lStart; l <= lEnd; ++l) {
-#if TARGET_OS_IOS
-                if (l < renderStart || l >= end) continue;
-#else
-                if (l < start || l >= end) continue;
-#endif
                 float y = (float)(l - start) * lineHeight;
                 size_t lineBegin = lineStarts[l], lineEnd = (l + 1 < (int)lineStarts.size() ? lineStarts[l + 1] : pt.length());
                 size_t selS = std::max(pStart, lineBegin), selE = std::min(pEnd, lineEnd);
                 float x1 = getXInLine(l, selS), x2 = getXInLine(l, selE);
                 if (selE == lineEnd && pEnd >= lineEnd) x2 += charWidth;
-                if (x2 > x1) CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, x2 - x1, lineHeight));
+                if (x2 > x1) { CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + x1, y, x2 - x1, lineHeight)); mark(l, x1, x2 - x1); }
             }
         }
     }
-#if TARGET_OS_IOS
-    for (int i = renderStart; i < end; ++i) {
-#else
-    for (int i = start; i < end; ++i) {
-#endif
+    profiler.pop();
+    profiler.push(FrameProfiler::Layout);
+    for (int i = drawFrom; i < drawTo; ++i) {
         size_t s = lineStarts[i], e = (i + 1 < lineStarts.size() ? lineStarts[i + 1] : pt.length());
-        std::string ls = pt.getRange(s, std::max((size_t)0, e - s)); size_t imIdx = std::string::npos;
+        std::string ls;
+        { FrameProfiler::Scope fs(profiler, FrameProfiler::TextFetch); ls = pt.getRange(s, std::max((size_t)0, e - s)); }
+        size_t imIdx = std::string::npos;
         if (!imeComp.empty() && !cursors.empty() && getLineIdx(cursors.back().head) == i) { size_t cp = cursors.back().head; if (cp >= s && cp <= e) { imIdx = cp - s; ls.insert(imIdx, imeComp); } }
-        if (!ls.empty()) {
+        if (!ls.empty() && imIdx == std::string::npos) {
+            // 入力中でない行は、改行を除いた文字列のレイアウトを位置の計算と共有する
+            size_t n = ls.size(); if (n > 0 && ls[n - 1] == '\n') n--; if (n > 0 && ls[n - 1] == '\r') n--; ls.resize(n);
+            CTLineRef tl = ls.empty() ? nullptr : layoutFor(ls).line;
+            if (tl) {
+                CGContextSetTextPosition(ctx, gutterWidth - (float)hScrollPos, (float)(i - start) * lineHeight + asc + 2.0f);
+                FrameProfiler::Scope ds(profiler, FrameProfiler::Submit); CTLineDraw(tl, ctx);
+            }
+        } else if (!ls.empty()) {
             CFStringRef cf = CFStringCreateWithBytes(NULL, (const UInt8*)ls.data(), ls.size(), kCFStringEncodingUTF8, false);
             if (cf) {
                 CFMutableAttributedStringRef mas = CFAttributedStringCreateMutable(NULL, 0);
@@ -1932,7 +2161,7 @@ void Editor::render(CGContextRef ctx, float w, float h) {
                 }
                 CTLineRef tl = CTLineCreateWithAttributedString(mas);
                 CGContextSetTextPosition(ctx, gutterWidth - (float)hScrollPos, (float)(i - start) * lineHeight + asc + 2.0f);
-                CTLineDraw(tl, ctx);
+                { FrameProfiler::Scope ds(profiler, FrameProfiler::Submit); CTLineDraw(tl, ctx); }
                 CFRelease(tl); CFRelease(mas); CFRelease(cf);
             }
         }
@@ -1994,37 +2223,30 @@ void Editor::render(CGContextRef ctx, float w, float h) {
             }
         }
     }
+    profiler.pop();
+    profiler.push(FrameProfiler::Selection);
     CGContextSetFillColorWithColor(ctx, colCaret);
-    for (const auto& c : cursors) {
-        int l = getLineIdx(c.head);
+    for (size_t ci : visibleCursors) {
+        const auto& c = cursors[ci]; int l = getLineIdx(c.head);
         if (l >= start && l < end) {
             float physX = getXInLine(l, c.head); float drawX = physX; if (c.isVirtual) drawX = std::max(physX, c.desiredX);
-            CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + drawX, (float)(l - start) * lineHeight, 2, lineHeight));
+            CGContextFillRect(ctx, CGRectMake(gutterWidth - (float)hScrollPos + drawX, (float)(l - start) * lineHeight, 2, lineHeight)); mark(l, drawX - 1.0f, 4.0f);
         }
     }
+    profiler.pop();
     CGContextRestoreGState(ctx);
+    profiler.push(FrameProfiler::Gutter);
     CGContextSetFillColorWithColor(ctx, colGutterBg);
     CGContextFillRect(ctx, CGRectMake(0, 0, gutterWidth, h));
-#if TARGET_OS_IOS
-    for (int i = renderStart; i < end; ++i) {
-#else
-    for (int i = start; i < end; ++i) {
-#endif
-        CFStringRef n = CFStringCreateWithCString(NULL, std::to_string(i + 1).c_str(), kCFStringEncodingUTF8);
-        if (n) {
-            const void* keys[] = { kCTFontAttributeName, kCTForegroundColorAttributeName };
-            const void* values[] = { fontRef, colGutterText };
-            CFDictionaryRef attr = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-            CFAttributedStringRef nas = CFAttributedStringCreate(NULL, n, attr);
-            CTLineRef nl = CTLineCreateWithAttributedString(nas);
-            double ascent, descent, leading;
-            double lineWidth = CTLineGetTypographicBounds(nl, &ascent, &descent, &leading);
-            float xPos = gutterWidth - (float)lineWidth - (charWidth * 0.5f); if (xPos < 5.0f) xPos = 5.0f;
-            CGContextSetTextPosition(ctx, xPos, (float)(i - start) * lineHeight + asc + 2.0f);
-            CTLineDraw(nl, ctx);
-            CFRelease(nl); CFRelease(nas); CFRelease(attr); CFRelease(n);
-        }
+    for (int i = drawFrom; i < drawTo; ++i) {
+        const GutterLabel& g = gutterLabel(i + 1);
+        if (!g.layout.line) continue;
+        float xPos = gutterWidth - g.width - (charWidth * 0.5f); if (xPos < 5.0f) xPos = 5.0f;
+        CGContextSetTextPosition(ctx, xPos, (float)(i - start) * lineHeight + asc + 2.0f);
+        CTLineDraw(g.layout.line, ctx);
     }
+    profiler.pop();
+    profiler.push(FrameProfiler::Submit);
     auto now = std::chrono::steady_clock::now();
     if (now < zoomPopupEndTime) {
         float zw = 160.0f, zh = 80.0f;
@@ -2089,6 +2311,31 @@ void Editor::render(CGContextRef ctx, float w, float h) {
         CGContextRestoreGState(ctx);
         CFRelease(frame); CFRelease(pth); CFRelease(fs); CFRelease(has); CFRelease(ha); CFRelease(hf); CFRelease(hcf); CFRelease(ps); CGColorRelease(helpWhite);
     }
+    lastRender = renderState(w, h); lastRender.marks = std::move(marks);
+    profiler.endFrame();
+    noteSlowOp("frame", profiler.phaseUs[FrameProfiler::Frame] / 1000.0);
+    if (profiler.showOverlay) {
+        std::vector<std::string> lines = profiler.overlayLines();
+        for (const auto& l : memoryStats().summaryLines()) lines.push_back(l);
+        if (!lines.empty()) {
+            CTFontRef of = CTFontCreateWithName(CFSTR("Menlo"), 11.0f, NULL);
+            CGColorRef ofg = CGColorCreateGenericRGB(1.0, 1.0, 1.0, 1.0), obg = CGColorCreateGenericRGB(0.0, 0.0, 0.0, 0.6);
+            const void* oKeys[] = { kCTFontAttributeName, kCTForegroundColorAttributeName };
+            const void* oVals[] = { of, ofg };
+            CFDictionaryRef oa = CFDictionaryCreate(NULL, oKeys, oVals, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            float olh = 14.0f, ow = 300.0f, oh = olh * (float)lines.size() + 12.0f;
+            CGRect orc = CGRectMake(w - ow - visibleVScrollWidth - 8.0f, 8.0f, ow, oh);
+            CGContextSetFillColorWithColor(ctx, obg); CGContextFillRect(ctx, orc);
+            CGContextSetTextMatrix(ctx, CGAffineTransformMakeScale(1.0, -1.0));
+            for (size_t k = 0; k < lines.size(); ++k) {
+                CFStringRef ocf = CFStringCreateWithCString(NULL, lines[k].c_str(), kCFStringEncodingUTF8); if (!ocf) continue;
+                CFAttributedStringRef oas = CFAttributedStringCreate(NULL, ocf, oa); CTLineRef ol = CTLineCreateWithAttributedString(oas);
+                CGContextSetTextPosition(ctx, orc.origin.x + 6.0f, orc.origin.y + 6.0f + olh * (float)(k + 1) - 3.0f);
+                CTLineDraw(ol, ctx); CFRelease(ol); CFRelease(oas); CFRelease(ocf);
+            }
+            CFRelease(oa); CFRelease(of); CGColorRelease(ofg); CGColorRelease(obg);
+        }
+    }
 }
 #endif
 size_t Editor::countUTF16Length(size_t start, size_t byteLen) {
@@ -2153,6 +2400,7 @@ size_t Editor::getPositionByUTF16Offset(size_t startPos, int offset) {
     }
 }
 Editor::~Editor() {
+    searchBuilder.stop(); folderSearch.stop();
 #if defined(__APPLE__)
     if (colBackground) CGColorRelease(colBackground);
     if (colText) CGColorRelease(colText);
@@ -2,6 +2,7 @@
 #define NOMINMAX
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <algorithm>
@@ -9,15 +10,22 @@
 #include <cmath>
 #include <iomanip>
 #include <sstream>
-#include <regex>
 #include <chrono>
 #include <numeric>
 #include <functional>
+#include <iterator>
+#include <tuple>
 #if defined(__APPLE__)
 #include <CoreGraphics/CoreGraphics.h>
 #include <CoreText/CoreText.h>
 #endif
 #include "compact_enc_det/compact_enc_det.h"
+#include "miu/regex.h"
+#include "miu/literal.h"
+#include "miu/parallel.h"
+#include "miu/matchindex.h"
+#include "miu/lrucache.h"
+#include "miu/findinfiles.h"
 extern const std::wstring APP_VERSION;
 extern const std::wstring APP_TITLE;
 enum MiuEncoding {
@@ -35,13 +43,15 @@ std::string WToUTF8(const std::wstring& w);
 std::wstring UTF8ToW(const std::string& s);
 std::string Utf16ToUtf8(const char* data, size_t len, bool isBigEndian);
 Encoding DetectEncoding(const char* buf, size_t len);
+DetectResult DetectEncodingEx(const char* buf, size_t len);
 std::string ConvertCase(const std::string& s, bool toUpper);
 struct Piece { bool isOriginal; size_t start; size_t len; };
 struct PieceTable {
     const char* origPtr = nullptr; size_t origSize = 0;
     std::string addBuf; std::vector<Piece> pieces;
-    void initFromFile(const char* data, size_t size) { origPtr = data; origSize = size; pieces.clear(); addBuf.clear(); if (size > 0) pieces.push_back({ true, 0, size }); }
-    void initEmpty() { origPtr = nullptr; origSize = 0; pieces.clear(); addBuf.clear(); }
+    miu::ChangeLog changes; // 文書の版と直近の変更 (検索結果の索引が差分だけ更新するのに使う)
+    void initFromFile(const char* data, size_t size) { origPtr = data; origSize = size; pieces.clear(); addBuf.clear(); if (size > 0) pieces.push_back({ true, 0, size }); changes.reset(); }
+    void initEmpty() { origPtr = nullptr; origSize = 0; pieces.clear(); addBuf.clear(); changes.reset(); }
     size_t length() const { size_t s = 0; for (auto& p : pieces) s += p.len; return s; }
     std::string getRange(size_t pos, size_t count) const {
         std::string out; out.reserve(std::min(count, (size_t)4096));
@@ -65,6 +75,19 @@ struct PieceTable {
         }
         return ' ';
     }
+    // pos を含むピース全体を返す。idx/at (ピース番号とその開始位置) は前回の位置から前後にたどる
+    std::string_view pieceAt(size_t pos, size_t& idx, size_t& at) const {
+        if (idx >= pieces.size()) { idx = 0; at = 0; }
+        while (idx > 0 && at > pos) { idx--; at -= pieces[idx].len; }
+        while (idx < pieces.size() && at + pieces[idx].len <= pos) { at += pieces[idx].len; idx++; }
+        if (idx >= pieces.size()) return {};
+        const Piece& p = pieces[idx]; return std::string_view(p.isOriginal ? origPtr + p.start : addBuf.data() + p.start, p.len);
+    }
+    std::string_view spanAt(size_t pos, size_t& idx, size_t& at) const { std::string_view v = pieceAt(pos, idx, at); return v.empty() ? v : v.substr(pos - at); }
+    // miu::LiteralSearcher 用: pos を含むピース全体とその開始位置を返す関数
+    auto pieceReader() const { return [this, idx = (size_t)0, at = (size_t)0](size_t pos, size_t& start) mutable { std::string_view v = pieceAt(pos, idx, at); start = at; return v; }; }
+    // 文書全体をコピーせずにピース単位で読む関数 (miu::Regex の断片入力)
+    miu::RegexSpanFn spanReader() const { return [this, idx = (size_t)0, at = (size_t)0](size_t pos) mutable { return spanAt(pos, idx, at); }; }
     void insert(size_t pos, const std::string& s) {
         if (s.empty()) return;
         size_t cur = 0, idx = 0;
@@ -79,6 +102,7 @@ struct PieceTable {
         }
         size_t addStart = addBuf.size(); addBuf.append(s);
         pieces.insert(pieces.begin() + idx, { false, addStart, (size_t)s.size() });
+        changes.record(pos, 0, s.size());
     }
     void erase(size_t pos, size_t count) {
         if (count == 0) return;
@@ -96,9 +120,41 @@ struct PieceTable {
             if (pieces[idx].len <= remaining) { remaining -= pieces[idx].len; pieces.erase(pieces.begin() + idx); }
             else { pieces[idx].start += remaining; pieces[idx].len -= remaining; remaining = 0; }
         }
+        if (remaining < count) changes.record(pos, count - remaining, 0);
+    }
+    // 全置換用: 昇順で重ならない範囲をまとめて置き換え、ピース列を 1 回の走査で作り直す。置き換える前のピース列を返し、change に変わった範囲を入れる。
+    // 同じ string を指す置換文字列は追加バッファに 1 度だけ書き、ピースはそれを共有する
+    struct RangeEdit { size_t pos, len; const std::string* text; };
+    std::vector<Piece> replaceRanges(const std::vector<RangeEdit>& edits, miu::TextChange& change) {
+        std::vector<Piece> next; next.reserve(pieces.size() + edits.size() * 2);
+        size_t idx = 0, off = 0, cur = 0; // 元の文書で次に読む位置 (ピース番号とその中の位置)
+        auto emit = [&](const Piece& p) {
+            if (p.len == 0) return;
+            if (!next.empty() && next.back().isOriginal == p.isOriginal && next.back().start + next.back().len == p.start) next.back().len += p.len; else next.push_back(p);
+        };
+        auto advance = [&](size_t to, bool keep) {
+            while (cur < to && idx < pieces.size()) {
+                const Piece& p = pieces[idx]; size_t take = std::min(p.len - off, to - cur);
+                if (keep) emit({ p.isOriginal, p.start + off, take });
+                cur += take; off += take; if (off == p.len) { ++idx; off = 0; }
+            }
+        };
+        const std::string* lastText = nullptr; size_t lastStart = 0, removed = 0, inserted = 0;
+        for (const auto& e : edits) {
+            advance(e.pos, true); advance(e.pos + e.len, false); removed += e.len; inserted += e.text->size();
+            if (e.text != lastText) { lastText = e.text; lastStart = addBuf.size(); addBuf.append(*e.text); }
+            emit({ false, lastStart, e.text->size() });
+        }
+        advance(std::string::npos, true);
+        change = miu::TextChange();
+        if (!edits.empty()) { change.pos = edits.front().pos; change.removed = edits.back().pos + edits.back().len - change.pos; change.inserted = change.removed - removed + inserted; }
+        swapPieces(next, change); return next;
     }
+    // ピース列を other と入れ替え、変わった範囲を記録する (元に戻すときは change の removed と inserted を逆にして渡す)
+    void swapPieces(std::vector<Piece>& other, const miu::TextChange& change) { pieces.swap(other); changes.record(change.pos, change.removed, change.inserted); }
 };
 struct Cursor {
+    static constexpr float kUnresolvedX = -1.0f; // desiredX / originalAnchorX をまだ求めていない (Editor::resolveCursorX で求める)
     size_t head, anchor;
     float desiredX;
     float originalAnchorX;
@@ -107,7 +163,40 @@ struct Cursor {
     size_t end() const { return std::max(head, anchor); }
     bool hasSelection() const { return head != anchor; }
 };
-struct EditOp { enum Type { Insert, Erase } type; size_t pos; std::string text; };
+// 行 line の x1 から x2 までを塗る (一致のハイライトなど)
+struct LineSpan { int line; float x1, x2; };
+// 1 行のレイアウト。Apple では改行を除いた行の文字列を組んだ CTLine を持つ (組めなかったら null)
+struct LineLayout {
+#if defined(__APPLE__)
+    CTLineRef line = nullptr;
+    LineLayout() = default;
+    explicit LineLayout(CTLineRef l) : line(l) {}
+    LineLayout(LineLayout&& o) noexcept : line(o.line) { o.line = nullptr; }
+    LineLayout(const LineLayout&) = delete; LineLayout& operator=(const LineLayout&) = delete; LineLayout& operator=(LineLayout&&) = delete;
+    ~LineLayout() { if (line) CFRelease(line); }
+#endif
+};
+// 行番号 1 つのレイアウトと幅 (右寄せに使う)
+struct GutterLabel { LineLayout layout; float width = 0.0f; };
+// 自動ハイライト (カーソルのある単語と同じ語) のキャッシュ。対象の語は文書の版かカーソルが変わったときだけ求め直し、
+// 塗る範囲は [first, end) 行の分を行の順に持つ。スクロールしたら新しく見えた行だけを求める
+struct AutoHighlightCache {
+    uint64_t version = UINT64_MAX; size_t head = 0, anchor = 0, cursorCount = 0; // 対象の語を求めたときの版とカーソル
+    std::string target; bool wholeWord = false;
+    float charWidth = 0.0f; std::string ime; int first = 0, end = 0; std::vector<LineSpan> spans;
+};
+// ビューの座標の矩形 (描き直す範囲)
+struct DirtyRect { float x, y, w, h; bool operator==(const DirtyRect& o) const { return x == o.x && y == o.y && w == o.w && h == o.h; } };
+// 前回描いたときの状態。次に描く前に今の状態と比べ、変わった所だけを描き直す範囲にする。
+// marks はカーソル・選択・自動ハイライトを描いた矩形で、前回と今回で違うものだけを描き直す
+struct RenderSnapshot {
+    bool valid = false; float w = 0, h = 0; int vScroll = 0, hScroll = 0, first = 0, end = 0;
+    float fontSize = 0, gutterWidth = 0; size_t lineCount = 0; uint64_t version = 0;
+    std::string ime, search; bool overlay = false; const void* theme = nullptr;
+    std::vector<DirtyRect> marks;
+};
+// Pieces はピース列をまとめて入れ替える編集 (全置換)。pieces はもう一方の側のピース列で、元に戻す・やり直すたびに文書のピース列と交換する
+struct EditOp { enum Type { Insert, Erase, Pieces } type; size_t pos; std::string text; std::shared_ptr<std::vector<Piece>> pieces = nullptr; miu::TextChange change = {}; };
 struct EditBatch { std::vector<EditOp> ops; std::vector<Cursor> beforeCursors, afterCursors; };
 struct UndoManager {
     std::vector<EditBatch> undoStack, redoStack; int savePoint = 0;
@@ -118,10 +207,63 @@ struct UndoManager {
     EditBatch popUndo() { EditBatch e = undoStack.back(); undoStack.pop_back(); redoStack.push_back(e); return e; }
     EditBatch popRedo() { EditBatch e = redoStack.back(); redoStack.pop_back(); undoStack.push_back(e); return e; }
 };
+// 編集コマンドのトレース (1 行 1 コマンド、タブ区切り)。bench/miu_replay で再生できる。
+struct EditTrace {
+    static constexpr double kFlushIntervalMs = 1000.0; // 書いた行はこの間隔でまとめてファイルへ出す (1 キーごとには出さない)
+    std::ofstream out; bool active = false; int depth = 0;
+    std::chrono::steady_clock::time_point t0; double lastFlushMs = 0.0;
+    std::string lastCursors, lastSearch;
+    bool start(const std::string& path);
+    void stop();
+    void write(const char* cmd, std::initializer_list<std::string_view> args);
+    static std::string escape(std::string_view s);
+    static std::vector<std::string> parseLine(const std::string& line);
+};
+// 閾値を超えた操作だけを 1 行 1 JSON で追記する (opt-in)
+struct SlowOpLog {
+    static constexpr int kFlushIntervalMs = 1000; // 書いた行はこの間隔でまとめてファイルへ出す
+    std::ofstream out; bool active = false; double thresholdMs = 50.0; long long lastFlush = 0;
+    bool start(const std::string& path, double threshold);
+    void stop();
+    void write(const char* op, double ms, size_t docBytes, size_t pieces, size_t lines, size_t cursors);
+};
+// 描画 1 フレームを処理段階ごとに計測する。入れ子の区間は親から差し引いた排他時間で集計する。
+struct FrameProfiler {
+    enum Phase { TextFetch, RegexHighlight, AutoHighlight, Layout, Gutter, Selection, Submit, Frame, PhaseCount };
+    struct Event { int phase; int64_t startUs, durUs; };
+    struct Scope { FrameProfiler& p; Scope(FrameProfiler& fp, Phase ph) : p(fp) { p.push(ph); } ~Scope() { p.pop(); } };
+    static constexpr int kHistory = 120, kMaxDepth = 16;
+    static const char* phaseName(int phase);
+    bool showOverlay = false, recording = false;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    double phaseUs[PhaseCount] = {};
+    double history[kHistory][PhaseCount] = {}; int historyCount = 0, historyPos = 0;
+    std::chrono::steady_clock::time_point stackStart[kMaxDepth]; int stackPhase[kMaxDepth] = {}; double stackChildUs[kMaxDepth] = {}; int depth = 0;
+    std::vector<Event> events; size_t maxEvents = 1 << 20;
+    void beginFrame();
+    void endFrame();
+    void push(Phase phase);
+    void pop();
+    std::vector<std::string> overlayLines() const;
+    bool exportChromeTrace(const std::string& path) const;
+};
+// 主要データ構造の使用バイト数 (容量ベース)。originalMapped は仮想サイズで total には含めない。
+struct MemoryStats {
+    size_t pieceList = 0, addBuffer = 0, originalMapped = 0, originalResident = 0, fileBuffer = 0;
+    size_t lineIndex = 0, undoStack = 0, redoStack = 0, profiler = 0;
+    size_t searchIndex = 0, searchSnapshot = 0, autoHighlight = 0, layoutCache = 0, gutterCache = 0; // 検索の索引 (自動ハイライトの分を含む)、別のスレッドが読む文書の写し、キャッシュ
+    std::vector<std::pair<const char*, size_t>> entries() const;
+    size_t total() const;
+    std::string toJson() const;
+    std::vector<std::string> summaryLines() const;
+};
 struct MappedFile {
+    static constexpr int kResidentRefreshMs = 1000; // residentBytes() はページを全部調べるので、この間隔より頻繁には調べ直さない
     int fd = -1; char* ptr = nullptr; size_t size = 0;
+    mutable size_t residentCache = 0; mutable std::chrono::steady_clock::time_point residentAt;
     bool open(const char* path);
     void close();
+    size_t residentBytes() const;
     ~MappedFile() { close(); }
 };
 struct Editor {
@@ -140,12 +282,30 @@ struct Editor {
     bool searchWholeWord = false;
     bool searchRegex = false;
     bool isReplaceMode = false;
+    miu::Regex cachedRegex;
+    miu::MatchIndex searchIndex, autoIndex; // 検索語と自動ハイライトの一致の索引
+    AutoHighlightCache autoHighlight;
+    std::vector<size_t> visibleCursors;     // 描画中、見えている行に掛かるカーソルの添字
+    static constexpr size_t kMaxDirtyRects = 64; // 描き直す所がこれより多ければ全体を描き直す
+    RenderSnapshot lastRender;              // 前回の render の状態 (collectDamage が比べる)
+    miu::IndexBuilder searchBuilder;        // 検索語を打っている間、別のスレッドで searchIndex を作る
+    std::weak_ptr<const PieceTable> searchSnapshot; // searchBuilder が読んでいる文書の写し (メモリの集計用)
+    size_t searchAnchor = 0;                // 検索語を打ち始めたときのカーソル位置 (ここから後の最初の一致を選ぶ)
+    bool searchRevealPending = false;       // 最初の一致をまだ選んでいない
+    miu::FolderSearch folderSearch;         // フォルダ内検索 (ワーカースレッドでファイルを読んで探す)
+    std::vector<miu::FileMatch> folderMatches; // フォルダ内検索で見つかり、UI のスレッドに取り込んだ一致
+    size_t regexStepBudget = 500000000;   // 検索・置換で VM が実行するステップ数の上限
+    int regexTimeLimitMs = 100;           // 次を検索で正規表現を照合する時間の上限 (UI のスレッドを止めない)
+    int bulkRegexTimeLimitMs = 2000;      // すべて置換などで文書全体を正規表現で探す時間の上限
+    bool searchTimedOut = false;          // 直前の正規表現の検索が時間の上限で打ち切られた (検索パネルに表示する)
+    size_t highlightStepBudget = 5000000; // 描画時のハイライト 1 回あたりの上限
     std::chrono::steady_clock::time_point zoomPopupEndTime;
     std::string zoomPopupText = "";
     float currentFontSize = 14.0f;
     float lineHeight = 18.0f;
     float charWidth = 8.0f;
     float tabWidth = 32.0f;
+    bool monospaceFont = false; // 等幅フォントなら、表示できる ASCII とタブだけの行の x 座標はレイアウトせずに計算する
     float gutterWidth = 40.0f;
     float maxLineWidth = 100.0f;
     int vScrollPos = 0, hScrollPos = 0;
@@ -160,6 +320,10 @@ struct Editor {
     CTFontRef fontRef = nullptr;
     CTParagraphStyleRef paragraphStyle = nullptr;
 #endif
+    static constexpr size_t kLayoutCacheLines = 1024, kLayoutCacheTextBytes = 4 << 20; // レイアウトの大きさは行の長さに比例するので、行の文字列の合計でも抑える
+    miu::LruCache<LineLayout> layoutCache{ kLayoutCacheLines, kLayoutCacheTextBytes }; // 行の文字列ごとのレイアウト (位置と x 座標の変換と描画で共有する)
+    static constexpr size_t kGutterCacheLabels = 512;
+    miu::LruCache<GutterLabel> gutterCache{ kGutterCacheLabels }; // 行番号ごとのレイアウト (フォントか色が変わったら捨てる)
     std::wstring helpTextStr;
     std::wstring appVersionStr;
     std::string currentFileBuffer;
@@ -174,6 +338,18 @@ struct Editor {
     std::function<bool()> cbShowUnsavedAlert;
     std::function<bool()> cbSaveFileAs;
     std::function<bool()> cbOpenFile;
+    std::function<void()> cbSearchProgress; // 別のスレッドの検索が進んだ。検索のスレッドから呼ばれるので、UI のスレッドで applySearchProgress() を呼ぶ
+    std::function<void()> cbFolderSearchProgress; // フォルダ内検索が進んだか終わった。探しているスレッドから呼ばれるので、UI のスレッドで applyFolderSearchProgress() を呼ぶ
+    EditTrace trace;
+    FrameProfiler profiler;
+    SlowOpLog slowLog;
+    bool startTrace(const std::string& path);
+    void stopTrace();
+    bool startSlowLog(const std::string& path, double thresholdMs);
+    void stopSlowLog();
+    void noteSlowOp(const char* op, double ms);
+    void traceSync();
+    MemoryStats memoryStats() const;
     void detectNewlineStyle(const char* buf, size_t len);
     void insertAtCursorsWithPadding(const std::string& text);
     void insertNewlineWithAutoIndent();
@@ -187,19 +363,48 @@ struct Editor {
     void updateGutterWidth();
     void updateMaxLineWidth();
     std::pair<std::string, bool> getHighlightTarget();
-    std::string preprocessRegexQuery(const std::string& query);
+    const AutoHighlightCache& updateAutoHighlight(int firstLine, int endLine);
+    void matchSpans(size_t pos, size_t len, int lineFrom, int lineTo, std::vector<LineSpan>& out);
+    const miu::Regex& compileSearchRegex(const std::string& query, bool matchCase);
     std::string UnescapeString(const std::string& s, const std::string& newline);
     size_t findText(size_t startPos, const std::string& query, bool forward, bool matchCase, bool wholeWord, bool isRegex, size_t* outLen = nullptr);
+    std::vector<miu::SearchHit> findAll(const std::string& query, bool matchCase, bool wholeWord, bool isRegex, bool* complete = nullptr);
+    bool collectRegexMatches(const miu::Regex& re, const std::function<miu::RegexSpanFn()>& source, size_t len, size_t limit, std::vector<miu::RegexMatch>& out);
+    size_t alignToCharStart(size_t pos);
+    size_t nextSearchStart(const miu::SearchHit& h);
+    const miu::MatchIndex* matchIndex(miu::MatchIndex& idx, const std::string& query, bool matchCase, bool wholeWord, bool isRegex);
+    const miu::MatchIndex* searchMatchIndex();
+    const miu::MatchIndex* searchMatchIndexNow();
+    void startSearchBuild();
+    void searchQueryChanged();
+    bool applySearchProgress();
+    bool searchMatchStatus(size_t& current, size_t& total, bool* partial = nullptr);
+    bool startFolderSearch(const std::string& root);
+    void stopFolderSearch();
+    bool applyFolderSearchProgress();
+    bool openFolderMatch(size_t index);
     void findNext(bool forward);
     void replaceNext();
     void replaceAll();
     void selectNextOccurrence();
+    void selectAllOccurrences();
+    void resolveCursorX(Cursor& c);
+    void visibleCursorIndices(size_t from, size_t to, std::vector<size_t>& out) const;
+    void visibleLineRange(float h, int& first, int& end) const;
+    RenderSnapshot renderState(float w, float h);
+    RenderSnapshot renderSnapshot(float w, float h);
+    bool collectDamage(float w, float h, std::vector<DirtyRect>& out);
     void updateTitleBar();
     void updateScrollBars();
     void updateDirtyFlag();
     void updateFont(float s);
     void rebuildLineStarts();
     int getLineIdx(size_t pos);
+    const LineLayout& layoutFor(const std::string& text);
+    const GutterLabel& gutterLabel(int number);
+    bool isAsciiMonospaceLine(const std::string& text) const;
+    float asciiX(const std::string& text, size_t bytes) const;
+    size_t asciiPosForX(const std::string& text, float tx) const;
     float getXInLine(int li, size_t pos);
     float getXFromPos(size_t p);
     size_t getPosFromLineAndX(int li, float tx);
@@ -223,8 +428,9 @@ struct Editor {
     bool openFileFromPath(const std::string& p);
     bool openFile();
     void newFile();
-    bool isWordChar(char c);
+    static bool isWordChar(char c);
     void getWordBoundaries(size_t pos, size_t& start, size_t& end);
+    void wordAtCaret(size_t pos, size_t& start, size_t& end);
     void initGraphics();
     void updateThemeColors();
     size_t countUTF16Length(size_t start, size_t byteLen);
@@ -1,7 +1,7 @@
 #import <Cocoa/Cocoa.h>
 #import "EditorCore.h"
 static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular";
-@interface EditorView : NSView <NSTextInputClient, NSTextFieldDelegate>
+@interface EditorView : NSView <NSTextInputClient, NSTextFieldDelegate, NSTableViewDataSource, NSTableViewDelegate>
 {
 @public
     std::shared_ptr<Editor> editor;
@@ -16,16 +16,25 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     NSButton *matchCaseBtn;
     NSButton *wholeWordBtn;
     NSButton *regexBtn;
+    NSTextField *matchCountLabel;
+    NSButton *folderBtn;
+    NSScrollView *folderResultsScroll;
+    NSTableView *folderResultsTable;
 }
 - (void)updateScrollers;
+- (void)invalidateEditor;
 - (void)applyZoom:(float)val relative:(bool)rel;
 - (void)showFindPanel:(BOOL)replaceMode;
 - (void)updateFindQueries;
+- (void)updateMatchCountLabel;
 - (void)findNextWithDirection:(BOOL)forward;
 - (BOOL)isReplaceMode;
 - (void)findNextAction:(id)sender;
 - (void)replaceAction:(id)sender;
 - (void)replaceAllAction:(id)sender;
+- (void)findInFolderAction:(id)sender;
+- (void)updateFolderResults;
+- (void)layoutFindPanel;
 - (void)showGoToLinePanel;
 - (void)jumpToLine:(NSInteger)line;
 @end
@@ -88,13 +97,27 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         __weak EditorView* weakSelf = self;
         editor->cbNeedsDisplay = [weakSelf]() {
             __strong EditorView *strongSelf = weakSelf;
-            if (strongSelf) [strongSelf setNeedsDisplay:YES];
+            if (strongSelf) [strongSelf invalidateEditor];
         };
         editor->cbUpdateScrollers = [weakSelf]() {
             __strong EditorView *strongSelf = weakSelf;
             if (strongSelf) [strongSelf updateScrollers];
         };
         editor->cbBeep = []() { NSBeep(); };
+        // 検索のスレッドから呼ばれるので、メインスレッドで進み具合を取り込む
+        editor->cbSearchProgress = [weakSelf]() {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                __strong EditorView *strongSelf = weakSelf;
+                if (strongSelf && strongSelf->editor) { strongSelf->editor->applySearchProgress(); [strongSelf setNeedsDisplay:YES]; }
+            });
+        };
+        // フォルダ内検索も別のスレッドから呼ばれる。見つかった一致を取り込んで一覧を更新する
+        editor->cbFolderSearchProgress = [weakSelf]() {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                __strong EditorView *strongSelf = weakSelf;
+                if (strongSelf && strongSelf->editor) { strongSelf->editor->applyFolderSearchProgress(); [strongSelf updateFolderResults]; }
+            });
+        };
         editor->cbGetViewSize = [weakSelf](float& w, float& h) {
             __strong EditorView *strongSelf = weakSelf;
             if (strongSelf) {
@@ -173,6 +196,8 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         [hScroller setAutoresizingMask:NSViewWidthSizable|NSViewMinYMargin];
         [hScroller setTarget:self]; [hScroller setAction:@selector(scrollAction:)]; [self addSubview:hScroller];
         [self registerForDraggedTypes:@[NSPasteboardTypeFileURL]];
+        if (const char* tracePath = getenv("MIU_TRACE")) editor->startTrace(tracePath);
+        if (const char* slowPath = getenv("MIU_SLOW_LOG")) { const char* ms = getenv("MIU_SLOW_MS"); editor->startSlowLog(slowPath, ms ? atof(ms) : 50.0); }
         [[NSNotificationCenter defaultCenter] addObserver:self
                                                          selector:@selector(systemColorsDidChange:)
                                                              name:NSSystemColorsDidChangeNotification
@@ -207,6 +232,10 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         [replaceTextField setDelegate:nil];
         [replaceTextField setTarget:nil];
     }
+    if (folderResultsTable) {
+        [folderResultsTable setDataSource:nil];
+        [folderResultsTable setDelegate:nil];
+    }
 }
 - (void)systemColorsDidChange:(NSNotification *)notification {
     [self applySystemHighlightColor];
@@ -263,19 +292,26 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         }
     }
 }
+// 前回描いたときから変わった所だけを描き直す (全体が変わったときは全体)
+- (void)invalidateEditor {
+    std::vector<DirtyRect> rects;
+    if (!editor || editor->collectDamage((float)self.bounds.size.width, (float)self.bounds.size.height, rects)) { [self setNeedsDisplay:YES]; return; }
+    for (const auto& d : rects) [self setNeedsDisplayInRect:NSMakeRect(d.x, d.y, d.w, d.h)];
+}
 - (void)drawRect:(NSRect)r {
     editor->render([[NSGraphicsContext currentContext] CGContext], (float)self.bounds.size.width, (float)self.bounds.size.height);
+    [self updateMatchCountLabel];
 }
 - (void)undo:(id)sender {
     if (editor) {
         editor->performUndo();
-        [self setNeedsDisplay:YES];
+        [self invalidateEditor];
     }
 }
 - (void)redo:(id)sender {
     if (editor) {
         editor->performRedo();
-        [self setNeedsDisplay:YES];
+        [self invalidateEditor];
     }
 }
 - (void)updateScrollers {
@@ -309,7 +345,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     [hScroller setKnobProportion:std::min(1.0, (double)visibleWidth / maxLineWidth)];
     float maxH = maxLineWidth - visibleWidth;
     if (needsH && maxH > 0) { [hScroller setDoubleValue:(double)editor->hScrollPos / maxH]; [hScroller setEnabled:YES]; } else { [hScroller setDoubleValue:0.0]; [hScroller setEnabled:NO]; editor->hScrollPos = 0; }
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
 - (void)scrollAction:(NSScroller*)s {
     NSRect b = [self bounds]; CGFloat sw = [NSScroller scrollerWidthForControlSize:NSControlSizeRegular scrollerStyle:NSScrollerStyleLegacy];
@@ -320,16 +356,16 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         float visibleWidth = b.size.width - editor->gutterWidth - sw; float maxH = editor->maxLineWidth - visibleWidth;
         editor->hScrollPos = std::max(0, (int)([s doubleValue] * maxH));
     }
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
 - (void)applyZoom:(float)val relative:(bool)rel {
     editor->updateFont(rel ? editor->currentFontSize * val : val);
     editor->zoomPopupEndTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
     editor->zoomPopupText = std::to_string((int)std::round(editor->currentFontSize)) + "px";
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
 - (void)mouseDown:(NSEvent *)e {
-    if (editor->showHelpPopup) { editor->showHelpPopup = false; [self setNeedsDisplay:YES]; }
+    if (editor->showHelpPopup) { editor->showHelpPopup = false; [self invalidateEditor]; }
     [[self window] makeFirstResponder:self];
     NSPoint p = [self convertPoint:[e locationInWindow] fromView:nil];
     if (p.x > self.bounds.size.width - editor->visibleVScrollWidth || p.y > self.bounds.size.height - editor->visibleHScrollHeight) return;
@@ -358,7 +394,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         newCursor.head = end; newCursor.anchor = s; newCursor.desiredX = editor->getXInLine(editor->getLineIdx(end), end); newCursor.originalAnchorX = newCursor.desiredX; newCursor.isVirtual = false;
         editor->cursors.push_back(newCursor);
     } else { editor->cursors.push_back(newCursor); }
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
 - (void)mouseDragged:(NSEvent *)e {
     NSPoint p = [self convertPoint:[e locationInWindow] fromView:nil];
@@ -384,9 +420,9 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         size_t pos = editor->getDocPosFromPoint((float)p.x, (float)p.y);
         if (!editor->cursors.empty()) { Cursor& c = editor->cursors.back(); c.head = pos; int li = editor->getLineIdx(pos); c.desiredX = editor->getXInLine(li, pos); c.isVirtual = false; }
     }
-    editor->ensureCaretVisible(); [self setNeedsDisplay:YES];
+    editor->ensureCaretVisible(); [self invalidateEditor];
 }
-- (void)mouseUp:(NSEvent *)e { [self setNeedsDisplay:YES]; }
+- (void)mouseUp:(NSEvent *)e { [self invalidateEditor]; }
 - (void)showFindPanel:(BOOL)replaceMode {
     editor->isReplaceMode = replaceMode;
     auto [candidate, _] = editor->getHighlightTarget();
@@ -425,6 +461,10 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         [cv addSubview:wholeWordBtn];
         regexBtn = [NSButton checkboxWithTitle:NSLocalizedString(@"Regex", @"正規表現") target:self action:@selector(findOptionsChanged:)];
         [cv addSubview:regexBtn];
+        matchCountLabel = [NSTextField labelWithString:@""];
+        [matchCountLabel setFont:[NSFont systemFontOfSize:11]];
+        [matchCountLabel setTextColor:[NSColor secondaryLabelColor]];
+        [cv addSubview:matchCountLabel];
         findBtn = [NSButton buttonWithTitle:NSLocalizedString(@"Find Next", @"次を検索") target:self action:@selector(findNextAction:)];
         [findBtn setKeyEquivalent:@"\r"];
         [findBtn setToolTip:NSLocalizedString(@"Find Next (F3)", @"次を検索のツールチップ")];
@@ -439,6 +479,24 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         [replaceAllBtn setKeyEquivalentModifierMask:NSEventModifierFlagCommand | NSEventModifierFlagOption];
         [replaceAllBtn setToolTip:NSLocalizedString(@"Replace All (⌥⌘R)", @"すべて置換のツールチップ")];
         [cv addSubview:replaceAllBtn];
+        folderBtn = [NSButton buttonWithTitle:NSLocalizedString(@"Find in Folder…", @"フォルダ内を検索") target:self action:@selector(findInFolderAction:)];
+        [cv addSubview:folderBtn];
+        // フォルダ内検索の結果の一覧 (探し始めるまでは隠しておく)。ダブルクリックでその一致を開く
+        folderResultsTable = [[NSTableView alloc] initWithFrame:NSZeroRect];
+        NSTableColumn *col = [[NSTableColumn alloc] initWithIdentifier:@"match"];
+        [col setResizingMask:NSTableColumnAutoresizingMask];
+        [folderResultsTable addTableColumn:col];
+        [folderResultsTable setColumnAutoresizingStyle:NSTableViewUniformColumnAutoresizingStyle];
+        [folderResultsTable setDataSource:self];
+        [folderResultsTable setDelegate:self];
+        [folderResultsTable setTarget:self];
+        [folderResultsTable setDoubleAction:@selector(openFolderResult:)];
+        folderResultsScroll = [[NSScrollView alloc] initWithFrame:NSZeroRect];
+        [folderResultsScroll setDocumentView:folderResultsTable];
+        [folderResultsScroll setHasVerticalScroller:YES];
+        [folderResultsScroll setBorderType:NSBezelBorder];
+        [folderResultsScroll setHidden:YES];
+        [cv addSubview:folderResultsScroll];
         [matchCaseBtn setState:editor->searchMatchCase ? NSControlStateValueOn : NSControlStateValueOff];
         [wholeWordBtn setState:editor->searchWholeWord ? NSControlStateValueOn : NSControlStateValueOff];
         [regexBtn setState:editor->searchRegex ? NSControlStateValueOn : NSControlStateValueOff];
@@ -448,32 +506,49 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     [replaceTextField setHidden:!replaceMode];
     [replaceBtn setHidden:!replaceMode];
     [replaceAllBtn setHidden:!replaceMode];
-    CGFloat panelHeight = 185;
-    [findPanel setContentSize:NSMakeSize(360, panelHeight)];
-    [findLabel setFrame:NSMakeRect(10, 150, 60, 20)];
-    [findTextField setFrame:NSMakeRect(80, 150, 260, 22)];
-    [replaceLabel setFrame:NSMakeRect(10, 120, 60, 20)];
-    [replaceTextField setFrame:NSMakeRect(80, 120, 260, 22)];
-    [matchCaseBtn setFrame:NSMakeRect(80, 95, 260, 20)];
-    [wholeWordBtn setFrame:NSMakeRect(80, 75, 260, 20)];
-    [regexBtn setFrame:NSMakeRect(80, 55, 260, 20)];
-    [replaceAllBtn setFrame:NSMakeRect(80, 10, 100, 32)];
-    [replaceBtn setFrame:NSMakeRect(180, 10, 80, 32)];
-    [findBtn setFrame:NSMakeRect(260, 10, 90, 32)];
+    [self layoutFindPanel];
     if (!editor->searchQuery.empty()) [findTextField setStringValue:[NSString stringWithUTF8String:editor->searchQuery.c_str()]];
     if (!editor->replaceQuery.empty()) [replaceTextField setStringValue:[NSString stringWithUTF8String:editor->replaceQuery.c_str()]];
     [[self window] addChildWindow:findPanel ordered:NSWindowAbove];
     [findPanel makeKeyAndOrderFront:nil];
     [findPanel makeFirstResponder:findTextField];
+    [self updateMatchCountLabel];
+}
+// 検索パネルの部品を並べる。フォルダ内検索の結果があれば、その一覧の分だけ下に広げる
+- (void)layoutFindPanel {
+    CGFloat list = [folderResultsScroll isHidden] ? 0 : 200, panelHeight = 185 + list;
+    [findPanel setContentSize:NSMakeSize(360, panelHeight)];
+    [findLabel setFrame:NSMakeRect(10, list + 150, 60, 20)];
+    [findTextField setFrame:NSMakeRect(80, list + 150, 260, 22)];
+    [replaceLabel setFrame:NSMakeRect(10, list + 120, 60, 20)];
+    [replaceTextField setFrame:NSMakeRect(80, list + 120, 260, 22)];
+    [matchCaseBtn setFrame:NSMakeRect(80, list + 95, 140, 20)];
+    [wholeWordBtn setFrame:NSMakeRect(80, list + 75, 140, 20)];
+    [regexBtn setFrame:NSMakeRect(80, list + 55, 140, 20)];
+    [folderBtn setFrame:NSMakeRect(220, list + 70, 130, 32)];
+    [matchCountLabel setFrame:NSMakeRect(10, list + 16, 68, 20)];
+    [replaceAllBtn setFrame:NSMakeRect(80, list + 10, 100, 32)];
+    [replaceBtn setFrame:NSMakeRect(180, list + 10, 80, 32)];
+    [findBtn setFrame:NSMakeRect(260, list + 10, 90, 32)];
+    [folderResultsScroll setFrame:NSMakeRect(10, 10, 340, list > 0 ? list - 5 : 0)];
 }
 - (void)updateFindQueries {
     editor->searchQuery = [[findTextField stringValue] UTF8String];
     editor->replaceQuery = [[replaceTextField stringValue] UTF8String];
 }
+// 検索パネルに一致の件数と、選択中の一致が何番目かを表示する (件数は検索の索引から取り出す)。正規表現の検索が時間の上限で打ち切られたらそれを表示する
+- (void)updateMatchCountLabel {
+    if (!findPanel || ![findPanel isVisible]) return;
+    size_t current = 0, total = 0; bool partial = false; NSString *s = @"";
+    if (editor->searchTimedOut) s = NSLocalizedString(@"Too slow", @"時間切れ");
+    else if (!editor->searchQuery.empty() && editor->searchMatchStatus(current, total, &partial)) s = partial ? [NSString stringWithFormat:@"%zu…", total] : current ? [NSString stringWithFormat:@"%zu / %zu", current, total] : [NSString stringWithFormat:@"%zu", total];
+    [matchCountLabel setStringValue:s];
+}
 - (void)controlTextDidChange:(NSNotification *)obj {
     if ([obj object] == findTextField || [obj object] == replaceTextField) {
         [self updateFindQueries];
-        [self setNeedsDisplay:YES];
+        if ([obj object] == findTextField) editor->searchQueryChanged();
+        [self invalidateEditor];
     }
 }
 - (BOOL)control:(NSControl *)control textView:(NSTextView *)textView doCommandBySelector:(SEL)commandSelector {
@@ -490,7 +565,8 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     editor->searchMatchCase = ([matchCaseBtn state] == NSControlStateValueOn);
     editor->searchWholeWord = ([wholeWordBtn state] == NSControlStateValueOn);
     editor->searchRegex = ([regexBtn state] == NSControlStateValueOn);
-    [self setNeedsDisplay:YES];
+    editor->searchQueryChanged();
+    [self invalidateEditor];
 }
 - (void)findNextWithDirection:(BOOL)forward {
     if (editor) {
@@ -498,6 +574,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
             [self showFindPanel:NO];
         } else {
             editor->findNext(forward);
+            [self updateMatchCountLabel];
         }
     }
 }
@@ -507,9 +584,43 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     }
     return NO;
 }
-- (void)findNextAction:(id)sender { [self updateFindQueries]; editor->findNext(true); }
+- (void)findNextAction:(id)sender { [self updateFindQueries]; editor->findNext(true); [self updateMatchCountLabel]; }
 - (void)replaceAction:(id)sender { [self updateFindQueries]; editor->replaceNext(); }
-- (void)replaceAllAction:(id)sender { [self updateFindQueries]; editor->replaceAll(); }
+- (void)replaceAllAction:(id)sender { [self updateFindQueries]; editor->replaceAll(); [self updateMatchCountLabel]; }
+// 選んだフォルダ以下のファイルを今の検索条件で探す。見つかった一致は cbFolderSearchProgress のたびに一覧に加わる
+- (void)findInFolderAction:(id)sender {
+    [self updateFindQueries];
+    if (editor->searchQuery.empty()) { NSBeep(); return; }
+    NSOpenPanel *p = [NSOpenPanel openPanel];
+    [p setCanChooseFiles:NO]; [p setCanChooseDirectories:YES]; [p setAllowsMultipleSelection:NO];
+    if ([p runModal] != NSModalResponseOK) return;
+    if (!editor->startFolderSearch([[[p URLs] objectAtIndex:0].path UTF8String])) { NSBeep(); return; }
+    if ([folderResultsScroll isHidden]) { [folderResultsScroll setHidden:NO]; [self layoutFindPanel]; }
+    [self updateFolderResults];
+}
+// 一覧の見出しに件数と、探している途中か打ち切ったかを出す
+- (void)updateFolderResults {
+    if (!folderResultsTable) return;
+    miu::FolderSearch::Progress p = editor->folderSearch.progress();
+    NSString *fmt = !p.done ? NSLocalizedString(@"Searching… %lu match(es)", @"フォルダ内検索中の件数") : p.truncated ? NSLocalizedString(@"%lu match(es) (stopped)", @"フォルダ内検索を打ち切ったときの件数") : NSLocalizedString(@"%lu match(es)", @"フォルダ内検索の件数");
+    [[[folderResultsTable tableColumns] firstObject] setTitle:[NSString stringWithFormat:fmt, (unsigned long)editor->folderMatches.size()]];
+    [[folderResultsTable headerView] setNeedsDisplay:YES];
+    [folderResultsTable reloadData];
+}
+- (void)openFolderResult:(id)sender {
+    NSInteger row = [folderResultsTable clickedRow];
+    if (row < 0 || !editor->openFolderMatch((size_t)row)) return;
+    [self updateScrollers]; [self invalidateEditor];
+}
+- (NSInteger)numberOfRowsInTableView:(NSTableView *)tableView { return editor ? (NSInteger)editor->folderMatches.size() : 0; }
+// 1 行に「ファイル名:行番号: 一致を含む行の一部」を出す
+- (id)tableView:(NSTableView *)tableView objectValueForTableColumn:(NSTableColumn *)tableColumn row:(NSInteger)row {
+    if (!editor || row < 0 || (size_t)row >= editor->folderMatches.size()) return @"";
+    const miu::FileMatch& m = editor->folderMatches[(size_t)row];
+    NSString *name = [[NSString stringWithUTF8String:m.path.c_str()] lastPathComponent];
+    NSString *preview = [[NSString alloc] initWithBytes:m.preview.data() length:m.preview.size() encoding:NSUTF8StringEncoding];
+    return [NSString stringWithFormat:@"%@:%zu: %@", name ?: @"", m.line + 1, preview ?: @""];
+}
 - (void)jumpToLine:(NSInteger)line {
     if (!editor) return;
     if (line < 1) line = 1;
@@ -526,7 +637,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     c.isVirtual = false;
     editor->cursors.push_back(c);
     editor->ensureCaretVisible();
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
 - (void)showGoToLinePanel {
     if (goToLineWindow && [goToLineWindow isVisible]) return;
@@ -578,15 +689,23 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     bool cmd = ([e modifierFlags] & NSEventModifierFlagCommand);
     bool shift = ([e modifierFlags] & NSEventModifierFlagShift);
     bool ctrl = ([e modifierFlags] & NSEventModifierFlagControl);
-    if (editor->showHelpPopup) { editor->showHelpPopup = false; [self setNeedsDisplay:YES]; if (code == 122) return; }
-    if (code == 122) { editor->showHelpPopup = true; [self setNeedsDisplay:YES]; return; }
-    if (code == 53) { if (editor->cursors.size() > 1 || (editor->cursors.size() == 1 && editor->cursors[0].hasSelection())) { Cursor lastC = editor->cursors.back(); lastC.anchor = lastC.head; editor->cursors.clear(); editor->cursors.push_back(lastC); [self setNeedsDisplay:YES]; return; } }
+    if (editor->showHelpPopup) { editor->showHelpPopup = false; [self invalidateEditor]; if (code == 122) return; }
+    if (code == 122) { editor->showHelpPopup = true; [self invalidateEditor]; return; }
+    if (code == 111) {
+        if (shift) {
+            NSString *tracePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"miu_frame_trace.json"]; if (editor->profiler.exportChromeTrace([tracePath UTF8String])) NSLog(@"frame trace: %@", tracePath);
+            NSLog(@"memory: %s", editor->memoryStats().toJson().c_str());
+        }
+        else { editor->profiler.showOverlay = !editor->profiler.showOverlay; editor->profiler.recording = editor->profiler.showOverlay; }
+        [self invalidateEditor]; return;
+    }
+    if (code == 53) { if (editor->cursors.size() > 1 || (editor->cursors.size() == 1 && editor->cursors[0].hasSelection())) { Cursor lastC = editor->cursors.back(); lastC.anchor = lastC.head; editor->cursors.clear(); editor->cursors.push_back(lastC); [self invalidateEditor]; return; } }
     if (code == 48) {
         if (shift) { editor->unindentLines(); } else {
             bool isRectMode = editor->cursors.size() > 1;
             if (isRectMode) { editor->insertAtCursors("\t"); } else { editor->indentLines(false); }
         }
-        [self setNeedsDisplay:YES];
+        [self invalidateEditor];
         return;
     }
     if (cmd && (code == 126 || code == 115)) {
@@ -614,13 +733,14 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
             if (!shift) { c.anchor = c.head; c.originalAnchorX = c.desiredX; }
             c.isVirtual = false;
         }
-        editor->ensureCaretVisible(); [self setNeedsDisplay:YES]; return;
+        editor->ensureCaretVisible(); [self invalidateEditor]; return;
     }
     if (code == 116 || code == 121) {
         float viewHeight = [self bounds].size.height - editor->visibleHScrollHeight;
         int pageLines = std::max(1, (int)(viewHeight / editor->lineHeight) - 1);
         int totalLines = (int)editor->lineStarts.size();
         for (auto& c : editor->cursors) {
+            editor->resolveCursorX(c);
             int currentLine = editor->getLineIdx(c.head); int newLine = currentLine;
             if (code == 116) { newLine = currentLine - pageLines; if (newLine < 0) newLine = 0; }
             else { newLine = currentLine + pageLines; if (newLine >= totalLines) newLine = totalLines - 1; }
@@ -630,7 +750,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
             c.isVirtual = false;
         }
         if (code == 116) editor->vScrollPos = std::max(0, editor->vScrollPos - pageLines); else editor->vScrollPos = std::min(totalLines - 1, editor->vScrollPos + pageLines);
-        editor->ensureCaretVisible(); [self setNeedsDisplay:YES]; return;
+        editor->ensureCaretVisible(); [self invalidateEditor]; return;
     }
     if (code == 99) {
         [self findNextWithDirection:!shift];
@@ -641,30 +761,32 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         if (ctrl && [lowerChar isEqualToString:@"f"]) { [[self window] toggleFullScreen:nil]; return; }
         if ([lowerChar isEqualToString:@"q"]) { [NSApp terminate:nil]; return; }
         if ([lowerChar isEqualToString:@"u"]) { editor->convertSelectedText(!shift); return; }
-        if (shift && [lowerChar isEqualToString:@"k"]) { editor->deleteLine(); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"d"]) { editor->selectNextOccurrence(); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"a"]) { editor->selectAll(); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"s"]) { shift ? editor->saveFileAs() : (editor->currentFilePath.empty() ? editor->saveFileAs() : editor->saveFile(editor->currentFilePath)); [self setNeedsDisplay:YES]; return; }
+        if (shift && [lowerChar isEqualToString:@"k"]) { editor->deleteLine(); [self invalidateEditor]; return; }
+        if (shift && [lowerChar isEqualToString:@"l"]) { editor->selectAllOccurrences(); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"d"]) { editor->selectNextOccurrence(); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"a"]) { editor->selectAll(); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"s"]) { shift ? editor->saveFileAs() : (editor->currentFilePath.empty() ? editor->saveFileAs() : editor->saveFile(editor->currentFilePath)); [self invalidateEditor]; return; }
         if ([lowerChar isEqualToString:@"c"]) { editor->copyToClipboard(); return; }
-        if ([lowerChar isEqualToString:@"x"]) { editor->cutToClipboard(); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"v"]) { editor->pasteFromClipboard(); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"z"]) { shift ? editor->performRedo() : editor->performUndo(); [self setNeedsDisplay:YES]; return; }
+        if ([lowerChar isEqualToString:@"x"]) { editor->cutToClipboard(); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"v"]) { editor->pasteFromClipboard(); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"z"]) { shift ? editor->performRedo() : editor->performUndo(); [self invalidateEditor]; return; }
         if ([lowerChar isEqualToString:@"o"]) { [NSApp sendAction:@selector(openDocument:) to:nil from:self]; return; }
         if ([lowerChar isEqualToString:@"n"]) { [NSApp sendAction:@selector(newDocument:) to:nil from:self]; return; }
         if ([lowerChar isEqualToString:@"0"]) { [self applyZoom:14.0f relative:false]; return; }
         if ([lowerChar isEqualToString:@"+"] || [lowerChar isEqualToString:@"="]) { [self applyZoom:1.1f relative:true]; return; }
         if ([lowerChar isEqualToString:@"-"]) { [self applyZoom:0.9f relative:true]; return; }
-        if ([lowerChar isEqualToString:@"]"]) { editor->indentLines(true); [self setNeedsDisplay:YES]; return; }
-        if ([lowerChar isEqualToString:@"["]) { editor->unindentLines(); [self setNeedsDisplay:YES]; return; }
+        if ([lowerChar isEqualToString:@"]"]) { editor->indentLines(true); [self invalidateEditor]; return; }
+        if ([lowerChar isEqualToString:@"["]) { editor->unindentLines(); [self invalidateEditor]; return; }
         if ([lowerChar isEqualToString:@"f"]) { [self showFindPanel:NO]; return; }
         if ([lowerChar isEqualToString:@"h"] || [lowerChar isEqualToString:@"r"]) { [self showFindPanel:YES]; return; }
         if ([lowerChar isEqualToString:@"l"] || [lowerChar isEqualToString:@"g"]) { [self showGoToLinePanel]; return; }
     }
     if (code >= 123 && code <= 126) {
         bool opt = ([e modifierFlags] & NSEventModifierFlagOption);
-        if (code == 126 && opt) { if (shift) editor->copyLines(true); else editor->moveLines(true); [self setNeedsDisplay:YES]; return; }
-        if (code == 125 && opt) { if (shift) editor->copyLines(false); else editor->moveLines(false); [self setNeedsDisplay:YES]; return; }
+        if (code == 126 && opt) { if (shift) editor->copyLines(true); else editor->moveLines(true); [self invalidateEditor]; return; }
+        if (code == 125 && opt) { if (shift) editor->copyLines(false); else editor->moveLines(false); [self invalidateEditor]; return; }
         for (auto& c : editor->cursors) {
+            editor->resolveCursorX(c);
             if (code == 123) {
                 size_t p = c.head; int li = editor->getLineIdx(p); size_t lineStart = editor->lineStarts[li];
                 if (cmd) { if (p == lineStart && p > 0) p--; else { while (p > lineStart && !editor->isWordChar(editor->pt.charAt(p - 1))) p--; while (p > lineStart && editor->isWordChar(editor->pt.charAt(p - 1))) p--; } c.head = p; }
@@ -689,12 +811,12 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
             if (code == 123 || code == 124) c.desiredX = editor->getXFromPos(c.head);
             if (!shift) { c.anchor = c.head; c.originalAnchorX = c.desiredX; }
         }
-        editor->ensureCaretVisible(); [self setNeedsDisplay:YES]; return;
+        editor->ensureCaretVisible(); [self invalidateEditor]; return;
     }
     if (![self.inputContext handleEvent:e]) [super keyDown:e];
 }
 - (void)scrollWheel:(NSEvent *)e {
-    if ([e modifierFlags] & NSEventModifierFlagCommand) { float dy = [e scrollingDeltaY]; if (dy == 0) dy = [e deltaY]; if (dy != 0) { float factor = (dy > 0) ? 1.1f : 0.9f; editor->updateFont(editor->currentFontSize * factor); editor->zoomPopupText = std::to_string((int)std::round(editor->currentFontSize)) + "px"; editor->zoomPopupEndTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000); [self setNeedsDisplay:YES]; } return; }
+    if ([e modifierFlags] & NSEventModifierFlagCommand) { float dy = [e scrollingDeltaY]; if (dy == 0) dy = [e deltaY]; if (dy != 0) { float factor = (dy > 0) ? 1.1f : 0.9f; editor->updateFont(editor->currentFontSize * factor); editor->zoomPopupText = std::to_string((int)std::round(editor->currentFontSize)) + "px"; editor->zoomPopupEndTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000); [self invalidateEditor]; } return; }
     NSRect b = [self bounds];
     int totalLines = (int)editor->lineStarts.size();
     int maxV = std::max(0, totalLines - 1);
@@ -702,7 +824,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     float visibleWidth = b.size.width - editor->gutterWidth - editor->visibleVScrollWidth;
     int maxH = std::max(0, (int)(editor->maxLineWidth - visibleWidth + editor->charWidth * 4));
     editor->hScrollPos = std::clamp(editor->hScrollPos - (int)[e deltaX], 0, maxH);
-    [self updateScrollers]; [self setNeedsDisplay:YES];
+    [self updateScrollers]; [self invalidateEditor];
 }
 - (void)insertText:(id)s replacementRange:(NSRange)r {
     NSString* t = [s isKindOfClass:[NSAttributedString class]] ? [s string] : s;
@@ -723,10 +845,10 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
         }
     }
     editor->imeComp = "";
-    [self setNeedsDisplay:YES];
+    [self invalidateEditor];
 }
-- (void)setMarkedText:(id)s selectedRange:(NSRange)sr replacementRange:(NSRange)rr { editor->imeComp = [([s isKindOfClass:[NSAttributedString class]] ? [s string] : s) UTF8String]; [self setNeedsDisplay:YES]; }
-- (void)unmarkText { editor->imeComp = ""; [self setNeedsDisplay:YES]; }
+- (void)setMarkedText:(id)s selectedRange:(NSRange)sr replacementRange:(NSRange)rr { editor->imeComp = [([s isKindOfClass:[NSAttributedString class]] ? [s string] : s) UTF8String]; [self invalidateEditor]; }
+- (void)unmarkText { editor->imeComp = ""; [self invalidateEditor]; }
 - (BOOL)hasMarkedText { return !editor->imeComp.empty(); }
 - (NSRange)markedRange { return [self hasMarkedText] ? NSMakeRange(0, editor->imeComp.length()) : NSMakeRange(NSNotFound, 0); }
 - (NSRange)selectedRange { return NSMakeRange(NSNotFound, 0); }
@@ -734,7 +856,7 @@ static NSString *const kMiuRectangularSelectionType = @"jp.hack.miu.rectangular"
     if (s == @selector(deleteBackward:)) editor->backspaceAtCursors();
     else if (s == @selector(deleteForward:)) editor->deleteForwardAtCursors();
     else if (s == @selector(insertNewline:)) editor->insertNewlineWithAutoIndent();
-    [self setNeedsDisplay:YES]; }
+    [self invalidateEditor]; }
 - (nullable NSAttributedString *)attributedSubstringForProposedRange:(NSRange)r actualRange:(NSRangePointer)ar { return nil; }
 - (NSArray*)validAttributesForMarkedText { return @[]; }
 - (NSRect)firstRectForCharacterRange:(NSRange)r actualRange:(NSRangePointer)ar { if (editor->cursors.empty()) return NSZeroRect; float x = editor->getXFromPos(editor->cursors.back().head), y = (float)(editor->getLineIdx(editor->cursors.back().head) - editor->vScrollPos) * editor->lineHeight; return [[self window] convertRectToScreen:[self convertRect:NSMakeRect(editor->gutterWidth-(float)editor->hScrollPos+x, y, 2, editor->lineHeight) toView:nil]]; }
@@ -25,6 +25,7 @@
 #define IDS_FILE_CHANGED_EXT            121
 #define IDS_FILE_CHANGED_WARN           122
 #define IDS_FILE_CHANGED_TITLE          123
+#define IDS_SEARCH_TIMEOUT              124
 #define IDC_FIND_EDIT                   1001
 #define IDC_FIND_NEXT                   1002
 #define IDC_FIND_CANCEL                 1003